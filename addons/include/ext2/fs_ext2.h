@@ -51,6 +51,7 @@ __BEGIN_DECLS
 
 #include <stdint.h>
 #include <kos/blockdev.h>
+#include <kos/blockcache.h>
 
 /** \defgroup vfs_ext2  EXT2 
     \brief              KOS VFS support for the Second Extended Filesystem
@@ -148,5 +149,17 @@ int fs_ext2_unmount(const char *mp);
 */
 int fs_ext2_sync(const char *mp);
 
+/** \brief   Get the block cache statistics of an ext2 filesystem.
+    \ingroup vfs_ext2
+
+    \param  mp          The mount point of the filesystem.
+    \param  stats       Where to store the statistics.
+
+    \retval 0           On success.
+    \retval -1          If the filesystem is not mounted (errno is set to
+                        ENOENT).
+*/
+int fs_ext2_cache_stats(const char *mp, blockcache_stats_t *stats);
+
 __END_DECLS
 #endif /* !__EXT2_FS_EXT2_H */
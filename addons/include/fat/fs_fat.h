@@ -34,6 +34,7 @@ __BEGIN_DECLS
 
 #include <stdint.h>
 #include <kos/blockdev.h>
+#include <kos/blockcache.h>
 
 /** \defgroup vfs_fat   FAT
     \brief              FAT 12, 16, and 32-bit support for KOS's VFS
@@ -131,5 +132,23 @@ int fs_fat_unmount(const char *mp);
 */
 int fs_fat_sync(const char *mp);
 
+/** \brief   Get the block cache statistics of a FAT filesystem.
+    \ingroup vfs_fat
+
+    Each mounted filesystem has one cache for its clusters and one for the
+    blocks of its file allocation table. Either pointer may be NULL if that
+    cache is of no interest.
+
+    \param  mp          The mount point of the filesystem.
+    \param  data        Where to store the cluster cache statistics.
+    \param  fat         Where to store the FAT block cache statistics.
+
+    \retval 0           On success.
+    \retval -1          If the filesystem is not mounted (errno is set to
+                        ENOENT).
+*/
+int fs_fat_cache_stats(const char *mp, blockcache_stats_t *data,
+                       blockcache_stats_t *fat);
+
 __END_DECLS
 #endif /* !__FAT_FS_FAT_H */
@@ -16,6 +16,8 @@ __BEGIN_DECLS
 #include <kos/blockdev.h>
 #endif
 
+#include <kos/blockcache.h>
+
 /* Tunable filesystem parameters. These must be set at compile time. */
 
 /* Logarithm (base 2) of the maximum number of entries in the inode cache.
@@ -60,11 +62,12 @@ typedef struct kos_blockdev {
     uint32_t l_block_size;
     int (*init)(struct kos_blockdev *d);
     int (*shutdown)(struct kos_blockdev *d);
-    int (*read_blocks)(const struct kos_blockdev *d, uint32_t block, size_t count,
+    int (*read_blocks)(const struct kos_blockdev *d, uint64_t block, size_t count,
                        void *buf);
-    int (*write_blocks)(const struct kos_blockdev *d, uint32_t block, size_t count,
+    int (*write_blocks)(const struct kos_blockdev *d, uint64_t block, size_t count,
                         const void *buf);
-    uint32_t (*count_blocks)(const struct kos_blockdev *d);
+    uint64_t (*count_blocks)(const struct kos_blockdev *d);
+    int (*flush)(struct kos_blockdev *d);
 } kos_blockdev_t;
 
 #ifndef SYMLOOP_MAX
@@ -96,6 +99,7 @@ ext2_fs_t *ext2_fs_init(kos_blockdev_t *bd, uint32_t flags);
 ext2_fs_t *ext2_fs_init_ex(kos_blockdev_t *bd, uint32_t flags, int cache_sz);
 int ext2_fs_sync(ext2_fs_t *fs);
 void ext2_fs_shutdown(ext2_fs_t *fs);
+void ext2_fs_cache_stats(const ext2_fs_t *fs, blockcache_stats_t *stats);
 
 int ext2_block_read_nc(ext2_fs_t *fs, uint32_t block_num, uint8_t *rv);
 uint8_t *ext2_block_read(ext2_fs_t *fs, uint32_t block_num, int *err);
@@ -16,14 +16,7 @@
 #ifndef __EXT2_EXT2INTERNAL_H
 #define __EXT2_EXT2INTERNAL_H
 
-#define EXT2_CACHE_FLAG_VALID   1
-#define EXT2_CACHE_FLAG_DIRTY   2
-
-typedef struct ext2_cache {
-    uint32_t flags;
-    uint32_t block;
-    uint8_t *data;
-} ext2_cache_t;
+#include <kos/blockcache.h>
 
 struct ext2fs_struct {
     kos_blockdev_t *dev;
@@ -33,8 +26,7 @@ struct ext2fs_struct {
     uint32_t bg_count;
     ext2_bg_desc_t *bg;
 
-    ext2_cache_t **bcache;
-    int cache_size;
+    kos_blockcache_t *bcache;
 
     uint32_t flags;
     uint32_t mnt_flags;
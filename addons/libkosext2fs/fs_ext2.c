@@ -1921,7 +1921,11 @@ static vfs_handler_t vh = {
     fs_ext2_total64,            /* total64 */
     fs_ext2_readlink,           /* readlink */
     fs_ext2_rewinddir,          /* rewinddir */
-    fs_ext2_fstat               /* fstat */
+    fs_ext2_fstat,              /* fstat */
+    NULL,                       /* readv */
+    NULL,                       /* writev */
+    NULL,                       /* pread64 */
+    NULL                        /* pwrite64 */
 };
 
 static int initted = 0;
@@ -2049,6 +2053,22 @@ int fs_ext2_sync(const char *mp) {
     return rv;
 }
 
+int fs_ext2_cache_stats(const char *mp, blockcache_stats_t *stats) {
+    fs_ext2_fs_t *i;
+
+    mutex_lock_scoped(&ext2_mutex);
+
+    LIST_FOREACH(i, &ext2_fses, entry) {
+        if(!strcmp(mp, i->vfsh->nmmgr.pathname)) {
+            ext2_fs_cache_stats(i->fs, stats);
+            return 0;
+        }
+    }
+
+    errno = ENOENT;
+    return -1;
+}
+
 int fs_ext2_init(void) {
     if(initted)
         return 0;
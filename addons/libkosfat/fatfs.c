@@ -4,7 +4,6 @@
    Copyright (C) 2012, 2013, 2019 Lawrence Sebald
 */
 
-#include <malloc.h>
 #include <stdio.h>
 #include <errno.h>
 #include <stdint.h>
@@ -16,206 +15,118 @@
 #include "bpb.h"
 #include "fatinternal.h"
 
-/* This is basically the same as bgrad_cache from fs_iso9660 */
-static void make_mru(fat_fs_t *fs, fat_cache_t **cache, int block) {
-    int i;
-    fat_cache_t *tmp;
-
-    /* Don't try it with the end block */
-    if(block < 0 || block >= fs->cache_size - 1)
-        return;
-
-    /* Make a copy and scoot everything down */
-    tmp = cache[block];
+/* Figure out where a cluster lives on the block device. Raw blocks (for the
+   FAT12/FAT16 root directory) are a single block long. */
+static int fat_cluster_loc(fat_fs_t *fs, uint32_t cluster, uint64_t *block,
+                           size_t *count) {
+    if(cluster & 0x80000000 && fs->sb.fs_type != FAT_FS_FAT32) {
+        *block = cluster & 0x7FFFFFFF;
+        *count = 1;
+    }
+    else {
+        if(fs->sb.num_clusters + 2 <= cluster || cluster < 2)
+            return -EINVAL;
 
-    for(i = block; i < fs->cache_size - 1; ++i) {
-        cache[i] = cache[i + 1];
+        *block = (uint64_t)(cluster - 2) * fs->sb.sectors_per_cluster +
+            fs->sb.first_data_block;
+        *count = fs->sb.sectors_per_cluster;
     }
 
-    cache[fs->cache_size - 1] = tmp;
+    return 0;
 }
 
 /* XXXX: This needs locking! */
 uint8_t *fat_cluster_read(fat_fs_t *fs, uint32_t cl, int *err) {
-    int i;
+    uint64_t block;
+    size_t count;
     uint8_t *rv;
-    fat_cache_t **cache = fs->bcache;
-
-    /* Look through the cache from the most recently used to the least recently
-       used entry. */
-    for(i = fs->cache_size - 1; i >= 0; --i) {
-        if(cache[i]->block == cl && cache[i]->flags) {
-            rv = cache[i]->data;
-            make_mru(fs, cache, i);
-            goto out;
-        }
-    }
 
-    /* If we didn't get anything, did we end up with an invalid entry or do we
-       need to boot someone out? */
-    if(i < 0) {
-        i = 0;
-
-        /* Make sure that if the block is dirty, we write it back out. */
-        if(cache[0]->flags & FAT_CACHE_FLAG_DIRTY) {
-            if(fat_cluster_write_nc(fs, cache[0]->block, cache[0]->data)) {
-                /* XXXX: Uh oh... */
-                *err = EIO;
-                return NULL;
-            }
-        }
-    }
-
-    /* Try to read the block in question. */
-    if(fat_cluster_read_nc(fs, cl, cache[i]->data)) {
+    if(fat_cluster_loc(fs, cl, &block, &count)) {
         *err = EIO;
-        cache[i]->flags = 0;            /* Mark it as invalid... */
         return NULL;
     }
 
-    cache[i]->block = cl;
-    cache[i]->flags = FAT_CACHE_FLAG_VALID;
-    rv = cache[i]->data;
-    make_mru(fs, cache, i);
+    if(!(rv = blockcache_read(fs->bcache, block, count)))
+        *err = errno;
 
-out:
     return rv;
 }
 
 uint8_t *fat_cluster_clear(fat_fs_t *fs, uint32_t cl, int *err) {
-    int i;
+    uint64_t block;
+    size_t count;
     uint8_t *rv;
-    fat_cache_t **cache = fs->bcache;
-
-    /* Look through the cache from the most recently used to the least recently
-       used entry. */
-    for(i = fs->cache_size - 1; i >= 0; --i) {
-        if(cache[i]->block == cl && cache[i]->flags) {
-            rv = cache[i]->data;
-            make_mru(fs, cache, i);
-            goto out;
-        }
-    }
 
-    /* If we didn't get anything, did we end up with an invalid entry or do we
-       need to boot someone out? */
-    if(i < 0) {
-        i = 0;
-
-        /* Make sure that if the block is dirty, we write it back out. */
-        if(cache[0]->flags & FAT_CACHE_FLAG_DIRTY) {
-            if(fat_cluster_write_nc(fs, cache[0]->block, cache[0]->data)) {
-                /* XXXX: Uh oh... */
-                *err = EIO;
-                return NULL;
-            }
-        }
+    if(fat_cluster_loc(fs, cl, &block, &count)) {
+        *err = EIO;
+        return NULL;
     }
 
     /* Don't bother reading the cluster from disk, since we're erasing it
        anyway... */
-    cache[i]->block = cl;
-    cache[i]->flags = FAT_CACHE_FLAG_VALID | FAT_CACHE_FLAG_DIRTY;
-    rv = cache[i]->data;
-    make_mru(fs, cache, i);
+    if(!(rv = blockcache_claim(fs->bcache, block, count))) {
+        *err = errno;
+        return NULL;
+    }
 
-out:
-    memset(rv, 0, fs->sb.bytes_per_sector * fs->sb.sectors_per_cluster);
+    memset(rv, 0, count * fs->sb.bytes_per_sector);
     return rv;
 }
 
 int fat_cluster_read_nc(fat_fs_t *fs, uint32_t cluster, uint8_t *rv) {
-    int fs_per_block = (int)fs->sb.sectors_per_cluster;
+    uint64_t block;
+    size_t count;
+    int err;
 
-    if(fs_per_block < 0)
-        /* This should never happen, as the cluster size must be at least
-           as large as the sector size of the block device itself. */
-        return -EINVAL;
+    if((err = fat_cluster_loc(fs, cluster, &block, &count)))
+        return err;
 
-    /* Are we reading a raw block (for FAT12/FAT16 root directory reading) or
-       are we reading a normal cluster? */
-    if(cluster & 0x80000000 && fs->sb.fs_type != FAT_FS_FAT32) {
-        if(fs->dev->read_blocks(fs->dev, cluster & 0x7FFFFFFF, 1, rv))
-            return -EIO;
-    }
-    else {
-        if(fs->sb.num_clusters + 2 <= cluster || cluster < 2)
-            return -EINVAL;
-
-        cluster -= 2;
-
-        if(fs->dev->read_blocks(fs->dev, cluster * fs_per_block +
-                                fs->sb.first_data_block, fs_per_block, rv))
-            return -EIO;
-    }
+    if(fs->dev->read_blocks(fs->dev, block, count, rv))
+        return -EIO;
 
     return 0;
 }
 
 int fat_cluster_write_nc(fat_fs_t *fs, uint32_t cluster, const uint8_t *blk) {
-    int fs_per_block = (int)fs->sb.sectors_per_cluster;
+    uint64_t block;
+    size_t count;
+    int err;
 
-    if(fs_per_block < 0)
-        /* This should never happen, as the cluster size must be at least
-           as large as the sector size of the block device itself. */
-        return -EINVAL;
+    if((err = fat_cluster_loc(fs, cluster, &block, &count)))
+        return err;
 
-    /* Are we writing a raw block (for FAT12/FAT16 root directory updating) or
-       are we writing a normal cluster? */
-    if(cluster & 0x80000000 && fs->sb.fs_type != FAT_FS_FAT32) {
-        if(fs->dev->write_blocks(fs->dev, cluster & 0x7FFFFFFF, 1, blk))
-            return -EIO;
-    }
-    else {
-        if(fs->sb.num_clusters + 2 <= cluster || cluster < 2)
-            return -EINVAL;
-
-        cluster -= 2;
-
-        if(fs->dev->write_blocks(fs->dev, cluster * fs_per_block +
-                                 fs->sb.first_data_block, fs_per_block, blk))
-            return -EIO;
-    }
+    if(fs->dev->write_blocks(fs->dev, block, count, blk))
+        return -EIO;
 
     return 0;
 }
 
 int fat_cluster_mark_dirty(fat_fs_t *fs, uint32_t cluster) {
-    int i;
-    fat_cache_t **cache = fs->bcache;
-
-    /* Look through the cache from the most recently used to the least recently
-       used entry. */
-    for(i = fs->cache_size - 1; i >= 0; --i) {
-        if(cache[i]->block == cluster && cache[i]->flags) {
-            cache[i]->flags |= FAT_CACHE_FLAG_DIRTY;
-            make_mru(fs, cache, i);
-            return 0;
-        }
-    }
+    uint64_t block;
+    size_t count;
+    int err;
 
-    return -EINVAL;
+    if((err = fat_cluster_loc(fs, cluster, &block, &count)))
+        return err;
+
+    return blockcache_mark_dirty(fs->bcache, block) ? -errno : 0;
 }
 
 int fat_cluster_cache_wb(fat_fs_t *fs) {
-    int i, err;
-    fat_cache_t **cache = fs->bcache;
-
     /* Don't even bother if we're mounted read-only. */
     if(!(fs->mnt_flags & FAT_MNT_FLAG_RW))
         return 0;
 
-    for(i = fs->cache_size - 1; i >= 0; --i) {
-        if(cache[i]->flags & FAT_CACHE_FLAG_DIRTY) {
-            if((err = fat_cluster_write_nc(fs, cache[i]->block,
-                                           cache[i]->data)))
-                return err;
+    return blockcache_flush(fs->bcache) ? -errno : 0;
+}
 
-            cache[i]->flags &= ~FAT_CACHE_FLAG_DIRTY;
-        }
-    }
+void fat_fs_cache_stats(const fat_fs_t *fs, blockcache_stats_t *data,
+                        blockcache_stats_t *fat) {
+    if(data)
+        blockcache_get_stats(fs->bcache, data);
 
-    return 0;
+    if(fat)
+        blockcache_get_stats(fs->fcache, fat);
 }
 
 static inline uint32_t ilog2(uint32_t i) {
@@ -265,8 +176,6 @@ fat_fs_t *fat_fs_init(kos_blockdev_t *bd, uint32_t flags) {
 fat_fs_t *fat_fs_init_ex(kos_blockdev_t *bd, uint32_t flags, int cache_sz,
                          int fcache_sz) {
     fat_fs_t *rv;
-    int j;
-    int block_size, cluster_size;
 
     if(bd->init(bd)) {
         return NULL;
@@ -298,85 +207,23 @@ fat_fs_t *fat_fs_init_ex(kos_blockdev_t *bd, uint32_t flags, int cache_sz,
     fat_print_superblock(&rv->sb);
 #endif
 
-    block_size = rv->sb.bytes_per_sector;
-    cluster_size = rv->sb.bytes_per_sector * rv->sb.sectors_per_cluster;
-
     /* Make space for the block cache. */
-    if(!(rv->bcache = (fat_cache_t **)malloc(sizeof(fat_cache_t *) *
-                                             cache_sz))) {
+    if(!(rv->bcache = blockcache_create(bd, rv->sb.sectors_per_cluster,
+                                        cache_sz))) {
         free(rv);
         bd->shutdown(bd);
         return NULL;
     }
 
-    for(j = 0; j < cache_sz; ++j) {
-        if(!(rv->bcache[j] = (fat_cache_t *)malloc(sizeof(fat_cache_t)))) {
-            goto out_cache;
-        }
-    }
-
-    for(j = 0; j < cache_sz; ++j) {
-        if(!(rv->bcache[j]->data = (uint8_t *)memalign(32, cluster_size))) {
-            goto out_bcache;
-        }
-
-        rv->bcache[j]->flags = 0;
-    }
-
-    rv->cache_size = cache_sz;
-
     /* Make space for the FAT block cache. */
-    if(!(rv->fcache = (fat_cache_t **)malloc(sizeof(fat_cache_t *) *
-                                             fcache_sz))) {
-        goto out_bcache;
-    }
-
-    for(j = 0; j < fcache_sz; ++j) {
-        if(!(rv->fcache[j] = (fat_cache_t *)malloc(sizeof(fat_cache_t)))) {
-            goto out_fcache;
-        }
-    }
-
-    for(j = 0; j < fcache_sz; ++j) {
-        if(!(rv->fcache[j]->data = (uint8_t *)memalign(32, block_size))) {
-            goto out_fcache2;
-        }
-
-        rv->fcache[j]->flags = 0;
+    if(!(rv->fcache = blockcache_create(bd, 1, fcache_sz))) {
+        blockcache_destroy(rv->bcache);
+        free(rv);
+        bd->shutdown(bd);
+        return NULL;
     }
 
-    rv->fcache_size = fcache_sz;
     return rv;
-
-out_fcache2:
-    for(; j >= 0; --j) {
-        free(rv->fcache[j]->data);
-    }
-
-    j = fcache_sz - 1;
-
-out_fcache:
-    for(; j >= 0; --j) {
-        free(rv->fcache[j]);
-    }
-
-    free(rv->fcache);
-
-out_bcache:
-    for(; j >= 0; --j) {
-        free(rv->bcache[j]->data);
-    }
-
-    j = cache_sz - 1;
-out_cache:
-    for(; j >= 0; --j) {
-        free(rv->bcache[j]);
-    }
-
-    free(rv->bcache);
-    free(rv);
-    bd->shutdown(bd);
-    return NULL;
 }
 
 int fat_fs_sync(fat_fs_t *fs) {
@@ -415,22 +262,11 @@ int fat_fs_sync(fat_fs_t *fs) {
 }
 
 void fat_fs_shutdown(fat_fs_t *fs) {
-    int i;
-
     /* Sync the filesystem back to the block device, if needed. */
     fat_fs_sync(fs);
 
-    for(i = 0; i < fs->cache_size; ++i) {
-        free(fs->bcache[i]->data);
-        free(fs->bcache[i]);
-    }
-
-    free(fs->bcache);
-
-    for(i = 0; i < fs->fcache_size; ++i) {
-        free(fs->fcache[i]->data);
-        free(fs->fcache[i]);
-    }
+    blockcache_destroy(fs->bcache);
+    blockcache_destroy(fs->fcache);
 
     fs->dev->shutdown(fs->dev);
     free(fs);
@@ -16,6 +16,8 @@ __BEGIN_DECLS
 #include <kos/blockdev.h>
 #endif
 
+#include <kos/blockcache.h>
+
 /* Tunable filesystem parameters. These must be set at compile time. */
 
 /* Size of the cluster cache, in filesystem clusters. When reading data from the
@@ -62,7 +64,8 @@ typedef struct kos_blockdev {
                        void *buf);
     int (*write_blocks)(const struct kos_blockdev *d, uint64_t block, size_t count,
                         const void *buf);
-    uint32_t (*count_blocks)(const struct kos_blockdev *d);
+    uint64_t (*count_blocks)(const struct kos_blockdev *d);
+    int (*flush)(struct kos_blockdev *d);
 } kos_blockdev_t;
 #endif /* FAT_NOT_IN_KOS */
 
@@ -82,6 +85,8 @@ fat_fs_t *fat_fs_init_ex(kos_blockdev_t *bd, uint32_t flags, int cache_sz,
                          int fcache_sz);
 int fat_fs_sync(fat_fs_t *fs);
 void fat_fs_shutdown(fat_fs_t *fs);
+void fat_fs_cache_stats(const fat_fs_t *fs, blockcache_stats_t *data,
+                        blockcache_stats_t *fat);
 
 int fat_cluster_read_nc(fat_fs_t *fs, uint32_t cluster, uint8_t *rv);
 uint8_t *fat_cluster_read(fat_fs_t *fs, uint32_t cluster, int *err);
@@ -10,26 +10,19 @@
 #include <stddef.h>
 #include <stdint.h>
 
-#include "bpb.h"
-
-#define FAT_CACHE_FLAG_VALID    1
-#define FAT_CACHE_FLAG_DIRTY    2
+#include <kos/blockcache.h>
 
-typedef struct fat_cache {
-    uint32_t flags;
-    uint32_t block;
-    uint8_t *data;
-} fat_cache_t;
+#include "bpb.h"
 
 struct fatfs_struct {
     kos_blockdev_t *dev;
     fat_superblock_t sb;
 
-    fat_cache_t **bcache;
-    int cache_size;
+    /* Clusters (and raw root directory blocks) */
+    kos_blockcache_t *bcache;
 
-    fat_cache_t **fcache;
-    int fcache_size;
+    /* Blocks of the file allocation table */
+    kos_blockcache_t *fcache;
 
     uint32_t flags;
     uint32_t mnt_flags;
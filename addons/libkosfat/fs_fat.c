@@ -13,6 +13,7 @@
 #include <fcntl.h>
 #include <limits.h>
 #include <sys/queue.h>
+#include <sys/uio.h>
 
 #include <kos/fs.h>
 #include <kos/mutex.h>
@@ -679,6 +680,123 @@ static ssize_t fs_fat_write(void *h, const void *buf, size_t cnt) {
     return rv;
 }
 
+static ssize_t fs_fat_readv(void *h, const struct iovec *iov, int iovcnt) {
+    ssize_t rv, total = 0;
+    int i;
+
+    mutex_lock(&fat_mutex);
+
+    for(i = 0; i < iovcnt; i++) {
+        rv = fs_fat_read(h, iov[i].iov_base, iov[i].iov_len);
+
+        if(rv < 0) {
+            if(total)
+                break;
+
+            mutex_unlock(&fat_mutex);
+            return -1;
+        }
+
+        total += rv;
+
+        if((size_t)rv < iov[i].iov_len)
+            break;
+    }
+
+    mutex_unlock(&fat_mutex);
+    return total;
+}
+
+static ssize_t fs_fat_writev(void *h, const struct iovec *iov, int iovcnt) {
+    ssize_t rv, total = 0;
+    int i;
+
+    mutex_lock(&fat_mutex);
+
+    for(i = 0; i < iovcnt; i++) {
+        rv = fs_fat_write(h, iov[i].iov_base, iov[i].iov_len);
+
+        if(rv < 0) {
+            if(total)
+                break;
+
+            mutex_unlock(&fat_mutex);
+            return -1;
+        }
+
+        total += rv;
+
+        if((size_t)rv < iov[i].iov_len)
+            break;
+    }
+
+    mutex_unlock(&fat_mutex);
+    return total;
+}
+
+/* Do a read or write at the given offset, then put the file pointer (and the
+   cluster we had cached for it) back the way it was. */
+static ssize_t fs_fat_prw(void *h, void *buf, size_t cnt, _off64_t offset,
+                          int write) {
+    file_t fd = ((file_t)h) - 1;
+    uint32_t ptr, cluster, order;
+    int seeked, err;
+    ssize_t rv;
+
+    mutex_lock(&fat_mutex);
+
+    if(fd >= MAX_FAT_FILES || !fh[fd].opened || (fh[fd].mode & O_DIR)) {
+        mutex_unlock(&fat_mutex);
+        errno = EBADF;
+        return -1;
+    }
+
+    /* The file pointer is 32 bits, as is the largest file FAT can hold. */
+    if(offset > UINT32_MAX || (write && offset + cnt > UINT32_MAX)) {
+        mutex_unlock(&fat_mutex);
+
+        if(!write)
+            return 0;
+
+        errno = EFBIG;
+        return -1;
+    }
+
+    ptr = fh[fd].ptr;
+    cluster = fh[fd].cluster;
+    order = fh[fd].cluster_order;
+    seeked = fh[fd].mode & 0x80000000;
+
+    fh[fd].ptr = (uint32_t)offset;
+    fh[fd].mode |= 0x80000000;
+
+    if(write)
+        rv = fs_fat_write(h, buf, cnt);
+    else
+        rv = fs_fat_read(h, buf, cnt);
+
+    /* A write may have extended the cluster chain, but never changes the
+       clusters before the end, so the cached one is still good. */
+    err = errno;
+    fh[fd].ptr = ptr;
+    fh[fd].cluster = cluster;
+    fh[fd].cluster_order = order;
+    fh[fd].mode = (fh[fd].mode & ~0x80000000) | seeked;
+    errno = err;
+
+    mutex_unlock(&fat_mutex);
+    return rv;
+}
+
+static ssize_t fs_fat_pread64(void *h, void *buf, size_t cnt, _off64_t offset) {
+    return fs_fat_prw(h, buf, cnt, offset, 0);
+}
+
+static ssize_t fs_fat_pwrite64(void *h, const void *buf, size_t cnt,
+                               _off64_t offset) {
+    return fs_fat_prw(h, (void *)buf, cnt, offset, 1);
+}
+
 static _off64_t fs_fat_seek64(void *h, _off64_t offset, int whence) {
     file_t fd = ((file_t)h) - 1;
     off_t rv;
@@ -1349,7 +1467,11 @@ static vfs_handler_t vh = {
     fs_fat_total64,             /* total64 */
     NULL,                       /* readlink */
     fs_fat_rewinddir,           /* rewinddir */
-    fs_fat_fstat                /* fstat */
+    fs_fat_fstat,               /* fstat */
+    fs_fat_readv,               /* readv */
+    fs_fat_writev,              /* writev */
+    fs_fat_pread64,             /* pread64 */
+    fs_fat_pwrite64             /* pwrite64 */
 };
 
 static int initted = 0;
@@ -1477,12 +1599,31 @@ int fs_fat_sync(const char *mp) {
     return rv;
 }
 
+int fs_fat_cache_stats(const char *mp, blockcache_stats_t *data,
+                       blockcache_stats_t *fat) {
+    fs_fat_fs_t *i;
+
+    mutex_lock_scoped(&fat_mutex);
+
+    LIST_FOREACH(i, &fat_fses, entry) {
+        if(!strcmp(mp, i->vfsh->nmmgr.pathname)) {
+            fat_fs_cache_stats(i->fs, data, fat);
+            return 0;
+        }
+    }
+
+    errno = ENOENT;
+    return -1;
+}
+
 int fs_fat_init(void) {
     if(initted)
         return 0;
 
     LIST_INIT(&fat_fses);
-    mutex_init(&fat_mutex, MUTEX_TYPE_NORMAL);
+    /* Recursive, so that the vectored and positional calls can hold it
+       around the plain read and write paths. */
+    mutex_init(&fat_mutex, MUTEX_TYPE_RECURSIVE);
     initted = 1;
 
     memset(fh, 0, sizeof(fh));
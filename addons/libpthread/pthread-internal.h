@@ -20,7 +20,7 @@ __BEGIN_DECLS
 #define __PTHREAD_ATTR_SIZE             32
 #define __PTHREAD_MUTEX_SIZE            32
 #define __PTHREAD_COND_SIZE             16
-#define __PTHREAD_RWLOCK_SIZE           32
+#define __PTHREAD_RWLOCK_SIZE           48
 #define __PTHREAD_BARRIER_SIZE          64
 #define __PTHREAD_CONDATTR_SIZE         16
 
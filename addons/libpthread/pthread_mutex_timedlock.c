@@ -20,7 +20,7 @@ int pthread_mutex_timedlock(pthread_mutex_t *__RESTRICT mutex,
     if(!mutex || !abstime)
         return EFAULT;
 
-    if(mutex->mutex.type > MUTEX_TYPE_RECURSIVE)
+    if(!MUTEX_TYPE_VALID(mutex->mutex.type))
         return EINVAL;
 
     if(abstime->tv_nsec < 0 || abstime->tv_nsec > 1000000000L)
@@ -11,7 +11,7 @@
 #include <kos/mutex.h>
 
 int pthread_mutex_trylock(pthread_mutex_t *mutex) {
-    if(mutex->mutex.type > MUTEX_TYPE_RECURSIVE)
+    if(!MUTEX_TYPE_VALID(mutex->mutex.type))
         return EINVAL;
 
     errno_save_scoped();
@@ -0,0 +1,114 @@
+/*  KallistiOS ##version##
+
+    adaptive_mutex.c
+
+    Adaptive mutex test
+
+    This program compares normal and adaptive mutexes under contention. A few
+    threads of the same priority each take a shared mutex many times, doing a
+    tiny bit of work inside and a bit more outside of the critical section, so
+    that the lock is regularly held when a thread gets preempted. Lock
+    statistics are enabled on both mutexes and printed at the end, along with
+    the time each run took.
+
+ */
+
+#include <kos/thread.h>
+#include <kos/mutex.h>
+#include <kos/timer.h>
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/* Configurable constants */
+#define THREAD_COUNT    8       /* Number of contending threads */
+#define LOCK_COUNT      20000   /* Lock/unlock pairs per thread */
+#define INNER_WORK      50      /* Work done while holding the lock */
+#define OUTER_WORK      200     /* Work done outside of the lock */
+
+static mutex_t normal_mutex, adaptive_mutex;
+static volatile uint32_t counter;
+
+static void spin(unsigned int n) {
+    volatile unsigned int i;
+
+    for(i = 0; i < n; i++)
+        ;
+}
+
+static void *lock_thread(void *param) {
+    mutex_t *m = param;
+    unsigned int i;
+
+    for(i = 0; i < LOCK_COUNT; i++) {
+        mutex_lock(m);
+        counter++;
+        spin(INNER_WORK);
+        mutex_unlock(m);
+
+        spin(OUTER_WORK);
+    }
+
+    return NULL;
+}
+
+/* Returns the time the run took, in milliseconds. */
+static uint64_t run_bench(mutex_t *m) {
+    kthread_t *thds[THREAD_COUNT];
+    uint64_t start, end;
+    unsigned int i;
+
+    counter = 0;
+    start = timer_ms_gettime64();
+
+    for(i = 0; i < THREAD_COUNT; i++) {
+        thds[i] = thd_create(false, lock_thread, m);
+
+        if(!thds[i]) {
+            fprintf(stderr, "Unable to create thread %u\n", i);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    for(i = 0; i < THREAD_COUNT; i++)
+        thd_join(thds[i], NULL);
+
+    end = timer_ms_gettime64();
+
+    if(counter != THREAD_COUNT * LOCK_COUNT) {
+        fprintf(stderr, "Counter mismatch: %lu\n", (unsigned long)counter);
+        exit(EXIT_FAILURE);
+    }
+
+    return end - start;
+}
+
+int main(int argc, char **argv) {
+    (void)argc;
+    (void)argv;
+
+    mutex_init(&normal_mutex, MUTEX_TYPE_NORMAL);
+    mutex_init(&adaptive_mutex, MUTEX_TYPE_ADAPTIVE);
+
+    if(mutex_stats_enable(&normal_mutex, "normal") ||
+       mutex_stats_enable(&adaptive_mutex, "adaptive")) {
+        fprintf(stderr, "Unable to enable lock statistics\n");
+        return EXIT_FAILURE;
+    }
+
+    printf("Adaptive mutex test: %u threads, %u locks each\n",
+           THREAD_COUNT, LOCK_COUNT);
+
+    printf("normal:\t\t%llu ms\n", run_bench(&normal_mutex));
+    printf("adaptive:\t%llu ms\n", run_bench(&adaptive_mutex));
+
+    mutex_stats_print(printf);
+
+    mutex_destroy(&normal_mutex);
+    mutex_destroy(&adaptive_mutex);
+
+    printf("Done.\n");
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,109 @@
+/*  KallistiOS ##version##
+
+    sched_bench.c
+
+    Scheduler microbenchmark
+
+    This program measures the cost of a context switch as the number of
+    threads in the system grows. For each thread count, that many threads are
+    spawned and all of them repeatedly yield with thd_pass(). The total time
+    spent is divided by the number of context switches to get the average cost
+    of a switch.
+
+    Two runs are done for each thread count: one where all of the threads share
+    the same priority, and one where every thread has a distinct priority, which
+    exercises the run queue with many non-empty priority levels.
+
+ */
+
+#include <kos/thread.h>
+#include <kos/timer.h>
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <stdio.h>
+
+/* Configurable constants */
+#define MAX_THREADS     128  /* Maximum number of threads to spawn */
+#define PASS_COUNT      256  /* Number of thd_pass() calls per thread */
+
+static kthread_t *threads[MAX_THREADS];
+
+/* Number of threads that are done spawning, used to start all the threads at
+   the same time. */
+static atomic_uint ready_count;
+static atomic_bool go;
+
+static void *yield_thread(void *param) {
+    unsigned int i;
+
+    (void)param;
+
+    ++ready_count;
+
+    while(!go)
+        thd_pass();
+
+    for(i = 0; i < PASS_COUNT; i++)
+        thd_pass();
+
+    return NULL;
+}
+
+/* Spawn the given number of threads, let them all yield PASS_COUNT times and
+   return the average cost of one context switch, in nanoseconds. */
+static uint64_t run_bench(unsigned int count, bool spread_prio) {
+    kthread_attr_t attr = { 0 };
+    uint64_t start, end;
+    unsigned int i;
+
+    ready_count = 0;
+    go = false;
+
+    attr.label = "yield";
+
+    for(i = 0; i < count; i++) {
+        attr.prio = PRIO_DEFAULT + (spread_prio ? i : 0);
+        threads[i] = thd_create_ex(&attr, yield_thread, NULL);
+
+        if(!threads[i]) {
+            fprintf(stderr, "Unable to create thread %u\n", i);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    /* Wait for all of the threads to be up and running. */
+    while(ready_count != count)
+        thd_pass();
+
+    start = timer_ns_gettime64();
+    go = true;
+
+    for(i = 0; i < count; i++)
+        thd_join(threads[i], NULL);
+
+    end = timer_ns_gettime64();
+
+    return (end - start) / ((uint64_t)count * PASS_COUNT);
+}
+
+int main(int argc, char **argv) {
+    unsigned int count;
+
+    (void)argc;
+    (void)argv;
+
+    printf("Scheduler microbenchmark: %u passes per thread\n", PASS_COUNT);
+    printf("threads\tsame prio (ns/switch)\tspread prio (ns/switch)\n");
+
+    for(count = 2; count <= MAX_THREADS; count *= 2) {
+        printf("%u\t%llu\t\t\t", count, run_bench(count, false));
+        printf("%llu\n", run_bench(count, true));
+    }
+
+    printf("Done.\n");
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,135 @@
+/*  KallistiOS ##version##
+
+    timed_wait.c
+
+    Timed wait stress test
+
+    This program measures the cost of timed waits as the number of threads
+    blocked with a timeout grows. For each waiter count, that many threads are
+    put to sleep on semaphores with long, random timeouts so that they all sit
+    in the kernel's timer queue. Two threads then ping-pong through a pair of
+    semaphores with sem_wait_timed(), so that every operation inserts into and
+    removes from that same timer queue. The elapsed time is divided by the
+    number of operations to get the average cost of one timed wait/wake pair.
+
+ */
+
+#include <kos/thread.h>
+#include <kos/sem.h>
+#include <kos/timer.h>
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/* Configurable constants */
+#define MAX_WAITERS     512     /* Maximum number of background waiters */
+#define PING_COUNT      2000    /* Number of ping-pong round trips */
+#define PING_TIMEOUT    5000    /* Timeout of the ping-pong waits (ms) */
+#define WAITER_TIMEOUT  20000   /* Base timeout of the background waiters */
+
+static kthread_t *waiters[MAX_WAITERS];
+static semaphore_t waiter_sem;
+static semaphore_t ping_sem, pong_sem;
+
+static void *waiter_thread(void *param) {
+    unsigned int timeout = (uintptr_t)param;
+
+    /* Nobody ever signals this one before the end of the test, so this sits
+       in the timer queue until we are woken with sem_signal(). */
+    sem_wait_timed(&waiter_sem, timeout);
+
+    return NULL;
+}
+
+static void *pong_thread(void *param) {
+    unsigned int i;
+
+    (void)param;
+
+    for(i = 0; i < PING_COUNT; i++) {
+        if(sem_wait_timed(&ping_sem, PING_TIMEOUT) < 0) {
+            fprintf(stderr, "pong: timed out\n");
+            break;
+        }
+
+        sem_signal(&pong_sem);
+    }
+
+    return NULL;
+}
+
+/* Returns the average time of one timed wait operation, in nanoseconds. */
+static uint64_t run_bench(unsigned int count) {
+    kthread_t *pong;
+    uint64_t start, end;
+    unsigned int i;
+
+    sem_init(&waiter_sem, 0);
+    sem_init(&ping_sem, 0);
+    sem_init(&pong_sem, 0);
+
+    for(i = 0; i < count; i++) {
+        waiters[i] = thd_create(false, waiter_thread,
+                                (void *)(uintptr_t)(WAITER_TIMEOUT +
+                                                      rand() % 10000));
+
+        if(!waiters[i]) {
+            fprintf(stderr, "Unable to create waiter %u\n", i);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    /* Let all the waiters block */
+    thd_sleep(100);
+
+    pong = thd_create(false, pong_thread, NULL);
+
+    start = timer_ns_gettime64();
+
+    for(i = 0; i < PING_COUNT; i++) {
+        sem_signal(&ping_sem);
+
+        if(sem_wait_timed(&pong_sem, PING_TIMEOUT) < 0) {
+            fprintf(stderr, "ping: timed out\n");
+            break;
+        }
+    }
+
+    end = timer_ns_gettime64();
+
+    thd_join(pong, NULL);
+
+    /* Release the waiters */
+    for(i = 0; i < count; i++)
+        sem_signal(&waiter_sem);
+
+    for(i = 0; i < count; i++)
+        thd_join(waiters[i], NULL);
+
+    sem_destroy(&waiter_sem);
+    sem_destroy(&ping_sem);
+    sem_destroy(&pong_sem);
+
+    /* Two timed waits per round trip */
+    return (end - start) / (2 * PING_COUNT);
+}
+
+int main(int argc, char **argv) {
+    unsigned int count;
+
+    (void)argc;
+    (void)argv;
+
+    printf("Timed wait stress test: %u round trips per run\n", PING_COUNT);
+    printf("waiters\tns/timed wait\n");
+
+    printf("%u\t%llu\n", 0, run_bench(0));
+
+    for(count = 8; count <= MAX_WAITERS; count *= 2)
+        printf("%u\t%llu\n", count, run_bench(count));
+
+    printf("Done.\n");
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,120 @@
+/*  KallistiOS ##version##
+
+    workqueue.c
+
+    Work queue pool test
+
+    This program creates a work queue with a pool of worker threads and feeds
+    it batches of jobs. Each job does a bit of busy work and records which
+    worker ran it. Half of the jobs of each batch are delayed, and jobs get
+    different priorities. The program waits for every batch to complete and
+    prints how long that took and how the jobs were spread across workers.
+
+ */
+
+#include <kos/thread.h>
+#include <kos/timer.h>
+#include <kos/workqueue.h>
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/* Configurable constants */
+#define WORKER_COUNT    4       /* Number of worker threads in the pool */
+#define JOB_COUNT       64      /* Number of jobs per batch */
+#define BATCH_COUNT     16      /* Number of batches */
+#define JOB_WORK        20000   /* Busy work done by each job */
+#define JOB_DELAY       5       /* Delay of the delayed jobs (ms) */
+
+typedef struct {
+    workqueue_job_t job;
+    volatile uint32_t result;
+    kthread_t *thd;
+} test_job_t;
+
+static test_job_t jobs[JOB_COUNT];
+static workqueue_t *wq;
+
+static void test_job(workqueue_t *queue, workqueue_job_t *job) {
+    test_job_t *tj = (test_job_t *)job;
+    uint32_t i, acc = 0;
+
+    (void)queue;
+
+    for(i = 0; i < JOB_WORK; i++)
+        acc = acc * 31 + i;
+
+    tj->result = acc;
+    tj->thd = thd_get_current();
+}
+
+int main(int argc, char **argv) {
+    workqueue_batch_t batch = WORKQUEUE_BATCH_INITIALIZER;
+    kthread_t *workers[WORKER_COUNT] = { NULL };
+    unsigned int per_worker[WORKER_COUNT] = { 0 };
+    uint64_t start, end;
+    unsigned int i, j, b;
+
+    (void)argc;
+    (void)argv;
+
+    wq = workqueue_create_pool(WORKER_COUNT, NULL);
+    if(!wq) {
+        fprintf(stderr, "Unable to create the work queue\n");
+        return EXIT_FAILURE;
+    }
+
+    printf("Work queue test: %u workers, %u batches of %u jobs\n",
+           WORKER_COUNT, BATCH_COUNT, JOB_COUNT);
+
+    start = timer_ms_gettime64();
+
+    for(b = 0; b < BATCH_COUNT; b++) {
+        for(i = 0; i < JOB_COUNT; i++) {
+            jobs[i].job.cb = test_job;
+            jobs[i].job.prio = i % 3 - 1;
+            jobs[i].job.time_ms = (i & 1) ?
+                timer_ms_gettime64() + JOB_DELAY : 0;
+            jobs[i].thd = NULL;
+
+            workqueue_enqueue_batch(wq, &batch, &jobs[i].job);
+        }
+
+        if(workqueue_batch_wait(wq, &batch, 5000) < 0) {
+            fprintf(stderr, "Batch %u timed out\n", b);
+            return EXIT_FAILURE;
+        }
+
+        for(i = 0; i < JOB_COUNT; i++) {
+            if(!jobs[i].thd) {
+                fprintf(stderr, "Job %u of batch %u did not run\n", i, b);
+                return EXIT_FAILURE;
+            }
+
+            /* Workers are numbered in the order they are first seen */
+            for(j = 0; j < WORKER_COUNT; j++) {
+                if(!workers[j])
+                    workers[j] = jobs[i].thd;
+
+                if(workers[j] == jobs[i].thd) {
+                    per_worker[j]++;
+                    break;
+                }
+            }
+        }
+    }
+
+    end = timer_ms_gettime64();
+
+    printf("All batches done in %llu ms\n", end - start);
+
+    for(j = 0; j < WORKER_COUNT; j++)
+        printf("worker %u: %u jobs\n", j, per_worker[j]);
+
+    workqueue_destroy(wq);
+
+    printf("Done.\n");
+
+    return EXIT_SUCCESS;
+}
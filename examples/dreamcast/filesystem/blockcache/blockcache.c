@@ -0,0 +1,245 @@
+/* KallistiOS ##version##
+
+   blockcache.c
+
+   This program checks the block cache's bookkeeping against a small block
+   device kept in RAM, which counts the requests that reach it. It goes
+   through a plain miss and hit, a sequential miss that reads ahead, hits on
+   the blocks read ahead, a flush that writes adjacent dirty blocks in one
+   request, and evictions that write a dirty block back. After each step the
+   counters from blockcache_get_stats() are compared with what the cache is
+   expected to have done.
+*/
+
+#include <kos/blockdev.h>
+#include <kos/blockcache.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#define DEV_BLOCKS      256
+#define DEV_BLOCK_LOG   9
+#define DEV_BLOCK_SIZE  (1 << DEV_BLOCK_LOG)
+
+#define CACHE_ENTRIES   16
+
+typedef struct ramdev {
+    uint8_t data[DEV_BLOCKS * DEV_BLOCK_SIZE];
+    int reads;
+    int writes;
+} ramdev_t;
+
+static ramdev_t ramdev;
+static int failures;
+
+static int ramdev_init(kos_blockdev_t *d) {
+    (void)d;
+    return 0;
+}
+
+static int ramdev_shutdown(kos_blockdev_t *d) {
+    (void)d;
+    return 0;
+}
+
+static int ramdev_read(const kos_blockdev_t *d, uint64_t block, size_t count,
+                       void *buf) {
+    ramdev_t *rd = (ramdev_t *)d->dev_data;
+
+    if(block + count > DEV_BLOCKS)
+        return -1;
+
+    memcpy(buf, rd->data + block * DEV_BLOCK_SIZE, count * DEV_BLOCK_SIZE);
+    ++rd->reads;
+    return 0;
+}
+
+static int ramdev_write(const kos_blockdev_t *d, uint64_t block, size_t count,
+                        const void *buf) {
+    ramdev_t *rd = (ramdev_t *)d->dev_data;
+
+    if(block + count > DEV_BLOCKS)
+        return -1;
+
+    memcpy(rd->data + block * DEV_BLOCK_SIZE, buf, count * DEV_BLOCK_SIZE);
+    ++rd->writes;
+    return 0;
+}
+
+static uint64_t ramdev_count(const kos_blockdev_t *d) {
+    (void)d;
+    return DEV_BLOCKS;
+}
+
+static int ramdev_flush(kos_blockdev_t *d) {
+    (void)d;
+    return 0;
+}
+
+static kos_blockdev_t dev = {
+    &ramdev,
+    DEV_BLOCK_LOG,
+    ramdev_init,
+    ramdev_shutdown,
+    ramdev_read,
+    ramdev_write,
+    ramdev_count,
+    ramdev_flush
+};
+
+/* Every block on the device starts out filled with a byte made from its
+   number. */
+static uint8_t block_byte(uint64_t block) {
+    return (uint8_t)(block * 13 + 1);
+}
+
+static void check(kos_blockcache_t *bc, const char *step, int hits,
+                  int misses, int readaheads, int readahead_hits,
+                  int evictions, int writebacks, int writeback_runs,
+                  int reads, int writes) {
+    blockcache_stats_t st;
+
+    blockcache_get_stats(bc, &st);
+
+    printf("%-24s hits %2d misses %2d ra %d/%d evict %2d wb %d/%d "
+           "dev %2d/%d\n", step, (int)st.hits, (int)st.misses,
+           (int)st.readaheads, (int)st.readahead_hits, (int)st.evictions,
+           (int)st.writebacks, (int)st.writeback_runs, ramdev.reads,
+           ramdev.writes);
+
+    if(st.hits != (uint64_t)hits || st.misses != (uint64_t)misses ||
+       st.readaheads != (uint64_t)readaheads ||
+       st.readahead_hits != (uint64_t)readahead_hits ||
+       st.evictions != (uint64_t)evictions ||
+       st.writebacks != (uint64_t)writebacks ||
+       st.writeback_runs != (uint64_t)writeback_runs ||
+       ramdev.reads != reads || ramdev.writes != writes) {
+        printf("FAIL: expected hits %2d misses %2d ra %d/%d evict %2d "
+               "wb %d/%d dev %2d/%d\n", hits, misses, readaheads,
+               readahead_hits, evictions, writebacks, writeback_runs,
+               reads, writes);
+        ++failures;
+    }
+}
+
+static void check_read(kos_blockcache_t *bc, uint64_t block) {
+    uint8_t *buf = blockcache_read(bc, block, 1);
+
+    if(!buf) {
+        printf("FAIL: reading block %d\n", (int)block);
+        ++failures;
+    }
+    else if(buf[0] != block_byte(block) ||
+            buf[DEV_BLOCK_SIZE - 1] != block_byte(block)) {
+        printf("FAIL: wrong data in block %d\n", (int)block);
+        ++failures;
+    }
+}
+
+static void check_dev(uint64_t block, uint8_t val) {
+    const uint8_t *p = ramdev.data + block * DEV_BLOCK_SIZE;
+
+    if(p[0] != val || p[DEV_BLOCK_SIZE - 1] != val) {
+        printf("FAIL: block %d on the device holds 0x%02x, not 0x%02x\n",
+               (int)block, p[0], val);
+        ++failures;
+    }
+}
+
+static uint8_t *claim(kos_blockcache_t *bc, uint64_t block, uint8_t val) {
+    uint8_t *buf = blockcache_claim(bc, block, 1);
+
+    if(!buf) {
+        printf("FAIL: claiming block %d\n", (int)block);
+        ++failures;
+        return NULL;
+    }
+
+    memset(buf, val, DEV_BLOCK_SIZE);
+    return buf;
+}
+
+int main(int argc, char *argv[]) {
+    kos_blockcache_t *bc;
+    uint8_t *buf;
+    int i;
+
+    (void)argc;
+    (void)argv;
+
+    for(i = 0; i < DEV_BLOCKS; ++i)
+        memset(ramdev.data + i * DEV_BLOCK_SIZE, block_byte(i),
+               DEV_BLOCK_SIZE);
+
+    /* One block per entry, which gives a readahead of 4 entries. */
+    if(!(bc = blockcache_create(&dev, 1, CACHE_ENTRIES))) {
+        perror("blockcache_create");
+        return EXIT_FAILURE;
+    }
+
+    /* The first lookup can't be sequential, so it reads just the one. */
+    check_read(bc, 0);
+    check(bc, "miss", 0, 1, 0, 0, 0, 0, 0, 1, 0);
+
+    check_read(bc, 0);
+    check(bc, "hit", 1, 1, 0, 0, 0, 0, 0, 1, 0);
+
+    /* Block 1 follows the last lookup, so it brings 2-5 along with it. */
+    check_read(bc, 1);
+    check(bc, "sequential miss", 1, 2, 4, 0, 0, 0, 0, 2, 0);
+
+    for(i = 2; i <= 5; ++i)
+        check_read(bc, i);
+
+    check(bc, "readahead hits", 5, 2, 4, 4, 0, 0, 0, 2, 0);
+
+    /* Dirty block 0 in place, and blocks 100-103 without reading them. */
+    if((buf = blockcache_read(bc, 0, 1))) {
+        memset(buf, 0xa0, DEV_BLOCK_SIZE);
+        blockcache_mark_dirty(bc, 0);
+    }
+
+    for(i = 100; i <= 103; ++i)
+        claim(bc, i, (uint8_t)(0xb0 + i - 100));
+
+    check(bc, "dirty", 6, 2, 4, 4, 0, 0, 0, 2, 0);
+
+    /* Five dirty entries, but 100-103 go out together. */
+    if(blockcache_flush(bc)) {
+        printf("FAIL: blockcache_flush\n");
+        ++failures;
+    }
+
+    check(bc, "flush", 6, 2, 4, 4, 0, 5, 2, 2, 2);
+    check_dev(0, 0xa0);
+
+    for(i = 100; i <= 103; ++i)
+        check_dev(i, (uint8_t)(0xb0 + i - 100));
+
+    /* A flush with nothing dirty shouldn't touch the device. */
+    blockcache_flush(bc);
+    check(bc, "empty flush", 6, 2, 4, 4, 0, 5, 2, 2, 2);
+
+    /* Leave block 150 dirty, then push everything out of the cache with
+       lookups that never follow each other. The five unused entries go
+       first, then the eleven valid ones, 150 being written back as it
+       goes. */
+    claim(bc, 150, 0xc5);
+
+    for(i = 0; i < CACHE_ENTRIES; ++i)
+        check_read(bc, 160 + i * 5);
+
+    check(bc, "evictions", 6, 18, 4, 4, 11, 6, 3, 18, 3);
+    check_dev(150, 0xc5);
+
+    /* Nothing is dirty anymore, so this is another no-op. */
+    blockcache_flush(bc);
+    check(bc, "final flush", 6, 18, 4, 4, 11, 6, 3, 18, 3);
+
+    blockcache_destroy(bc);
+
+    printf("%s\n", failures ? "FAIL" : "PASS");
+
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
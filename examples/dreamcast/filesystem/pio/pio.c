@@ -0,0 +1,161 @@
+/* KallistiOS ##version##
+
+   pio.c
+
+   This program exercises positional and vectored I/O on a ramdisk file.
+   It checks that pwrite() and pread() round trip data at arbitrary offsets
+   without moving the file position, that pread() comes up short at the end
+   of the file and returns 0 past it, that pwrite() past the end zero-fills
+   the gap, and that writev() and readv() agree with each other no matter
+   how the buffers are split.
+*/
+
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#define TEST_FILE   "/ram/pio.bin"
+#define FILE_SIZE   1024
+
+static int failures;
+
+#define CHECK(cond, ...) do { \
+        if(!(cond)) { \
+            printf("FAIL: " __VA_ARGS__); \
+            printf("\n"); \
+            ++failures; \
+        } \
+    } while(0)
+
+static void fill(uint8_t *buf, size_t len, uint8_t seed) {
+    size_t i;
+
+    for(i = 0; i < len; ++i)
+        buf[i] = (uint8_t)(seed + i * 7);
+}
+
+static void test_positional(int fd) {
+    uint8_t pattern[FILE_SIZE], buf[FILE_SIZE], patch[100];
+    ssize_t rv;
+    off_t pos;
+    size_t i;
+
+    fill(pattern, sizeof(pattern), 1);
+    rv = write(fd, pattern, sizeof(pattern));
+    CHECK(rv == FILE_SIZE, "write returned %d", (int)rv);
+
+    /* Park the file position somewhere the positional calls don't touch. */
+    pos = lseek(fd, 200, SEEK_SET);
+    CHECK(pos == 200, "lseek returned %d", (int)pos);
+
+    fill(patch, sizeof(patch), 0x80);
+    rv = pwrite(fd, patch, sizeof(patch), 600);
+    CHECK(rv == sizeof(patch), "pwrite returned %d", (int)rv);
+    CHECK(lseek(fd, 0, SEEK_CUR) == 200, "pwrite moved the file position");
+
+    memset(buf, 0, sizeof(buf));
+    rv = pread(fd, buf, sizeof(patch), 600);
+    CHECK(rv == sizeof(patch), "pread returned %d", (int)rv);
+    CHECK(!memcmp(buf, patch, sizeof(patch)), "pread data mismatch at 600");
+    CHECK(lseek(fd, 0, SEEK_CUR) == 200, "pread moved the file position");
+
+    /* A plain read() picks up where lseek() left it. */
+    rv = read(fd, buf, 100);
+    CHECK(rv == 100, "read returned %d", (int)rv);
+    CHECK(!memcmp(buf, pattern + 200, 100), "read data mismatch at 200");
+
+    /* Short read at the end of the file, nothing past it. */
+    rv = pread(fd, buf, 100, FILE_SIZE - 40);
+    CHECK(rv == 40, "pread at EOF returned %d, expected 40", (int)rv);
+    CHECK(!memcmp(buf, pattern + FILE_SIZE - 40, 40),
+          "pread data mismatch at EOF");
+
+    rv = pread(fd, buf, 100, FILE_SIZE + 10);
+    CHECK(rv == 0, "pread past EOF returned %d, expected 0", (int)rv);
+
+    /* Writing past the end extends the file and zero-fills the gap. */
+    rv = pwrite(fd, patch, 10, FILE_SIZE + 16);
+    CHECK(rv == 10, "pwrite past EOF returned %d", (int)rv);
+
+    memset(buf, 0xff, sizeof(buf));
+    rv = pread(fd, buf, 26, FILE_SIZE);
+    CHECK(rv == 26, "pread of extension returned %d", (int)rv);
+
+    for(i = 0; i < 16; ++i)
+        CHECK(buf[i] == 0, "gap byte %d is 0x%02x", (int)i, buf[i]);
+
+    CHECK(!memcmp(buf + 16, patch, 10), "pread data mismatch in extension");
+}
+
+static void test_vectored(int fd) {
+    static const size_t splits[][3] = {
+        { 1, 2, 509 }, { 256, 0, 256 }, { 511, 1, 0 }, { 3, 300, 209 }
+    };
+    uint8_t out[512], in[512];
+    struct iovec iov[3];
+    size_t i, j, off;
+    ssize_t rv;
+
+    fill(out, sizeof(out), 0x33);
+
+    for(i = 0; i < sizeof(splits) / sizeof(splits[0]); ++i) {
+        lseek(fd, 0, SEEK_SET);
+
+        for(j = 0, off = 0; j < 3; off += splits[i][j++]) {
+            iov[j].iov_base = out + off;
+            iov[j].iov_len = splits[i][j];
+        }
+
+        rv = writev(fd, iov, 3);
+        CHECK(rv == sizeof(out), "writev split %d returned %d",
+              (int)i, (int)rv);
+
+        /* Read it back with the next split along so they never line up. */
+        lseek(fd, 0, SEEK_SET);
+        memset(in, 0, sizeof(in));
+
+        for(j = 0, off = 0; j < 3; off += splits[(i + 1) % 4][j++]) {
+            iov[j].iov_base = in + off;
+            iov[j].iov_len = splits[(i + 1) % 4][j];
+        }
+
+        rv = readv(fd, iov, 3);
+        CHECK(rv == sizeof(in), "readv split %d returned %d", (int)i, (int)rv);
+        CHECK(!memcmp(in, out, sizeof(in)), "readv data mismatch, split %d",
+              (int)i);
+        CHECK(lseek(fd, 0, SEEK_CUR) == sizeof(in),
+              "readv left the file position at %d",
+              (int)lseek(fd, 0, SEEK_CUR));
+
+        out[0]++;
+    }
+}
+
+int main(int argc, char *argv[]) {
+    int fd;
+
+    (void)argc;
+    (void)argv;
+
+    fd = open(TEST_FILE, O_RDWR | O_CREAT | O_TRUNC);
+
+    if(fd < 0) {
+        perror("open " TEST_FILE);
+        return EXIT_FAILURE;
+    }
+
+    test_positional(fd);
+    test_vectored(fd);
+
+    close(fd);
+    unlink(TEST_FILE);
+
+    printf("%s\n", failures ? "FAIL" : "PASS");
+
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -49,10 +49,11 @@ int main(int argc, char **argv) {
            "Packets received successfully:   %6ld\n"
            "Packets rejected (bad size):     %6ld\n"
            "                 (bad checksum): %6ld\n"
-           "                 (no socket):    %6ld\n\n",
+           "                 (no socket):    %6ld\n"
+           "Packets dropped (socket full):   %6ld\n\n",
            udp.pkt_sent, udp.pkt_send_failed, udp.pkt_recv,
            udp.pkt_recv_bad_size, udp.pkt_recv_bad_chksum,
-           udp.pkt_recv_no_sock);
+           udp.pkt_recv_no_sock, udp.pkt_recv_dropped);
 
     return 0;
 }
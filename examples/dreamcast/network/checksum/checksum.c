@@ -0,0 +1,192 @@
+/*  KallistiOS ##version##
+
+    checksum.c
+
+    CRC-32 and Internet checksum benchmark
+
+    This program times the CRC-32 and Internet checksum routines of the network
+    stack against the simple versions they replaced (which are copied in here),
+    on buffers from 64 bytes to 64 KiB, and checks that both give the same
+    results. It also times copying a buffer and then checksumming it, against
+    doing both at once with net_ipv4_checksum_copy(), which is what TCP and UDP
+    do with the data they send.
+
+    Nothing needs to be connected for this one.
+
+ */
+
+#include <kos/init.h>
+#include <kos/net.h>
+#include <kos/timer.h>
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+KOS_INIT_FLAGS(INIT_DEFAULT);
+
+/* Configurable constants */
+#define MAX_SIZE        65536           /* Largest buffer size */
+#define BYTES_PER_TEST  (512 * 1024)    /* Data to go through per measurement */
+
+static const size_t sizes[] = { 64, 256, 1500, 4096, 16384, MAX_SIZE };
+
+static uint8_t src[MAX_SIZE] __attribute__((aligned(32)));
+static uint8_t dst[MAX_SIZE] __attribute__((aligned(32)));
+
+/* The old bit-at-a-time CRC-32s */
+static uint32_t old_crc32le(const uint8_t *data, int size) {
+    uint32_t rv = 0xFFFFFFFF;
+    int i, j;
+
+    for(i = 0; i < size; ++i) {
+        rv ^= data[i];
+
+        for(j = 0; j < 8; ++j)
+            rv = (0xEDB88320 & (-(rv & 1))) ^ (rv >> 1);
+    }
+
+    return ~rv;
+}
+
+static uint32_t old_crc32be(const uint8_t *data, int size) {
+    uint32_t rv = 0xFFFFFFFF, b, c;
+    int i, j;
+
+    for(i = 0; i < size; ++i) {
+        b = data[i];
+
+        for(j = 0; j < 8; ++j) {
+            c = ((rv & 0x80000000) ? 1 : 0) ^ (b & 1);
+            b >>= 1;
+
+            if(c)   rv = ((rv << 1) ^ 0x04C11DB6) | c;
+            else    rv <<= 1;
+        }
+    }
+
+    return rv;
+}
+
+/* The old Internet checksum, which folds the carry in after every word */
+static uint16_t old_checksum(const uint8_t *data, size_t bytes, uint16_t sum) {
+    uint16_t result;
+
+    for(; bytes > 1; bytes -= 2, data += 2) {
+        sum = __builtin_add_overflow(*(const uint16_t *)data, sum, &result) +
+              result;
+    }
+
+    if(bytes)
+        sum = __builtin_add_overflow(*data, sum, &result) + result;
+
+    return ~sum;
+}
+
+typedef uint32_t (*test_fn)(size_t size);
+
+static uint32_t test_old_crc32le(size_t size) {
+    return old_crc32le(src, size);
+}
+
+static uint32_t test_crc32le(size_t size) {
+    return net_crc32le(src, size);
+}
+
+static uint32_t test_old_crc32be(size_t size) {
+    return old_crc32be(src, size);
+}
+
+static uint32_t test_crc32be(size_t size) {
+    return net_crc32be(src, size);
+}
+
+static uint32_t test_old_checksum(size_t size) {
+    return old_checksum(src, size, 0);
+}
+
+static uint32_t test_checksum(size_t size) {
+    return net_ipv4_checksum(src, size, 0);
+}
+
+static uint32_t test_old_copy(size_t size) {
+    memcpy(dst, src, size);
+    return old_checksum(dst, size, 0);
+}
+
+static uint32_t test_copy(size_t size) {
+    return net_ipv4_checksum_copy(dst, src, size, 0);
+}
+
+static const struct {
+    const char *name;
+    test_fn old_fn;
+    test_fn new_fn;
+} tests[] = {
+    { "crc32le", test_old_crc32le, test_crc32le },
+    { "crc32be", test_old_crc32be, test_crc32be },
+    { "checksum", test_old_checksum, test_checksum },
+    { "copy+checksum", test_old_copy, test_copy },
+};
+
+/* Run a test enough times to go through BYTES_PER_TEST bytes, and return the
+   throughput in KiB/s. The result of the last run is stored in rv. */
+static uint32_t run(test_fn fn, size_t size, uint32_t *rv) {
+    uint64_t start, end;
+    int i, count = BYTES_PER_TEST / size;
+
+    start = timer_ns_gettime64();
+
+    for(i = 0; i < count; i++)
+        *rv = fn(size);
+
+    end = timer_ns_gettime64();
+
+    return (uint32_t)((uint64_t)count * size * 1000000000 / 1024 /
+                      (end - start + 1));
+}
+
+int main(int argc, char **argv) {
+    uint32_t old_rv, new_rv, old_speed, new_speed;
+    unsigned int i, j;
+    int failed = 0;
+
+    (void)argc;
+    (void)argv;
+
+    srand(1234);
+
+    for(i = 0; i < MAX_SIZE; i++)
+        src[i] = (uint8_t)rand();
+
+    printf("%-14s %6s %12s %12s %7s\n", "test", "size", "old (KiB/s)",
+           "new (KiB/s)", "speedup");
+
+    for(i = 0; i < sizeof(tests) / sizeof(tests[0]); i++) {
+        for(j = 0; j < sizeof(sizes) / sizeof(sizes[0]); j++) {
+            old_speed = run(tests[i].old_fn, sizes[j], &old_rv);
+            new_speed = run(tests[i].new_fn, sizes[j], &new_rv);
+
+            printf("%-14s %6u %12lu %12lu %6lu.%lux%s\n", tests[i].name,
+                   (unsigned int)sizes[j], (unsigned long)old_speed,
+                   (unsigned long)new_speed,
+                   (unsigned long)(new_speed / (old_speed + 1)),
+                   (unsigned long)((new_speed * 10 / (old_speed + 1)) % 10),
+                   old_rv != new_rv ? " MISMATCH" : "");
+
+            if(old_rv != new_rv)
+                failed = 1;
+        }
+    }
+
+    /* The old checksum assumed an even address; the new one doesn't. */
+    if(net_ipv4_checksum(src + 1, 1499, 0) !=
+       net_ipv4_checksum_copy(dst, src + 1, 1499, 0)) {
+        printf("Checksum of unaligned data doesn't match!\n");
+        failed = 1;
+    }
+
+    printf(failed ? "Some results didn't match!\n" : "Done!\n");
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,224 @@
+/*  KallistiOS ##version##
+
+    demux.c
+
+    Socket demultiplexing benchmark
+
+    This program opens more and more UDP and listening TCP sockets, and times
+    how long the stack takes to deal with packets that have to be matched
+    against them. The packets are built here and fed to net_input() as if the
+    network adapter had received them, so nothing has to be connected to the
+    other end of the cable:
+      - UDP datagrams to a port that no socket is bound to, which means looking
+        at every socket that could possibly have it.
+      - TCP RST segments to the first listening socket that was opened, which
+        is found, then ignored without sending anything back.
+
+    With the lookup tables, the cost per packet should stay about the same no
+    matter how many sockets are open.
+
+ */
+
+#include <kos/init.h>
+#include <kos/net.h>
+#include <kos/timer.h>
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+KOS_INIT_FLAGS(INIT_DEFAULT | INIT_NET);
+
+/* Configurable constants */
+#define MAX_SOCKETS     256         /* Sockets of each type, at most */
+#define PACKETS         20000       /* Packets timed per measurement */
+#define UDP_BASE_PORT   20000       /* First port for the UDP sockets */
+#define TCP_BASE_PORT   30000       /* First port for the TCP sockets */
+#define UNUSED_PORT     19999       /* Port with no socket on it */
+#define PEER_ADDR       0x0A000002  /* Made-up source address (10.0.0.2) */
+
+#define ETH_HDR_LEN     14
+#define UDP_HDR_LEN     8
+#define TCP_HDR_LEN     20
+
+static const int socket_counts[] = { 1, 16, 64, MAX_SOCKETS };
+
+static int udp_socks[MAX_SOCKETS];
+static int tcp_socks[MAX_SOCKETS];
+static int open_count;
+
+static uint8_t udp_frame[ETH_HDR_LEN + sizeof(ip_hdr_t) + UDP_HDR_LEN + 4];
+static uint8_t tcp_frame[ETH_HDR_LEN + sizeof(ip_hdr_t) + TCP_HDR_LEN];
+
+static uint32_t sum16(const uint8_t *data, size_t len, uint32_t sum) {
+    size_t i;
+
+    for(i = 0; i + 1 < len; i += 2)
+        sum += (data[i] << 8) | data[i + 1];
+
+    if(len & 1)
+        sum += data[len - 1] << 8;
+
+    return sum;
+}
+
+static uint16_t fold(uint32_t sum) {
+    while(sum >> 16)
+        sum = (sum & 0xFFFF) + (sum >> 16);
+
+    return (uint16_t)~sum;
+}
+
+/* Fill in the Ethernet and IPv4 headers of a frame. */
+static void build_ip(uint8_t *frame, uint8_t proto, size_t payload) {
+    ip_hdr_t *ip = (ip_hdr_t *)(frame + ETH_HDR_LEN);
+    uint16_t cs;
+
+    memcpy(frame, net_default_dev->mac_addr, 6);
+    memcpy(frame + 6, "\x02\x00\x00\x00\x00\x01", 6);
+    frame[12] = 0x08;
+    frame[13] = 0x00;
+
+    memset(ip, 0, sizeof(ip_hdr_t));
+    ip->version_ihl = 0x45;
+    ip->length = htons(sizeof(ip_hdr_t) + payload);
+    ip->ttl = 64;
+    ip->protocol = proto;
+    ip->src = htonl(PEER_ADDR);
+    ip->dest = htonl(net_ipv4_address(net_default_dev->ip_addr));
+
+    cs = fold(sum16((const uint8_t *)ip, sizeof(ip_hdr_t), 0));
+    ip->checksum = htons(cs);
+}
+
+static void build_frames(void) {
+    uint8_t *udp = udp_frame + ETH_HDR_LEN + sizeof(ip_hdr_t);
+    uint8_t *tcp = tcp_frame + ETH_HDR_LEN + sizeof(ip_hdr_t);
+    ip_hdr_t *ip = (ip_hdr_t *)(tcp_frame + ETH_HDR_LEN);
+    uint8_t pseudo[12];
+    uint16_t cs;
+
+    /* UDP, with no checksum (which IPv4 allows) */
+    build_ip(udp_frame, IPPROTO_UDP, UDP_HDR_LEN + 4);
+    udp[0] = 40000 >> 8;
+    udp[1] = 40000 & 0xFF;
+    udp[2] = UNUSED_PORT >> 8;
+    udp[3] = UNUSED_PORT & 0xFF;
+    udp[4] = 0;
+    udp[5] = UDP_HDR_LEN + 4;
+    memcpy(udp + UDP_HDR_LEN, "ping", 4);
+
+    /* TCP RST, which needs a proper checksum to get past the checks */
+    build_ip(tcp_frame, IPPROTO_TCP, TCP_HDR_LEN);
+    memset(tcp, 0, TCP_HDR_LEN);
+    tcp[0] = 40000 >> 8;
+    tcp[1] = 40000 & 0xFF;
+    tcp[2] = TCP_BASE_PORT >> 8;
+    tcp[3] = TCP_BASE_PORT & 0xFF;
+    tcp[12] = (TCP_HDR_LEN / 4) << 4;
+    tcp[13] = 0x04;
+
+    memcpy(pseudo, &ip->src, 4);
+    memcpy(pseudo + 4, &ip->dest, 4);
+    pseudo[8] = 0;
+    pseudo[9] = IPPROTO_TCP;
+    pseudo[10] = 0;
+    pseudo[11] = TCP_HDR_LEN;
+
+    cs = fold(sum16(tcp, TCP_HDR_LEN, sum16(pseudo, sizeof(pseudo), 0)));
+    tcp[16] = cs >> 8;
+    tcp[17] = cs & 0xFF;
+}
+
+/* Open sockets until there are count of each type. */
+static int open_sockets(int count) {
+    struct sockaddr_in addr;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = INADDR_ANY;
+
+    for(; open_count < count; open_count++) {
+        udp_socks[open_count] = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+        tcp_socks[open_count] = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+
+        if(udp_socks[open_count] < 0 || tcp_socks[open_count] < 0) {
+            perror("socket");
+            return -1;
+        }
+
+        addr.sin_port = htons(UDP_BASE_PORT + open_count);
+
+        if(bind(udp_socks[open_count], (struct sockaddr *)&addr,
+                sizeof(addr)) < 0) {
+            perror("bind");
+            return -1;
+        }
+
+        addr.sin_port = htons(TCP_BASE_PORT + open_count);
+
+        if(bind(tcp_socks[open_count], (struct sockaddr *)&addr,
+                sizeof(addr)) < 0 || listen(tcp_socks[open_count], 1) < 0) {
+            perror("bind/listen");
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/* Feed a frame to the stack over and over, and return the time per frame in
+   nanoseconds. */
+static uint32_t time_frame(const uint8_t *frame, int len) {
+    uint64_t start, end;
+    int i;
+
+    start = timer_ns_gettime64();
+
+    for(i = 0; i < PACKETS; i++)
+        net_input(net_default_dev, frame, len);
+
+    end = timer_ns_gettime64();
+
+    return (uint32_t)((end - start) / PACKETS);
+}
+
+int main(int argc, char **argv) {
+    unsigned int i;
+    int j;
+
+    (void)argc;
+    (void)argv;
+
+    if(!net_default_dev) {
+        printf("No network device, giving up.\n");
+        return EXIT_FAILURE;
+    }
+
+    build_frames();
+
+    printf("%8s %14s %14s\n", "sockets", "UDP miss (ns)", "TCP RST (ns)");
+
+    for(i = 0; i < sizeof(socket_counts) / sizeof(socket_counts[0]); i++) {
+        if(open_sockets(socket_counts[i]) < 0)
+            break;
+
+        printf("%8d %14lu %14lu\n", open_count,
+               (unsigned long)time_frame(udp_frame, sizeof(udp_frame)),
+               (unsigned long)time_frame(tcp_frame, sizeof(tcp_frame)));
+    }
+
+    for(j = 0; j < open_count; j++) {
+        close(udp_socks[j]);
+        close(tcp_socks[j]);
+    }
+
+    printf("Done!\n");
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,382 @@
+/*  KallistiOS ##version##
+
+    loopback.c
+
+    Network stack throughput test, with no network hardware
+
+    This program brings the network stack up on the loopback device only, then
+    times how fast it can push data from one TCP socket to another and from
+    one UDP socket to another. Everything goes through the same layers it
+    would on a real network adapter (ARP, IPv4, TCP/UDP and the socket
+    interface), with batching of transmitted and received frames, so this is
+    a measure of how much time the stack itself takes.
+
+    The UDP test is run twice: once with a sendto() / recv() per datagram,
+    and once with sendmmsg() / recvmmsg() moving a batch at a time. Before
+    that, a datagram gathered from odd-sized pieces with sendmsg() checks that
+    the checksum comes out right however the data is split up (the receiving
+    end drops datagrams with a bad checksum).
+
+ */
+
+#include <kos/init.h>
+#include <kos/net.h>
+#include <kos/thread.h>
+#include <kos/timer.h>
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+/* Don't bring up the network stack before main(), since the loopback device
+   has to be registered first. */
+KOS_INIT_FLAGS(INIT_DEFAULT);
+
+/* Configurable constants */
+#define LOOP_ADDR       "10.0.0.1"      /* Address of the loopback device */
+#define TCP_PORT        5001            /* Port for the TCP test */
+#define UDP_PORT        5002            /* Port for the UDP test */
+#define TCP_BYTES       (4 * 1024 * 1024)   /* Data sent over TCP */
+#define UDP_DGRAMS      4000            /* Datagrams sent over UDP */
+#define UDP_SIZE        1024            /* Size of each datagram */
+#define CHUNK_SIZE      8192            /* Size of each send() / recv() */
+#define UDP_BATCH       8               /* Datagrams per sendmmsg() */
+
+static uint8_t sendbuf[CHUNK_SIZE];
+static uint8_t recvbuf[CHUNK_SIZE];
+
+static struct sockaddr_in loop_addr(int port) {
+    struct sockaddr_in addr;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    inet_pton(AF_INET, LOOP_ADDR, &addr.sin_addr);
+
+    return addr;
+}
+
+/* Accept one connection, and read everything from it. */
+static void *tcp_sink(void *param) {
+    int lsock = (int)(intptr_t)param;
+    size_t total = 0;
+    ssize_t rv;
+    int sock;
+
+    if((sock = accept(lsock, NULL, NULL)) < 0) {
+        perror("accept");
+        return NULL;
+    }
+
+    while((rv = recv(sock, recvbuf, sizeof(recvbuf), 0)) > 0)
+        total += rv;
+
+    close(sock);
+
+    return (void *)(intptr_t)total;
+}
+
+static int test_tcp(void) {
+    struct sockaddr_in addr = loop_addr(TCP_PORT);
+    kthread_t *thd;
+    uint64_t start, end;
+    size_t sent = 0;
+    void *received;
+    ssize_t rv;
+    int lsock, sock;
+
+    if((lsock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP)) < 0) {
+        perror("socket");
+        return -1;
+    }
+
+    if(bind(lsock, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+       listen(lsock, 1) < 0) {
+        perror("bind/listen");
+        close(lsock);
+        return -1;
+    }
+
+    thd = thd_create(0, tcp_sink, (void *)(intptr_t)lsock);
+
+    if((sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP)) < 0) {
+        perror("socket");
+        close(lsock);
+        return -1;
+    }
+
+    if(connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("connect");
+        close(sock);
+        close(lsock);
+        return -1;
+    }
+
+    start = timer_us_gettime64();
+
+    while(sent < TCP_BYTES) {
+        if((rv = send(sock, sendbuf, sizeof(sendbuf), 0)) <= 0) {
+            perror("send");
+            break;
+        }
+
+        sent += rv;
+    }
+
+    close(sock);
+    thd_join(thd, &received);
+
+    end = timer_us_gettime64();
+    close(lsock);
+
+    printf("TCP: %u bytes sent, %u received in %lu ms (%lu KiB/s)\n",
+           (unsigned int)sent, (unsigned int)(uintptr_t)received,
+           (unsigned long)((end - start) / 1000),
+           (unsigned long)(((uint64_t)(uintptr_t)received * 1000000 /
+                            1024) / (end - start + 1)));
+
+    return 0;
+}
+
+static int test_udp(void) {
+    struct sockaddr_in addr = loop_addr(UDP_PORT);
+    uint64_t start, end;
+    int i, rsock, ssock, received = 0;
+    ssize_t rv;
+
+    if((rsock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) < 0 ||
+       (ssock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) < 0) {
+        perror("socket");
+        return -1;
+    }
+
+    if(bind(rsock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("bind");
+        close(rsock);
+        close(ssock);
+        return -1;
+    }
+
+    start = timer_us_gettime64();
+
+    /* Send in small bursts, draining the receiving end in between, so that
+       the socket's queue doesn't overflow. */
+    for(i = 0; i < UDP_DGRAMS; i++) {
+        if(sendto(ssock, sendbuf, UDP_SIZE, 0, (struct sockaddr *)&addr,
+                  sizeof(addr)) < 0) {
+            perror("sendto");
+            break;
+        }
+
+        if((i & 7) != 7)
+            continue;
+
+        thd_pass();
+
+        while((rv = recv(rsock, recvbuf, sizeof(recvbuf),
+                         MSG_DONTWAIT)) > 0)
+            received++;
+    }
+
+    /* Give the last few a moment to arrive. */
+    thd_sleep(10);
+
+    while((rv = recv(rsock, recvbuf, sizeof(recvbuf), MSG_DONTWAIT)) > 0)
+        received++;
+
+    end = timer_us_gettime64();
+
+    close(ssock);
+    close(rsock);
+
+    printf("UDP: %d datagrams sent, %d received in %lu ms (%lu us each)\n",
+           i, received, (unsigned long)((end - start) / 1000),
+           (unsigned long)((end - start) / (i ? i : 1)));
+
+    return 0;
+}
+
+/* Send one datagram gathered from pieces of odd sizes, and make sure that it
+   arrives, intact and with a good checksum. */
+static int test_udp_iov(void) {
+    static const size_t lens[] = { 3, 1, 6, 5, 0, 77, 2, 9 };
+    struct sockaddr_in addr = loop_addr(UDP_PORT);
+    struct iovec iov[sizeof(lens) / sizeof(lens[0])];
+    net_udp_stats_t before, after;
+    struct msghdr msg;
+    size_t i, off = 0;
+    int rsock, ssock, rv = -1;
+    ssize_t got;
+
+    if((rsock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) < 0 ||
+       (ssock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) < 0) {
+        perror("socket");
+        return -1;
+    }
+
+    if(bind(rsock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("bind");
+        goto out;
+    }
+
+    for(i = 0; i < sizeof(lens) / sizeof(lens[0]); i++) {
+        iov[i].iov_base = sendbuf + off;
+        iov[i].iov_len = lens[i];
+        off += lens[i];
+    }
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = &addr;
+    msg.msg_namelen = sizeof(addr);
+    msg.msg_iov = iov;
+    msg.msg_iovlen = sizeof(lens) / sizeof(lens[0]);
+
+    before = net_udp_get_stats();
+
+    if(sendmsg(ssock, &msg, 0) < 0) {
+        perror("sendmsg");
+        goto out;
+    }
+
+    thd_sleep(10);
+    got = recv(rsock, recvbuf, sizeof(recvbuf), MSG_DONTWAIT);
+    after = net_udp_get_stats();
+
+    if(got != (ssize_t)off || memcmp(sendbuf, recvbuf, off)) {
+        printf("UDP (odd iovecs): FAILED, got %d of %u bytes, %lu bad "
+               "checksums\n", (int)got, (unsigned int)off,
+               (unsigned long)(after.pkt_recv_bad_chksum -
+                               before.pkt_recv_bad_chksum));
+        goto out;
+    }
+
+    printf("UDP (odd iovecs): %u bytes in %u pieces arrived intact\n",
+           (unsigned int)off, (unsigned int)msg.msg_iovlen);
+    rv = 0;
+
+out:
+    close(ssock);
+    close(rsock);
+    return rv;
+}
+
+static int test_udp_mmsg(void) {
+    struct sockaddr_in addr = loop_addr(UDP_PORT);
+    struct mmsghdr smsg[UDP_BATCH], rmsg[UDP_BATCH];
+    struct iovec siov, riov[UDP_BATCH];
+    static uint8_t rbufs[UDP_BATCH][UDP_SIZE];
+    uint64_t start, end;
+    int i, rv, rsock, ssock, sent = 0, received = 0;
+
+    if((rsock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) < 0 ||
+       (ssock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) < 0) {
+        perror("socket");
+        return -1;
+    }
+
+    if(bind(rsock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("bind");
+        close(rsock);
+        close(ssock);
+        return -1;
+    }
+
+    /* Every datagram in a batch is sent from the same buffer, to the same
+       place. */
+    siov.iov_base = sendbuf;
+    siov.iov_len = UDP_SIZE;
+    memset(smsg, 0, sizeof(smsg));
+    memset(rmsg, 0, sizeof(rmsg));
+
+    for(i = 0; i < UDP_BATCH; i++) {
+        smsg[i].msg_hdr.msg_name = &addr;
+        smsg[i].msg_hdr.msg_namelen = sizeof(addr);
+        smsg[i].msg_hdr.msg_iov = &siov;
+        smsg[i].msg_hdr.msg_iovlen = 1;
+
+        riov[i].iov_base = rbufs[i];
+        riov[i].iov_len = UDP_SIZE;
+        rmsg[i].msg_hdr.msg_iov = &riov[i];
+        rmsg[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    start = timer_us_gettime64();
+
+    while(sent < UDP_DGRAMS) {
+        if((rv = sendmmsg(ssock, smsg, UDP_BATCH, 0)) < 0) {
+            perror("sendmmsg");
+            break;
+        }
+
+        sent += rv;
+        thd_pass();
+
+        while((rv = recvmmsg(rsock, rmsg, UDP_BATCH, MSG_DONTWAIT,
+                             NULL)) > 0)
+            received += rv;
+    }
+
+    thd_sleep(10);
+
+    while((rv = recvmmsg(rsock, rmsg, UDP_BATCH, MSG_DONTWAIT, NULL)) > 0)
+        received += rv;
+
+    end = timer_us_gettime64();
+
+    close(ssock);
+    close(rsock);
+
+    printf("UDP (batched): %d datagrams sent, %d received in %lu ms "
+           "(%lu us each)\n", sent, received,
+           (unsigned long)((end - start) / 1000),
+           (unsigned long)((end - start) / (sent ? sent : 1)));
+
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    net_udp_stats_t udp_stats;
+    net_pbuf_stats_t stats;
+    unsigned int i;
+
+    (void)argc;
+    (void)argv;
+
+    for(i = 0; i < sizeof(sendbuf); i++)
+        sendbuf[i] = (uint8_t)i;
+
+    if(net_loop_init() < 0 || net_init(0) < 0) {
+        printf("Couldn't bring up the loopback device, giving up.\n");
+        return EXIT_FAILURE;
+    }
+
+    printf("Network up on %s (%s)\n", net_default_dev->name, LOOP_ADDR);
+
+    test_tcp();
+    test_udp_iov();
+    test_udp();
+    test_udp_mmsg();
+
+    stats = net_pbuf_get_stats();
+    printf("Packet buffers: %lu from the pool, %lu from the heap, "
+           "%lu failed, %lu copies\n", (unsigned long)stats.pool_allocs,
+           (unsigned long)stats.heap_allocs, (unsigned long)stats.alloc_failed,
+           (unsigned long)stats.copies);
+
+    udp_stats = net_udp_get_stats();
+    printf("UDP: %lu datagrams dropped on full sockets, %lu copied to the "
+           "heap\n", (unsigned long)udp_stats.pkt_recv_dropped,
+           (unsigned long)udp_stats.pkt_recv_copied);
+
+    net_shutdown();
+    net_loop_shutdown();
+
+    printf("Done!\n");
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,235 @@
+/*  KallistiOS ##version##
+
+    pbuf.c
+
+    Packet buffer statistics
+
+    This program sends UDP datagrams through the stack and counts how many
+    buffers were allocated and how many times packet data was copied along the
+    way, per datagram, using the counters from net_pbuf_get_stats(). Copies to
+    and from the buffers passed to sendto() and recvfrom() aren't counted, as
+    they can't be avoided.
+
+    Three paths are measured:
+      - Loopback: sent to 127.0.0.1 and received on the same Dreamcast.
+      - Received with net_input(): as a driver that only has a plain buffer
+        would hand the packet to the stack.
+      - Received with net_input_pbuf(): as the broadband adapter's driver does,
+        which lets the socket keep the buffer rather than copying out of it.
+
+    The received packets are built here, so nothing has to be connected to the
+    other end of the cable.
+
+ */
+
+#include <kos/init.h>
+#include <kos/net.h>
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+KOS_INIT_FLAGS(INIT_DEFAULT | INIT_NET);
+
+/* Configurable constants */
+#define PACKETS         1000        /* Datagrams sent per measurement */
+#define PAYLOAD         512         /* Size of each datagram */
+#define PORT            20000       /* Port to send the datagrams to */
+#define PEER_ADDR       0x0A000002  /* Made-up source address (10.0.0.2) */
+
+#define ETH_HDR_LEN     14
+#define UDP_HDR_LEN     8
+#define FRAME_LEN       (ETH_HDR_LEN + sizeof(ip_hdr_t) + UDP_HDR_LEN + PAYLOAD)
+
+static uint8_t payload[PAYLOAD];
+static uint8_t recvbuf[PAYLOAD];
+static uint8_t frame[FRAME_LEN];
+
+static uint32_t sum16(const uint8_t *data, size_t len, uint32_t sum) {
+    size_t i;
+
+    for(i = 0; i + 1 < len; i += 2)
+        sum += (data[i] << 8) | data[i + 1];
+
+    if(len & 1)
+        sum += data[len - 1] << 8;
+
+    return sum;
+}
+
+/* Build a frame carrying a datagram with no checksum (which IPv4 allows). */
+static void build_frame(void) {
+    ip_hdr_t *ip = (ip_hdr_t *)(frame + ETH_HDR_LEN);
+    uint8_t *udp = frame + ETH_HDR_LEN + sizeof(ip_hdr_t);
+    uint32_t sum;
+
+    memcpy(frame, net_default_dev->mac_addr, 6);
+    memcpy(frame + 6, "\x02\x00\x00\x00\x00\x01", 6);
+    frame[12] = 0x08;
+    frame[13] = 0x00;
+
+    memset(ip, 0, sizeof(ip_hdr_t));
+    ip->version_ihl = 0x45;
+    ip->length = htons(sizeof(ip_hdr_t) + UDP_HDR_LEN + PAYLOAD);
+    ip->ttl = 64;
+    ip->protocol = IPPROTO_UDP;
+    ip->src = htonl(PEER_ADDR);
+    ip->dest = htonl(net_ipv4_address(net_default_dev->ip_addr));
+
+    sum = sum16((const uint8_t *)ip, sizeof(ip_hdr_t), 0);
+
+    while(sum >> 16)
+        sum = (sum & 0xFFFF) + (sum >> 16);
+
+    ip->checksum = htons((uint16_t)~sum);
+
+    udp[0] = 40000 >> 8;
+    udp[1] = 40000 & 0xFF;
+    udp[2] = PORT >> 8;
+    udp[3] = PORT & 0xFF;
+    udp[4] = (UDP_HDR_LEN + PAYLOAD) >> 8;
+    udp[5] = (UDP_HDR_LEN + PAYLOAD) & 0xFF;
+    udp[6] = 0;
+    udp[7] = 0;
+    memcpy(udp + UDP_HDR_LEN, payload, PAYLOAD);
+}
+
+static void print_stats(const char *name, const net_pbuf_stats_t *before,
+                        const net_pbuf_stats_t *after) {
+    uint32_t allocs = (after->pool_allocs - before->pool_allocs) +
+                      (after->heap_allocs - before->heap_allocs);
+
+    printf("%-16s %8.2f %8.2f %10.1f %8.2f\n", name,
+           (double)allocs / PACKETS,
+           (double)(after->copies - before->copies) / PACKETS,
+           (double)(after->copy_bytes - before->copy_bytes) / PACKETS,
+           (double)(after->rx_held - before->rx_held) / PACKETS);
+}
+
+/* Send a datagram to ourselves, and read it back. */
+static int loopback(int sock) {
+    struct sockaddr_in addr;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(PORT);
+    inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
+
+    if(sendto(sock, payload, PAYLOAD, 0, (struct sockaddr *)&addr,
+              sizeof(addr)) != PAYLOAD) {
+        perror("sendto");
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Hand our frame to the stack, as a driver with a plain buffer would. */
+static int input_copy(int sock) {
+    (void)sock;
+
+    return net_input(net_default_dev, frame, FRAME_LEN) ? -1 : 0;
+}
+
+/* Hand our frame to the stack in a packet buffer. */
+static int input_pbuf(int sock) {
+    net_pbuf_t *pb;
+    int rv;
+
+    (void)sock;
+
+    if(!(pb = net_pbuf_alloc(0, FRAME_LEN)))
+        return -1;
+
+    memcpy(pb->data, frame, FRAME_LEN);
+    rv = net_input_pbuf(net_default_dev, pb);
+    net_pbuf_free(pb);
+
+    return rv ? -1 : 0;
+}
+
+static int measure(const char *name, int sock, int (*send_one)(int)) {
+    net_pbuf_stats_t before, after;
+    int i;
+
+    before = net_pbuf_get_stats();
+
+    for(i = 0; i < PACKETS; i++) {
+        if(send_one(sock) < 0) {
+            printf("%s: sending failed\n", name);
+            return -1;
+        }
+
+        if(recv(sock, recvbuf, PAYLOAD, 0) != PAYLOAD ||
+           memcmp(recvbuf, payload, PAYLOAD)) {
+            printf("%s: received the wrong data\n", name);
+            return -1;
+        }
+    }
+
+    after = net_pbuf_get_stats();
+
+    /* The frames we built ourselves don't count */
+    if(send_one == input_pbuf)
+        after.pool_allocs -= PACKETS;
+
+    print_stats(name, &before, &after);
+
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    struct sockaddr_in addr;
+    int sock, i;
+
+    (void)argc;
+    (void)argv;
+
+    if(!net_default_dev) {
+        printf("No network device, giving up.\n");
+        return EXIT_FAILURE;
+    }
+
+    for(i = 0; i < PAYLOAD; i++)
+        payload[i] = (uint8_t)i;
+
+    build_frame();
+
+    if((sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) < 0) {
+        perror("socket");
+        return EXIT_FAILURE;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(PORT);
+    addr.sin_addr.s_addr = INADDR_ANY;
+
+    if(bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("bind");
+        close(sock);
+        return EXIT_FAILURE;
+    }
+
+    printf("Per datagram of %d bytes:\n", PAYLOAD);
+    printf("%-16s %8s %8s %10s %8s\n", "path", "allocs", "copies",
+           "bytes", "held");
+
+    if(measure("loopback", sock, loopback) < 0 ||
+       measure("net_input", sock, input_copy) < 0 ||
+       measure("net_input_pbuf", sock, input_pbuf) < 0) {
+        close(sock);
+        return EXIT_FAILURE;
+    }
+
+    close(sock);
+
+    printf("Done!\n");
+    return EXIT_SUCCESS;
+}
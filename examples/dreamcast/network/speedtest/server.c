@@ -14,10 +14,15 @@
 #define BACKLOG         1
 #define HTTP_PORT       80
 
+/* Socket buffer sizes. Anything over 64KB needs TCP window scaling, which lets
+   the test keep the link busy when the round-trip time isn't tiny. */
+#define SOCKET_BUFSIZE  (256 * 1024)
+
 void *server_thread(void *p) {
     (void) p;
     int server_socket;
     struct sockaddr_in server_addr;
+    int bufsize = SOCKET_BUFSIZE;
 
     server_socket = socket(AF_INET, SOCK_STREAM, 0);
     if(server_socket < 0) {
@@ -25,6 +30,13 @@ void *server_thread(void *p) {
         return NULL;
     }
 
+    /* Accepted sockets get the same buffer sizes as the listening one. */
+    if(setsockopt(server_socket, SOL_SOCKET, SO_RCVBUF, &bufsize,
+                  sizeof(bufsize)) < 0 ||
+       setsockopt(server_socket, SOL_SOCKET, SO_SNDBUF, &bufsize,
+                  sizeof(bufsize)) < 0)
+        printf("server_thread: can't set socket buffer sizes\n");
+
     memset(&server_addr, 0, sizeof(server_addr));
     server_addr.sin_family = AF_INET;
     server_addr.sin_addr.s_addr = INADDR_ANY;
@@ -0,0 +1,155 @@
+/*  KallistiOS ##version##
+
+    latency.c
+
+    TCP request/response latency test
+
+    This program connects to a TCP echo server, then sends requests of a few
+    different sizes one at a time, waiting for each one to be echoed back in
+    full before sending the next. It prints the minimum, median, average and
+    maximum round trip time for each size. Since only one request is ever in
+    flight, any time the stack spends holding back an ACK or a segment shows
+    up directly in the results.
+
+    Set SERVER_ADDR to the address of a machine running an echo server, such
+    as this on a Linux PC:
+        socat TCP-LISTEN:1337,fork,reuseaddr EXEC:cat
+
+ */
+
+#include <kos/init.h>
+#include <kos/net.h>
+#include <kos/thread.h>
+#include <kos/timer.h>
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+KOS_INIT_FLAGS(INIT_DEFAULT | INIT_NET);
+
+/* Configurable constants */
+#define SERVER_ADDR     "192.168.1.100"     /* Address of the echo server */
+#define SERVER_PORT     1337                /* Port of the echo server */
+#define ROUNDS          200                 /* Round trips per request size */
+#define MAX_SIZE        4096                /* Largest request size */
+
+static const size_t sizes[] = { 1, 64, 512, 1460, MAX_SIZE };
+
+static uint8_t sendbuf[MAX_SIZE];
+static uint8_t recvbuf[MAX_SIZE];
+static uint32_t rtts[ROUNDS];
+
+static int cmp_u32(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+/* Send a request and wait for all of it to come back. Returns the round trip
+   time in microseconds, or -1 on error. */
+static int64_t round_trip(int sock, size_t size) {
+    uint64_t start;
+    ssize_t rv;
+    size_t got = 0;
+
+    start = timer_us_gettime64();
+
+    if(send(sock, sendbuf, size, 0) != (ssize_t)size) {
+        perror("send");
+        return -1;
+    }
+
+    while(got < size) {
+        rv = recv(sock, recvbuf + got, size - got, 0);
+
+        if(rv <= 0) {
+            if(rv < 0)
+                perror("recv");
+            else
+                printf("Connection closed by the server\n");
+
+            return -1;
+        }
+
+        got += rv;
+    }
+
+    return (int64_t)(timer_us_gettime64() - start);
+}
+
+int main(int argc, char **argv) {
+    struct sockaddr_in addr;
+    uint64_t total;
+    int64_t rtt;
+    unsigned int i, j;
+    int sock, one = 1;
+
+    (void)argc;
+    (void)argv;
+
+    for(i = 0; i < MAX_SIZE; i++)
+        sendbuf[i] = (uint8_t)i;
+
+    if((sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP)) < 0) {
+        perror("socket");
+        return EXIT_FAILURE;
+    }
+
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(SERVER_PORT);
+    inet_pton(AF_INET, SERVER_ADDR, &addr.sin_addr);
+
+    printf("Connecting to %s:%d...\n", SERVER_ADDR, SERVER_PORT);
+
+    if(connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("connect");
+        close(sock);
+        return EXIT_FAILURE;
+    }
+
+    printf("%8s %10s %10s %10s %10s\n", "size", "min (us)", "median",
+           "avg", "max");
+
+    for(i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        total = 0;
+
+        for(j = 0; j < ROUNDS; j++) {
+            if((rtt = round_trip(sock, sizes[i])) < 0) {
+                close(sock);
+                return EXIT_FAILURE;
+            }
+
+            if(memcmp(sendbuf, recvbuf, sizes[i])) {
+                printf("Echoed data doesn't match!\n");
+                close(sock);
+                return EXIT_FAILURE;
+            }
+
+            rtts[j] = (uint32_t)rtt;
+            total += rtt;
+        }
+
+        qsort(rtts, ROUNDS, sizeof(rtts[0]), cmp_u32);
+
+        printf("%8u %10lu %10lu %10lu %10lu\n", (unsigned int)sizes[i],
+               (unsigned long)rtts[0], (unsigned long)rtts[ROUNDS / 2],
+               (unsigned long)(total / ROUNDS),
+               (unsigned long)rtts[ROUNDS - 1]);
+    }
+
+    close(sock);
+
+    printf("Done!\n");
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,127 @@
+/*  KallistiOS ##version##
+
+    list_flush.c
+
+    Vertex DMA streaming test
+
+    This program draws the same scene of lots of small quads, through vertex
+    DMA, in two ways. First with a vertex buffer big enough for a whole frame,
+    so that everything is sent to the TA once the scene is finished. Then with
+    a small one, calling pvr_list_flush() as it goes, so that the TA gets the
+    vertices while the rest are being generated. For each, it prints how long
+    a frame took on average and how much RAM the vertex buffer needed.
+
+ */
+
+#include <kos/init.h>
+#include <kos/timer.h>
+#include <dc/pvr.h>
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+
+KOS_INIT_FLAGS(INIT_DEFAULT);
+
+/* Configurable constants */
+#define QUADS           8000            /* Quads per frame */
+#define FRAMES          120             /* Frames per test */
+#define FLUSH_EVERY     256             /* Quads between pvr_list_flush() */
+#define SMALL_BUF       (32 * 1024)     /* Vertex buffer, when streaming */
+
+/* A header and four vertices per quad, twice over for double-buffering. */
+#define BIG_BUF         (2 * (QUADS * 5 + 2) * 32)
+
+static uint8_t vertbuf[BIG_BUF] __attribute__((aligned(32)));
+
+static pvr_init_params_t params = {
+    { PVR_BINSIZE_16, PVR_BINSIZE_0, PVR_BINSIZE_0, PVR_BINSIZE_0,
+      PVR_BINSIZE_0 },
+    1024 * 1024,    /* Vertex buffer size */
+    1,              /* Vertex DMA enabled */
+    0,              /* No FSAA */
+    0,              /* Translucent autosort enabled */
+    3,              /* Extra OPBs */
+    0               /* Vertex buffer double-buffering enabled */
+};
+
+static void draw_frame(int frame, int flush) {
+    pvr_poly_cxt_t cxt;
+    pvr_poly_hdr_t hdr;
+    pvr_vertex_t vert[4] __attribute__((aligned(32)));
+    float x, y;
+    int i;
+
+    pvr_poly_cxt_col(&cxt, PVR_LIST_OP_POLY);
+    pvr_poly_compile(&hdr, &cxt);
+
+    pvr_wait_ready();
+    pvr_scene_begin();
+    pvr_list_begin(PVR_LIST_OP_POLY);
+    pvr_prim(&hdr, sizeof(hdr));
+
+    for(i = 0; i < QUADS; i++) {
+        x = (float)((i * 37 + frame * 3) % 632);
+        y = (float)((i * 11 + (i / 632) * 7) % 472);
+
+        vert[0].flags = vert[1].flags = vert[2].flags = PVR_CMD_VERTEX;
+        vert[3].flags = PVR_CMD_VERTEX_EOL;
+        vert[0].argb = vert[1].argb = vert[2].argb = vert[3].argb =
+            0xff000000 | (i * 0x10204);
+        vert[0].oargb = vert[1].oargb = vert[2].oargb = vert[3].oargb = 0;
+        vert[0].z = vert[1].z = vert[2].z = vert[3].z = 1.0f + i / 65536.0f;
+
+        vert[0].x = x;        vert[0].y = y + 8.0f;
+        vert[1].x = x;        vert[1].y = y;
+        vert[2].x = x + 8.0f; vert[2].y = y + 8.0f;
+        vert[3].x = x + 8.0f; vert[3].y = y;
+
+        pvr_prim(vert, sizeof(vert));
+
+        if(flush && (i % FLUSH_EVERY) == FLUSH_EVERY - 1)
+            pvr_list_flush(PVR_LIST_OP_POLY);
+    }
+
+    pvr_list_finish();
+    pvr_scene_finish();
+}
+
+static void run_test(const char *name, size_t bufsize, int flush) {
+    uint64_t start, end;
+    int i;
+
+    pvr_set_vertbuf(PVR_LIST_OP_POLY, vertbuf, bufsize);
+
+    /* Get going before timing anything. */
+    for(i = 0; i < 4; i++)
+        draw_frame(i, flush);
+
+    pvr_wait_ready();
+    start = timer_us_gettime64();
+
+    for(i = 0; i < FRAMES; i++)
+        draw_frame(i, flush);
+
+    pvr_wait_ready();
+    end = timer_us_gettime64();
+
+    printf("%-10s %7u bytes of vertex buffer, %lu us per frame\n", name,
+           (unsigned int)bufsize, (unsigned long)((end - start) / FRAMES));
+}
+
+int main(int argc, char **argv) {
+    (void)argc;
+    (void)argv;
+
+    if(pvr_init(&params) < 0)
+        return EXIT_FAILURE;
+
+    printf("%d quads per frame:\n", QUADS);
+
+    run_test("Buffered", BIG_BUF, 0);
+    run_test("Streamed", SMALL_BUF, 1);
+
+    pvr_shutdown();
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,171 @@
+/* KallistiOS ##version##
+
+   pvrmark_strips_dma.c
+*/
+
+/*
+   This file serves as both an example of and benchmark for the ways of
+   getting vertices into the vertex DMA buffers: copying each one in with
+   pvr_list_prim(), or building strips in place with
+   pvr_vertbuf_reserve_strip() / pvr_vertbuf_commit_strip(), with a buffer
+   that holds the whole frame or a small one that's streamed to the TA as it
+   fills up. Each path draws the same strips for a few seconds, and the
+   number of polygons per second is printed for each.
+*/
+
+#include <kos.h>
+#include <stdlib.h>
+#include <limits.h>
+
+#define POLYS       40000       /* Polygons per frame, roughly */
+#define STRIP_LEN   64          /* Vertices per strip */
+#define STRIPS      (POLYS / (STRIP_LEN - 2))
+#define FRAME_POLYS (STRIPS * (STRIP_LEN - 2))  /* Polygons actually drawn */
+#define FRAMES      300         /* Frames per test */
+
+/* The whole frame, twice over, plus the header and end of list. */
+#define BIG_BUF     (2 * (STRIPS * STRIP_LEN * 32 + 64))
+#define SMALL_BUF   (64 * 1024)
+
+static pvr_init_params_t pvr_params = {
+    { PVR_BINSIZE_16, PVR_BINSIZE_0, PVR_BINSIZE_0, PVR_BINSIZE_0, PVR_BINSIZE_0 },
+    2 * 1024 * 1024, 1, 0, 0, 3, 0
+};
+
+static uint8_t vertbuf[BIG_BUF] __attribute__((aligned(32)));
+static pvr_poly_hdr_t hdr;
+
+static void setup(void) {
+    pvr_poly_cxt_t cxt;
+
+    pvr_init(&pvr_params);
+    pvr_set_bg_color(0, 0, 0);
+
+    pvr_poly_cxt_col(&cxt, PVR_LIST_OP_POLY);
+    cxt.gen.shading = PVR_SHADE_FLAT;
+    pvr_poly_compile(&hdr, &cxt);
+}
+
+inline static int getnum(int *seed, int mn) {
+    int num = (*seed & ((mn) - 1));
+    *seed = *seed * 1164525 + 1013904223;
+    return num;
+}
+
+inline static void get_vert(int *seed, int *x, int *y, int *col) {
+    *x = (*x + ((getnum(seed, 64)) - 32)) & 1023;
+    *y = (*y + ((getnum(seed, 64)) - 32)) & 511;
+    *col = getnum(seed, INT32_MAX);
+}
+
+/* A vertex at a time, copied into the buffer. */
+static int frame_list_prim(int *seed) {
+    pvr_vertex_t vert __attribute__((aligned(32)));
+    int x = 0, y = 0, col = 0;
+    int i, j;
+
+    vert.z = getnum(seed, 128) + 1;
+    vert.u = vert.v = 0.0f;
+    vert.oargb = 0;
+
+    for(i = 0; i < STRIPS; i++) {
+        for(j = 0; j < STRIP_LEN; j++) {
+            get_vert(seed, &x, &y, &col);
+
+            vert.flags = j == STRIP_LEN - 1 ? PVR_CMD_VERTEX_EOL : PVR_CMD_VERTEX;
+            vert.x = x;
+            vert.y = y;
+            vert.argb = 0xff000000 | col;
+            if(pvr_list_prim(PVR_LIST_OP_POLY, &vert, sizeof(vert)) < 0)
+                return -1;
+        }
+    }
+
+    return 0;
+}
+
+/* A strip at a time, written straight into the buffer. */
+static int frame_reserve(int *seed) {
+    pvr_vertex_t *vert;
+    int x = 0, y = 0, z, col = 0;
+    int i, j;
+
+    z = getnum(seed, 128) + 1;
+
+    for(i = 0; i < STRIPS; i++) {
+        /* This fails if the strip can't fit in the buffer, or the list
+           can't take any more. */
+        if(!(vert = pvr_vertbuf_reserve_strip(PVR_LIST_OP_POLY, STRIP_LEN)))
+            return -1;
+
+        for(j = 0; j < STRIP_LEN; j++) {
+            get_vert(seed, &x, &y, &col);
+
+            vert[j].x = x;
+            vert[j].y = y;
+            vert[j].z = z;
+            vert[j].argb = 0xff000000 | col;
+        }
+
+        pvr_vertbuf_commit_strip(PVR_LIST_OP_POLY, vert, STRIP_LEN);
+    }
+
+    return 0;
+}
+
+static int run_test(const char *name, int (*frame)(int *seed),
+                    size_t bufsize) {
+    uint64_t start, end;
+    int i, rv, seed = 0xdeadbeef;
+
+    /* Nothing can still be using the old buffer when it's changed. */
+    pvr_wait_ready();
+    pvr_set_vertbuf(PVR_LIST_OP_POLY, vertbuf, bufsize);
+
+    start = timer_ms_gettime64();
+
+    for(i = 0; i < FRAMES; i++) {
+        pvr_wait_ready();
+        pvr_scene_begin();
+        pvr_list_prim(PVR_LIST_OP_POLY, &hdr, sizeof(hdr));
+        rv = frame(&seed);
+        pvr_scene_finish();
+
+        if(rv < 0) {
+            printf("%-28s %8u bytes: couldn't submit frame %d\n", name,
+                   (unsigned int)bufsize, i);
+            return -1;
+        }
+    }
+
+    pvr_wait_ready();
+    end = timer_ms_gettime64();
+
+    printf("%-28s %8u bytes: %lu pps\n", name, (unsigned int)bufsize,
+           (unsigned long)((uint64_t)FRAME_POLYS * FRAMES * 1000 /
+                           (end - start + 1)));
+
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    pvr_stats_t stats;
+
+    setup();
+
+    printf("%d polys per frame, in strips of %d vertices\n", FRAME_POLYS,
+           STRIP_LEN);
+
+    if(run_test("pvr_list_prim", frame_list_prim, BIG_BUF) < 0 ||
+       run_test("pvr_vertbuf_reserve_strip", frame_reserve, BIG_BUF) < 0 ||
+       run_test("pvr_list_prim, streamed", frame_list_prim, SMALL_BUF) < 0 ||
+       run_test("pvr_vertbuf_reserve_strip, streamed", frame_reserve,
+                SMALL_BUF) < 0)
+        return 1;
+
+    pvr_get_stats(&stats);
+    dbglog(DBG_INFO, "3D Stats: %d frames, frame rate ~%f fps\n",
+           (int)stats.vbl_count, (double)stats.frame_rate);
+
+    return 0;
+}
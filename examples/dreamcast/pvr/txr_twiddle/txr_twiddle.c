@@ -0,0 +1,222 @@
+/*  KallistiOS ##version##
+
+    txr_twiddle.c
+
+    Texture twiddling benchmark
+
+    This program checks that pvr_txr_load_ex() twiddles textures of every
+    format and a range of sizes the same way as the per-pixel routine it
+    replaced (which is copied in here), with the store queues and with DMA,
+    and with and without inverting them. Then it times loading textures of
+    each format with the old routine and both new paths.
+
+ */
+
+#include <kos/init.h>
+#include <kos/timer.h>
+#include <dc/pvr.h>
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+KOS_INIT_FLAGS(INIT_DEFAULT);
+
+/* Configurable constants */
+#define MAX_SIDE        1024            /* Largest texture side */
+#define MAX_BYTES       (MAX_SIDE * MAX_SIDE * 2)
+#define BENCH_SIDE      512             /* Side of the benchmark textures */
+#define BENCH_LOADS     4               /* Loads per measurement */
+
+static uint8_t src[MAX_BYTES] __attribute__((aligned(32)));
+static uint8_t flipped[MAX_BYTES] __attribute__((aligned(32)));
+
+/* The old per-pixel twiddling routine */
+#define TWIDTAB(x) ( (x&1)|((x&2)<<1)|((x&4)<<2)|((x&8)<<3)|((x&16)<<4)| \
+                     ((x&32)<<5)|((x&64)<<6)|((x&128)<<7)|((x&256)<<8)|((x&512)<<9) )
+#define TWIDOUT(x, y) ( TWIDTAB((y)) | (TWIDTAB((x)) << 1) )
+
+static void old_load(const void *src, pvr_ptr_t dst, uint32_t w, uint32_t h,
+                     uint32_t bpp) {
+    uint32_t x, y, min, mask;
+
+    min = w < h ? w : h;
+    mask = min - 1;
+
+    if(bpp == 4) {
+        const uint8_t *pixels = src;
+        uint16_t *vtex = (uint16_t *)dst;
+
+        for(y = 0; y < h; y += 2) {
+            for(x = 0; x < w; x += 2) {
+                vtex[TWIDOUT((x & mask) / 2, (y & mask) / 2) +
+                     (x / min + y / min) * min * min / 4] =
+                         (pixels[(x + y * w) >> 1] & 15) |
+                         ((pixels[(x + (y + 1) * w) >> 1] & 15) << 4) |
+                         ((pixels[(x + y * w) >> 1] >> 4) << 8) |
+                         ((pixels[(x + (y + 1) * w) >> 1] >> 4) << 12);
+            }
+        }
+    }
+    else if(bpp == 8) {
+        const uint8_t *pixels = src;
+        uint16_t *vtex = (uint16_t *)dst;
+
+        for(y = 0; y < h; y += 2) {
+            for(x = 0; x < w; x++) {
+                vtex[TWIDOUT((y & mask) / 2, x & mask) +
+                     (x / min + y / min) * min * min / 2] =
+                         pixels[y * w + x] | (pixels[(y + 1) * w + x] << 8);
+            }
+        }
+    }
+    else {
+        const uint16_t *pixels = src;
+        uint16_t *vtex = (uint16_t *)dst;
+
+        for(y = 0; y < h; y++) {
+            for(x = 0; x < w; x++) {
+                vtex[TWIDOUT(x & mask, y & mask) +
+                     (x / min + y / min) * min * min] = pixels[y * w + x];
+            }
+        }
+    }
+}
+
+static const struct {
+    const char *name;
+    uint32_t bpp;
+    uint32_t flags;
+} formats[] = {
+    { "4bpp", 4, PVR_TXRLOAD_4BPP },
+    { "8bpp", 8, PVR_TXRLOAD_8BPP },
+    { "16bpp", 16, PVR_TXRLOAD_16BPP },
+};
+
+static int vram_cmp(pvr_ptr_t a, pvr_ptr_t b, size_t size) {
+    const volatile uint32_t *pa = a, *pb = b;
+    size_t i;
+
+    for(i = 0; i < size / 4; i++) {
+        if(pa[i] != pb[i])
+            return -1;
+    }
+
+    return 0;
+}
+
+/* Check one format, size and set of flags against the old routine. */
+static int check(pvr_ptr_t ref, pvr_ptr_t out, unsigned int fmt, uint32_t w,
+                 uint32_t h, uint32_t flags) {
+    uint32_t bpp = formats[fmt].bpp, y;
+    size_t pitch = w * bpp / 8, size = pitch * h;
+
+    /* The old routine is given the source upside down, when inverting. */
+    for(y = 0; y < h; y++) {
+        memcpy(flipped + y * pitch, src + ((flags & PVR_TXRLOAD_INVERT_Y) ?
+               (h - 1 - y) : y) * pitch, pitch);
+    }
+
+    old_load(flipped, ref, w, h, bpp);
+    pvr_txr_load_ex(src, out, w, h, formats[fmt].flags | flags);
+    pvr_txr_load_wait();
+
+    if(vram_cmp(ref, out, size) < 0) {
+        printf("%s %lux%lu flags %04lx doesn't match!\n", formats[fmt].name,
+               (unsigned long)w, (unsigned long)h, (unsigned long)flags);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int conformance(void) {
+    static const uint32_t flags[] = {
+        0, PVR_TXRLOAD_INVERT_Y, PVR_TXRLOAD_DMA,
+        PVR_TXRLOAD_DMA | PVR_TXRLOAD_NONBLOCK | PVR_TXRLOAD_INVERT_Y
+    };
+    pvr_ptr_t ref, out;
+    unsigned int fmt, f, failed = 0, count = 0;
+    uint32_t w, h;
+
+    ref = pvr_mem_malloc(MAX_SIDE * 256 * 2);
+    out = pvr_mem_malloc(MAX_SIDE * 256 * 2);
+
+    for(fmt = 0; fmt < sizeof(formats) / sizeof(formats[0]); fmt++) {
+        for(w = 8; w <= MAX_SIDE; w <<= 1) {
+            for(h = 8; h <= 256; h <<= 1) {
+                for(f = 0; f < sizeof(flags) / sizeof(flags[0]); f++) {
+                    if(check(ref, out, fmt, w, h, flags[f]) < 0)
+                        failed++;
+
+                    count++;
+                }
+            }
+        }
+    }
+
+    printf("Conformance: %u of %u cases match\n", count - failed, count);
+
+    pvr_mem_free(out);
+    pvr_mem_free(ref);
+
+    return failed ? -1 : 0;
+}
+
+/* Time BENCH_LOADS loads, returning the throughput in KiB/s. */
+static uint32_t bench(pvr_ptr_t dst, unsigned int fmt, int mode) {
+    uint32_t bpp = formats[fmt].bpp;
+    uint64_t start, end;
+    int i;
+
+    start = timer_ns_gettime64();
+
+    for(i = 0; i < BENCH_LOADS; i++) {
+        if(mode == 0)
+            old_load(src, dst, BENCH_SIDE, BENCH_SIDE, bpp);
+        else
+            pvr_txr_load_ex(src, dst, BENCH_SIDE, BENCH_SIDE,
+                            formats[fmt].flags |
+                            (mode == 2 ? PVR_TXRLOAD_DMA : 0));
+    }
+
+    end = timer_ns_gettime64();
+
+    return (uint32_t)((uint64_t)BENCH_LOADS * BENCH_SIDE * BENCH_SIDE * bpp /
+                      8 * 1000000000 / 1024 / (end - start + 1));
+}
+
+int main(int argc, char **argv) {
+    unsigned int fmt, i;
+    pvr_ptr_t dst;
+    int failed;
+
+    (void)argc;
+    (void)argv;
+
+    pvr_init_defaults();
+    srand(1234);
+
+    for(i = 0; i < MAX_BYTES; i++)
+        src[i] = (uint8_t)rand();
+
+    failed = conformance() < 0;
+
+    dst = pvr_mem_malloc(BENCH_SIDE * BENCH_SIDE * 2);
+
+    printf("%-6s %12s %12s %12s\n", "format", "old (KiB/s)", "SQ (KiB/s)",
+           "DMA (KiB/s)");
+
+    for(fmt = 0; fmt < sizeof(formats) / sizeof(formats[0]); fmt++) {
+        printf("%-6s %12lu %12lu %12lu\n", formats[fmt].name,
+               (unsigned long)bench(dst, fmt, 0),
+               (unsigned long)bench(dst, fmt, 1),
+               (unsigned long)bench(dst, fmt, 2));
+    }
+
+    pvr_mem_free(dst);
+
+    printf(failed ? "Some results didn't match!\n" : "Done!\n");
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
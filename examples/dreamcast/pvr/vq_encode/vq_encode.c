@@ -0,0 +1,193 @@
+/*  KallistiOS ##version##
+
+    vq_encode.c
+
+    Run-time VQ encoding benchmark
+
+    This program VQ encodes a generated RGB565 texture at every quality
+    setting of pvr_txr_vq_encode(), and prints how long each one took and
+    how close the result is to the original (as PSNR, by decoding it again
+    here). Then it loads the texture into VRAM the short way, with
+    pvr_txr_load_ex() and PVR_TXRLOAD_VQ_LOAD, and draws it until START is
+    pressed.
+
+ */
+
+#include <kos/init.h>
+#include <kos/timer.h>
+#include <dc/pvr.h>
+#include <dc/maple.h>
+#include <dc/maple/controller.h>
+
+#include <math.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+
+KOS_INIT_FLAGS(INIT_DEFAULT);
+
+/* Configurable constants */
+#define TXR_W       256
+#define TXR_H       256
+
+static uint16_t src[TXR_W * TXR_H] __attribute__((aligned(32)));
+
+/* Something with gradients, edges and noise */
+static void generate(void) {
+    int x, y, r, g, b;
+
+    for(y = 0; y < TXR_H; y++) {
+        for(x = 0; x < TXR_W; x++) {
+            r = (x * 255 / TXR_W + (int)(40.0f * sinf(y * 0.05f))) & 255;
+            g = y * 255 / TXR_H;
+            b = (x ^ y) & 255;
+
+            if(((x / 32) + (y / 32)) & 1)
+                b = 128 + (rand() % 32);
+
+            src[y * TXR_W + x] = ((r >> 3) << 11) | ((g >> 2) << 5) | (b >> 3);
+        }
+    }
+}
+
+/* Spread the bits of v out to the even bits of the result. */
+static uint32_t spread_bits(uint32_t v) {
+    uint32_t rv = 0;
+    int i;
+
+    for(i = 0; i < 16; i++)
+        rv |= ((v >> i) & 1) << (2 * i);
+
+    return rv;
+}
+
+/* Decode the VQ texture, and work out its PSNR against the source, in
+   hundredths of a dB. */
+static int psnr(const uint8_t *vq) {
+    const uint16_t *codebook = (const uint16_t *)vq;
+    const uint8_t *index = vq + 2048;
+    uint32_t m = (TXR_W < TXR_H ? TXR_W : TXR_H) / 2;
+    uint32_t x, y, bx, by, i;
+    uint64_t se = 0;
+    uint16_t p, o;
+    int dr, dg, db;
+
+    for(y = 0; y < TXR_H; y++) {
+        for(x = 0; x < TXR_W; x++) {
+            bx = x / 2;
+            by = y / 2;
+            i = (spread_bits(by & (m - 1)) | (spread_bits(bx & (m - 1)) << 1)) +
+                (bx / m + by / m) * m * m;
+
+            /* Each entry is the top left, bottom left, top right and bottom
+               right texels, in that order. */
+            p = codebook[index[i] * 4 + (x & 1) * 2 + (y & 1)];
+            o = src[y * TXR_W + x];
+
+            dr = ((p >> 11) - (o >> 11)) * 8;
+            dg = (((p >> 5) & 63) - ((o >> 5) & 63)) * 4;
+            db = ((p & 31) - (o & 31)) * 8;
+            se += dr * dr + dg * dg + db * db;
+        }
+    }
+
+    if(!se)
+        return 9999;
+
+    return (int)(1000.0 * log10(255.0 * 255.0 * TXR_W * TXR_H * 3 /
+                                (double)se));
+}
+
+static void draw(pvr_ptr_t txr) {
+    pvr_poly_cxt_t cxt;
+    pvr_poly_hdr_t hdr;
+    pvr_vertex_t vert;
+
+    pvr_poly_cxt_txr(&cxt, PVR_LIST_OP_POLY,
+                     PVR_TXRFMT_RGB565 | PVR_TXRFMT_VQ_ENABLE |
+                     PVR_TXRFMT_TWIDDLED, TXR_W, TXR_H, txr,
+                     PVR_FILTER_BILINEAR);
+    pvr_poly_compile(&hdr, &cxt);
+
+    pvr_wait_ready();
+    pvr_scene_begin();
+    pvr_list_begin(PVR_LIST_OP_POLY);
+    pvr_prim(&hdr, sizeof(hdr));
+
+    vert.flags = PVR_CMD_VERTEX;
+    vert.argb = 0xffffffff;
+    vert.oargb = 0;
+    vert.z = 1.0f;
+
+    vert.x = 192.0f; vert.y = 368.0f; vert.u = 0.0f; vert.v = 1.0f;
+    pvr_prim(&vert, sizeof(vert));
+    vert.x = 192.0f; vert.y = 112.0f; vert.u = 0.0f; vert.v = 0.0f;
+    pvr_prim(&vert, sizeof(vert));
+    vert.x = 448.0f; vert.y = 368.0f; vert.u = 1.0f; vert.v = 1.0f;
+    pvr_prim(&vert, sizeof(vert));
+    vert.flags = PVR_CMD_VERTEX_EOL;
+    vert.x = 448.0f; vert.y = 112.0f; vert.u = 1.0f; vert.v = 0.0f;
+    pvr_prim(&vert, sizeof(vert));
+
+    pvr_list_finish();
+    pvr_scene_finish();
+}
+
+int main(int argc, char **argv) {
+    uint64_t start, end;
+    pvr_ptr_t txr;
+    uint8_t *vq;
+    int q, db;
+
+    (void)argc;
+    (void)argv;
+
+    pvr_init_defaults();
+    srand(1234);
+    generate();
+
+    if(!(vq = malloc(pvr_txr_vq_size(TXR_W, TXR_H))))
+        return EXIT_FAILURE;
+
+    printf("%dx%d RGB565 texture:\n", TXR_W, TXR_H);
+    printf("%-8s %10s %10s\n", "quality", "time (ms)", "PSNR (dB)");
+
+    for(q = PVR_TXR_VQ_QUALITY_FASTEST; q <= PVR_TXR_VQ_QUALITY_BEST; q++) {
+        start = timer_us_gettime64();
+
+        if(pvr_txr_vq_encode(src, vq, TXR_W, TXR_H, PVR_TXRLOAD_VQ_RGB565,
+                             q) < 0) {
+            perror("pvr_txr_vq_encode");
+            break;
+        }
+
+        end = timer_us_gettime64();
+        db = psnr(vq);
+
+        printf("%-8d %10lu %7d.%02d\n", q, (unsigned long)((end - start) / 1000),
+               db / 100, db % 100);
+    }
+
+    free(vq);
+
+    txr = pvr_mem_malloc(pvr_txr_vq_size(TXR_W, TXR_H));
+    pvr_txr_load_ex(src, txr, TXR_W, TXR_H,
+                    PVR_TXRLOAD_16BPP | PVR_TXRLOAD_VQ_LOAD |
+                    PVR_TXRLOAD_VQ_RGB565);
+
+    printf("Press START to exit.\n");
+
+    for(;;) {
+        MAPLE_FOREACH_BEGIN(MAPLE_FUNC_CONTROLLER, cont_state_t, st)
+            if(st->buttons & CONT_START)
+                goto out;
+        MAPLE_FOREACH_END()
+
+        draw(txr);
+    }
+
+out:
+    pvr_mem_free(txr);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,211 @@
+/*  KallistiOS ##version##
+
+    vram_alloc.c
+
+    Texture memory allocator test
+
+    This program exercises the PVR texture memory allocator: it times
+    allocating and freeing blocks, fragments the pool and then compacts it,
+    and allocates more evictable textures than fit in VRAM at once, so that
+    the least recently used ones get moved out to main RAM and back. The
+    contents of every block are checked after being moved around.
+
+ */
+
+#include <kos/init.h>
+#include <kos/timer.h>
+#include <dc/pvr.h>
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+
+KOS_INIT_FLAGS(INIT_DEFAULT);
+
+/* Configurable constants */
+#define SPEED_BLOCKS    256             /* Blocks per allocation speed pass */
+#define SPEED_PASSES    16              /* Allocation speed passes */
+#define FRAG_HANDLES    64              /* Handles to fragment the pool with */
+#define EVICT_SIZE      (256 * 1024)    /* Size of each evictable texture */
+
+static uint32_t buf[EVICT_SIZE / 4] __attribute__((aligned(32)));
+
+/* Fill a block with a pattern that depends on which block it is. */
+static void fill(pvr_ptr_t dst, size_t size, uint32_t seed) {
+    size_t i;
+
+    for(i = 0; i < size / 4; i++)
+        buf[i] = seed * 0x9e3779b9 + i;
+
+    pvr_txr_load(buf, dst, size);
+}
+
+static int check(pvr_ptr_t src, size_t size, uint32_t seed) {
+    const volatile uint32_t *p = (const volatile uint32_t *)src;
+    size_t i;
+
+    if(!src)
+        return -1;
+
+    for(i = 0; i < size / 4; i++) {
+        if(p[i] != seed * 0x9e3779b9 + i)
+            return -1;
+    }
+
+    return 0;
+}
+
+/* Render an empty frame, so that textures age. */
+static void frame(void) {
+    pvr_wait_ready();
+    pvr_scene_begin();
+    pvr_scene_finish();
+}
+
+static void print_stats(const char *when) {
+    pvr_mem_stats_t st;
+
+    pvr_mem_get_stats(&st);
+    printf("%-16s %8lu free in %4lu blocks, largest %8lu, %3u%% fragmented\n",
+           when, (unsigned long)st.free, (unsigned long)st.free_blocks,
+           (unsigned long)st.largest_free, st.fragmentation);
+}
+
+static void test_speed(void) {
+    static pvr_ptr_t ptrs[SPEED_BLOCKS];
+    uint64_t start, end;
+    int i, j;
+
+    start = timer_ns_gettime64();
+
+    for(i = 0; i < SPEED_PASSES; i++) {
+        for(j = 0; j < SPEED_BLOCKS; j++)
+            ptrs[j] = pvr_mem_malloc(32 << (rand() % 8));
+
+        for(j = 0; j < SPEED_BLOCKS; j++)
+            pvr_mem_free(ptrs[(j * 7) % SPEED_BLOCKS]);
+    }
+
+    end = timer_ns_gettime64();
+
+    printf("malloc + free: %lu ns each\n",
+           (unsigned long)((end - start) / (SPEED_PASSES * SPEED_BLOCKS)));
+}
+
+static int test_compact(void) {
+    static pvr_mem_handle_t h[FRAG_HANDLES];
+    static size_t sizes[FRAG_HANDLES];
+    size_t moved;
+    int i, failed = 0;
+
+    for(i = 0; i < FRAG_HANDLES; i++) {
+        sizes[i] = 2048 << (rand() % 4);
+
+        if(!(h[i] = pvr_mem_handle_alloc(sizes[i], 0)))
+            return -1;
+
+        fill(pvr_mem_handle_ptr(h[i]), sizes[i], i);
+    }
+
+    /* Leave a hole after every other one. */
+    for(i = 0; i < FRAG_HANDLES; i += 2) {
+        pvr_mem_handle_free(h[i]);
+        h[i] = NULL;
+    }
+
+    print_stats("fragmented:");
+
+    /* Handles used in the last few frames are left alone. */
+    for(i = 0; i < 4; i++)
+        frame();
+
+    moved = pvr_mem_compact();
+    print_stats("compacted:");
+    printf("compaction moved %lu bytes\n", (unsigned long)moved);
+
+    for(i = 1; i < FRAG_HANDLES; i += 2) {
+        if(check(pvr_mem_handle_ptr(h[i]), sizes[i], i) < 0) {
+            printf("block %d was corrupted by compaction!\n", i);
+            failed = 1;
+        }
+
+        pvr_mem_handle_free(h[i]);
+    }
+
+    return failed ? -1 : 0;
+}
+
+static int test_evict(void) {
+    pvr_mem_handle_t *h;
+    pvr_mem_stats_t st;
+    int i, count, failed = 0;
+
+    /* Twice as many textures as there's room for */
+    count = 2 * pvr_mem_available() / EVICT_SIZE;
+
+    if(!(h = calloc(count, sizeof(*h))))
+        return -1;
+
+    for(i = 0; i < count; i++) {
+        if(!(h[i] = pvr_mem_handle_alloc(EVICT_SIZE, PVR_MEM_EVICTABLE))) {
+            printf("couldn't allocate texture %d of %d\n", i, count);
+            failed = 1;
+            break;
+        }
+
+        fill(pvr_mem_handle_ptr(h[i]), EVICT_SIZE, i);
+        frame();
+    }
+
+    pvr_mem_get_stats(&st);
+    printf("%lu textures in VRAM, %lu evicted (%lu bytes)\n",
+           (unsigned long)st.handles_resident,
+           (unsigned long)st.handles_evicted,
+           (unsigned long)st.evicted_bytes);
+
+    /* Bring them all back in turn, evicting others to make room. */
+    for(i = 0; i < count && h[i]; i++) {
+        if(check(pvr_mem_handle_ptr(h[i]), EVICT_SIZE, i) < 0) {
+            printf("texture %d didn't survive eviction!\n", i);
+            failed = 1;
+        }
+
+        frame();
+    }
+
+    pvr_mem_get_stats(&st);
+    printf("%lu evictions, %lu restores\n", (unsigned long)st.evictions,
+           (unsigned long)st.restores);
+
+    for(i = 0; i < count; i++)
+        pvr_mem_handle_free(h[i]);
+
+    free(h);
+
+    return failed ? -1 : 0;
+}
+
+int main(int argc, char **argv) {
+    int failed = 0;
+
+    (void)argc;
+    (void)argv;
+
+    srand(1234);
+    pvr_init_defaults();
+
+    print_stats("initial:");
+    test_speed();
+
+    if(test_compact() < 0)
+        failed = 1;
+
+    if(test_evict() < 0)
+        failed = 1;
+
+    print_stats("final:");
+    pvr_mem_stats();
+
+    printf(failed ? "Some tests failed!\n" : "Done!\n");
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
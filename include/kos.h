@@ -55,6 +55,7 @@ __BEGIN_DECLS
 #include <kos/exports.h>
 #include <kos/dbgio.h>
 #include <kos/blockdev.h>
+#include <kos/blockcache.h>
 #include <kos/dbglog.h>
 #include <kos/elf.h>
 #include <kos/fs_socket.h>
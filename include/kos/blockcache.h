@@ -0,0 +1,174 @@
+/* KallistiOS ##version##
+
+   kos/blockcache.h
+*/
+
+/** \file    kos/blockcache.h
+    \brief   Shared block cache for block-device-backed filesystems.
+    \ingroup vfs_blockcache
+
+    This file contains a block cache that sits on top of a kos_blockdev_t, so
+    that each filesystem doesn't have to carry its own. Lookups are hashed and
+    the LRU list is updated in constant time. Misses that continue a sequential
+    run read the next few entries in the same device request, and dirty entries
+    are written back in runs of adjacent blocks when the cache is flushed.
+
+    The cache does no locking of its own. Each filesystem is expected to
+    serialize the accesses to its caches with the lock it already uses for
+    its own state.
+*/
+
+#ifndef __KOS_BLOCKCACHE_H
+#define __KOS_BLOCKCACHE_H
+
+#include <kos/cdefs.h>
+__BEGIN_DECLS
+
+#include <stddef.h>
+#include <stdint.h>
+
+/** \defgroup vfs_blockcache  Block Cache
+    \brief                    Cache of blocks read from a block device
+    \ingroup                  vfs_blockdev
+
+    @{
+*/
+
+struct kos_blockdev;
+
+/** \brief  Opaque block cache type. */
+typedef struct kos_blockcache kos_blockcache_t;
+
+/** \brief  Default number of entries read ahead on a sequential miss. */
+#define BLOCKCACHE_READAHEAD    4
+
+/** \brief  Block cache statistics.
+
+    All counts are in cache entries, since the cache was created or since the
+    last call to blockcache_reset_stats().
+
+    \headerfile kos/blockcache.h
+*/
+typedef struct blockcache_stats {
+    uint64_t hits;              /**< \brief Lookups served from the cache */
+    uint64_t misses;            /**< \brief Lookups that went to the device */
+    uint64_t readaheads;        /**< \brief Entries read ahead of a miss */
+    uint64_t readahead_hits;    /**< \brief Read ahead entries later used */
+    uint64_t evictions;         /**< \brief Valid entries thrown out */
+    uint64_t writebacks;        /**< \brief Dirty entries written back */
+    uint64_t writeback_runs;    /**< \brief Device writes used for those */
+} blockcache_stats_t;
+
+/** \brief  Create a block cache.
+
+    Each entry of the cache holds up to blocks_per_entry device blocks. The
+    entries are aligned to 32 bytes, so that they can be used for DMA.
+
+    \param  dev             The block device to cache.
+    \param  blocks_per_entry    The number of device blocks per entry.
+    \param  entries         The number of entries in the cache.
+    \return                 The new cache, or NULL on failure (with errno
+                            set to EINVAL or ENOMEM).
+*/
+kos_blockcache_t *blockcache_create(struct kos_blockdev *dev,
+                                    size_t blocks_per_entry, size_t entries);
+
+/** \brief  Destroy a block cache.
+
+    Dirty entries are not written back; call blockcache_flush() first if
+    they matter.
+
+    \param  bc              The cache to destroy.
+*/
+void blockcache_destroy(kos_blockcache_t *bc);
+
+/** \brief  Set the number of entries read ahead on a sequential miss.
+
+    A miss on the entry right after the last one looked up is considered
+    sequential. Only whole entries are read ahead. The value is clamped to a
+    quarter of the cache, and to twice BLOCKCACHE_READAHEAD minus one; 0
+    disables readahead.
+
+    \param  bc              The cache to modify.
+    \param  entries         The number of entries to read ahead.
+*/
+void blockcache_set_readahead(kos_blockcache_t *bc, size_t entries);
+
+/** \brief  Get a cached copy of some blocks, reading them if needed.
+
+    An entry is looked up by its first device block, and must always be used
+    with the same block count.
+
+    \param  bc              The cache to read through.
+    \param  block           The first device block of the entry.
+    \param  count           The number of device blocks in the entry, between
+                            1 and the blocks per entry of the cache.
+    \return                 The entry's data, valid until the entry is
+                            evicted, or NULL on error (with errno set).
+*/
+uint8_t *blockcache_read(kos_blockcache_t *bc, uint64_t block, size_t count);
+
+/** \brief  Get an entry that is about to be completely overwritten.
+
+    This works like blockcache_read(), but doesn't read anything from the
+    device on a miss. The entry is marked dirty, and its contents are
+    undefined on a miss.
+
+    \param  bc              The cache to use.
+    \param  block           The first device block of the entry.
+    \param  count           The number of device blocks in the entry.
+    \return                 The entry's data, or NULL on error (with errno
+                            set).
+*/
+uint8_t *blockcache_claim(kos_blockcache_t *bc, uint64_t block, size_t count);
+
+/** \brief  Mark a cached entry as modified.
+
+    \param  bc              The cache to modify.
+    \param  block           The first device block of the entry.
+    \retval 0               On success.
+    \retval -1              If the entry is not in the cache (errno is set to
+                            EINVAL).
+*/
+int blockcache_mark_dirty(kos_blockcache_t *bc, uint64_t block);
+
+/** \brief  Write back all dirty entries.
+
+    The dirty entries are written in block order, with each run of adjacent
+    entries going out in as few device writes as possible. This does not
+    call the device's own flush function.
+
+    \param  bc              The cache to flush.
+    \retval 0               On success.
+    \retval -1              If a write failed (errno is set to EIO). Entries
+                            that couldn't be written stay dirty.
+*/
+int blockcache_flush(kos_blockcache_t *bc);
+
+/** \brief  Drop every entry from the cache, without writing anything back.
+
+    This is meant for when the medium changes under the cache.
+
+    \param  bc              The cache to empty.
+*/
+void blockcache_invalidate(kos_blockcache_t *bc);
+
+/** \brief  Get the statistics of a cache.
+
+    \param  bc              The cache to look at.
+    \param  stats           Where to store the statistics.
+*/
+void blockcache_get_stats(const kos_blockcache_t *bc,
+                          blockcache_stats_t *stats);
+
+/** \brief  Reset the statistics of a cache.
+
+    \param  bc              The cache to modify.
+*/
+void blockcache_reset_stats(kos_blockcache_t *bc);
+
+/** @} */
+
+__END_DECLS
+
+#endif /* !__KOS_BLOCKCACHE_H */
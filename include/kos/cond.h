@@ -59,10 +59,11 @@ __BEGIN_DECLS
 */
 typedef struct condvar {
     int dummy;
+    genwait_queue_t waiters;
 } condvar_t;
 
 /** \brief  Initializer for a transient condvar. */
-#define COND_INITIALIZER    { 0 }
+#define COND_INITIALIZER    { 0, GENWAIT_QUEUE_INITIALIZER }
 
 /** \brief  Initialize a condition variable.
 
@@ -58,6 +58,7 @@ typedef struct kos_dirent {
 
 /* Forward declaration */
 struct vfs_handler;
+struct iovec;
 
 /* stat_t.unique */
 /** \brief stat_t.unique: Constant to use denoting file has no unique ID */
@@ -204,6 +205,22 @@ typedef struct vfs_handler {
 
     /** \brief Get status information on an already opened file. */
     int (*fstat)(void *hnd, struct stat *st);
+
+    /* Vectored and positional I/O. These are optional; when they are not
+       provided, the VFS falls back to the functions above. */
+
+    /** \brief Read into several buffers from a previously opened file */
+    ssize_t (*readv)(void *hnd, const struct iovec *iov, int iovcnt);
+
+    /** \brief Write from several buffers to a previously opened file */
+    ssize_t (*writev)(void *hnd, const struct iovec *iov, int iovcnt);
+
+    /** \brief Read at the given offset without moving the file pointer */
+    ssize_t (*pread64)(void *hnd, void *buffer, size_t cnt, _off64_t offset);
+
+    /** \brief Write at the given offset without moving the file pointer */
+    ssize_t (*pwrite64)(void *hnd, const void *buffer, size_t cnt,
+                        _off64_t offset);
 } vfs_handler_t;
 
 /** \cond */
@@ -300,6 +317,65 @@ ssize_t fs_read(file_t hnd, void *buffer, size_t cnt);
 */
 ssize_t fs_write(file_t hnd, const void *buffer, size_t cnt);
 
+/** \brief   Read from an opened file into several buffers.
+
+    This function reads from the file at its current file pointer, filling
+    each of the \p iovcnt buffers in turn. Filesystems that support it do this
+    in one go; others are handled with one fs_read() call per buffer.
+
+    \param  hnd             The file descriptor to read from.
+    \param  iov             The buffers to read into.
+    \param  iovcnt          The number of buffers (at most IOV_MAX).
+
+    \return                 The number of bytes read, or -1 on error.
+*/
+ssize_t fs_readv(file_t hnd, const struct iovec *iov, int iovcnt);
+
+/** \brief   Write to an opened file from several buffers.
+
+    This function writes the \p iovcnt buffers in turn into the file at its
+    current file pointer. Filesystems that support it do this in one go;
+    others are handled with one fs_write() call per buffer.
+
+    \param  hnd             The file descriptor to write into.
+    \param  iov             The buffers to write.
+    \param  iovcnt          The number of buffers (at most IOV_MAX).
+
+    \return                 The number of bytes written, or -1 on error.
+*/
+ssize_t fs_writev(file_t hnd, const struct iovec *iov, int iovcnt);
+
+/** \brief   Read from an opened file at a given offset.
+
+    This function reads from the file at the given offset, without using or
+    moving the file pointer. On filesystems that support it natively, several
+    threads can read from the same file descriptor this way without racing
+    on the file pointer. On others, it is emulated with a seek and a read,
+    and is not atomic.
+
+    \param  hnd             The file descriptor to read from.
+    \param  buffer          The buffer to read into.
+    \param  cnt             The number of bytes requested.
+    \param  offset          The offset in the file to read from.
+
+    \return                 The number of bytes read, or -1 on error.
+*/
+ssize_t fs_pread(file_t hnd, void *buffer, size_t cnt, _off64_t offset);
+
+/** \brief   Write to an opened file at a given offset.
+
+    This function writes into the file at the given offset, without using or
+    moving the file pointer. The same caveats as fs_pread() apply.
+
+    \param  hnd             The file descriptor to write into.
+    \param  buffer          The data to write.
+    \param  cnt             The size of the data, in bytes.
+    \param  offset          The offset in the file to write at.
+
+    \return                 The number of bytes written, or -1 on error.
+*/
+ssize_t fs_pwrite(file_t hnd, const void *buffer, size_t cnt, _off64_t offset);
+
 /** \brief   Seek to a new position within a file.
 
     This function moves the file pointer to the specified position within the
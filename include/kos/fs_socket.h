@@ -377,6 +377,44 @@ typedef struct fs_socket_proto {
                             currently true in the socket. 0 if none are true.
     */
     short (*poll)(net_socket_t *s, short events);
+
+    /** \brief  Receive several messages on a socket created with the
+                protocol.
+
+        This function should implement the ::recvmmsg() system call for the
+        protocol, minus the timeout (which is handled by the caller), and is
+        also used for ::recvmsg(). It is optional: if it is NULL, those calls
+        are built on top of recvfrom() instead, one buffer at a time, which
+        is only correct for stream sockets.
+
+        \param  s           The socket to receive data on
+        \param  msgvec      The messages to fill in
+        \param  vlen        The number of elements in msgvec
+        \param  flags       Flags to the function
+        \retval -1          On error, if no messages were received (set errno
+                            appropriately)
+        \retval n           The number of messages received
+    */
+    int (*recvmmsg)(net_socket_t *s, struct mmsghdr *msgvec, unsigned int vlen,
+                    int flags);
+
+    /** \brief  Send several messages on a socket created with the protocol.
+
+        This function should implement the ::sendmmsg() system call for the
+        protocol, and is also used for ::sendmsg(). It is optional: if it is
+        NULL, those calls are built on top of sendto() instead, one buffer at
+        a time, which is only correct for stream sockets.
+
+        \param  s           The socket to send data on
+        \param  msgvec      The messages to send
+        \param  vlen        The number of elements in msgvec
+        \param  flags       Flags to the function
+        \retval -1          On error, if no messages were sent (set errno
+                            appropriately)
+        \retval n           The number of messages sent
+    */
+    int (*sendmmsg)(net_socket_t *s, struct mmsghdr *msgvec, unsigned int vlen,
+                    int flags);
 } fs_socket_proto_t;
 
 /** \brief   Initializer for the entry field in the fs_socket_proto_t struct. 
@@ -16,6 +16,12 @@
     KOS' sync primitives (other than spinlocks) are based on this concept, and
     it can be used for some fairly useful things.
 
+    Sleepers are normally kept in a small table of queues, hashed by the address
+    of the object they sleep on, so waking up the sleepers of one object may
+    have to skip over the sleepers of unrelated objects. Objects that are waited
+    on often can instead embed a genwait_queue_t and use genwait_wait_queue()
+    and genwait_wake_queue_cnt(), which keep their sleepers on that queue only.
+
     \author Megan Potter
     \author Lawrence Sebald
 */
@@ -27,6 +33,7 @@
 __BEGIN_DECLS
 
 #include <kos/thread.h>
+#include <kos/waitqueue.h>
 #include <stdint.h>
 
 /** \brief  Sleep on an object.
@@ -123,6 +130,64 @@ void genwait_wake_one_err(const void *obj, int err);
 */
 int genwait_wake_thd(const void *obj, kthread_t *thd, int err) __nonnull((2));
 
+/** \brief  Sleep on an object, using the object's own wait queue.
+
+    This function works like genwait_wait(), but puts the calling thread on the
+    given wait queue instead of the shared hashed queues. Threads sleeping this
+    way must be woken with genwait_wake_queue_cnt() on the same queue (or with
+    genwait_wake_thd()). You are not allowed to call this function inside an
+    interrupt.
+
+    \param  queue           The wait queue embedded in the object
+    \param  obj             The object to sleep on
+    \param  mesg            A message to show in the status
+    \param  timeout         If not woken before this many milliseconds have
+                            passed, wake up anyway
+    \retval 0               On successfully being woken up (not by timeout)
+    \retval -1              On error or being woken by timeout
+
+    \par    Error Conditions:
+    \em     EAGAIN - on timeout
+*/
+int genwait_wait_queue(genwait_queue_t *queue, void *obj, const char *mesg,
+                       unsigned int timeout) __nonnull((1));
+
+/** \brief  Wake up a number of threads sleeping on a wait queue.
+
+    This function wakes up to the specified number of threads sleeping on the
+    given wait queue, in priority order. Unlike genwait_wake_cnt(), this never
+    has to look at threads sleeping on other objects.
+
+    \param  queue           The wait queue embedded in the object
+    \param  cnt             The number of threads to wake, if <= 0, wake all
+    \param  err             The errno code to set on the woken threads, or 0.
+                            See genwait_wake_cnt().
+    \return                 The number of threads woken
+*/
+int genwait_wake_queue_cnt(genwait_queue_t *queue, int cnt, int err) __nonnull_all;
+
+/** \brief  Generic wait statistics.
+
+    These counters are updated by the generic wait system, and can be used to
+    see how much work wakeups on the hashed queues spend on collisions.
+
+    \headerfile kos/genwait.h
+*/
+typedef struct genwait_stats {
+    uint32_t waits;             /**< \brief Total number of sleeps */
+    uint32_t queue_waits;       /**< \brief Sleeps on an embedded wait queue */
+    uint32_t wakeups;           /**< \brief Threads woken (including timeouts) */
+    uint32_t timeouts;          /**< \brief Threads woken by a timeout */
+    uint32_t hashed_scans;      /**< \brief Sleepers looked at by hashed wakeups */
+    uint32_t hashed_collisions; /**< \brief ... which slept on another object */
+} genwait_stats_t;
+
+/** \brief  Retrieve the generic wait statistics.
+
+    \param  stats           Where to copy the statistics to
+*/
+void genwait_get_stats(genwait_stats_t *stats) __nonnull_all;
+
 /** \brief  Look for timed out genwait_wait() calls.
 
     There should be no reason you need to call this function, it is called
@@ -144,6 +209,10 @@ void genwait_check_timeouts(uint64_t now);
 uint64_t genwait_next_timeout(void);
 
 /** \cond */
+/* Make room for count threads in the timer queue. Called by thd_create() with
+   interrupts disabled, so that sleeping never has to allocate. */
+int genwait_reserve(size_t count);
+
 /* Initialize the genwait system */
 int genwait_init(void);
 
@@ -164,6 +164,8 @@ extern const void * __kos_romdisk;
 #define INIT_FS_RND      0x00000200  /**< Enable support for /dev/urandom VFS */
 
 #define INIT_NO_SHUTDOWN 0x00000400  /**< Disable hardware shutdown */
+#define INIT_THD_TICKLESS 0x00000800 /**< Start the scheduler in tickless mode */
+#define INIT_THD_STACK_PAINT 0x00001000 /**< Paint thread stacks to measure use */
 /** @} */
 
 __END_DECLS
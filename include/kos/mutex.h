@@ -17,10 +17,11 @@
     a block of code to prevent two threads from interfering with one another
     when only one would be appropriate to be in the block at a time.
 
-    KallistiOS implements 2 types of mutexes, normal mutexes and recursive
+    KallistiOS implements 3 types of mutexes: normal, recursive and adaptive
     mutexes. Internally the implementation is the same, the only difference lies
-    in error-checking. When assert() calls are disabled (by setting the NDEBUG
-    macro), they should have the exact same behaviour.
+    in error-checking and in what happens under contention. When assert() calls
+    are disabled (by setting the NDEBUG macro), normal and recursive mutexes
+    should have the exact same behaviour.
 
     A normal mutex (MUTEX_TYPE_NORMAL) is roughly equivalent to a semaphore that
     has been initialized with a count of 1. If assert() is disabled, there is no
@@ -32,6 +33,15 @@
     times for the mutex to be effectively released. Still only one thread can
     hold the lock, but it may hold it as many times as it needs to.
 
+    An adaptive mutex (MUTEX_TYPE_ADAPTIVE) behaves like a normal mutex, but
+    when it is contended and the holder is runnable, the locking thread first
+    yields the CPU to the holder a few times before going to sleep. Short
+    critical sections are usually over by then, which saves the sleep queue
+    round-trip of a full block and wake-up.
+
+    Any mutex can also have lock statistics attached to it with
+    mutex_stats_enable(). The statistics are printed with mutex_stats_print().
+
     \author Lawrence Sebald
     \see    kos/sem.h
 */
@@ -43,6 +53,8 @@
 
 __BEGIN_DECLS
 
+#include <kos/waitqueue.h>
+
 /* Forward declare kthread to not expose all of thread.h here */
 struct kthread;
 
@@ -57,6 +69,8 @@ typedef struct kos_mutex {
     unsigned int type;
     struct kthread *holder;
     int count;
+    genwait_queue_t waiters;
+    struct mutex_stats *stats;
 } mutex_t;
 
 /** \name  Mutex types
@@ -71,22 +85,41 @@ typedef struct kos_mutex {
 #define MUTEX_TYPE_OLDNORMAL    1   /**< \brief Alias for MUTEX_TYPE_NORMAL */
 #define MUTEX_TYPE_RECURSIVE    3   /**< \brief Recursive mutex type */
 #define MUTEX_TYPE_DESTROYED    4   /**< \brief Mutex that has been destroyed */
+#define MUTEX_TYPE_ADAPTIVE     5   /**< \brief Yield-then-block mutex type */
 
  __depr("Error-checking mutexes are deprecated")
 static const unsigned int MUTEX_TYPE_ERRORCHECK = 2;
 
 /** \brief Default mutex type */
 #define MUTEX_TYPE_DEFAULT      MUTEX_TYPE_NORMAL
+
+/** \brief Check whether a mutex type is valid (and not destroyed) */
+#define MUTEX_TYPE_VALID(t) \
+    ((t) <= MUTEX_TYPE_RECURSIVE || (t) == MUTEX_TYPE_ADAPTIVE)
 /** @} */
 
+/** \brief  Number of times an adaptive mutex yields to the holder.
+
+    This is how many times mutex_lock() on a contended adaptive mutex passes
+    the CPU to the (runnable) holder before blocking.
+*/
+#define MUTEX_ADAPTIVE_YIELDS   4
+
 /** \brief  Initializer for a transient mutex. */
-#define MUTEX_INITIALIZER               { MUTEX_TYPE_NORMAL, NULL, 0 }
+#define MUTEX_INITIALIZER \
+    { MUTEX_TYPE_NORMAL, NULL, 0, GENWAIT_QUEUE_INITIALIZER, NULL }
 
 /** \brief  Initializer for a transient error-checking mutex. */
-#define ERRORCHECK_MUTEX_INITIALIZER    { MUTEX_TYPE_ERRORCHECK, NULL, 0 }
+#define ERRORCHECK_MUTEX_INITIALIZER \
+    { MUTEX_TYPE_ERRORCHECK, NULL, 0, GENWAIT_QUEUE_INITIALIZER, NULL }
 
 /** \brief  Initializer for a transient recursive mutex. */
-#define RECURSIVE_MUTEX_INITIALIZER     { MUTEX_TYPE_RECURSIVE, NULL, 0 }
+#define RECURSIVE_MUTEX_INITIALIZER \
+    { MUTEX_TYPE_RECURSIVE, NULL, 0, GENWAIT_QUEUE_INITIALIZER, NULL }
+
+/** \brief  Initializer for a transient adaptive mutex. */
+#define ADAPTIVE_MUTEX_INITIALIZER \
+    { MUTEX_TYPE_ADAPTIVE, NULL, 0, GENWAIT_QUEUE_INITIALIZER, NULL }
 
 /** \brief  Initialize a new mutex.
 
@@ -234,6 +267,43 @@ int mutex_trylock(mutex_t *m) __nonnull_all;
 */
 int mutex_unlock(mutex_t *m) __nonnull_all;
 
+/** \brief  Enable lock statistics on a mutex.
+
+    This function attaches a statistics block to the given mutex. From then on,
+    every acquisition records whether it was contended, how long the caller
+    waited and how long the lock was held. The statistics block is freed by
+    mutex_destroy().
+
+    Calling this on a mutex that already has statistics only renames it.
+
+    \param  m               The mutex to profile
+    \param  name            Name to print the mutex under (not copied)
+    \retval 0               On success
+    \retval -1              On error, errno will be set as appropriate
+
+    \par    Error Conditions:
+    \em     EINVAL - the mutex is not valid \n
+    \em     ENOMEM - out of memory
+*/
+int mutex_stats_enable(mutex_t *m, const char *name) __nonnull_all;
+
+/** \brief  Print lock statistics.
+
+    This function prints a table of all mutexes that have statistics enabled,
+    in the same fashion as thd_pslist(): number of acquisitions, contended
+    acquisitions, total wait time and maximum hold time in microseconds.
+
+    \param  pf              Printf-like function to print with
+*/
+void mutex_stats_print(int (*pf)(const char *fmt, ...)) __nonnull_all;
+
+/** \brief  Reset lock statistics.
+
+    This function clears the counters of all mutexes that have statistics
+    enabled. The mutexes stay registered.
+*/
+void mutex_stats_reset(void);
+
 /** \cond */
 static inline void __mutex_scoped_cleanup(mutex_t **m) {
     if(*m)
@@ -22,6 +22,7 @@
 
 #include <kos/cdefs.h>
 #include <stdint.h>
+#include <stddef.h>
 __BEGIN_DECLS
 
 #include <sys/queue.h>
@@ -42,6 +43,10 @@ __BEGIN_DECLS
     \ingroup                        networking
 */
 
+/** \cond */
+struct net_pbuf;
+/** \endcond */
+
 /** \brief   Structure describing one usable network device.
     \ingroup networking_drivers
 
@@ -181,6 +186,25 @@ typedef struct knetif {
         \param  count       The number of addresses in list.
     */
     int (*if_set_mc)(struct knetif *self, const uint8_t *list, int count);
+
+    /** \brief  Queue several packets for transmission at once.
+
+        This is optional. Drivers that can hand the device a batch of frames
+        at a time should do so here, and only kick the hardware once for the
+        lot. The packets are only borrowed: a driver that needs them after it
+        returns must take a reference with net_pbuf_ref(). If this is NULL,
+        the stack calls if_tx for each packet, then if_tx_commit.
+
+        \param  self        The network device in question.
+        \param  pkts        The packets to transmit, starting at the Ethernet
+                            header.
+        \param  count       The number of packets in pkts.
+        \param  blocking    1 if we should block if needed, 0 otherwise.
+        \return             The number of packets queued (which may be less
+                            than count), or <0 on failure.
+    */
+    int (*if_tx_batch)(struct knetif *self, struct net_pbuf *const *pkts,
+                       int count, int blocking);
 } netif_t;
 
 /** \defgroup net_drivers_flags netif_t Flags
@@ -271,6 +295,212 @@ typedef struct ipv6_hdr_s {
     struct in6_addr dst_addr;       /**< \brief Destination IP address */
 } __packed ipv6_hdr_t;
 
+/***** net_pbuf.c *********************************************************/
+
+/** \defgroup networking_pbuf   Packet Buffers
+    \brief                      Reference counted buffers for packet data
+    \ingroup                    networking
+
+    Packet buffers let a packet move between the layers of the stack (and the
+    drivers) without being copied. Each one has some headroom in front of the
+    data, so that headers can be added to an outgoing packet in place, and a
+    reference count, so that a layer that needs to keep the packet around (a
+    socket's receive queue, or ARP while it waits for a reply) can just take a
+    reference to it.
+
+    Buffers of up to NET_PBUF_BUFSIZE bytes come from a fixed pool, which is
+    safe to use inside an interrupt. Larger buffers, or any buffers needed when
+    the pool is empty, are allocated on the heap, but only outside of an
+    interrupt. A few buffers in the pool are kept back for drivers to receive
+    into, with net_pbuf_alloc_rx().
+*/
+
+/** \brief   Number of buffers in the pool.
+    \ingroup networking_pbuf
+*/
+#define NET_PBUF_POOL_SIZE  64
+
+/** \brief   Number of pool buffers only net_pbuf_alloc_rx() hands out.
+    \ingroup networking_pbuf
+*/
+#define NET_PBUF_RX_RESERVE 16
+
+/** \brief   Size of each buffer in the pool, headroom included.
+    \ingroup networking_pbuf
+
+    Large enough for a full Ethernet frame, with its start aligned to a 32 byte
+    boundary, as the drivers need for DMA.
+*/
+#define NET_PBUF_BUFSIZE    1600
+
+/** \brief   Headroom to leave for an outgoing IPv4 packet.
+    \ingroup networking_pbuf
+
+    This is room for the Ethernet and IPv4 headers. Adding both to a buffer
+    allocated with this much headroom leaves the start of the frame aligned to
+    a 32 byte boundary.
+*/
+#define NET_PBUF_HEADROOM   34
+
+/** \brief   Packet buffer.
+    \ingroup networking_pbuf
+
+    \headerfile kos/net.h
+*/
+typedef struct net_pbuf {
+    /** \brief  Queue handle, for the layer holding the buffer */
+    TAILQ_ENTRY(net_pbuf) pkt_queue;
+
+    /** \brief  Start of the packet data */
+    uint8_t     *data;
+
+    /** \brief  Length of the packet data, in bytes */
+    size_t      len;
+
+    /** \brief  Start of the storage, aligned to a 32 byte boundary */
+    uint8_t     *buf;
+
+    /** \brief  Size of the storage, in bytes */
+    size_t      size;
+
+    /** \brief  Reference count */
+    int         refcnt;
+
+    /** \brief  Allocated from the heap, rather than the pool */
+    int         heap;
+
+    /** \brief  Scratch space, for the layer holding the buffer */
+    uint32_t    cb[12];
+} net_pbuf_t;
+
+/** \brief   Packet buffer statistics structure.
+    \ingroup networking_pbuf
+
+    A copy is counted every time the stack has to move packet data from one
+    buffer to another, other than to or from the buffers that the program
+    passes to the socket functions.
+
+    \headerfile kos/net.h
+*/
+typedef struct net_pbuf_stats {
+    uint32_t  pool_allocs;            /** \brief Buffers taken from the pool */
+    uint32_t  heap_allocs;            /** \brief Buffers allocated on the heap */
+    uint32_t  alloc_failed;           /** \brief Allocations that failed */
+    uint32_t  in_use;                 /** \brief Buffers allocated right now */
+    uint32_t  copies;                 /** \brief Packet data copies */
+    uint32_t  copy_bytes;             /** \brief Bytes of packet data copied */
+    uint32_t  rx_held;                /** \brief Received buffers queued as is */
+} net_pbuf_stats_t;
+
+/** \brief   Allocate a packet buffer.
+    \ingroup networking_pbuf
+
+    \param  headroom        Space to leave in front of the data, in bytes.
+    \param  len             Length of the data, in bytes.
+
+    \return                 The new buffer, with a reference count of 1, or
+                            NULL if none could be allocated.
+*/
+net_pbuf_t *net_pbuf_alloc(size_t headroom, size_t len);
+
+/** \brief   Allocate a packet buffer to receive a frame into.
+    \ingroup networking_pbuf
+
+    This is net_pbuf_alloc() for drivers. It may also use the last
+    NET_PBUF_RX_RESERVE buffers in the pool, which the rest of the stack
+    leaves alone, so that receiving doesn't stop when the stack is holding on
+    to a lot of buffers.
+
+    \param  headroom        Space to leave in front of the data, in bytes.
+    \param  len             Length of the data, in bytes.
+
+    \return                 The new buffer, with a reference count of 1, or
+                            NULL if none could be allocated.
+*/
+net_pbuf_t *net_pbuf_alloc_rx(size_t headroom, size_t len);
+
+/** \brief   Take another reference to a packet buffer.
+    \ingroup networking_pbuf
+
+    \param  pb              The buffer.
+
+    \return                 pb.
+*/
+net_pbuf_t *net_pbuf_ref(net_pbuf_t *pb);
+
+/** \brief   Drop a reference to a packet buffer.
+    \ingroup networking_pbuf
+
+    The buffer is freed once the last reference to it is dropped.
+
+    \param  pb              The buffer. May be NULL.
+*/
+void net_pbuf_free(net_pbuf_t *pb);
+
+/** \brief   Add space for a header in front of the data.
+    \ingroup networking_pbuf
+
+    \param  pb              The buffer.
+    \param  len             Size of the header, in bytes.
+
+    \return                 The new start of the data, or NULL if there isn't
+                            enough headroom.
+*/
+uint8_t *net_pbuf_push(net_pbuf_t *pb, size_t len);
+
+/** \brief   Remove a header from the front of the data.
+    \ingroup networking_pbuf
+
+    \param  pb              The buffer.
+    \param  len             Size of the header, in bytes.
+
+    \return                 The new start of the data, or NULL if the data is
+                            shorter than len.
+*/
+uint8_t *net_pbuf_pull(net_pbuf_t *pb, size_t len);
+
+/** \brief   Retrieve statistics about packet buffers.
+    \ingroup networking_pbuf
+
+    \return                 The net_pbuf_stats_t structure.
+*/
+net_pbuf_stats_t net_pbuf_get_stats(void);
+
+/***** net_loop.c *********************************************************/
+
+/** \defgroup networking_loop   Loopback
+    \brief                      Network device that receives what it sends
+    \ingroup                    networking_drivers
+
+    The loopback device ("lo") hands every frame sent on it back to the
+    network stack, as if it had gone out on the wire and come back. It has the
+    address 10.0.0.1/8, and speaks Ethernet (ARP included), so it can be used
+    to exercise and benchmark the whole stack with no network hardware at all.
+
+    To use it, register it with net_loop_init(), then bring up the stack with
+    net_init(0) (which means not passing INIT_NET to KOS_INIT_FLAGS(), as that
+    brings the stack up before main() is reached). If no other device is
+    found, it becomes the default device.
+
+    @{
+*/
+
+/** \brief   Register the loopback device.
+
+    \retval  0              On success.
+    \retval  -1             If the device could not be registered.
+*/
+int net_loop_init(void);
+
+/** \brief   Stop and unregister the loopback device.
+
+    \retval  0              On success.
+    \retval  -1             If the device was not registered.
+*/
+int net_loop_shutdown(void);
+
+/** @} */
+
 /***** net_arp.c **********************************************************/
 
 /** \defgroup networking_arp    ARP
@@ -311,23 +541,26 @@ int net_arp_insert(netif_t *nif, const uint8_t mac[6], const uint8_t ip[4],
 
     If no entry is found, then an ARP query will be sent and an error will be
     returned. If you specify a packet with the call, it will be sent when the
-    reply comes in.
+    reply comes in. Up to 8 packets are held for each address this way; past
+    that, the oldest ones are dropped.
 
     \param  nif             The network device in use.
     \param  ip_in           The IP address to lookup.
     \param  mac_out         Storage for the MAC address, if found.
-    \param  pkt             A simple IPv4 header, if you want to send one when a
-                            response comes in (if not found immediately).
-    \param  data            Packet data to go with the header.
-    \param  data_size       The size of data.
+    \param  pkt             An IPv4 packet, if you want to send one when a
+                            response comes in (if not found immediately). ARP
+                            takes its own reference to the buffer, which needs
+                            room for the Ethernet header in front of the data.
 
     \retval 0               On success.
-    \retval -1              A query is outstanding for that address.
-    \retval -2              Address not found, query generated.
+    \retval -1              A query is outstanding for that address (and no
+                            packet was given).
+    \retval -2              Address not found, query generated (and the packet
+                            queued, if one was given).
     \retval -3              Error allocating memory.
 */
 int net_arp_lookup(netif_t *nif, const uint8_t ip_in[4], uint8_t mac_out[6],
-                   const ip_hdr_t *pkt, const uint8_t *data, int data_size);
+                   net_pbuf_t *pkt);
 
 /** \brief   Do a reverse ARP lookup.
     \ingroup networking_arp
@@ -399,6 +632,38 @@ extern net_input_func net_input_target;
 */
 int net_input(netif_t *device, const uint8_t *data, int len);
 
+/** \brief   Submit a received packet held in a packet buffer.
+    \ingroup networking_drivers
+
+    This works like net_input(), except that the protocols that queue received
+    data may take a reference to the buffer instead of copying the data out of
+    it. The caller keeps its own reference, and drops it when done.
+
+    \param  device          The network device submitting packets.
+    \param  pb              The packet to submit.
+
+    \return                 0 on success, <0 on failure.
+*/
+int net_input_pbuf(netif_t *device, net_pbuf_t *pb);
+
+/** \brief   Submit a batch of received packets.
+    \ingroup networking_drivers
+
+    Drivers that pull several frames off the device at once should hand them
+    over with this, rather than one net_input_pbuf() call each. Anything the
+    stack sends in reply while handling the batch (ACKs, ARP replies and the
+    like) is held back and given to the device in one batch at the end. As
+    with net_input_pbuf(), the caller keeps its references to the packets.
+
+    \param  device          The network device submitting packets.
+    \param  pkts            The packets to submit.
+    \param  count           The number of packets in pkts.
+
+    \return                 The number of packets that were processed without
+                            error.
+*/
+int net_input_batch(netif_t *device, net_pbuf_t *const *pkts, int count);
+
 /** \brief   Setup a network input target.
     \ingroup networking_drivers
 
@@ -509,6 +774,12 @@ typedef struct net_ipv4_stats {
     uint32_t  pkt_recv_bad_size;      /** \brief Packets of a bad size */
     uint32_t  pkt_recv_bad_chksum;    /** \brief Packets with a bad checksum */
     uint32_t  pkt_recv_bad_proto;     /** \brief Packets with an unknown proto */
+    uint32_t  frag_recv;              /** \brief Fragments received */
+    uint32_t  frag_reasm_ok;          /** \brief Datagrams reassembled */
+    uint32_t  frag_reasm_timeout;     /** \brief Datagrams that timed out */
+    uint32_t  frag_reasm_evicted;     /** \brief Datagrams thrown out to make room */
+    uint32_t  frag_reasm_failed;      /** \brief Datagrams with bad fragments, or no memory */
+    uint32_t  frag_mem;               /** \brief Memory held by reassembly now */
 } net_ipv4_stats_t;
 
 /** \brief   Retrieve statistics from the IPv4 layer.
@@ -537,6 +808,43 @@ uint32_t __pure net_ipv4_address(const uint8_t addr[4]);
 */
 void net_ipv4_parse_address(uint32_t addr, uint8_t out[4]);
 
+/** \brief   Calculate an Internet checksum over a block of data.
+    \ingroup networking_ipv4
+
+    This is the one's complement sum used by IPv4, ICMP, UDP and TCP, as
+    described in RFC 1071. The data does not need to be aligned.
+
+    A checksum can be calculated over several blocks by passing the
+    complement of the result for one block as the start value for the next.
+    Every block but the last must be an even number of bytes long.
+
+    \param  data            The data to calculate over.
+    \param  bytes           The size of the data, in bytes.
+    \param  start           The sum to start with (0 for a new checksum).
+
+    \return                 The checksum (the complement of the sum), ready to
+                            be put in a header.
+*/
+uint16_t __pure net_ipv4_checksum(const uint8_t *data, size_t bytes,
+                                  uint16_t start);
+
+/** \brief   Copy a block of data, calculating its Internet checksum.
+    \ingroup networking_ipv4
+
+    This gives the same result as calling memcpy() and then
+    net_ipv4_checksum() on the destination, but when the source and
+    destination are aligned the same way, it only goes over the data once.
+
+    \param  dst             Where to copy the data to.
+    \param  src             The data to copy.
+    \param  bytes           The size of the data, in bytes.
+    \param  start           The sum to start with (0 for a new checksum).
+
+    \return                 The checksum of the data.
+*/
+uint16_t net_ipv4_checksum_copy(uint8_t *dst, const uint8_t *src, size_t bytes,
+                                uint16_t start);
+
 /***** net_icmp6.c ********************************************************/
 
 /** \defgroup networking_icmpv6     ICMPv6
@@ -736,7 +1044,8 @@ int net_ndp_init(void);
 void net_ndp_shutdown(void);
 
 /** \brief  Garbage collect timed out NDP entries.
-    This will be called periodically as NDP queries come in.
+    This goes through the whole cache. A few entries at a time are also looked
+    at as NDP queries come in, so there's normally no need to call this.
 */
 void net_ndp_gc(void);
 
@@ -754,7 +1063,8 @@ int net_ndp_insert(netif_t *nif, const uint8_t mac[6], const struct in6_addr *ip
 
     If no entry is found, then an NDP query will be sent and an error will be
     returned. If you specify a packet with the call, it will be sent when the
-    reply comes in.
+    reply comes in. Up to 8 packets are held for each address this way; past
+    that, the oldest ones are dropped.
 
     \param  net             The network device to use.
     \param  ip              The IPv6 address to query.
@@ -792,6 +1102,8 @@ typedef struct net_udp_stats {
     uint32_t  pkt_recv_bad_size;      /**< \brief Packets of a bad size */
     uint32_t  pkt_recv_bad_chksum;    /**< \brief Packets with a bad checksum */
     uint32_t  pkt_recv_no_sock;       /**< \brief Packets with to a closed port */
+    uint32_t  pkt_recv_dropped;       /**< \brief Packets dropped for lack of room on the socket */
+    uint32_t  pkt_recv_copied;        /**< \brief Packets copied to the heap, as the socket held its share of the pool */
 } net_udp_stats_t;
 
 /** \brief  Retrieve statistics from the UDP layer.
@@ -846,6 +1158,22 @@ void net_tcp_shutdown(void);
 */
 uint32_t __pure net_crc32le(const uint8_t *data, int size);
 
+/** \brief  Continue a "little-endian" CRC-32 over another block of data.
+
+    This allows calculating the CRC-32 of data that isn't all in memory at
+    once, such as a file read in chunks. It works the same as zlib's crc32():
+    pass 0 as the CRC for the first block, and the previous return value for
+    each one after that.
+
+    \param  crc             The CRC-32 of the data so far.
+    \param  data            The data to calculate over.
+    \param  size            The size of the data, in bytes.
+
+    \return                 The CRC-32 of all of the data so far.
+*/
+uint32_t __pure net_crc32le_update(uint32_t crc, const uint8_t *data,
+                                   size_t size);
+
 /** \brief  Calculate a "big-endian" CRC-32 over a block of data.
 
     \param  data            The data to calculate over.
@@ -968,6 +1296,28 @@ int net_reg_device(netif_t *device);
 */
 int net_unreg_device(netif_t *device);
 
+/** \brief   Most frames the stack holds back to send to a device at once.
+    \ingroup networking_drivers
+*/
+#define NET_TX_BATCH_MAX    16
+
+/** \brief   Send a batch of frames on a device.
+    \ingroup networking_drivers
+
+    The frames are handed to the device's if_tx_batch callback if it has one,
+    and to if_tx one at a time (followed by if_tx_commit) if not. This blocks
+    as needed for the device to take them. The caller keeps its references to
+    the packets.
+
+    \param  nif             The device to send on.
+    \param  pkts            The frames to send, starting at the Ethernet
+                            header.
+    \param  count           The number of frames in pkts.
+
+    \return                 The number of frames the device took.
+*/
+int net_tx_batch(netif_t *nif, net_pbuf_t *const *pkts, int count);
+
 /** \brief   Init network support.
     \ingroup networking_drivers
 
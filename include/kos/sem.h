@@ -27,6 +27,8 @@
 
 __BEGIN_DECLS
 
+#include <kos/waitqueue.h>
+
 /** \brief  Semaphore type.
 
     This structure defines a semaphore. There are no public members of this
@@ -37,11 +39,12 @@ __BEGIN_DECLS
 typedef struct semaphore {
     int initialized;    /**< \brief Are we initialized? */
     int count;          /**< \brief The semaphore count */
+    genwait_queue_t waiters; /**< \brief Threads waiting on the semaphore */
 } semaphore_t;
 
 /** \brief  Initializer for a transient semaphore.
     \param  value           The initial count of the semaphore. */
-#define SEM_INITIALIZER(value) { 1, value }
+#define SEM_INITIALIZER(value) { 1, value, GENWAIT_QUEUE_INITIALIZER }
 
 /** \brief  Initialize a semaphore for use.
 
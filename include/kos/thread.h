@@ -24,7 +24,6 @@
     \see    kos/tls.h
 
     \todo
-        - Remove deprecated thread mode API
         - Remove global extern pointer to current thread
 
     \author Megan Potter
@@ -137,6 +136,7 @@ LIST_HEAD(ktlist, kthread);
 #define THD_DETACHED    0x4  /**< \brief Thread is detached */
 #define THD_OWNS_STACK  0x8  /**< \brief Thread manages stack lifetime */
 #define THD_DISABLE_TLS 0x10 /**< \brief Thread does not use TLS variables */
+#define THD_STACK_PAINTED 0x20 /**< \brief Thread stack was painted at creation */
 /** @} */
 
 /** \brief Kernel thread flags type */
@@ -172,11 +172,14 @@ typedef struct __attribute__((aligned(32))) kthread {
     /** \brief  Thread list handle. Not a function. */
     LIST_ENTRY(kthread) t_list;
 
+    /** \brief  Thread ID hash handle. */
+    LIST_ENTRY(kthread) t_hash;
+
     /** \brief  Run/Wait queue handle. Once again, not a function. */
     TAILQ_ENTRY(kthread) thdq;
 
-    /** \brief  Timer queue handle (if applicable). Also not a function. */
-    TAILQ_ENTRY(kthread) timerq;
+    /** \brief  Position in the genwait timer heap (if applicable). */
+    size_t timer_idx;
 
     /** \brief  Kernel thread id. */
     tid_t tid;
@@ -187,6 +190,13 @@ typedef struct __attribute__((aligned(32))) kthread {
     /** \brief  Static priority: 0..PRIO_MAX (higher means lower priority). */
     prio_t real_prio;
 
+    /** \brief  Priority the thread was put in the run queue with, or -1 if
+                it is polling. */
+    prio_t rq_prio;
+
+    /** \brief  Ageing epoch at which the thread was put in the run queue. */
+    uint32_t rq_epoch;
+
     /** \brief  Thread flags. */
     kthread_flags_t flags;
 
@@ -205,6 +215,12 @@ typedef struct __attribute__((aligned(32))) kthread {
     */
     const char *wait_msg;
 
+    /** \brief  Embedded wait queue the thread sleeps on, if any.
+
+        \see    kos/genwait.h
+    */
+    struct genwait_queue *wait_queue;
+
     /** \brief  Poll callback.
 
         \param  data        A pointer passed to the polling function.
@@ -219,12 +235,18 @@ typedef struct __attribute__((aligned(32))) kthread {
     */
     uint64_t wait_timeout;
 
-    /** \brief Per-Thread CPU Time, in milliseconds. */
+    /** \brief Per-Thread CPU Time, in microseconds. */
     struct {
         uint64_t scheduled; /**< \brief time when the thread became active */
         uint64_t total;     /**< \brief total running CPU time for thread */
     } cpu_time;
 
+    /** \brief Number of times the thread was switched out. */
+    struct {
+        uint32_t voluntary;   /**< \brief blocked or yielded */
+        uint32_t involuntary; /**< \brief preempted from an interrupt */
+    } switches;
+
     /** \brief  Thread label.
 
         This value is used when printing out a user-readable process listing.
@@ -243,6 +265,9 @@ typedef struct __attribute__((aligned(32))) kthread {
     /** \brief  Size of the thread's stack, in bytes. */
     size_t stack_size;
 
+    /** \brief  Deepest stack usage seen at a context switch, in bytes. */
+    size_t stack_hwm;
+
     /** \brief  Thread errno variable. */
     int thd_errno;
 
@@ -265,6 +290,47 @@ typedef struct __attribute__((aligned(32))) kthread {
     void *rv;
 } kthread_t;
 
+/** \brief   Per-thread statistics.
+
+    This structure is filled in by thd_get_stats() and thd_snapshot().
+
+    \headerfile kos/thread.h
+*/
+typedef struct kthread_stats {
+    uint64_t cpu_time_us;           /**< \brief Total CPU time used, in us */
+    uint32_t voluntary_switches;    /**< \brief Times blocked or yielded */
+    uint32_t involuntary_switches;  /**< \brief Times preempted */
+    size_t stack_size;              /**< \brief Size of the stack, in bytes */
+
+    /** \brief  Deepest stack usage, in bytes.
+
+        This is exact if the stack was painted (see INIT_THD_STACK_PAINT), and
+        only the deepest point seen at a context switch otherwise.
+    */
+    size_t stack_used;
+    bool stack_painted;             /**< \brief Whether the stack was painted */
+} kthread_stats_t;
+
+/** \brief   Size of the label in a thread snapshot (including NULL terminator) */
+#define KTHREAD_SNAPSHOT_LABEL_SIZE 32
+
+/** \brief   Copy of the state of one thread.
+
+    This structure is filled in by thd_snapshot(). Unlike kthread_t, it can be
+    kept and looked at after the thread it describes has exited.
+
+    \headerfile kos/thread.h
+*/
+typedef struct kthread_snapshot {
+    tid_t tid;                  /**< \brief Thread ID */
+    prio_t prio;                /**< \brief Dynamic priority */
+    prio_t real_prio;           /**< \brief Static priority */
+    kthread_state_t state;      /**< \brief Process state */
+    kthread_flags_t flags;      /**< \brief Thread flags */
+    kthread_stats_t stats;      /**< \brief CPU time, switches and stack */
+    char label[KTHREAD_SNAPSHOT_LABEL_SIZE]; /**< \brief Truncated label */
+} kthread_snapshot_t;
+
 /** \brief   Thread creation attributes.
 
     This structure allows you to specify the various attributes for a thread to
@@ -300,16 +366,22 @@ typedef struct kthread_attr {
 
 /** \brief  kthread mode values
 
-    \deprecated
-    Only preemptive scheduling is still supported!
-
     The threading system will always be in one of the following modes. This
-    represents either pre-emptive scheduling or an un-initialized state.
+    represents either pre-emptive scheduling (with a periodic or an on-demand
+    timer tick) or an un-initialized state. Cooperative scheduling is no longer
+    supported.
+
+    In tickless mode, the scheduler only programs the primary timer for the
+    next event it actually has to handle: the end of the current timeslice when
+    other threads are waiting for the CPU, or the next genwait timeout
+    otherwise. This avoids waking up HZ times per second when every thread is
+    blocked or when a single thread is runnable.
 */
 typedef enum kthread_mode {
-    THD_MODE_NONE    = -1,  /**< \brief Threads not running */
-    THD_MODE_COOP    =  0,  /**< \brief Cooperative mode \deprecated */
-    THD_MODE_PREEMPT =  1   /**< \brief Preemptive threading mode */
+    THD_MODE_NONE     = -1, /**< \brief Threads not running */
+    THD_MODE_COOP     =  0, /**< \brief Cooperative mode \deprecated */
+    THD_MODE_PREEMPT  =  1, /**< \brief Preemptive mode, periodic tick */
+    THD_MODE_TICKLESS =  2  /**< \brief Preemptive mode, on-demand tick */
 } kthread_mode_t;
 
 /** \cond The currently executing thread -- Do not manipulate directly! */
@@ -672,9 +744,23 @@ struct _reent *thd_get_reent(kthread_t *thd);
     \param thd          The thead to retrieve the CPU time for.
 
     \retval             Total utilized CPU time in milliseconds.
+
+    \sa thd_get_cpu_time_us
 */
 uint64_t thd_get_cpu_time(kthread_t *thd);
 
+/** \brief       Retrieves the thread's elapsed CPU time in microseconds
+    \relatesalso kthread_t
+
+    Returns the amount of active CPU time the thread has consumed in
+    microseconds.
+
+    \param thd          The thead to retrieve the CPU time for.
+
+    \retval             Total utilized CPU time in microseconds.
+*/
+uint64_t thd_get_cpu_time_us(kthread_t *thd);
+
 /** \brief       Retrieves all thread's elapsed CPU time
     \relatesalso kthread_t
 
@@ -685,13 +771,36 @@ uint64_t thd_get_cpu_time(kthread_t *thd);
 */
 uint64_t thd_get_total_cpu_time(void);
 
-/** \brief   Change threading modes.
+/** \brief       Retrieves all thread's elapsed CPU time in microseconds
+    \relatesalso kthread_t
+
+    Returns the amount of active CPU time all threads have consumed in
+    microseconds.
+
+    \retval             Total utilized CPU time in microseconds.
+*/
+uint64_t thd_get_total_cpu_time_us(void);
+
+/** \brief       Retrieves a thread's statistics
+    \relatesalso kthread_t
+
+    This function fills in the CPU time, context switch counts and stack usage
+    of a thread.
+
+    \param thd          The thread to query. If NULL, the current thread
+                        will be used.
+    \param stats        Where to store the statistics.
+
+    \retval 0           On success.
+*/
+int thd_get_stats(kthread_t *thd, kthread_stats_t *stats);
 
-    This function changes the current threading mode of the system.
-    With preemptive threading being the only mode.
+/** \brief   Change threading modes.
 
-    \deprecated
-    This is now deprecated
+    This function switches the scheduler between periodic ticks
+    (THD_MODE_PREEMPT) and tickless operation (THD_MODE_TICKLESS). Tickless
+    mode can also be selected at startup with the INIT_THD_TICKLESS flag.
+    Requesting any other mode has no effect.
 
     \param  mode            One of the THD_MODE values.
 
@@ -699,20 +808,15 @@ uint64_t thd_get_total_cpu_time(void);
 
     \sa thd_get_mode
 */
-int thd_set_mode(kthread_mode_t mode) __deprecated;
+int thd_set_mode(kthread_mode_t mode);
 
 /** \brief   Fetch the current threading mode.
 
-    With preemptive threading being the only mode.
-
-    \deprecated
-    This is now deprecated.
-
     \return                 The current mode of the threading system.
 
     \sa thd_set_mode
 */
-kthread_mode_t thd_get_mode(void) __deprecated;
+kthread_mode_t thd_get_mode(void);
 
 /** \brief   Set the scheduler's frequency.
 
@@ -784,6 +888,32 @@ int thd_detach(kthread_t *thd);
 */
 int thd_each(int (*cb)(kthread_t *thd, void *user_data), void *data);
 
+/** \brief   Take a snapshot of all threads.
+
+    This function copies the state of up to \p count threads into \p buf.
+    Interrupts are only disabled for a small group of threads at a time rather
+    than for the whole walk, so the result is not an atomic picture: threads
+    created or destroyed during the call may or may not show up. The entries
+    are in no particular order.
+
+    \param  buf             Array to fill in.
+    \param  count           Number of entries in \p buf.
+
+    \return                 The number of entries filled in.
+
+    \sa thd_pslist, thd_get_count
+*/
+size_t thd_snapshot(kthread_snapshot_t *buf, size_t count);
+
+/** \brief   Retrieve the number of threads.
+
+    \return                 The number of threads currently alive, including
+                            the kernel's own threads.
+
+    \sa thd_snapshot
+*/
+size_t thd_get_count(void);
+
 /** \brief   Print a list of all threads using the given print function.
 
     Each thread is printed with its address, tid, priority level, flags,
@@ -794,6 +924,10 @@ int thd_each(int (*cb)(kthread_t *thd, void *user_data), void *data);
     initialization not spent in a thread (context switching, updating
     wait timeouts, etc).
 
+    The list is followed by the scheduler mode, the number of timer ticks
+    handled so far (along with the number a periodic tick would have needed)
+    and the number of reschedules.
+
     \param  pf              The printf-like function to print with.
 
     \retval 0               On success.
@@ -0,0 +1,45 @@
+/* KallistiOS ##version##
+
+   include/kos/waitqueue.h
+
+*/
+
+#ifndef __KOS_WAITQUEUE_H
+#define __KOS_WAITQUEUE_H
+
+/** \file    kos/waitqueue.h
+    \brief   Per-object wait queues.
+    \ingroup kthreads
+
+    This file defines the wait queue head that synchronization primitives embed
+    so that the generic wait system can keep their sleepers on a list of their
+    own, rather than in the shared hashed sleep queues. It is kept separate from
+    kos/genwait.h so that it can be used without pulling in kos/thread.h.
+
+    \see    kos/genwait.h
+*/
+
+#include <kos/cdefs.h>
+
+__BEGIN_DECLS
+
+#include <sys/queue.h>
+
+/* Forward declare kthread to not expose all of thread.h here */
+struct kthread;
+
+/** \brief  Wait queue head.
+
+    All members of this structure should be considered to be private. A wait
+    queue that is all zeroes (as with a static initializer) is valid and empty.
+
+    \headerfile kos/waitqueue.h
+*/
+typedef TAILQ_HEAD(genwait_queue, kthread) genwait_queue_t;
+
+/** \brief  Initializer for a wait queue head. */
+#define GENWAIT_QUEUE_INITIALIZER   { NULL, NULL }
+
+__END_DECLS
+
+#endif /* !__KOS_WAITQUEUE_H */
@@ -10,10 +10,18 @@
 
     This file contains the API to create and manage work queues.
 
-    A work queue is a thread that will execute tasks (aka. jobs) that are
-    enqueued by client code, at a predeterminated moment in time. Multiple
-    jobs can be enqueued. Once a job is executed, it is removed from the
-    execution queue.
+    A work queue is a pool of one or more threads that will execute tasks
+    (aka. jobs) that are enqueued by client code, at a predeterminated moment
+    in time. Multiple jobs can be enqueued. Once a job is executed, it is
+    removed from the execution queue.
+
+    Each worker thread of a pool has its own queue of ready jobs, ordered by
+    job priority. A worker runs the jobs of its own queue first, and steals
+    from the other workers' queues when it has nothing left to do. Jobs that
+    are set to execute later sit in a common timer list until they are due.
+
+    Jobs can be grouped in a batch with workqueue_enqueue_batch(), which
+    allows waiting for all of them to complete with workqueue_batch_wait().
 
     \author Paul Cercueil
 
@@ -28,11 +36,13 @@
 
 __BEGIN_DECLS
 
+#include <kos/cond.h>
 #include <kos/thread.h>
 #include <stdint.h>
 #include <sys/queue.h>
 
 struct workqueue;
+struct workqueue_batch;
 
 /** \struct  workqueue_t
     \brief   Opaque structure describing one work queue.
@@ -50,21 +60,64 @@ typedef struct workqueue_job {
                 If set to 0, the job will be set to execute immediately. */
     uint64_t time_ms;
 
+    /** \brief  Priority of the job among the jobs ready to execute.
+                Lower values run first; 0 is the default. */
+    int prio;
+
+    /** \brief  Batch the job belongs to. No need to set manually. */
+    struct workqueue_batch *batch;
+
     /** \brief  List handle. No need to set manually. */
-    STAILQ_ENTRY(workqueue_job) entry;
+    TAILQ_ENTRY(workqueue_job) entry;
+
+    /** \brief  Queue the job is in. No need to set manually. */
+    int queue;
 } workqueue_job_t;
 
+/** \struct  workqueue_batch_t
+    \brief   Structure describing a batch of jobs.
+
+    All members of this structure should be considered to be private.
+*/
+typedef struct workqueue_batch {
+    /** \brief  Number of jobs of the batch that have not completed yet. */
+    unsigned int pending;
+
+    /** \brief  Signaled when the last job completes. */
+    condvar_t done;
+} workqueue_batch_t;
+
+/** \brief  Initializer for a workqueue_batch_t. */
+#define WORKQUEUE_BATCH_INITIALIZER { 0, COND_INITIALIZER }
+
 /** \brief       Create a new work queue.
     \relatesalso workqueue_t
 
-    This function will create a new work queue.
+    This function will create a new work queue, with a single worker thread.
 
     \return                 The new work queue on success, NULL on failure.
 
-    \sa workqueue_destroy
+    \sa workqueue_create_pool, workqueue_destroy
 */
 workqueue_t *workqueue_create(void);
 
+/** \brief       Create a new work queue with a pool of worker threads.
+    \relatesalso workqueue_t
+
+    This function will create a new work queue, whose jobs are executed by
+    \p workers threads.
+
+    \param  workers         The number of worker threads (0 means 1).
+    \param  attr            Attributes of the worker threads, or NULL for
+                            the defaults.
+
+    \return                 The new work queue on success, NULL on failure.
+
+    \sa workqueue_create, workqueue_destroy
+*/
+workqueue_t *workqueue_create_pool(unsigned int workers,
+                                   const kthread_attr_t *attr);
+
 /** \brief       Destroy a work queue.
     \relatesalso workqueue_t
 
@@ -101,6 +154,42 @@ void workqueue_kill(workqueue_t *wq);
 */
 void workqueue_enqueue(workqueue_t *wq, workqueue_job_t *job);
 
+/** \brief       Enqueue a job to a work queue, as part of a batch.
+    \relatesalso workqueue_t
+
+    This function works like workqueue_enqueue(), but also adds the job to the
+    given batch, so that workqueue_batch_wait() waits for it to complete. A
+    batch must only be used with one work queue at a time.
+
+    \param  wq              A pointer to the work queue
+    \param  batch           A pointer to the batch
+    \param  job             A pointer to the job to enqueue
+
+    \sa workqueue_batch_wait
+*/
+void workqueue_enqueue_batch(workqueue_t *wq, workqueue_batch_t *batch,
+                             workqueue_job_t *job);
+
+/** \brief       Wait for all the jobs of a batch to complete.
+    \relatesalso workqueue_t
+
+    This function blocks until every job that was added to the batch has
+    completed or has been cancelled. It must not be called from one of the
+    work queue's own jobs.
+
+    \param  wq              A pointer to the work queue
+    \param  batch           A pointer to the batch
+    \param  timeout         The maximum time to wait, in milliseconds (0 for
+                            no limit)
+
+    \retval 0               On success
+    \retval -1              On timeout, errno will be set to ETIMEDOUT
+
+    \sa workqueue_enqueue_batch
+*/
+int workqueue_batch_wait(workqueue_t *wq, workqueue_batch_t *batch,
+                         unsigned int timeout);
+
 /** \brief       Cancel a job and remove it from the work queue.
     \relatesalso workqueue_t
 
@@ -120,7 +209,8 @@ void workqueue_cancel(workqueue_t *wq, workqueue_job_t *job);
 
     \param  wq              The workqueue whose thread should be returned.
 
-    \return                 A handle to the underlying thread.
+    \return                 A handle to the underlying thread (the first
+                            worker thread of a pool).
 */
 kthread_t *workqueue_get_thread(workqueue_t *wq);
 
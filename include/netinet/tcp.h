@@ -46,6 +46,9 @@ __BEGIN_DECLS
 */
 
 #define TCP_NODELAY             1 /**< \brief Don't delay to coalesce. */
+#define TCP_KEEPIDLE            4 /**< \brief Idle seconds before keepalives. */
+#define TCP_KEEPINTVL           5 /**< \brief Seconds between keepalives. */
+#define TCP_KEEPCNT             6 /**< \brief Keepalives before dropping. */
 
 /** @} */
 
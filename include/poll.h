@@ -97,6 +97,13 @@ int poll(struct pollfd fds[], nfds_t nfds, int timeout);
 
 /** @} */
 
+/* \cond */
+/* Deliver events on an fd to the threads blocked in poll() and to the epoll
+   instances watching it. Called by the handlers when an fd's state changes,
+   and with POLLNVAL when the fd is closed. */
+void __poll_event_trigger(int fd, short event);
+/* \endcond */
+
 __END_DECLS
 
 #endif /* !__POLL_H */
@@ -87,7 +87,7 @@ typedef union pthread_cond_t {
 
 #ifndef __PTHREAD_HAVE_RWLOCK_TYPE
 #define __PTHREAD_HAVE_RWLOCK_TYPE  1
-#define __PTHREAD_RWLOCK_SIZE       32
+#define __PTHREAD_RWLOCK_SIZE       48
 
 typedef union pthread_rwlock_t {
     rw_semaphore_t rwsem;
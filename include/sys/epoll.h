@@ -0,0 +1,134 @@
+/* KallistiOS ##version##
+
+   sys/epoll.h
+*/
+
+/** \file    sys/epoll.h
+    \brief   Event-driven readiness notification.
+    \ingroup threading_polling
+
+    This file contains an interface modelled on Linux's epoll. Unlike poll(),
+    the set of fds to watch is registered once with epoll_ctl(), and is kept
+    by the kernel between calls. Events are delivered to the instances that
+    watch the fd they happened on, which queue it on their ready list, so
+    epoll_wait() only has to look at the fds that may actually be ready.
+
+    An fd that is closed is removed from all the sets that it was in.
+*/
+
+#ifndef __SYS_EPOLL_H
+#define __SYS_EPOLL_H
+
+#include <sys/cdefs.h>
+#include <stdint.h>
+#include <poll.h>
+
+__BEGIN_DECLS
+
+/** \addtogroup threading_polling
+    @{
+*/
+
+/** \defgroup epoll_events  Events for epoll
+    \brief                  Masks representing event types for epoll
+
+    These are the same as the matching poll() events.
+
+    @{
+*/
+#define EPOLLIN         POLLIN      /**< \brief Data may be read */
+#define EPOLLRDNORM     POLLRDNORM  /**< \brief Normal data may be read */
+#define EPOLLRDBAND     POLLRDBAND  /**< \brief Priority data may be read */
+#define EPOLLPRI        POLLPRI     /**< \brief High-priority data may be read */
+#define EPOLLOUT        POLLOUT     /**< \brief Data may be written */
+#define EPOLLWRNORM     POLLWRNORM  /**< \brief Normal data may be written */
+#define EPOLLWRBAND     POLLWRBAND  /**< \brief Priority data may be written */
+#define EPOLLERR        POLLERR     /**< \brief Error has occurred */
+#define EPOLLHUP        POLLHUP     /**< \brief Peer disconnected */
+
+/** \brief  Report the fd once, then disable it until the next EPOLL_CTL_MOD */
+#define EPOLLONESHOT    (1U << 30)
+/** \brief  Report the fd only when an event arrives, rather than as long as
+            it stays ready */
+#define EPOLLET         (1U << 31)
+/** @} */
+
+/** \defgroup epoll_ops     Operations for epoll_ctl()
+    \brief                  What to do with the fd passed to epoll_ctl()
+
+    @{
+*/
+#define EPOLL_CTL_ADD   1   /**< \brief Add the fd to the set */
+#define EPOLL_CTL_DEL   2   /**< \brief Remove the fd from the set */
+#define EPOLL_CTL_MOD   3   /**< \brief Change the events of the fd */
+/** @} */
+
+/** \brief  Flag for epoll_create1(). Accepted, but has no effect. */
+#define EPOLL_CLOEXEC   0x0001
+
+/** \brief  User data attached to an fd in an epoll set. */
+typedef union epoll_data {
+    void *ptr;
+    int fd;
+    uint32_t u32;
+    uint64_t u64;
+} epoll_data_t;
+
+/** \brief  An fd's registration in an epoll set, or an event reported on it.
+    \headerfile sys/epoll.h
+*/
+struct epoll_event {
+    uint32_t events;        /**< \brief Events (see \ref epoll_events) */
+    epoll_data_t data;      /**< \brief Returned as is with each event */
+};
+
+/** \brief  Create an epoll instance.
+
+    \param  size        Ignored, other than it must be positive.
+    \return             A new fd for the instance, or -1 on error (with errno
+                        set as appropriate).
+*/
+int epoll_create(int size);
+
+/** \brief  Create an epoll instance.
+
+    \param  flags       0, or EPOLL_CLOEXEC.
+    \return             A new fd for the instance, or -1 on error (with errno
+                        set as appropriate).
+*/
+int epoll_create1(int flags);
+
+/** \brief  Add, modify or remove an fd in an epoll set.
+
+    An fd that is already ready when it is added or modified is reported by
+    the next epoll_wait().
+
+    \param  epfd        The epoll instance.
+    \param  op          What to do (see \ref epoll_ops).
+    \param  fd          The fd to act on.
+    \param  event       The events to watch and the data to report. Unused
+                        for EPOLL_CTL_DEL.
+    \retval 0           On success.
+    \retval -1          On error (with errno set to EBADF, EEXIST, EINVAL,
+                        ENOENT or ENOMEM).
+*/
+int epoll_ctl(int epfd, int op, int fd, struct epoll_event *event);
+
+/** \brief  Wait for events on an epoll set.
+
+    \param  epfd        The epoll instance.
+    \param  events      Where to store the events.
+    \param  maxevents   The size of events. Must be positive.
+    \param  timeout     Maximum amount of time to block, in milliseconds. Pass
+                        0 to not block and -1 to block until an event occurs.
+    \return             The number of events stored, 0 on timeout, or -1 on
+                        error (with errno set as appropriate).
+*/
+int epoll_wait(int epfd, struct epoll_event *events, int maxevents,
+               int timeout);
+
+/** @} */
+
+__END_DECLS
+
+#endif /* !__SYS_EPOLL_H */
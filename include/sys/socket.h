@@ -27,6 +27,10 @@
 
 __BEGIN_DECLS
 
+/** \cond */
+struct timespec;
+/** \endcond */
+
 /** \defgroup networking_sockets    Sockets
     \brief                          POSIX Sockets Interface for IPv4 and IPv6
                                     Address Families
@@ -87,6 +91,36 @@ struct sockaddr_storage {
     char _ss_pad2[_SS_PAD2SIZE];
 };
 
+/** \brief  Message header structure, for recvmsg() and sendmsg().
+    \headerfile sys/socket.h
+*/
+struct msghdr {
+    /** \brief  Address of the peer (optional). */
+    void         *msg_name;
+    /** \brief  Size of the address, in bytes. */
+    socklen_t     msg_namelen;
+    /** \brief  Array of buffers to scatter the data into or gather it from. */
+    struct iovec *msg_iov;
+    /** \brief  Number of elements in msg_iov. */
+    int           msg_iovlen;
+    /** \brief  Ancillary data (not supported, should be NULL). */
+    void         *msg_control;
+    /** \brief  Size of the ancillary data, in bytes. */
+    socklen_t     msg_controllen;
+    /** \brief  Flags on the received message (MSG_TRUNC, for instance). */
+    int           msg_flags;
+};
+
+/** \brief  Message structure, for recvmmsg() and sendmmsg() (non-standard).
+    \headerfile sys/socket.h
+*/
+struct mmsghdr {
+    /** \brief  The message itself. */
+    struct msghdr msg_hdr;
+    /** \brief  Number of bytes received or sent for this message. */
+    unsigned int  msg_len;
+};
+
 /** \brief  Datagram socket type.
 
     This socket type specifies that the socket in question transmits datagrams
@@ -171,6 +205,7 @@ struct sockaddr_storage {
 #define MSG_TRUNC       0x20    /**< \brief Normal data truncated (U) */
 #define MSG_WAITALL     0x40    /**< \brief Attempt to fill read buffer */
 #define MSG_DONTWAIT    0x80    /**< \brief Make this call non-blocking (non-standard) */
+#define MSG_WAITFORONE  0x100   /**< \brief Only block for the first message (recvmmsg() only, non-standard) */
 /** @} */
 
 /** \addtogroup networking_sockets
@@ -306,6 +341,51 @@ ssize_t recv(int socket, void *buffer, size_t length, int flags);
 ssize_t recvfrom(int socket, void *buffer, size_t length, int flags,
                  struct sockaddr *address, socklen_t *address_len);
 
+/** \brief  Receive a message on a socket, into several buffers.
+
+    This function works like recvfrom(), except that the data is scattered
+    into the buffers given in msg->msg_iov and the peer's address is stored
+    in msg->msg_name (if that isn't NULL). If a datagram didn't fit in the
+    buffers, MSG_TRUNC is set in msg->msg_flags and the rest of it is lost.
+
+    \param  socket      The socket to receive on.
+    \param  msg         The message header to fill in.
+    \param  flags       The type of message reception.
+
+    \return             On success, the number of bytes received. If no
+                        messages are available, and the socket has been shut
+                        down, 0. On error, -1, and sets errno as appropriate.
+*/
+ssize_t recvmsg(int socket, struct msghdr *msg, int flags);
+
+/** \brief  Receive several messages on a socket (non-standard).
+
+    This function receives up to vlen datagrams in one call, as if recvmsg()
+    were called for each element of msgvec, and stores the length of each
+    in its msg_len field. Protocols that support it (such as UDP) do this
+    without going through the socket layer for each message.
+
+    Unless MSG_DONTWAIT is given or the socket is non-blocking, this waits
+    until vlen messages have been received. With MSG_WAITFORONE, it only
+    waits for the first one, and then takes whatever else is already queued.
+
+    \param  socket      The socket to receive on.
+    \param  msgvec      The messages to fill in.
+    \param  vlen        The number of elements in msgvec.
+    \param  flags       The type of message reception.
+    \param  timeout     If not NULL, stop waiting for more messages once this
+                        much time has passed. As on other systems, this is
+                        only checked after each message is received, so it
+                        won't stop a wait for the first one.
+
+    \return             On success, the number of messages received (0 if the
+                        socket has been shut down). On error, -1, and sets
+                        errno as appropriate. If an error happens after some
+                        messages have been received, their number is returned.
+*/
+int recvmmsg(int socket, struct mmsghdr *msgvec, unsigned int vlen, int flags,
+             struct timespec *timeout);
+
 /** \brief  Send a message on a connected socket.
 
     This function sends messages to the peer on a connected socket.
@@ -339,6 +419,41 @@ ssize_t send(int socket, const void *message, size_t length, int flags);
 ssize_t sendto(int socket, const void *message, size_t length, int flags,
                const struct sockaddr *dest_addr, socklen_t dest_len);
 
+/** \brief  Send a message on a socket, from several buffers.
+
+    This function works like sendto(), except that the data is gathered from
+    the buffers given in msg->msg_iov and the peer's address is taken from
+    msg->msg_name (which should be NULL on a connected socket). On a datagram
+    socket, all of the buffers together make up one datagram.
+
+    \param  socket      The socket to send on.
+    \param  msg         The message to send.
+    \param  flags       The type of message transmission.
+
+    \return             On success, the number of bytes sent. On error, -1,
+                        and sets errno as appropriate.
+*/
+ssize_t sendmsg(int socket, const struct msghdr *msg, int flags);
+
+/** \brief  Send several messages on a socket (non-standard).
+
+    This function sends the vlen messages in msgvec in one call, as if
+    sendmsg() were called for each of them, and stores the number of bytes
+    sent for each in its msg_len field. Protocols that support it (such as
+    UDP) hand the whole lot to the network device together.
+
+    \param  socket      The socket to send on.
+    \param  msgvec      The messages to send.
+    \param  vlen        The number of elements in msgvec.
+    \param  flags       The type of message transmission.
+
+    \return             On success, the number of messages sent. On error, -1,
+                        and sets errno as appropriate. If an error happens
+                        after some messages have been sent, their number is
+                        returned.
+*/
+int sendmmsg(int socket, struct mmsghdr *msgvec, unsigned int vlen, int flags);
+
 /** \brief  Shutdown socket send and receive operations.
 
     This function closes a specific socket for the set of specified operations.
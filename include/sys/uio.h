@@ -10,8 +10,8 @@
     \ingroup vfs_posix
 
     This file contains definitions for vector I/O operations, as specified by
-    the POSIX 2008 specification. Full vector-based I/O is not supported for
-    file operations, but the stuff in here is still useful elsewhere.
+    the POSIX 2008 specification. readv() and writev() go through fs_readv()
+    and fs_writev(), which filesystems may implement natively.
 
     \author Lawrence Sebald
 */
@@ -20,6 +20,7 @@
 #define __SYS_UIO_H
 
 #include <sys/cdefs.h>
+#include <sys/types.h>
 #include <sys/syslimits.h>
 
 __BEGIN_DECLS
@@ -41,6 +42,24 @@ struct iovec {
 /** \brief  Old alias for the maximum length of an iovec. */
 #define UIO_MAXIOV IOV_MAX
 
+/** \brief  Read from a file into several buffers.
+
+    \param  fd      The file descriptor to read from.
+    \param  iov     The buffers to fill in turn.
+    \param  iovcnt  The number of buffers (at most IOV_MAX).
+    \return         The number of bytes read, or -1 on error.
+*/
+ssize_t readv(int fd, const struct iovec *iov, int iovcnt);
+
+/** \brief  Write to a file from several buffers.
+
+    \param  fd      The file descriptor to write into.
+    \param  iov     The buffers to write in turn.
+    \param  iovcnt  The number of buffers (at most IOV_MAX).
+    \return         The number of bytes written, or -1 on error.
+*/
+ssize_t writev(int fd, const struct iovec *iov, int iovcnt);
+
 /** @} */
 
 __END_DECLS
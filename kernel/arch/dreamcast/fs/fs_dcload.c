@@ -405,7 +405,11 @@ static vfs_handler_t vh = {
     NULL,               /* total64 */
     NULL,               /* readlink */
     fs_dcload_rewinddir,
-    NULL                /* fstat */
+    NULL,               /* fstat */
+    NULL,               /* readv */
+    NULL,               /* writev */
+    NULL,               /* pread64 */
+    NULL                /* pwrite64 */
 };
 
 /* We have to provide a minimal interface in case dcload usage is
@@ -658,7 +658,11 @@ static vfs_handler_t vh = {
     NULL,               /* total64 */
     NULL,               /* readlink */
     NULL,               /* rewinddir */
-    NULL                /* fstat */
+    NULL,               /* fstat */
+    NULL,               /* readv */
+    NULL,               /* writev */
+    NULL,               /* pread64 */
+    NULL                /* pwrite64 */
 };
 
 /* dbgio handler */
@@ -710,10 +714,10 @@ int fs_dclsocket_init(void) {
     /* Put dc-tool's info into our ARP cache */
     net_ipv4_parse_address(ip, ipaddr);
 
-    err = net_arp_lookup(net_default_dev, ipaddr, mac, NULL, NULL, 0);
+    err = net_arp_lookup(net_default_dev, ipaddr, mac, NULL);
 
     while(err == -1 || err == -2) {
-        err = net_arp_lookup(net_default_dev, ipaddr, mac, NULL, NULL, 0);
+        err = net_arp_lookup(net_default_dev, ipaddr, mac, NULL);
     }
 
     /* Make the entry permanent */
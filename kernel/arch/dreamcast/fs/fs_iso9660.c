@@ -39,6 +39,8 @@ ISO9660 systems, as these were used as references as well.
 #include <kos/opts.h>
 #include <kos/dbglog.h>
 #include <kos/limits.h>
+#include <kos/blockdev.h>
+#include <kos/blockcache.h>
 
 #include <stdbool.h>
 #include <stdlib.h>
@@ -50,6 +52,7 @@ ISO9660 systems, as these were used as references as well.
 #include <sys/queue.h>
 #include <errno.h>
 #include <sys/ioctl.h>
+#include <sys/uio.h>
 
 static int init_percd(void);
 static bool percd_done;
@@ -193,128 +196,106 @@ static uint32_t iso_733(const uint8_t *from) {
 
 
 /********************************************************************************/
-/* Low-level block caching routines. This implements a simple queue-based
-   LRU/MRU caching system. Whenever a block is requested, it will be placed
-   on the MRU end of the queue. As more blocks are loaded than can fit in
-   the cache, blocks are deleted from the LRU end. */
-
-/* Holds the data for one cache block, and a pointer to the next one.
-   As sectors are read from the disc, they are added to the front of
-   this cache. As the cache fills up, sectors are removed from the end
-   of it. */
-typedef struct {
-    uint8_t   *data;          /* Sector data */
-    uint32_t  sector;         /* CD sector */
-} cache_block_t;
+/* Low-level block caching routines. The disc is wrapped in a block device,
+   and inodes and data each get their own block cache on top of it, so that
+   reading a big file doesn't push the directory sectors out. */
 
-/* List of cache blocks (ordered least recently used to most recently) */
+/* Number of sectors in each of the caches */
 #define NUM_CACHE_BLOCKS 16
-static cache_block_t *icache[NUM_CACHE_BLOCKS];     /* inode cache */
-static cache_block_t *dcache[NUM_CACHE_BLOCKS];     /* data cache */
 
-static unsigned char *cache_data;
-static cache_block_t *caches;
+static kos_blockcache_t *icache;    /* inode cache */
+static kos_blockcache_t *dcache;    /* data cache */
+
+/* Set when a read finds out that the disc has changed */
+static bool cache_disc_changed;
 
 /* Cache modification mutex */
 static mutex_t cache_mutex;
 
-/* Clears all cache blocks */
-static void bclear_cache(cache_block_t **cache) {
-    mutex_lock_scoped(&cache_mutex);
-
-    for(size_t i = 0; i < NUM_CACHE_BLOCKS; i++)
-        cache[i]->sector = (uint32_t)-1;
-}
-
-/* Graduate a block from its current position to the MRU end of the cache */
-static void bgrad_cache(cache_block_t **cache, int block) {
-    cache_block_t   *tmp;
-
-    /* Don't try it with the end block */
-    if(block < 0 || block >= (NUM_CACHE_BLOCKS - 1)) return;
+static void iso_break_all(void);
+static void iso_abort_stream(bool lock);
 
-    /* Make a copy and scoot everything down */
-    tmp = cache[block];
+static kos_blockdev_t iso_inode_dev;
 
-    for(size_t i = block; i < (NUM_CACHE_BLOCKS - 1); i++)
-        cache[i] = cache[i + 1];
+/* Read sectors for one of the caches. Inode reads are done without holding
+   fh_mutex, so they have to take it to stop the stream; data reads already
+   hold it. */
+static int iso_bdev_read(const kos_blockdev_t *d, uint64_t block,
+                         size_t count, void *buf) {
+    int rv;
 
-    cache[NUM_CACHE_BLOCKS - 1] = tmp;
-}
+    iso_abort_stream(d == &iso_inode_dev);
 
-/* Pulls the requested sector into a cache block and returns the cache
-   block index. Note that the sector in question may already be in the
-   cache, in which case it just returns the containing block. */
-static void iso_break_all(void);
-static void iso_abort_stream(bool lock);
-static int bread_cache(cache_block_t **cache, uint32_t sector) {
-    int i, j, rv;
+    rv = cdrom_read_sectors_ex(buf, block + 150, count, true);
 
-    rv = -1;
-    mutex_lock(&cache_mutex);
+    if(rv != ERR_OK) {
+        if(rv == ERR_DISC_CHG || rv == ERR_NO_DISC)
+            cache_disc_changed = true;
 
-    /* Look for a pre-existing cache block */
-    for(i = NUM_CACHE_BLOCKS - 1; i >= 0; i--) {
-        if(cache[i]->sector == sector) {
-            bgrad_cache(cache, i);
-            rv = NUM_CACHE_BLOCKS - 1;
-            goto bread_exit;
-        }
+        errno = EIO;
+        return -1;
     }
 
-    /* If not, look for an open cache slot; if we find one, use it */
-    for(i = 0; i < NUM_CACHE_BLOCKS; i++) {
-        if(cache[i]->sector == (uint32_t)-1) break;
-    }
+    return 0;
+}
 
-    /* If we didn't find one, kick an LRU block out of cache */
-    if(i >= NUM_CACHE_BLOCKS) {
-        i = 0;
-    }
+static kos_blockdev_t iso_inode_dev = {
+    .l_block_size = 11,
+    .read_blocks = iso_bdev_read,
+};
 
-    iso_abort_stream(cache == icache);
-    // dbglog(DBG_DEBUG, "Stream stop for %s read\n", cache == icache ? "cached" : "inode");
+static kos_blockdev_t iso_data_dev = {
+    .l_block_size = 11,
+    .read_blocks = iso_bdev_read,
+};
 
-    /* Load the requested block */
-    j = cdrom_read_sectors_ex(cache[i]->data, sector + 150, 1, true);
+/* Pulls the requested sector into the cache, if it isn't there already, and
+   returns its data. */
+static uint8_t *bread_cache(kos_blockcache_t *cache, uint32_t sector) {
+    uint8_t *rv;
+    bool changed;
 
-    if(j != ERR_OK) {
-        //dbglog(DBG_ERROR, "fs_iso9660: can't read_sectors for %d: %d\n",
-        //  sector+150, j);
-        if(j == ERR_DISC_CHG || j == ERR_NO_DISC) {
-            init_percd();
-        }
+    mutex_lock(&cache_mutex);
 
-        rv = -1;
-        goto bread_exit;
-    }
+    rv = blockcache_read(cache, sector, 1);
+    changed = cache_disc_changed;
+    cache_disc_changed = false;
 
-    cache[i]->sector = sector;
+    mutex_unlock(&cache_mutex);
 
-    /* Move it to the most-recently-used position */
-    bgrad_cache(cache, i);
-    rv = NUM_CACHE_BLOCKS - 1;
+    /* This clears the caches, so it has to wait until we let go of them. */
+    if(changed)
+        init_percd();
 
-    /* Return the new cache block index */
-bread_exit:
-    mutex_unlock(&cache_mutex);
     return rv;
 }
 
 /* read data block */
-static inline int bdread(uint32_t sector) {
+static inline uint8_t *bdread(uint32_t sector) {
     return bread_cache(dcache, sector);
 }
 
 /* read inode block */
-static inline int biread(uint32_t sector) {
+static inline uint8_t *biread(uint32_t sector) {
     return bread_cache(icache, sector);
 }
 
 /* Clear both caches */
-static inline void bclear(void) {
-    bclear_cache(dcache);
-    bclear_cache(icache);
+static void bclear(void) {
+    mutex_lock_scoped(&cache_mutex);
+
+    blockcache_invalidate(dcache);
+    blockcache_invalidate(icache);
+}
+
+void iso_cache_stats(blockcache_stats_t *inode, blockcache_stats_t *data) {
+    mutex_lock_scoped(&cache_mutex);
+
+    if(inode)
+        blockcache_get_stats(icache, inode);
+
+    if(data)
+        blockcache_get_stats(dcache, data);
 }
 
 /********************************************************************************/
@@ -333,7 +314,8 @@ static iso_dirent_t root_dirent;
 /* Per-disc initialization; this is done every time it's discovered that
    a new CD has been inserted. */
 static int init_percd(void) {
-    int     i, blk;
+    int     i;
+    uint8_t *blk = NULL;
     cd_toc_t   toc;
 
     dbglog(DBG_NOTICE, "fs_iso9660: disc change detected\n");
@@ -359,10 +341,10 @@ static int init_percd(void) {
     for(i = 1; i <= 3; i++) {
         blk = biread(session_base + i + 16 - 150);
 
-        if(blk < 0) return blk;
+        if(!blk) return -1;
 
-        if(memcmp((char *)icache[blk]->data, "\02CD001", 6) == 0) {
-            joliet = isjoliet((char *)icache[blk]->data + 88);
+        if(memcmp((char *)blk, "\02CD001", 6) == 0) {
+            joliet = isjoliet((char *)blk + 88);
             dbglog(DBG_NOTICE, "  (joliet level %d extensions detected)\n", joliet);
 
             if(joliet) break;
@@ -374,16 +356,16 @@ static int init_percd(void) {
         /* Grab and check the volume descriptor */
         blk = biread(session_base + 16 - 150);
 
-        if(blk < 0) return i;
+        if(!blk) return -1;
 
-        if(memcmp((char*)icache[blk]->data, "\01CD001", 6)) {
+        if(memcmp((char*)blk, "\01CD001", 6)) {
             dbglog(DBG_ERROR, "fs_iso9660: disc is not iso9660\r\n");
             return -1;
         }
     }
 
     /* Locate the root directory */
-    memcpy(&root_dirent, icache[blk]->data + 156, sizeof(iso_dirent_t));
+    memcpy(&root_dirent, blk + 156, sizeof(iso_dirent_t));
     root_extent = iso_733(root_dirent.extent);
     root_size = iso_733(root_dirent.size);
 
@@ -432,7 +414,8 @@ static int fncompare(const char *isofn, int isosize, const char *normalfn) {
  */
 static iso_dirent_t *find_object(const char *fn, int dir,
                                  uint32_t dir_extent, uint32_t dir_size) {
-    int     i, c;
+    int     i;
+    uint8_t *blk;
     iso_dirent_t    *de;
 
     /* RockRidge */
@@ -453,13 +436,13 @@ static iso_dirent_t *find_object(const char *fn, int dir,
         utf2ucs(ucsname, (uint8_t *)fn);
 
     while(size_left > 0) {
-        c = biread(dir_extent);
+        blk = biread(dir_extent);
 
-        if(c < 0) return NULL;
+        if(!blk) return NULL;
 
         for(i = 0; i < 2048 && i < size_left;) {
             /* Locate the current dirent */
-            de = (iso_dirent_t *)(icache[c]->data + i);
+            de = (iso_dirent_t *)(blk + i);
 
             if(!de->length) break;
 
@@ -694,24 +677,16 @@ static int iso_stream_done(size_t *remain_size) {
     return cdrom_stream_progress(remain_size) != 1;
 }
 
-/* Read from a file */
-static ssize_t iso_read(void *h, void *buf, size_t bytes) {
+/* Read from a file at its current position. Assumes we hold fh_mutex. */
+static ssize_t iso_read_locked(iso_fd_t *fd, void *buf, size_t bytes) {
     int rv, c;
     size_t toread, thissect;
-    uint8_t *outbuf;
+    uint8_t *outbuf, *blk;
     size_t remain_size = 0, req_size;
     uint32_t sector;
-    iso_fd_t *fd = (iso_fd_t *)h;
-
-    /* Check that the fd is valid */
-    if(fd->first_extent == 0 || fd->broken) {
-        errno = EBADF;
-        return -1;
-    }
 
     rv = 0;
     outbuf = (uint8_t *)buf;
-    mutex_lock(&fh_mutex);
 
     /* Read zero or more sectors into the buffer from the current pos */
     while(bytes > 0) {
@@ -834,12 +809,12 @@ read_loop:
         }
         else {
             toread = (toread > thissect) ? thissect : toread;
-            c = bdread(sector);
+            blk = bdread(sector);
 
-            if(c < 0) {
+            if(!blk) {
                 goto read_error;
             }
-            memcpy(outbuf, dcache[c]->data + (fd->ptr % 2048), toread);
+            memcpy(outbuf, blk + (fd->ptr % 2048), toread);
         }
 
 end_loop:
@@ -850,15 +825,123 @@ end_loop:
         rv += toread;
     }
 
-    mutex_unlock(&fh_mutex);
     return rv;
 
 read_error:
     errno = EIO;
-    mutex_unlock(&fh_mutex);
     return -1;
 }
 
+/* Read from a file */
+static ssize_t iso_read(void *h, void *buf, size_t bytes) {
+    iso_fd_t *fd = (iso_fd_t *)h;
+
+    /* Check that the fd is valid */
+    if(fd->first_extent == 0 || fd->broken) {
+        errno = EBADF;
+        return -1;
+    }
+
+    mutex_lock_scoped(&fh_mutex);
+
+    return iso_read_locked(fd, buf, bytes);
+}
+
+/* Read from a file into several buffers, under one lock so that the stream
+   carries on from one buffer to the next. */
+static ssize_t iso_readv(void *h, const struct iovec *iov, int iovcnt) {
+    iso_fd_t *fd = (iso_fd_t *)h;
+    ssize_t rv, total = 0;
+    int i;
+
+    /* Check that the fd is valid */
+    if(fd->first_extent == 0 || fd->broken) {
+        errno = EBADF;
+        return -1;
+    }
+
+    mutex_lock_scoped(&fh_mutex);
+
+    for(i = 0; i < iovcnt; i++) {
+        rv = iso_read_locked(fd, iov[i].iov_base, iov[i].iov_len);
+
+        if(rv < 0)
+            return total ? total : -1;
+
+        total += rv;
+
+        if((size_t)rv < iov[i].iov_len)
+            break;
+    }
+
+    return total;
+}
+
+/* Read from a file at a given offset. The file pointer is left alone, and
+   the data comes from plain sector reads rather than from the stream. */
+static ssize_t iso_pread64(void *h, void *buf, size_t bytes, _off64_t offset) {
+    iso_fd_t *fd = (iso_fd_t *)h;
+    uint8_t *outbuf = (uint8_t *)buf, *blk;
+    size_t toread, thissect;
+    uint32_t sector, pos;
+    ssize_t rv = 0;
+    int c;
+
+    /* Check that the fd is valid */
+    if(fd->first_extent == 0 || fd->broken) {
+        errno = EBADF;
+        return -1;
+    }
+
+    if(offset >= fd->size)
+        return 0;
+
+    pos = (uint32_t)offset;
+
+    if(bytes > fd->size - pos)
+        bytes = fd->size - pos;
+
+    mutex_lock_scoped(&fh_mutex);
+
+    /* The drive can't serve sector reads in the middle of a stream. */
+    iso_abort_stream(false);
+
+    while(bytes > 0) {
+        thissect = 2048 - (pos % 2048);
+        sector = fd->first_extent + (pos / 2048);
+
+        /* Read whole sectors straight into the buffer when we can, and go
+           through the cache otherwise. */
+        if(thissect == 2048 && bytes >= 2048 && __is_aligned(outbuf, 32)) {
+            toread = bytes & ~2047;
+            c = cdrom_read_sectors_ex(outbuf, sector + 150, toread / 2048, true);
+
+            if(c) {
+                errno = EIO;
+                return rv ? rv : -1;
+            }
+        }
+        else {
+            toread = (bytes > thissect) ? thissect : bytes;
+            blk = bdread(sector);
+
+            if(!blk) {
+                errno = EIO;
+                return rv ? rv : -1;
+            }
+
+            memcpy(outbuf, blk + (pos % 2048), toread);
+        }
+
+        outbuf += toread;
+        pos += toread;
+        bytes -= toread;
+        rv += toread;
+    }
+
+    return rv;
+}
+
 /* Seek elsewhere in a file */
 static off_t iso_seek(void * h, off_t offset, int whence) {
     uint32_t old_ptr;
@@ -960,7 +1043,7 @@ static void fn_postprocess(char *fnin) {
 
 /* Read a directory entry */
 static const dirent_t *iso_readdir(void * h) {
-    int     c;
+    uint8_t *blk;
     iso_dirent_t    *de;
 
     /* RockRidge */
@@ -976,16 +1059,16 @@ static const dirent_t *iso_readdir(void * h) {
 
     /* Scan forwards until we find the next valid entry, an
        end-of-entry mark, or run out of dir size. */
-    c = -1;
+    blk = NULL;
     de = NULL;
 
     while(fd->ptr < fd->size) {
         /* Get the current dirent block */
-        c = biread(fd->first_extent + fd->ptr / 2048);
+        blk = biread(fd->first_extent + fd->ptr / 2048);
 
-        if(c < 0) return NULL;
+        if(!blk) return NULL;
 
-        de = (iso_dirent_t *)(icache[c]->data + (fd->ptr % 2048));
+        de = (iso_dirent_t *)(blk + (fd->ptr % 2048));
 
         if(de->length) break;
 
@@ -998,9 +1081,9 @@ static const dirent_t *iso_readdir(void * h) {
     /* If we're at the first, skip the two blank entries */
     if(!de->name[0] && de->name_len == 1) {
         fd->ptr += de->length;
-        de = (iso_dirent_t *)(icache[c]->data + (fd->ptr % 2048));
+        de = (iso_dirent_t *)(blk + (fd->ptr % 2048));
         fd->ptr += de->length;
-        de = (iso_dirent_t *)(icache[c]->data + (fd->ptr % 2048));
+        de = (iso_dirent_t *)(blk + (fd->ptr % 2048));
 
         if(!de->length) return NULL;
     }
@@ -1259,13 +1342,15 @@ static vfs_handler_t vh = {
     NULL,               /* total64 */
     NULL,               /* readlink */
     iso_rewinddir,
-    iso_fstat
+    iso_fstat,
+    iso_readv,
+    NULL,               /* writev */
+    iso_pread64,
+    NULL                /* pwrite64 */
 };
 
 /* Initialize the file system */
 void fs_iso9660_init(void) {
-    int i;
-
     /* Init the linked list */
     TAILQ_INIT(&iso_fd_queue);
 
@@ -1273,17 +1358,15 @@ void fs_iso9660_init(void) {
     mutex_init(&cache_mutex, MUTEX_TYPE_NORMAL);
     mutex_init(&fh_mutex, MUTEX_TYPE_NORMAL);
 
-    /* Allocate cache block space, properly aligned for DMA access */
-    cache_data = aligned_alloc(32, 2 * NUM_CACHE_BLOCKS * 2048);
-    caches = malloc(2 * NUM_CACHE_BLOCKS * sizeof(cache_block_t));
-
-    for(i = 0; i < NUM_CACHE_BLOCKS; i++) {
-        icache[i] = &caches[i * 2];
-        icache[i]->data = &cache_data[i * 2 * 2048];
-        icache[i]->sector = -1;
-        dcache[i] = &caches[i * 2 + 1];
-        dcache[i]->data = &cache_data[i * 2 * 2048 + 2048];
-        dcache[i]->sector = -1;
+    /* Allocate the caches, properly aligned for DMA access */
+    if(!(icache = blockcache_create(&iso_inode_dev, 1, NUM_CACHE_BLOCKS))) {
+        dbglog(DBG_ERROR, "fs_iso9660: can't allocate the inode cache\n");
+        goto out_mutex;
+    }
+
+    if(!(dcache = blockcache_create(&iso_data_dev, 1, NUM_CACHE_BLOCKS))) {
+        dbglog(DBG_ERROR, "fs_iso9660: can't allocate the data cache\n");
+        goto out_icache;
     }
 
     percd_done = false;
@@ -1294,16 +1377,29 @@ void fs_iso9660_init(void) {
 
     /* Register with VFS */
     nmmgr_handler_add(&vh.nmmgr);
+    return;
+
+out_icache:
+    blockcache_destroy(icache);
+    icache = NULL;
+out_mutex:
+    mutex_destroy(&cache_mutex);
+    mutex_destroy(&fh_mutex);
 }
 
 /* De-init the file system */
 void fs_iso9660_shutdown(void) {
+    /* Nothing to do if we never got going */
+    if(!dcache)
+        return;
+
     /* De-register with vblank */
     vblank_handler_remove(iso_vblank_hnd);
 
     /* Dealloc cache block space */
-    free(cache_data);
-    free(caches);
+    blockcache_destroy(icache);
+    blockcache_destroy(dcache);
+    icache = dcache = NULL;
 
     /* Free muteces */
     mutex_destroy(&cache_mutex);
@@ -851,7 +851,11 @@ static vfs_handler_t vh = {
     NULL,               /* total64 */
     NULL,               /* readlink */
     vmu_rewinddir,
-    vmu_fstat
+    vmu_fstat,
+    NULL,               /* readv */
+    NULL,               /* writev */
+    NULL,               /* pread64 */
+    NULL                /* pwrite64 */
 };
 
 int fs_vmu_init(void) {
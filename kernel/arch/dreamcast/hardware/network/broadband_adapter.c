@@ -425,16 +425,12 @@ static void bba_hw_shutdown(void) {
     asic_evt_remove_handler(ASIC_EVT_EXP_PCI);
 }
 
-#define RXBSZ    (64*1024) /* must be a power of two */
-#define MAX_PKTS (RXBSZ / 32)
-static struct pkt {
-    uint16_t pkt_size;
-    uint16_t offt;
-    uint8_t *rxbuff;
-} rx_pkt[MAX_PKTS];
+/* Received packets are DMA'd straight into packet buffers, which are handed
+   to the stack as is. The slot at rxin holds the buffer being filled, if any,
+   which is reused if the packet in it ends up being dropped. */
+#define MAX_PKTS 32
+static net_pbuf_t *rx_pkt[MAX_PKTS];
 
-static alignas(32) uint8_t rxbuff[RXBSZ + 2 * 1600];
-static uint32_t rxbuff_pos;
 static int rxin;
 static int rxout;
 static int dma_used;
@@ -522,14 +518,11 @@ static int bba_copy_packet(uint8_t *dst, uint32_t s, int len) {
     }
 }
 
-/* Compute the difference between the read head and the write head in a circular buffer */
-static inline unsigned int ptr_diff(const uint8_t *rd, const uint8_t *wr, size_t len) {
-    return (len + (uintptr_t)rd - (uintptr_t)wr) % len;
-}
-
 static int rx_enq(int ring_offset, size_t pkt_size) {
     size_t aligned_size;
     uint16_t offt;
+    net_pbuf_t *pb;
+    uint8_t *dst;
 
     /* If there's no one to receive it, don't bother. */
     if(!eth_rx_callback)
@@ -539,26 +532,21 @@ static int rx_enq(int ring_offset, size_t pkt_size) {
     aligned_size = __align_up(pkt_size + offt, 32);
 
     /* Do we have space for it? */
-    if(rxin != rxout
-       && ptr_diff(rx_pkt[rxout].rxbuff, &rxbuff[rxbuff_pos], RXBSZ) < aligned_size) {
+    if(!(pb = rx_pkt[rxin]) &&
+       !(pb = rx_pkt[rxin] = net_pbuf_alloc_rx(0, aligned_size))) {
         dbglog(DBG_WARNING, "No space in RX buffer\n");
         return -1;
     }
 
     /* Get a pointer to the receive buffer where we will store the packet */
-    rx_pkt[rxin].rxbuff = &rxbuff[rxbuff_pos];
+    dst = pb->buf;
     if(__is_defined(USE_P2_AREA))
-        rx_pkt[rxin].rxbuff = (void *)(((uintptr_t)rx_pkt[rxin].rxbuff) | MEM_AREA_P2_BASE);
-
-    rx_pkt[rxin].pkt_size = pkt_size;
-    rx_pkt[rxin].offt = offt;
+        dst = (void *)(((uintptr_t)dst) | MEM_AREA_P2_BASE);
 
-    rxbuff_pos += aligned_size;
-    if(rxbuff_pos >= RXBSZ)
-        rxbuff_pos = 0;
+    pb->data = dst + offt;
+    pb->len = pkt_size;
 
-    return bba_copy_packet(rx_pkt[rxin].rxbuff,
-                           rtl_mem + (ring_offset & ~0x1f), aligned_size);
+    return bba_copy_packet(dst, rtl_mem + (ring_offset & ~0x1f), aligned_size);
 }
 
 static int bba_link_is_stable(void *d) {
@@ -639,11 +627,33 @@ int bba_tx(const uint8_t *pkt, int len, int wait) {
     return res;
 }
 
+extern netif_t bba_if;
+static void bba_if_netinput(uint8_t *pkt, int pktsize);
+
 static void bba_rx_process(void) {
-    /* Call the callback to process it */
-    eth_rx_callback(rx_pkt[rxout].rxbuff + rx_pkt[rxout].offt, rx_pkt[rxout].pkt_size);
+    net_pbuf_t *pkts[MAX_PKTS];
+    int i, count = 0;
+
+    /* Take everything that has been received so far off the ring */
+    while(rxout != rxin) {
+        pkts[count++] = rx_pkt[rxout];
+        rx_pkt[rxout] = NULL;
+        rxout = (rxout + 1) % MAX_PKTS;
+    }
+
+    /* Call the callback to process them. The network stack gets the buffers
+       themselves, all in one go, so that it can hang on to them instead of
+       copying them, and send its replies back together. */
+    if(eth_rx_callback == bba_if_netinput) {
+        net_input_batch(&bba_if, pkts, count);
+    }
+    else {
+        for(i = 0; i < count; i++)
+            eth_rx_callback(pkts[i]->data, pkts[i]->len);
+    }
 
-    rxout = (rxout + 1) % MAX_PKTS;
+    for(i = 0; i < count; i++)
+        net_pbuf_free(pkts[i]);
 }
 
 static void bba_rx_worker(void *dummy) {
@@ -818,6 +828,8 @@ static int bba_if_init(netif_t *self) {
 }
 
 static int bba_if_shutdown(netif_t *self) {
+    int i;
+
     (void)self;
 
     if(!(bba_if.flags & NETIF_INITIALIZED))
@@ -825,6 +837,14 @@ static int bba_if_shutdown(netif_t *self) {
 
     bba_hw_shutdown();
 
+    /* Drop anything that was never processed */
+    for(i = 0; i < MAX_PKTS; i++) {
+        net_pbuf_free(rx_pkt[i]);
+        rx_pkt[i] = NULL;
+    }
+
+    rxin = rxout = 0;
+
     bba_if.flags &= ~(NETIF_INITIALIZED | NETIF_RUNNING);
     return 0;
 }
@@ -889,6 +909,32 @@ static int bba_if_tx(netif_t *self, const uint8_t *data, int len, int blocking)
     return 0;
 }
 
+/* Each of the RTL8139's TX descriptors starts sending as soon as its status
+   register is written, so there is no single doorbell for a whole batch. We
+   still only take the semaphore and check the link once for all of them. */
+static int bba_if_tx_batch(netif_t *self, net_pbuf_t *const *pkts, int count,
+                           int blocking) {
+    int i;
+
+    (void)self;
+
+    if(!(bba_if.flags & NETIF_RUNNING))
+        return -1;
+
+    if(__is_defined(TX_SEMA) && sem_wait_irqsafe(&tx_sema))
+        return -1;
+
+    for(i = 0; i < count; i++) {
+        if(bba_rtx(pkts[i]->data, pkts[i]->len, blocking) != BBA_TX_OK)
+            break;
+    }
+
+    if(__is_defined(TX_SEMA))
+        sem_signal(&tx_sema);
+
+    return i;
+}
+
 /* We'll auto-commit for now */
 static int bba_if_tx_commit(netif_t *self) {
     (void)self;
@@ -1050,6 +1096,7 @@ int bba_init(void) {
     bba_if.if_rx_poll = bba_if_rx_poll;
     bba_if.if_set_flags = bba_if_set_flags;
     bba_if.if_set_mc = bba_if_set_mc;
+    bba_if.if_tx_batch = bba_if_tx_batch;
 
     /* Attempt to set up our IP address et al from the flashrom */
     bba_set_ispcfg();
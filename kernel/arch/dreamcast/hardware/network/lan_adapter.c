@@ -444,38 +444,58 @@ static void la_hw_shutdown(void) {
 /* We don't really need these stats right now but we might want 'em later */
 static int total_pkts_rx = 0, total_pkts_tx = 0;
 
-/* Transmit a packet */
-/* Note that it's technically possible to queue up more than one packet
-   at a time for transmission, but this is the simple way. */
-static int la_tx(const uint8_t *pkt, int len, int blocking) {
-    int i, timeout;
-
-    (void)blocking;
+/* Size of the transmit buffer. Each packet in it is preceded by its length,
+   in two bytes. */
+#define LA_TX_BUF_SIZE  2048
 
-    assert_msg(la_started == LA_RUNNING, "la_tx called out of sequence");
+/* Most received packets handed to the stack at once */
+#define LA_RX_BATCH     8
 
-    /* Wait for queue to empty */
-    timeout = 50;
+/* Wait for the transmit queue to empty */
+static int la_tx_wait(void) {
+    int timeout = 50;
 
     while(BMPR10_PKTCNT(la_read(BMPR10)) > 0 && (--timeout) > 0)
         thd_sleep(2);
 
     if(timeout == 0) {
         dbglog(DBG_ERROR, "la_tx timed out waiting for previous tx\n");
-        return 0;
+        return -1;
     }
 
+    return 0;
+}
+
+/* Write a packet into the transmit buffer. Returns how much of the buffer it
+   took up. */
+static int la_tx_write(const uint8_t *pkt, int len) {
+    int i, size = len;
+
     /* Is the length less than the minimum? */
-    if(len < 0x60)
-        len = 0x60;
+    if(size < 0x60)
+        size = 0x60;
 
     /* Poke the length */
-    la_write(BMPR8, (len & 0x00ff));
-    la_write(BMPR8, (len & 0xff00) >> 8);
+    la_write(BMPR8, (size & 0x00ff));
+    la_write(BMPR8, (size & 0xff00) >> 8);
 
-    /* Write the packet */
-    for(i = 0; i < len; i++)
-        la_write(BMPR8, pkt[i]);
+    /* Write the packet, padding it with null bytes */
+    for(i = 0; i < size; i++)
+        la_write(BMPR8, i < len ? pkt[i] : 0);
+
+    return size + 2;
+}
+
+/* Transmit a packet */
+static int la_tx(const uint8_t *pkt, int len, int blocking) {
+    (void)blocking;
+
+    assert_msg(la_started == LA_RUNNING, "la_tx called out of sequence");
+
+    if(la_tx_wait() < 0)
+        return 0;
+
+    la_tx_write(pkt, len);
 
     /* Start the transmitter */
     thd_sleep(2);
@@ -486,18 +506,61 @@ static int la_tx(const uint8_t *pkt, int len, int blocking) {
     return 1;
 }
 
+/* Transmit as many packets as fit in the transmit buffer, and start the
+   transmitter once for all of them */
+static int la_tx_batch(net_pbuf_t *const *pkts, int count) {
+    int n, size, used = 0;
+
+    assert_msg(la_started == LA_RUNNING, "la_tx_batch called out of sequence");
+
+    if(la_tx_wait() < 0)
+        return -1;
+
+    for(n = 0; n < count && n < BMPR10_PKTCNT(~0); n++) {
+        size = (pkts[n]->len < 0x60 ? 0x60 : (int)pkts[n]->len) + 2;
+
+        if(n && used + size > LA_TX_BUF_SIZE)
+            break;
+
+        used += la_tx_write(pkts[n]->data, pkts[n]->len);
+    }
+
+    /* Start the transmitter */
+    thd_sleep(2);
+    la_write(BMPR10, n | BMPR10_TX);
+
+    total_pkts_tx += n;
+
+    return n;
+}
+
 static unsigned char current_pkt[1514];
 
+/* Hand a batch of received packets over to the stack */
+static void la_rx_deliver(net_pbuf_t *const *pkts, int count) {
+    int i;
+
+    net_input_batch(&la_if, pkts, count);
+
+    for(i = 0; i < count; i++)
+        net_pbuf_free(pkts[i]);
+}
+
 /* Check for received packets */
 static int la_rx(void) {
-    int i, status, len, count;
+    net_pbuf_t *pkts[LA_RX_BATCH];
+    net_pbuf_t *pb;
+    uint8_t *dst;
+    int i, status, len, count, rv, batched = 0;
 
     assert_msg(la_started == LA_RUNNING, "la_rx called out of sequence");
 
     for(count = 0; ; count++) {
         /* Is the buffer empty? */
-        if(la_read(DLCR5) & DLCR5_BUFEMP)
-            return count;
+        if(la_read(DLCR5) & DLCR5_BUFEMP) {
+            rv = count;
+            break;
+        }
 
         /* Get the receive status byte */
         status = la_read(BMPR8);
@@ -510,24 +573,53 @@ static int la_rx(void) {
         /* Check for errors */
         if((status & 0xF0) != 0x20) {
             dbglog(DBG_ERROR, "la_rx: receive error occurred (status %02x)\n", status);
-            return -1;
+            rv = -1;
+            break;
         }
 
         /* Read the packet */
         if(len > 1514) {
             dbglog(DBG_ERROR, "la_rx: big packet received (size %d)\n", len);
-            return -2;
+            rv = -2;
+            break;
+        }
+
+        /* Read it into a buffer of its own if there is one, so that it can be
+           handed over along with the others. Otherwise, use the static one,
+           after handing over the ones before it. */
+        if((pb = net_pbuf_alloc_rx(0, len))) {
+            dst = pb->data;
+        }
+        else {
+            la_rx_deliver(pkts, batched);
+            batched = 0;
+            dst = current_pkt;
         }
 
         for(i = 0; i < len; i++) {
-            current_pkt[i] = la_read(BMPR8);
+            dst[i] = la_read(BMPR8);
         }
 
         /* Submit it for processing */
-        net_input(&la_if, current_pkt, len);
+        if(!pb) {
+            net_input(&la_if, current_pkt, len);
+        }
+        else {
+            pkts[batched++] = pb;
+
+            if(batched == LA_RX_BATCH) {
+                la_rx_deliver(pkts, batched);
+                batched = 0;
+            }
+        }
 
         total_pkts_rx++;
     }
+
+    if(batched)
+        la_rx_deliver(pkts, batched);
+
+    return rv;
 }
 
 static void la_irq_hnd(uint32_t code, void *data) {
@@ -645,6 +737,16 @@ static int la_if_tx(netif_t *self, const uint8_t *data, int len, int blocking) {
     return NETIF_TX_OK;
 }
 
+static int la_if_tx_batch(netif_t *self, net_pbuf_t *const *pkts, int count,
+                          int blocking) {
+    (void)blocking;
+
+    if(!(self->flags & NETIF_RUNNING))
+        return NETIF_TX_ERROR;
+
+    return la_tx_batch(pkts, count);
+}
+
 /* We'll auto-commit for now */
 static int la_if_tx_commit(netif_t *self) {
     (void)self;
@@ -776,6 +878,7 @@ int la_init(void) {
     la_if.if_rx_poll = la_if_rx_poll;
     la_if.if_set_flags = la_if_set_flags;
     la_if.if_set_mc = la_if_set_mc;
+    la_if.if_tx_batch = la_if_tx_batch;
 
     /* Attempt to set up our IP address et al from the flashrom */
     la_set_ispcfg();
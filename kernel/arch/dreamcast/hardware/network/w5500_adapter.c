@@ -8,7 +8,6 @@
 #include <stdio.h>
 #include <string.h>
 #include <assert.h>
-#include <stdalign.h>
 
 #include <kos/net.h>
 #include <kos/thread.h>
@@ -506,12 +505,59 @@ static int w5500_tx(const uint8_t *pkt, int len, int blocking) {
     return 0;
 }
 
+/* Transmission of several packets. In MACRAW mode, each SEND command sends
+   one frame, so that still has to be done for every packet; but the link,
+   the free size and the write pointer are only read once for the lot. */
+static int w5500_tx_batch(net_pbuf_t *const *pkts, int count) {
+    uint16_t fsr, wr_ptr;
+    int n;
+
+    /* Check PHY Link */
+    if(w5500_wait_link(false) != 0) {
+        return -1;
+    }
+
+    fsr = w5500_read_reg16_safe(W5500_S0_REG_BLOCK, Sn_TX_FSR);
+    wr_ptr = w5500_read_reg16(W5500_S0_REG_BLOCK, Sn_TX_WR);
+
+    for(n = 0; n < count; n++) {
+        /* Check Free Size */
+        if(fsr < pkts[n]->len) {
+            if(!n)
+                dbglog(DBG_ERROR, "w5500: TX buffer full\n");
+
+            break;
+        }
+
+        /* Write Data */
+        w5500_write_buf(W5500_S0_TX_BLOCK, wr_ptr, pkts[n]->data,
+                        pkts[n]->len);
+
+        /* Update Write Pointer */
+        wr_ptr += pkts[n]->len;
+        fsr -= pkts[n]->len;
+        w5500_write_reg16(W5500_S0_REG_BLOCK, Sn_TX_WR, wr_ptr);
+
+        /* Issue Send Command */
+        if(w5500_exec_cmd(W5500_S0_REG_BLOCK, CR_SEND) < 0) {
+            break;
+        }
+    }
+
+    return n ? n : -1;
+}
+
+/* Most received packets handed to the stack at once */
+#define W5500_RX_BATCH  8
+
 static int w5500_rx_poll(netif_t *self) {
+    net_pbuf_t *pkts[W5500_RX_BATCH];
+    net_pbuf_t *pb;
     uint16_t rsr, rd_ptr, data_len;
     uint8_t head[2];
-    int i, work = 0;
-    uint16_t read_len;
-    uint8_t alignas(32) rx_pkt_buf[1600];
+    uint8_t dst_mac[6];
+    uint16_t read_len, peek_len;
+    int i, drop, count = 0;
 
     if(!(self->flags & NETIF_RUNNING))
         return 0;
@@ -519,31 +565,37 @@ static int w5500_rx_poll(netif_t *self) {
     /* Check Received Size */
     rsr = w5500_read_reg16_safe(W5500_S0_REG_BLOCK, Sn_RX_RSR);
 
-    if(rsr > 0) {
-        work = 1;
-        rd_ptr = w5500_read_reg16(W5500_S0_REG_BLOCK, Sn_RX_RD);
+    if(rsr == 0) {
+        w5500_wait_link(true);
+        return 0;
+    }
+
+    rd_ptr = w5500_read_reg16(W5500_S0_REG_BLOCK, Sn_RX_RD);
 
+    /* Read as many packets as have come in (up to a batch), and only tell the
+       chip that they're gone after the last one. */
+    while(rsr >= 2 && count < W5500_RX_BATCH) {
         /* Read 2-byte header (packet length) */
         w5500_read_buf(W5500_S0_RX_BLOCK, rd_ptr, head, 2);
         rd_ptr += 2;
 
         data_len = (head[0] << 8) | head[1];
 
-        if(data_len < 2) {
+        if(data_len < 2 || data_len > rsr) {
             /* Invalid size, skip */
             rd_ptr += data_len;
-            w5500_write_reg16(W5500_S0_REG_BLOCK, Sn_RX_RD, rd_ptr);
-            w5500_exec_cmd(W5500_S0_REG_BLOCK, CR_RECV);
-            return work;
+            break;
         }
+
+        rsr -= data_len;
         data_len -= 2; // Actual data length
 
         /* Peek at destination MAC to filter unwanted packets */
-        uint8_t dst_mac[6] = {0};
-        uint16_t peek_len = (data_len < 6) ? data_len : 6;
+        memset(dst_mac, 0, sizeof(dst_mac));
+        peek_len = (data_len < 6) ? data_len : 6;
         w5500_read_buf(W5500_S0_RX_BLOCK, rd_ptr, dst_mac, peek_len);
 
-        int drop = 0;
+        drop = 0;
         if(!(self->flags & NETIF_PROMISC)) {
             if((dst_mac[0] & 0x01) && (dst_mac[0] != 0xFF)) {
                 drop = 1;
@@ -556,34 +608,36 @@ static int w5500_rx_poll(netif_t *self) {
             }
         }
 
-        if(drop) {
-            rd_ptr += data_len;
-            w5500_write_reg16(W5500_S0_REG_BLOCK, Sn_RX_RD, rd_ptr);
-            w5500_exec_cmd(W5500_S0_REG_BLOCK, CR_RECV);
-            return work;
-        }
-
         /* Read Packet */
         read_len = data_len;
 
-        if(read_len > sizeof(rx_pkt_buf)) {
-            read_len = sizeof(rx_pkt_buf);
+        if(read_len > NET_PBUF_BUFSIZE) {
+            read_len = NET_PBUF_BUFSIZE;
         }
 
-        w5500_read_buf(W5500_S0_RX_BLOCK, rd_ptr, rx_pkt_buf, read_len);
+        if(!drop) {
+            if(!(pb = net_pbuf_alloc_rx(0, read_len))) {
+                dbglog(DBG_WARNING, "w5500: No space in RX buffer\n");
+            }
+            else {
+                w5500_read_buf(W5500_S0_RX_BLOCK, rd_ptr, pb->data, read_len);
+                pkts[count++] = pb;
+            }
+        }
 
         /* Advance pointer by full packet size (header + payload) */
         rd_ptr += data_len; // +2 was already added
-        w5500_write_reg16(W5500_S0_REG_BLOCK, Sn_RX_RD, rd_ptr);
-        w5500_exec_cmd(W5500_S0_REG_BLOCK, CR_RECV);
-
-        net_input(self, rx_pkt_buf, read_len);
-    }
-    else {
-        w5500_wait_link(true);
     }
 
-    return work;
+    w5500_write_reg16(W5500_S0_REG_BLOCK, Sn_RX_RD, rd_ptr);
+    w5500_exec_cmd(W5500_S0_REG_BLOCK, CR_RECV);
+
+    net_input_batch(self, pkts, count);
+
+    for(i = 0; i < count; i++)
+        net_pbuf_free(pkts[i]);
+
+    return 1;
 }
 
 /* RX Thread. Unfortunately, we need to use a polling mechanism
@@ -682,6 +736,16 @@ static int w5500_if_tx(netif_t *self, const uint8_t *data, int len, int blocking
     return NETIF_TX_OK;
 }
 
+static int w5500_if_tx_batch(netif_t *self, net_pbuf_t *const *pkts,
+                             int count, int blocking) {
+    (void)blocking;
+
+    if(!(self->flags & NETIF_RUNNING))
+        return NETIF_TX_ERROR;
+
+    return w5500_tx_batch(pkts, count);
+}
+
 static void w5500_update_mac_filter(netif_t *self) {
     uint8_t mode;
 
@@ -802,6 +866,7 @@ int w5500_adapter_init(const uint8_t *mac_addr, bool use_thread) {
     w5500_if.if_rx_poll = w5500_rx_poll;
     w5500_if.if_set_flags = w5500_if_set_flags;
     w5500_if.if_set_mc = w5500_if_set_mc;
+    w5500_if.if_tx_batch = w5500_if_tx_batch;
 
     if(mac_addr != NULL) {
         memcpy(w5500_if.mac_addr, mac_addr, 6);
@@ -110,6 +110,7 @@ int pvr_init(const pvr_init_params_t *params) {
     pvr_state.view_target = 0;
 
     pvr_state.list_reg_open = PVR_LIST_NONE;
+    pvr_state.list_streaming = PVR_LIST_NONE;
 
     // Sync all the hardware registers with our pipeline state.
     pvr_sync_view();
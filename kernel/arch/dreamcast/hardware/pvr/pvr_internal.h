@@ -109,6 +109,12 @@
    or ISP/TSP phases to take longer than one frame, they are allowed to expand
    into the next slot gracefully.
 
+   One list per scene may also skip the wait, and be streamed to the TA while
+   the SH4 is still writing it (see pvr_list_flush()). Its RAM buffer is then
+   used as a ring: each half is DMA'd to the TA once it's been filled, while
+   the SH4 writes into the other one. So that list's buffer only has to be big
+   enough to keep the DMA busy, rather than big enough for a whole frame.
+
  */
 
 /* Total number of OPBs. Matches the count of pvr_list_t elements */
@@ -128,6 +134,8 @@ typedef struct {
     uint8_t     *base[PVR_OPB_COUNT];  // DMA buffers, if assigned
     uint32_t    ptr[PVR_OPB_COUNT];    // DMA buffer write pointer, if used
     uint32_t    size[PVR_OPB_COUNT];   // DMA buffer sizes, or zero if none
+    uint32_t    flushed[PVR_OPB_COUNT]; // DMA buffer read pointer, if streamed
+    uint32_t    streamed;              // (1 << idx) for each list sent to the TA mid-scene
     int         ready;                 // >0 if these buffers are ready to be DMAed
 } pvr_dma_buffers_t;
 
@@ -161,6 +169,7 @@ typedef struct {
     uint32_t  lists_closed;             // (1 << idx) for each list which the SH4 has lost interest in
     uint32_t  lists_transferred;        // (1 << idx) for each list which has completely transferred to the TA
     uint32_t  lists_dmaed;              // (1 << idx) for each list which has been DMA'd (DMA mode only)
+    pvr_list_t  list_streaming;         // Which list is being streamed to the TA, if any? (DMA only)
 
     semaphore_t         dma_lock;       // Locked if a DMA is in progress (vertex or texture)
     int     ta_checked_ready;           // >0 if the TA has been checked to be ready for the new scene
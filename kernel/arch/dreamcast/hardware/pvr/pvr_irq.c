@@ -40,9 +40,10 @@ static void dma_next_list(void *thread) {
 
             /* If we are in PVR DMA mode, yet we haven't associated a
                RAM-residing vertex buffer with the current list
-               (because we submitted it directly, for example),
+               (because we submitted it directly, for example), or
+               it was already streamed to the TA during the scene,
                mark it as complete, so we skip trying to DMA it. */
-            if(!b->base[i]) {
+            if(!b->base[i] || (b->streamed & BIT(i))) {
                 pvr_state.lists_dmaed |= BIT(i);
                 continue;
             }
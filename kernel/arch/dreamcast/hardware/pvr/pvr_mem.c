@@ -8,40 +8,127 @@
 #include <assert.h>
 #include <dc/pvr.h>
 #include <stdio.h>
-
-#include <malloc.h> /* For the struct mallinfo defs */
+#include <stdlib.h>
+#include <string.h>
+#include <sys/queue.h>
 
 #include <kos/opts.h>
 #include <kos/dbglog.h>
+#include <kos/mutex.h>
 
 #include <arch/stack.h>
 
+#include "pvr_internal.h"
+
 /*
 
-This module basically serves as a KOS-friendly front end and support routines
-for the pvr_mem_core module, which is a dlmalloc-derived malloc for use with
-the PVR memory pool.
+This module manages the PVR texture RAM pool.
 
-I was originally going to make a totally separate thing that could be used
-to generically manage any memory pool, but then I realized what a gruelling
-and thankless task that would be when starting with dlmalloc, so we have this
-instead. ^_^;
+It used to be a front end for a dlmalloc-derived allocator working straight
+on top of texture RAM, which meant that every chunk header lived in VRAM, so
+each allocation and free went through a handful of slow, uncached accesses to
+it, and the pool fragmented over time with nothing to be done about it.
 
-*/
+Now, everything the allocator knows about the pool lives in main RAM: each
+block of VRAM, allocated or free, has a small descriptor in a list kept in
+address order (so that neighbours can be coalesced), and free blocks are also
+filed into two-level segregated free lists (the TLSF scheme), with bitmaps to
+find a big enough one in constant time. VRAM itself is only ever touched to
+move the contents of blocks around.
 
-/* Bring in some prototypes from pvr_mem_core.c */
-/* We can't directly include its header because of name clashes with
-   the real malloc header */
-extern void * pvr_int_malloc(size_t bytes);
-extern void pvr_int_free(void *ptr);
-extern struct mallinfo pvr_int_mallinfo(void);
-extern void pvr_int_mem_reset(void);
-extern void pvr_int_malloc_stats(void);
+On top of that, there are handles (pvr_mem_handle_t). A block allocated with
+pvr_mem_malloc() has a fixed address, since the caller keeps a raw pointer
+to it. A block behind a handle, on the other hand, may be moved about by
+pvr_mem_compact() to squeeze out the holes between blocks, and, if it's
+marked evictable, copied out to main RAM when VRAM runs short, in least
+recently used order. It's brought back into VRAM when it's next asked for.
 
+The PVR reads textures long after the scene using them was submitted, so a
+handle that was used (see pvr_mem_handle_ptr()) in one of the last few frames
+is never moved or evicted, and neither is a locked one.
+
+*/
 
 #include <kos/thread.h>
 #include <arch/arch.h>
 
+/* All blocks are aligned to (and a multiple of) this many bytes */
+#define PVR_MEM_ALIGN       32
+#define PVR_MEM_ALIGN_BITS  5
+
+/* Second level subdivisions of each power of two of free block sizes */
+#define SL_BITS     3
+#define SL_COUNT    (1 << SL_BITS)
+
+/* First level size classes: enough for 32 MiB of VRAM in 32-byte units */
+#define FL_COUNT    (20 - SL_BITS + 1)
+
+/* Buckets for looking up pvr_mem_malloc() blocks by address */
+#define PVR_MEM_HASH_SIZE   64
+
+/* Frames after its last use before a handle's block can be moved or evicted */
+#define PVR_MEM_IDLE_FRAMES 3
+
+/* Size of the bounce buffer used to move data around in VRAM */
+#define PVR_MEM_BOUNCE_SIZE 4096
+
+typedef struct mem_block {
+    /* All blocks, in address order */
+    TAILQ_ENTRY(mem_block)  phys;
+
+    /* Free list for free blocks; hash bucket for pvr_mem_malloc() blocks */
+    LIST_ENTRY(mem_block)   link;
+
+    uint32_t                addr;
+    uint32_t                size;
+    int                     free;
+
+    /* Owner of the block, or NULL if it's pinned (from pvr_mem_malloc()) */
+    struct pvr_mem_handle   *handle;
+} mem_block_t;
+
+struct pvr_mem_handle {
+    /* Block in VRAM, or NULL if evicted */
+    mem_block_t             *block;
+
+    /* Contents while evicted */
+    void                    *backing;
+
+    size_t                  size;
+    int                     flags;
+    int                     locks;
+    size_t                  last_used;
+
+    /* Resident handles, least recently used first */
+    TAILQ_ENTRY(pvr_mem_handle) lru;
+};
+
+static TAILQ_HEAD(block_list, mem_block) phys_list =
+    TAILQ_HEAD_INITIALIZER(phys_list);
+static LIST_HEAD(free_list, mem_block) free_lists[FL_COUNT][SL_COUNT];
+static LIST_HEAD(hash_list, mem_block) alloc_hash[PVR_MEM_HASH_SIZE];
+static TAILQ_HEAD(handle_list, pvr_mem_handle) lru_list =
+    TAILQ_HEAD_INITIALIZER(lru_list);
+
+static uint32_t fl_bitmap;
+static uint32_t sl_bitmap[FL_COUNT];
+
+/* Running totals, for the statistics */
+static size_t free_bytes;
+static size_t free_blocks;
+static size_t used_blocks;
+static size_t handles_resident;
+static size_t handles_evicted;
+static size_t evicted_bytes;
+static size_t evictions;
+static size_t restores;
+static size_t compactions;
+static size_t bytes_moved;
+
+static mutex_t pvr_mem_mutex = MUTEX_INITIALIZER;
+
+static uint32_t bounce[PVR_MEM_BOUNCE_SIZE / 4] __attribute__((aligned(32)));
+
 /* List of allocated memory blocks for leak checking */
 typedef struct memctl {
     uint32_t        size;
@@ -54,45 +141,364 @@ typedef struct memctl {
 static LIST_HEAD(memctl_list, memctl) block_list;
 
 
-/* PVR RAM base; NULL is considered invalid */
+/* PVR RAM base and size; NULL is considered invalid */
 static pvr_ptr_t pvr_mem_base = NULL;
-static pvr_ptr_t pvr_mem_sbrk = NULL;
-#define CHECK_MEM_SBRK \
-    assert_msg(pvr_mem_sbrk != NULL, \
+static size_t pvr_mem_size = 0;
+static int pvr_mem_valid = 0;
+#define CHECK_MEM_VALID \
+    assert_msg(pvr_mem_valid, \
                "pvr_mem_* used, but PVR hasn't been initialized yet")
 
-/* Used in pvr_mem_core.c */
-void *pvr_int_sbrk(size_t amt) {
-    uint32_t old, n;
+/* Work out the free list a block of the given size belongs in. */
+static void mapping_insert(uint32_t size, int *fl, int *sl) {
+    uint32_t units = size >> PVR_MEM_ALIGN_BITS;
+    int bit;
+
+    if(units < SL_COUNT) {
+        *fl = 0;
+        *sl = units;
+    }
+    else {
+        bit = 31 - __builtin_clz(units);
+        *sl = (units >> (bit - SL_BITS)) ^ SL_COUNT;
+        *fl = bit - SL_BITS + 1;
+    }
+}
+
+/* Work out the first free list whose blocks are all at least the given size,
+   so that any block found from there on up fits without searching. */
+static void mapping_search(uint32_t size, int *fl, int *sl) {
+    uint32_t units = size >> PVR_MEM_ALIGN_BITS;
+    int bit;
+
+    if(units >= SL_COUNT) {
+        bit = 31 - __builtin_clz(units);
+        size += ((1 << (bit - SL_BITS)) - 1) << PVR_MEM_ALIGN_BITS;
+    }
+
+    mapping_insert(size, fl, sl);
+}
+
+static void free_list_insert(mem_block_t *b) {
+    int fl, sl;
+
+    mapping_insert(b->size, &fl, &sl);
+    LIST_INSERT_HEAD(&free_lists[fl][sl], b, link);
+    fl_bitmap |= 1 << fl;
+    sl_bitmap[fl] |= 1 << sl;
+
+    b->free = 1;
+    free_bytes += b->size;
+    ++free_blocks;
+}
+
+static void free_list_remove(mem_block_t *b) {
+    int fl, sl;
+
+    mapping_insert(b->size, &fl, &sl);
+    LIST_REMOVE(b, link);
+
+    if(LIST_EMPTY(&free_lists[fl][sl])) {
+        sl_bitmap[fl] &= ~(1 << sl);
+
+        if(!sl_bitmap[fl])
+            fl_bitmap &= ~(1 << fl);
+    }
+
+    b->free = 0;
+    free_bytes -= b->size;
+    --free_blocks;
+}
+
+/* Find a free block of at least the given size, if there is one. */
+static mem_block_t *free_list_find(uint32_t size) {
+    uint32_t map;
+    int fl, sl;
+
+    mapping_search(size, &fl, &sl);
+
+    if(fl >= FL_COUNT)
+        return NULL;
+
+    map = sl_bitmap[fl] & (~0U << sl);
+
+    if(!map) {
+        map = fl_bitmap & (~0U << (fl + 1));
+
+        if(!map)
+            return NULL;
+
+        fl = __builtin_ctz(map);
+        map = sl_bitmap[fl];
+    }
+
+    sl = __builtin_ctz(map);
+
+    return LIST_FIRST(&free_lists[fl][sl]);
+}
+
+static inline unsigned int hash_addr(uint32_t addr) {
+    addr >>= PVR_MEM_ALIGN_BITS;
+    return (addr ^ (addr >> 6) ^ (addr >> 12)) % PVR_MEM_HASH_SIZE;
+}
+
+/* Put a block back on the free lists, merging it with its neighbours. */
+static void block_release(mem_block_t *b) {
+    mem_block_t *n;
+
+    b->handle = NULL;
+    --used_blocks;
+
+    n = TAILQ_PREV(b, block_list, phys);
+
+    if(n && n->free) {
+        free_list_remove(n);
+        n->size += b->size;
+        TAILQ_REMOVE(&phys_list, b, phys);
+        free(b);
+        b = n;
+    }
+
+    n = TAILQ_NEXT(b, phys);
+
+    if(n && n->free) {
+        free_list_remove(n);
+        b->size += n->size;
+        TAILQ_REMOVE(&phys_list, n, phys);
+        free(n);
+    }
+
+    free_list_insert(b);
+}
+
+/* Take a block of the given size from the free lists, splitting off the
+   remainder. */
+static mem_block_t *block_take(uint32_t size) {
+    mem_block_t *b, *rest;
+
+    if(!(b = free_list_find(size)))
+        return NULL;
+
+    /* The descriptor for the remainder has to come first, as there's no
+       undoing things if there isn't memory for it. */
+    if(b->size > size) {
+        if(!(rest = malloc(sizeof(mem_block_t))))
+            return NULL;
+
+        free_list_remove(b);
+
+        rest->addr = b->addr + size;
+        rest->size = b->size - size;
+        rest->handle = NULL;
+        b->size = size;
+        TAILQ_INSERT_AFTER(&phys_list, b, rest, phys);
+        free_list_insert(rest);
+    }
+    else {
+        free_list_remove(b);
+    }
+
+    ++used_blocks;
+
+    return b;
+}
+
+/* Copy data out of VRAM. It's read a longword at a time, since that's what
+   the bus handles best. */
+static void vram_read(void *dst, uint32_t src, size_t size) {
+    const volatile uint32_t *s = (const volatile uint32_t *)src;
+    uint32_t *d = (uint32_t *)dst;
+
+    for(size >>= 2; size; --size)
+        *d++ = *s++;
+}
+
+/* Move data down within VRAM, through the bounce buffer. Since the data only
+   ever moves down, reading each chunk before it's written is enough to make
+   overlapping moves work. */
+static void vram_move(uint32_t dst, uint32_t src, size_t size) {
+    size_t chunk;
+
+    bytes_moved += size;
+
+    while(size) {
+        chunk = size < PVR_MEM_BOUNCE_SIZE ? size : PVR_MEM_BOUNCE_SIZE;
+
+        vram_read(bounce, src, chunk);
+        pvr_sq_load((void *)dst, bounce, chunk, PVR_DMA_VRAM64);
+
+        src += chunk;
+        dst += chunk;
+        size -= chunk;
+    }
+}
+
+/* Can this handle's block be moved or evicted right now? */
+static inline int handle_idle(const struct pvr_mem_handle *h) {
+    return !h->locks &&
+           pvr_state.frame_count - h->last_used >= PVR_MEM_IDLE_FRAMES;
+}
+
+static void handle_touch(struct pvr_mem_handle *h) {
+    if(h->last_used == pvr_state.frame_count)
+        return;
+
+    h->last_used = pvr_state.frame_count;
+    TAILQ_REMOVE(&lru_list, h, lru);
+    TAILQ_INSERT_TAIL(&lru_list, h, lru);
+}
+
+/* Copy a handle's block out to main RAM and give the VRAM back. */
+static int handle_evict(struct pvr_mem_handle *h) {
+    if(!(h->backing = malloc(h->size)))
+        return -1;
+
+    vram_read(h->backing, h->block->addr, h->size);
+
+    block_release(h->block);
+    h->block = NULL;
+    TAILQ_REMOVE(&lru_list, h, lru);
+
+    --handles_resident;
+    ++handles_evicted;
+    evicted_bytes += h->size;
+    ++evictions;
+
+    return 0;
+}
+
+/* Slide every movable block down into the free space before it. */
+static void compact(void) {
+    mem_block_t *b, *hole, *n;
+
+    ++compactions;
+
+    TAILQ_FOREACH(b, &phys_list, phys) {
+        hole = TAILQ_PREV(b, block_list, phys);
+
+        if(b->free || !hole || !hole->free || !b->handle ||
+           !handle_idle(b->handle))
+            continue;
+
+        vram_move(hole->addr, b->addr, b->size);
+
+        /* Swap the block with the hole before it... */
+        free_list_remove(hole);
+        TAILQ_REMOVE(&phys_list, hole, phys);
+        b->addr = hole->addr;
+        hole->addr = b->addr + b->size;
+        TAILQ_INSERT_AFTER(&phys_list, b, hole, phys);
+
+        /* ...and merge the hole into whatever free space comes after. */
+        n = TAILQ_NEXT(hole, phys);
+
+        if(n && n->free) {
+            free_list_remove(n);
+            hole->size += n->size;
+            TAILQ_REMOVE(&phys_list, n, phys);
+            free(n);
+        }
+
+        free_list_insert(hole);
+    }
+}
+
+/* Allocate a block, making room for it if need be: first by compacting, if
+   there's enough free space in all and it's only in pieces, then by evicting
+   idle, evictable handles (least recently used first), compacting again once
+   those have freed up enough. */
+static mem_block_t *block_alloc(uint32_t size) {
+    struct pvr_mem_handle *h, *tmp;
+    mem_block_t *b;
+
+    if((b = block_take(size)))
+        return b;
+
+    if(free_bytes >= size) {
+        compact();
+
+        if((b = block_take(size)))
+            return b;
+    }
+
+    TAILQ_FOREACH_SAFE(h, &lru_list, lru, tmp) {
+        if(!(h->flags & PVR_MEM_EVICTABLE) || !handle_idle(h))
+            continue;
+
+        if(handle_evict(h) < 0)
+            break;
+
+        if((b = block_take(size)))
+            return b;
+
+        if(free_bytes >= size) {
+            compact();
+
+            if((b = block_take(size)))
+                return b;
+        }
+    }
+
+    return NULL;
+}
+
+/* Bring an evicted handle's contents back into VRAM. */
+static int handle_restore(struct pvr_mem_handle *h) {
+    mem_block_t *b;
+
+    if(!(b = block_alloc(h->size)))
+        return -1;
 
-    /* Are we valid? */
-    CHECK_MEM_SBRK;
+    b->handle = h;
+    h->block = b;
+
+    /* There's nothing to copy back if VRAM was reset while it was out. */
+    if(h->backing) {
+        pvr_sq_load((void *)b->addr, h->backing, h->size, PVR_DMA_VRAM64);
+        free(h->backing);
+        h->backing = NULL;
+    }
 
-    /* Try to increment it */
-    old = (uint32_t)pvr_mem_sbrk;
-    n = old + amt;
+    TAILQ_INSERT_TAIL(&lru_list, h, lru);
+
+    --handles_evicted;
+    evicted_bytes -= h->size;
+    ++handles_resident;
+    ++restores;
+
+    return 0;
+}
 
-    /* Did we run over? */
-    if(n > PVR_RAM_INT_TOP)
-        return (void *) - 1;
+static inline uint32_t block_size(size_t size) {
+    if(!size)
+        size = 1;
 
-    /* Nope, everything's cool */
-    pvr_mem_sbrk = (pvr_ptr_t)n;
-    return (pvr_ptr_t)old;
+    return __align_up(size, PVR_MEM_ALIGN);
 }
 
 /* Allocate a chunk of memory from texture space; the returned value
    will be relative to the base of texture memory (zero-based) */
 pvr_ptr_t __weak_symbol pvr_mem_malloc(size_t size) {
-    uint32_t rv32;
+    uint32_t rv32 = 0;
     memctl_t    *ctl;
+    mem_block_t *b;
 
-    CHECK_MEM_SBRK;
+    CHECK_MEM_VALID;
 
-    rv32 = (uint32_t)pvr_int_malloc(size);
-    assert_msg((rv32 & 0x1f) == 0,
-               "dlmalloc's alignment is broken; "
-               "please make a bug report");
+    if(size > pvr_mem_size)
+        return NULL;
+
+    {
+        mutex_lock_scoped(&pvr_mem_mutex);
+
+        if((b = block_alloc(block_size(size)))) {
+            rv32 = b->addr;
+            LIST_INSERT_HEAD(&alloc_hash[hash_addr(rv32)], b, link);
+        }
+    }
+
+    if(!rv32)
+        return NULL;
 
     if(__is_defined(PVR_KM_DBG)) {
         ctl = malloc(sizeof(memctl_t));
@@ -118,12 +524,16 @@ pvr_ptr_t __weak_symbol pvr_mem_malloc(size_t size) {
 void __weak_symbol pvr_mem_free(pvr_ptr_t chunk) {
     uint32_t    ra;
     memctl_t    *ctl, *tmp;
+    mem_block_t *b;
     int     found;
 
     if(__is_defined(PVR_KM_DBG))
         ra = arch_get_ret_addr();
 
-    CHECK_MEM_SBRK;
+    CHECK_MEM_VALID;
+
+    if(!chunk)
+        return;
 
     if(__is_defined(PVR_KM_DBG_VERBOSE)) {
         printf("Thread %d/%08lx freeing block @ %08lx\n",
@@ -150,7 +560,123 @@ void __weak_symbol pvr_mem_free(pvr_ptr_t chunk) {
         }
     }
 
-    pvr_int_free((void *)chunk);
+    mutex_lock_scoped(&pvr_mem_mutex);
+
+    LIST_FOREACH(b, &alloc_hash[hash_addr((uint32_t)chunk)], link) {
+        if(b->addr == (uint32_t)chunk) {
+            LIST_REMOVE(b, link);
+            block_release(b);
+            return;
+        }
+    }
+
+    dbglog(DBG_ERROR, "pvr_mem_free: %08lx isn't an allocated block\n",
+           (uint32_t)chunk);
+}
+
+pvr_mem_handle_t pvr_mem_handle_alloc(size_t size, int flags) {
+    struct pvr_mem_handle *h;
+    mem_block_t *b;
+
+    CHECK_MEM_VALID;
+
+    if(size > pvr_mem_size || !(h = malloc(sizeof(*h))))
+        return NULL;
+
+    h->size = block_size(size);
+    h->flags = flags;
+    h->locks = 0;
+    h->backing = NULL;
+    h->last_used = pvr_state.frame_count;
+
+    mutex_lock_scoped(&pvr_mem_mutex);
+
+    if(!(b = block_alloc(h->size))) {
+        free(h);
+        return NULL;
+    }
+
+    b->handle = h;
+    h->block = b;
+    TAILQ_INSERT_TAIL(&lru_list, h, lru);
+    ++handles_resident;
+
+    return h;
+}
+
+void pvr_mem_handle_free(pvr_mem_handle_t h) {
+    if(!h)
+        return;
+
+    CHECK_MEM_VALID;
+
+    {
+        mutex_lock_scoped(&pvr_mem_mutex);
+
+        if(h->block) {
+            TAILQ_REMOVE(&lru_list, h, lru);
+            block_release(h->block);
+            --handles_resident;
+        }
+        else {
+            free(h->backing);
+            --handles_evicted;
+            evicted_bytes -= h->size;
+        }
+    }
+
+    free(h);
+}
+
+pvr_ptr_t pvr_mem_handle_ptr(pvr_mem_handle_t h) {
+    CHECK_MEM_VALID;
+
+    mutex_lock_scoped(&pvr_mem_mutex);
+
+    if(!h->block && handle_restore(h) < 0)
+        return NULL;
+
+    handle_touch(h);
+
+    return (pvr_ptr_t)h->block->addr;
+}
+
+pvr_ptr_t pvr_mem_handle_lock(pvr_mem_handle_t h) {
+    CHECK_MEM_VALID;
+
+    mutex_lock_scoped(&pvr_mem_mutex);
+
+    if(!h->block && handle_restore(h) < 0)
+        return NULL;
+
+    ++h->locks;
+    handle_touch(h);
+
+    return (pvr_ptr_t)h->block->addr;
+}
+
+void pvr_mem_handle_unlock(pvr_mem_handle_t h) {
+    mutex_lock_scoped(&pvr_mem_mutex);
+
+    assert(h->locks > 0);
+    --h->locks;
+}
+
+int pvr_mem_handle_resident(pvr_mem_handle_t h) {
+    return h->block != NULL;
+}
+
+size_t pvr_mem_compact(void) {
+    size_t moved;
+
+    CHECK_MEM_VALID;
+
+    mutex_lock_scoped(&pvr_mem_mutex);
+
+    moved = bytes_moved;
+    compact();
+
+    return bytes_moved - moved;
 }
 
 /* Check the memory block list to see what's allocated */
@@ -164,49 +690,155 @@ void __weak_symbol pvr_mem_print_list(void) {
     LIST_FOREACH(ctl, &block_list, list) {
         printf("  unfreed block at %08lx size %lu, "
                "allocated by thread %d/%08lx\n",
-               (unsigned long)ctl->block, ctl->size, 
+               (unsigned long)ctl->block, ctl->size,
                ctl->thread, (unsigned long)ctl->addr);
     }
     printf("pvr_mem_print_list end block list\n");
 }
 
 /* Return the number of bytes available still in the memory pool */
-static size_t pvr_mem_available_int(void) {
-    struct mallinfo mi = pvr_int_mallinfo();
+size_t __weak_symbol pvr_mem_available(void) {
+    if(!pvr_mem_valid)
+        return 0;
 
-    /* This magic formula is modeled after mstats() */
-    return mi.arena - mi.uordblks;
+    return free_bytes;
 }
 
-size_t __weak_symbol pvr_mem_available(void) {
-    if(!pvr_mem_sbrk)
-        return 0;
+int pvr_mem_get_stats(pvr_mem_stats_t *stats) {
+    mem_block_t *b;
+    size_t largest = 0;
+
+    if(!pvr_mem_valid)
+        return -1;
+
+    mutex_lock_scoped(&pvr_mem_mutex);
 
-    return pvr_mem_available_int() + 
-        (PVR_RAM_INT_TOP - (size_t)pvr_mem_sbrk);
+    /* The largest free block is in the highest non-empty free list. */
+    if(fl_bitmap) {
+        int fl = 31 - __builtin_clz(fl_bitmap);
+        int sl = 31 - __builtin_clz(sl_bitmap[fl]);
+
+        LIST_FOREACH(b, &free_lists[fl][sl], link) {
+            if(b->size > largest)
+                largest = b->size;
+        }
+    }
+
+    stats->total = pvr_mem_size;
+    stats->free = free_bytes;
+    stats->largest_free = largest;
+    stats->free_blocks = free_blocks;
+    stats->used_blocks = used_blocks;
+    stats->fragmentation = free_bytes ?
+        100 - (unsigned int)((uint64_t)largest * 100 / free_bytes) : 0;
+    stats->handles_resident = handles_resident;
+    stats->handles_evicted = handles_evicted;
+    stats->evicted_bytes = evicted_bytes;
+    stats->evictions = evictions;
+    stats->restores = restores;
+    stats->compactions = compactions;
+    stats->bytes_moved = bytes_moved;
+
+    return 0;
+}
+
+/* Throw away every block descriptor. Handles that were resident are left
+   evicted, with nothing to restore. */
+static void pvr_mem_clear(void) {
+    mem_block_t *b;
+    int i, j;
+
+    while((b = TAILQ_FIRST(&phys_list))) {
+        TAILQ_REMOVE(&phys_list, b, phys);
+
+        if(b->handle) {
+            b->handle->block = NULL;
+            ++handles_evicted;
+            evicted_bytes += b->handle->size;
+        }
+
+        free(b);
+    }
+
+    TAILQ_INIT(&lru_list);
+
+    for(i = 0; i < FL_COUNT; i++) {
+        for(j = 0; j < SL_COUNT; j++)
+            LIST_INIT(&free_lists[i][j]);
+
+        sl_bitmap[i] = 0;
+    }
+
+    for(i = 0; i < PVR_MEM_HASH_SIZE; i++)
+        LIST_INIT(&alloc_hash[i]);
+
+    fl_bitmap = 0;
+    free_bytes = free_blocks = used_blocks = 0;
+    handles_resident = 0;
 }
 
 /* Reset the memory pool, equivalent to freeing all textures currently
    residing in RAM. This _must_ be done on a mode change, configuration
-   change, etc. */
-void __weak_symbol pvr_mem_reset(void) {    
-    if (pvr_mem_base != NULL) {
-        pvr_mem_sbrk = pvr_mem_base;
-        pvr_int_mem_reset();
-    } else {
-        pvr_mem_sbrk = NULL;
+   change, etc. Handles that are still around are left evicted, with
+   undefined contents. */
+void __weak_symbol pvr_mem_reset(void) {
+    mem_block_t *b;
+
+    mutex_lock_scoped(&pvr_mem_mutex);
+
+    pvr_mem_clear();
+    pvr_mem_valid = 0;
+
+    if(pvr_mem_base == NULL || !pvr_mem_size)
+        return;
+
+    if(!(b = malloc(sizeof(mem_block_t)))) {
+        dbglog(DBG_ERROR, "pvr_mem_reset: out of memory\n");
+        return;
     }
+
+    b->addr = (uint32_t)pvr_mem_base;
+    b->size = pvr_mem_size;
+    b->handle = NULL;
+    TAILQ_INSERT_TAIL(&phys_list, b, phys);
+    free_list_insert(b);
+
+    pvr_mem_valid = 1;
 }
 
 void __weak_symbol pvr_mem_initialize(pvr_ptr_t pvr_texture_base, size_t available_memory) {
-    (void)available_memory;
-    pvr_mem_base = pvr_texture_base;
+    /* Blocks are aligned relative to the base, so it has to be aligned. */
+    pvr_mem_base = (pvr_ptr_t)__align_up((uint32_t)pvr_texture_base,
+                                         PVR_MEM_ALIGN);
+    available_memory -= (uint32_t)pvr_mem_base - (uint32_t)pvr_texture_base;
+    pvr_mem_size = available_memory & ~(PVR_MEM_ALIGN - 1);
 }
 
 /* Print some statistics (like mallocstats) */
 void __weak_symbol pvr_mem_stats(void) {
+    pvr_mem_stats_t st;
+
     printf("pvr_mem_stats():\n");
-    pvr_int_malloc_stats();
-    printf("max sbrk base: %08lx\n", (uint32_t)pvr_mem_sbrk);
+
+    if(pvr_mem_get_stats(&st) < 0) {
+        printf("not initialized\n");
+        return;
+    }
+
+    printf("total bytes        = %10lu\n", (unsigned long)st.total);
+    printf("free bytes         = %10lu\n", (unsigned long)st.free);
+    printf("largest free block = %10lu\n", (unsigned long)st.largest_free);
+    printf("free/used blocks   = %10lu / %lu\n",
+           (unsigned long)st.free_blocks, (unsigned long)st.used_blocks);
+    printf("fragmentation      = %10u%%\n", st.fragmentation);
+    printf("handles in VRAM    = %10lu\n",
+           (unsigned long)st.handles_resident);
+    printf("handles evicted    = %10lu (%lu bytes)\n",
+           (unsigned long)st.handles_evicted,
+           (unsigned long)st.evicted_bytes);
+    printf("evictions/restores = %10lu / %lu\n",
+           (unsigned long)st.evictions, (unsigned long)st.restores);
+    printf("compactions        = %10lu (%lu bytes moved)\n",
+           (unsigned long)st.compactions, (unsigned long)st.bytes_moved);
     pvr_mem_print_list();
 }
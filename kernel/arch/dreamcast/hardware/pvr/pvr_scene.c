@@ -33,6 +33,8 @@
 
 */
 
+static void stream_wait(const uint8_t *start, const uint8_t *end);
+
 void *pvr_set_vertbuf(pvr_list_t list, void *buffer, size_t len) {
     void *oldbuf;
 
@@ -54,10 +56,12 @@ void *pvr_set_vertbuf(pvr_list_t list, void *buffer, size_t len) {
     // Write new values.
     pvr_state.dma_buffers[0].base[list] = (uint8_t *)buffer;
     pvr_state.dma_buffers[0].ptr[list] = 0;
+    pvr_state.dma_buffers[0].flushed[list] = 0;
     pvr_state.dma_buffers[0].size[list] = len / 2;
     pvr_state.dma_buffers[0].ready = 0;
     pvr_state.dma_buffers[1].base[list] = ((uint8_t *)buffer) + len / 2;
     pvr_state.dma_buffers[1].ptr[list] = 0;
+    pvr_state.dma_buffers[1].flushed[list] = 0;
     pvr_state.dma_buffers[1].size[list] = len / 2;
     pvr_state.dma_buffers[1].ready = 0;
 
@@ -74,6 +78,12 @@ void *pvr_vertbuf_tail(pvr_list_t list) {
     bufbase = pvr_state.dma_buffers[pvr_state.ram_target].base[list];
     assert(bufbase);
 
+    // If the list is being streamed, the rest of the buffer might still be
+    // on its way to the TA.
+    if(pvr_state.list_streaming == list)
+        stream_wait(bufbase + pvr_state.dma_buffers[pvr_state.ram_target].ptr[list],
+                    bufbase + pvr_state.dma_buffers[pvr_state.ram_target].size[list]);
+
     // Return the current end of the buffer.
     return bufbase + pvr_state.dma_buffers[pvr_state.ram_target].ptr[list];
 }
@@ -128,8 +138,12 @@ void pvr_scene_begin(void) {
     if(pvr_state.dma_mode) {
         for(i = 0; i < PVR_OPB_COUNT; i++) {
             pvr_state.dma_buffers[pvr_state.ram_target].ptr[i] = 0;
+            pvr_state.dma_buffers[pvr_state.ram_target].flushed[i] = 0;
         }
 
+        pvr_state.dma_buffers[pvr_state.ram_target].streamed = 0;
+        pvr_state.list_streaming = PVR_LIST_NONE;
+
         pvr_sync_stats(PVR_SYNC_BUFSTART);
     }
     else {
@@ -171,6 +185,142 @@ inline static bool pvr_list_uses_dma(pvr_list_t list) {
            pvr_state.dma_buffers[pvr_state.ram_target].base[list];
 }
 
+/* Vertex streaming
+
+   Rather than waiting for pvr_scene_finish(), one list at a time can be sent
+   to the TA while it's still being written, either because pvr_list_flush()
+   was called for it or because its buffer filled up. From then on its buffer
+   is a ring: as soon as half of it has been written, that part is DMA'd to the
+   TA, and writing carries on in the rest. The TA can only take one list at a
+   time, so the list stays open there until another list needs the TA or the
+   scene is finished, and nothing more can be added to it after that. */
+
+static const uint8_t list_eol[32];      /* All zeros, to end a list */
+static uint8_t *stream_lo, *stream_hi;  /* What's being DMA'd right now */
+
+static void stream_done(void *data) {
+    (void)data;
+
+    sem_signal((semaphore_t *)&pvr_state.dma_lock);
+}
+
+/* Wait for the DMA in progress, if it's reading from [start, end). */
+static void stream_wait(const uint8_t *start, const uint8_t *end) {
+    if(start < stream_hi && end > stream_lo) {
+        sem_wait((semaphore_t *)&pvr_state.dma_lock);
+        sem_signal((semaphore_t *)&pvr_state.dma_lock);
+        stream_lo = stream_hi = NULL;
+    }
+}
+
+/* Start DMAing whatever has been written to the list since the last time. */
+static void stream_ship(pvr_list_t list) {
+    volatile pvr_dma_buffers_t *b = pvr_state.dma_buffers + pvr_state.ram_target;
+    uint32_t start = b->flushed[list], end = b->ptr[list];
+
+    if(start == end)
+        return;
+
+    sem_wait((semaphore_t *)&pvr_state.dma_lock);
+
+    stream_lo = b->base[list] + start;
+    stream_hi = b->base[list] + end;
+    b->flushed[list] = end;
+
+    if(pvr_dma_load_ta(stream_lo, end - start, false, stream_done, NULL) < 0) {
+        stream_lo = stream_hi = NULL;
+        sem_signal((semaphore_t *)&pvr_state.dma_lock);
+    }
+}
+
+/* How much of the list to send to the TA at a time, once it's streamed. */
+static uint32_t stream_chunk(volatile pvr_dma_buffers_t *b, pvr_list_t list) {
+    uint32_t chunk = (b->size[list] / 2) & ~31;
+
+    return chunk ? chunk : b->size[list];
+}
+
+/* Append to the list being streamed, sending each half of the ring off as
+   soon as it's full. */
+static void stream_prim(pvr_list_t list, const uint8_t *data, size_t size) {
+    volatile pvr_dma_buffers_t *b = pvr_state.dma_buffers + pvr_state.ram_target;
+    uint32_t chunk = stream_chunk(b, list);
+    uint32_t n;
+
+    while(size) {
+        /* Go back to the start once the end has been sent. */
+        if(b->ptr[list] == b->size[list]) {
+            stream_ship(list);
+            b->ptr[list] = b->flushed[list] = 0;
+        }
+        else if(b->ptr[list] - b->flushed[list] >= chunk) {
+            stream_ship(list);
+        }
+
+        n = chunk - (b->ptr[list] - b->flushed[list]);
+
+        if(n > b->size[list] - b->ptr[list])
+            n = b->size[list] - b->ptr[list];
+
+        if(n > size)
+            n = size;
+
+        stream_wait(b->base[list] + b->ptr[list],
+                    b->base[list] + b->ptr[list] + n);
+        memcpy(b->base[list] + b->ptr[list], data, n);
+
+        b->ptr[list] += n;
+        data += n;
+        size -= n;
+    }
+
+    if(b->ptr[list] - b->flushed[list] >= chunk)
+        stream_ship(list);
+}
+
+/* Send the rest of the list being streamed, and end it. The TA is free for
+   something else once this returns. */
+static void stream_close(void) {
+    pvr_list_t list = pvr_state.list_streaming;
+
+    if(list == PVR_LIST_NONE)
+        return;
+
+    stream_prim(list, list_eol, sizeof(list_eol));
+    stream_ship(list);
+    stream_wait(stream_lo, stream_hi);
+
+    pvr_state.lists_closed |= BIT(list);
+    pvr_state.list_streaming = PVR_LIST_NONE;
+}
+
+/* Start streaming the list to the TA, if nothing else is using it. */
+static int stream_open(pvr_list_t list) {
+    volatile pvr_dma_buffers_t *b = pvr_state.dma_buffers + pvr_state.ram_target;
+
+    if(pvr_state.list_streaming == list)
+        return 0;
+
+    if(b->streamed & BIT(list)) {
+        dbglog(DBG_WARNING, "pvr_scene: list was already sent to the TA\n");
+        return -1;
+    }
+
+    if(pvr_state.list_reg_open != PVR_LIST_NONE && !pvr_list_dma) {
+        dbglog(DBG_WARNING, "pvr_scene: TA is busy with a direct list\n");
+        return -1;
+    }
+
+    stream_close();
+    pvr_start_ta_rendering();
+
+    b->streamed |= BIT(list);
+    b->flushed[list] = 0;
+    pvr_state.list_streaming = list;
+
+    return 0;
+}
+
 /* Begin collecting data for the given list type. Lists do not have to be
    submitted in any particular order, but all types of a list must be
    submitted at once. If the given list has already been closed, then an
@@ -189,6 +339,8 @@ int pvr_list_begin(pvr_list_t list) {
     pvr_list_dma = pvr_list_uses_dma(list);
 
     if(!pvr_list_dma) {
+        /* The TA can't take this list while it's taking a streamed one. */
+        stream_close();
         pvr_start_ta_rendering();
         sq_lock((void *)PVR_TA_INPUT);
     }
@@ -272,8 +424,28 @@ int pvr_list_prim(pvr_list_t list, const void *data, size_t size) {
     /* Ensure at least 4-byte alignment. */
     assert(!((uintptr_t)data & 0x3));
 
-    /* Ensure we won't overflow the vertex buffer. */
-    assert(b->ptr[list] + size <= b->size[list]);
+    if(pvr_state.list_streaming == list) {
+        stream_prim(list, data, size);
+        return 0;
+    }
+
+    if(b->streamed & BIT(list)) {
+        dbglog(DBG_WARNING, "pvr_list_prim: list was already sent to the TA\n");
+        return -1;
+    }
+
+    /* If it won't fit, start sending the list to the TA now so that the
+       buffer can be reused. */
+    if(b->ptr[list] + size > b->size[list]) {
+        if(stream_open(list) < 0) {
+            assert_msg(0, "vertex buffer overflow");
+            return -1;
+        }
+
+        stream_ship(list);
+        stream_prim(list, data, size);
+        return 0;
+    }
 
     memcpy(b->base[list] + b->ptr[list], data, size);
     b->ptr[list] += size;
@@ -282,10 +454,83 @@ int pvr_list_prim(pvr_list_t list, const void *data, size_t size) {
 }
 
 int pvr_list_flush(pvr_list_t list) {
-    (void)list;
+    volatile pvr_dma_buffers_t * b;
 
-    assert_msg(0, "not implemented yet");
-    return -1;
+    b = pvr_state.dma_buffers + pvr_state.ram_target;
+
+    /* Ensure we associated a DMA vertex buffer with this list type. */
+    assert(b->base[list]);
+
+    if(pvr_state.list_streaming != list) {
+        /* Nothing to send yet. */
+        if(!b->ptr[list])
+            return 0;
+
+        if(stream_open(list) < 0)
+            return -1;
+    }
+
+    stream_ship(list);
+
+    /* Start over at the beginning, if the end has been reached. */
+    if(b->ptr[list] == b->size[list])
+        b->ptr[list] = b->flushed[list] = 0;
+
+    return 0;
+}
+
+void *pvr_vertbuf_reserve(pvr_list_t list, size_t size) {
+    volatile pvr_dma_buffers_t * b;
+
+    b = pvr_state.dma_buffers + pvr_state.ram_target;
+
+    /* The common case: there's room, and nothing has been sent from it. The
+       list being streamed always has its streamed bit set, so this also
+       keeps it (and lists the TA is already done with) off the fast path. */
+    if(b->ptr[list] + size <= b->size[list] &&
+       !(b->streamed & BIT(list)))
+        return b->base[list] + b->ptr[list];
+
+    assert(b->base[list]);
+    assert(!(size & 31));
+
+    /* Anything but the list being streamed can't take more once it has been
+       sent to the TA. */
+    if(pvr_state.list_streaming != list && (b->streamed & BIT(list))) {
+        dbglog(DBG_WARNING, "pvr_scene: list was already sent to the TA\n");
+        return NULL;
+    }
+
+    if(size > b->size[list])
+        return NULL;
+
+    /* Out of room; send what's there to the TA to make some. */
+    if(pvr_state.list_streaming != list) {
+        if(stream_open(list) < 0)
+            return NULL;
+    }
+
+    /* It has to be contiguous, so skip the end of the ring if needed. */
+    if(b->ptr[list] + size > b->size[list]) {
+        stream_ship(list);
+        b->ptr[list] = b->flushed[list] = 0;
+    }
+
+    stream_wait(b->base[list] + b->ptr[list],
+                b->base[list] + b->ptr[list] + size);
+
+    return b->base[list] + b->ptr[list];
+}
+
+void pvr_vertbuf_commit(pvr_list_t list, size_t size) {
+    volatile pvr_dma_buffers_t * b;
+
+    b = pvr_state.dma_buffers + pvr_state.ram_target;
+    b->ptr[list] += size;
+
+    if(pvr_state.list_streaming == list &&
+       b->ptr[list] - b->flushed[list] >= stream_chunk(b, list))
+        stream_ship(list);
 }
 
 /* Call this after you have finished submitting all data for a frame; once
@@ -308,7 +553,8 @@ int pvr_scene_finish(void) {
                 continue;
 
             /* If any lists weren't used in this scene, submit blank ones now */
-            if(!(pvr_state.lists_closed & BIT(i))) {
+            if(!(pvr_state.lists_closed & BIT(i)) &&
+               !(b->streamed & BIT(i))) {
                 pvr_list_begin(i);
                 pvr_blank_polyhdr(i);
                 pvr_list_finish();
@@ -320,6 +566,19 @@ int pvr_scene_finish(void) {
             if(!b->base[i])
                 continue;
 
+            /* The list was streamed to the TA during the scene - end it, if
+               that's not been done already */
+            if(b->streamed & BIT(i)) {
+                stream_close();
+                continue;
+            }
+
+            /* No room left for the end of the list - stream it all now */
+            if(b->ptr[i] + 32 > b->size[i] && !stream_open(i)) {
+                stream_close();
+                continue;
+            }
+
             // Make sure there's at least one primitive in each.
             if(b->ptr[i] == 0) {
                 pvr_blank_polyhdr_buf(i, (pvr_poly_hdr_t*)(b->base[i]));
@@ -7,10 +7,14 @@
  */
 
 #include <assert.h>
+#include <stddef.h>
 #include <dc/pvr.h>
 #include <dc/sq.h>
 #include <kos/dbglog.h>
 #include <kos/regfield.h>
+#include <kos/mutex.h>
+#include <kos/thread.h>
+#include <stdlib.h>
 #include <string.h>
 #include "pvr_internal.h"
 
@@ -57,85 +61,72 @@ void pvr_txr_load(const void *src, pvr_ptr_t dst, size_t count) {
 
 /*
    Load texture data from an SH-4 buffer into PVR RAM, twiddling it
-   in the process.
+   in the process, one pixel at a time.
 
    This is a modified version of Vincent Penne's general twiddling
    function. The texture can be 16bpp, 8bpp, or 4bpp (i.e., paletted).
    The rectangle does not need to be a square (not tested with h>w, but
    this is just a matter of a rotation by PI/2 and UV swapping).
 
-   - w and h must be a power of 2
-   - flags must be a logical OR of the various texture loading
-     flags available:
-       PVR_TXRLOAD_4BPP, _8BPP, _16BPP, _32BPP (not supported yet)
-       PVR_TXRLOAD_VQ (not supported yet)
-       PVR_TXRLOAD_INVERT
+   It's only used for textures too small to be done in 32-byte blocks by
+   txr_twiddle_tiled().
 
 */
-void pvr_txr_load_ex(const void *src, pvr_ptr_t dst, uint32_t w, uint32_t h,
-                     uint32_t flags) {
-    uint32_t x, y, yout, min, mask, bpp, invert;
-
-    /* Make sure we're attempting something we can do */
-    switch(flags & PVR_TXRLOAD_FMT_MASK) {
-        case PVR_TXRLOAD_4BPP:
-            bpp = 4;
-            break;
-        case PVR_TXRLOAD_8BPP:
-            bpp = 8;
-            break;
-        case PVR_TXRLOAD_16BPP:
-            bpp = 16;
-            break;
-        default:
-            assert_msg(0, "Invalid format specifier in `flags'");
-            bpp = 8;
-    }
-
-    assert_msg(!(flags & PVR_TXRLOAD_VQ_LOAD), "VQ compression on the fly not supported yet");
-    invert = (flags & PVR_TXRLOAD_INVERT_Y) ? 1 : 0;
+static void txr_twiddle_slow(const void *src, pvr_ptr_t dst, uint32_t w,
+                             uint32_t h, uint32_t bpp, uint32_t invert) {
+    uint32_t x, y, yout, min, mask;
 
     min = MIN(w, h);
     mask = min - 1;
 
     switch(bpp) {
         case 4: {
-            uint8_t * pixels;
+            uint8_t * pixels, * r0, * r1;
             uint16_t * vtex;
             pixels = (uint8_t *) src;
             vtex = (uint16_t *)dst;
 
-            for(y = 0; y < h; y += 2) {
-                if(!invert)
-                    yout = y;
-                else
-                    yout = ((h - 1) - y);
+            /* Two rows go together, so flip the source rather than the
+               output when inverting. */
+            for(yout = 0; yout < h; yout += 2) {
+                if(!invert) {
+                    r0 = pixels + yout * w / 2;
+                    r1 = r0 + w / 2;
+                }
+                else {
+                    r0 = pixels + ((h - 1) - yout) * w / 2;
+                    r1 = r0 - w / 2;
+                }
 
                 for(x = 0; x < w; x += 2) {
                     vtex[TWIDOUT((x & mask) / 2, (yout & mask) / 2) +
                          (x / min + yout / min)*min * min / 4] =
-                             (pixels[(x + y * w) >> 1] & 15) | ((pixels[(x + (y + 1) * w) >> 1] & 15) << 4) |
-                             ((pixels[(x + y * w) >> 1] >> 4) << 8) | ((pixels[(x + (y + 1) * w) >> 1] >> 4) << 12);
+                             (r0[x >> 1] & 15) | ((r1[x >> 1] & 15) << 4) |
+                             ((r0[x >> 1] >> 4) << 8) | ((r1[x >> 1] >> 4) << 12);
                 }
             }
         }
         break;
         case 8: {
-            uint8_t * pixels;
+            uint8_t * pixels, * r0, * r1;
             uint16_t * vtex;
             pixels = (uint8_t *) src;
             vtex = (uint16_t *)dst;
 
-            for(y = 0; y < h; y += 2) {
-                if(!invert)
-                    yout = y;
-                else
-                    yout = ((h - 1) - y);
+            for(yout = 0; yout < h; yout += 2) {
+                if(!invert) {
+                    r0 = pixels + yout * w;
+                    r1 = r0 + w;
+                }
+                else {
+                    r0 = pixels + ((h - 1) - yout) * w;
+                    r1 = r0 - w;
+                }
 
                 for(x = 0; x < w; x++) {
                     vtex[TWIDOUT((yout & mask) / 2, x & mask) +
                          (x / min + yout / min)*min * min / 2] =
-                             pixels[y * w + x] | (pixels[(y + 1) * w + x] << 8);
+                             r0[x] | (r1[x] << 8);
                 }
             }
         }
@@ -162,6 +153,340 @@ void pvr_txr_load_ex(const void *src, pvr_ptr_t dst, uint32_t w, uint32_t h,
     }
 }
 
+/*
+   Tiled twiddling.
+
+   In twiddled order, each run of 32 bytes holds a small tile of the texture:
+   4x4 pixels at 16bpp, 4 wide by 8 high at 8bpp, and 8x8 at 4bpp. So rather
+   than working out where each pixel goes, the output is built 32 bytes at a
+   time: where the tile comes from is worked out once, and then it's put
+   together from its rows of the source with a fixed pattern, and written out
+   in one go, either straight through the store queues or into a buffer in
+   cache that's then sent with DMA.
+
+   Textures that aren't square are made of squares one after the other, each
+   of them twiddled on its own.
+
+*/
+
+/* Buffers for loading with DMA: one is filled while the other is sent. */
+#define TXR_CHUNK_SIZE      4096
+#define TXR_CHUNK_BLOCKS    (TXR_CHUNK_SIZE / 32)
+
+static uint32_t txr_chunks[2][TXR_CHUNK_SIZE / 4] __attribute__((aligned(32)));
+
+static mutex_t txr_mutex = MUTEX_INITIALIZER;
+static semaphore_t txr_dma_done = SEM_INITIALIZER(0);
+static bool txr_dma_pending;
+
+typedef struct {
+    const uint8_t *row0;        /* Source row of the first output row */
+    ptrdiff_t stride;           /* From one output row to the next, in src */
+    uint32_t bpp;
+    uint32_t block_shift;       /* log2 of the pixels in a 32-byte block */
+    uint32_t square_shift;      /* log2 of the pixels in a square */
+    uint32_t min_shift;         /* log2 of the side of a square */
+    bool wide;                  /* Squares go left to right, not downwards */
+    uint32_t blocks;            /* Total 32-byte blocks */
+} txr_twiddle_t;
+
+/* Take every other bit of v, from bit 0 up. */
+static inline uint32_t compact_bits(uint32_t v) {
+    v &= 0x55555555;
+    v = (v | (v >> 1)) & 0x33333333;
+    v = (v | (v >> 2)) & 0x0f0f0f0f;
+    v = (v | (v >> 4)) & 0x00ff00ff;
+    v = (v | (v >> 8)) & 0x0000ffff;
+
+    return v;
+}
+
+/* Find the source of the top left pixel of a block. */
+static inline const uint8_t *txr_block_src(const txr_twiddle_t *t,
+                                           uint32_t block) {
+    uint32_t p = block << t->block_shift;
+    uint32_t q = p & ((1 << t->square_shift) - 1);
+    uint32_t s = (p >> t->square_shift) << t->min_shift;
+    uint32_t x = compact_bits(q >> 1);
+    uint32_t y = compact_bits(q);
+
+    if(t->wide)
+        x += s;
+    else
+        y += s;
+
+    return t->row0 + (ptrdiff_t)y * t->stride + ((x * t->bpp) >> 3);
+}
+
+/* 4x4 pixels: two rows per longword, two longwords per 2x2 quad. */
+static inline void txr_block16(uint32_t *out, const uint8_t *src,
+                               ptrdiff_t stride) {
+    const uint16_t *r0 = (const uint16_t *)src;
+    const uint16_t *r1 = (const uint16_t *)(src + stride);
+    const uint16_t *r2 = (const uint16_t *)(src + 2 * stride);
+    const uint16_t *r3 = (const uint16_t *)(src + 3 * stride);
+
+    out[0] = r0[0] | ((uint32_t)r1[0] << 16);
+    out[1] = r0[1] | ((uint32_t)r1[1] << 16);
+    out[2] = r2[0] | ((uint32_t)r3[0] << 16);
+    out[3] = r2[1] | ((uint32_t)r3[1] << 16);
+    out[4] = r0[2] | ((uint32_t)r1[2] << 16);
+    out[5] = r0[3] | ((uint32_t)r1[3] << 16);
+    out[6] = r2[2] | ((uint32_t)r3[2] << 16);
+    out[7] = r2[3] | ((uint32_t)r3[3] << 16);
+}
+
+/* 4x8 pixels: each longword is a 2x2 quad. */
+static inline void txr_block8(uint32_t *out, const uint8_t *src,
+                              ptrdiff_t stride) {
+    const uint8_t *r0, *r1;
+    int i;
+
+    for(i = 0; i < 8; i++) {
+        r0 = src + (((i & 1) << 1) | (i & 4)) * stride + (i & 2);
+        r1 = r0 + stride;
+
+        out[i] = r0[0] | (r1[0] << 8) | (r0[1] << 16) |
+                 ((uint32_t)r1[1] << 24);
+    }
+}
+
+/* 8x8 pixels: each longword is a 2x4 column, from one byte of four rows. */
+static inline void txr_block4(uint32_t *out, const uint8_t *src,
+                              ptrdiff_t stride) {
+    const uint8_t *r;
+    uint32_t b0, b1, b2, b3;
+    int i;
+
+    for(i = 0; i < 8; i++) {
+        r = src + ((i & 2) << 1) * stride + ((i & 1) | ((i & 4) >> 1));
+        b0 = r[0];
+        b1 = r[stride];
+        b2 = r[2 * stride];
+        b3 = r[3 * stride];
+
+        out[i] = (b0 & 15) | ((b1 & 15) << 4) |
+                 ((b0 >> 4) << 8) | ((b1 >> 4) << 12) |
+                 ((b2 & 15) << 16) | ((b3 & 15) << 20) |
+                 ((b2 >> 4) << 24) | ((b3 >> 4) << 28);
+    }
+}
+
+/* Build count blocks, starting with the given one. If sq is set, out is a
+   store queue, which is flushed after each block. */
+static void txr_twiddle_blocks(const txr_twiddle_t *t, uint32_t *out,
+                               uint32_t first, uint32_t count, bool sq) {
+    const uint8_t *src;
+    uint32_t end = first + count;
+
+    for(; first < end; first++, out += 8) {
+        src = txr_block_src(t, first);
+
+        switch(t->bpp) {
+            case 4:
+                txr_block4(out, src, t->stride);
+                break;
+            case 8:
+                txr_block8(out, src, t->stride);
+                break;
+            default:
+                txr_block16(out, src, t->stride);
+                break;
+        }
+
+        if(sq)
+            sq_flush(out);
+    }
+}
+
+static void txr_dma_cb(void *data) {
+    sem_signal(&txr_dma_done);
+
+    /* The last transfer of a non-blocking load lets go of the DMA. */
+    if(data)
+        sem_signal((semaphore_t *)data);
+}
+
+/* Wait for the last DMA transfer to finish, if there is one. Called with
+   txr_mutex held. */
+static void txr_dma_wait(void) {
+    if(txr_dma_pending) {
+        sem_wait(&txr_dma_done);
+        txr_dma_pending = false;
+    }
+}
+
+static void txr_twiddle_sq(const txr_twiddle_t *t, pvr_ptr_t dst) {
+    uint32_t *sq;
+
+    sq = sq_lock((void *)(((uintptr_t)dst & 0xffffff) | PVR_TA_TEX_MEM));
+    txr_twiddle_blocks(t, sq, 0, t->blocks, true);
+    sq_wait();
+    sq_unlock();
+}
+
+static void txr_twiddle_dma(const txr_twiddle_t *t, pvr_ptr_t dst,
+                            bool block) {
+    semaphore_t *lock = (semaphore_t *)&pvr_state.dma_lock;
+    uint8_t *out = (uint8_t *)dst;
+    uint32_t first, count;
+    bool last;
+    int cur = 0;
+
+    sem_wait(lock);
+
+    for(first = 0; first < t->blocks; first += count, cur ^= 1) {
+        count = MIN(t->blocks - first, TXR_CHUNK_BLOCKS);
+        last = first + count == t->blocks;
+
+        /* The buffer being filled was sent two transfers ago, and the one
+           before this has to be done before the next can start anyway. */
+        txr_twiddle_blocks(t, txr_chunks[cur], first, count, false);
+        txr_dma_wait();
+
+        if(pvr_txr_load_dma(txr_chunks[cur], out + first * 32, count * 32,
+                            false, txr_dma_cb,
+                            (last && !block) ? lock : NULL) < 0) {
+            /* Something else is using the DMA, so wait for it to finish and
+               use the store queues for this chunk. */
+            while(!pvr_dma_ready())
+                thd_pass();
+
+            pvr_sq_load(out + first * 32, txr_chunks[cur], count * 32,
+                        PVR_DMA_VRAM64);
+
+            if(last && !block)
+                sem_signal(lock);
+        }
+        else {
+            txr_dma_pending = true;
+        }
+    }
+
+    if(block) {
+        txr_dma_wait();
+        sem_signal(lock);
+    }
+}
+
+/* Twiddle a texture 32 bytes at a time, if it's big enough for that. */
+static int txr_twiddle_tiled(const void *src, pvr_ptr_t dst, uint32_t w,
+                             uint32_t h, uint32_t bpp, uint32_t flags) {
+    uint32_t min = MIN(w, h), max = w + h - min;
+    ptrdiff_t pitch = (w * bpp) >> 3;
+    txr_twiddle_t t;
+
+    if(((min * min * bpp) >> 3) < 32 || ((uintptr_t)dst & 31))
+        return -1;
+
+    t.bpp = bpp;
+    t.min_shift = __builtin_ctz(min);
+    t.square_shift = 2 * t.min_shift;
+    t.block_shift = __builtin_ctz(256 / bpp);
+    t.wide = w > h;
+    t.blocks = (max / min) << (t.square_shift - t.block_shift);
+
+    if(flags & PVR_TXRLOAD_INVERT_Y) {
+        t.row0 = (const uint8_t *)src + (h - 1) * pitch;
+        t.stride = -pitch;
+    }
+    else {
+        t.row0 = (const uint8_t *)src;
+        t.stride = pitch;
+    }
+
+    mutex_lock_scoped(&txr_mutex);
+
+    txr_dma_wait();
+
+    if(flags & PVR_TXRLOAD_DMA)
+        txr_twiddle_dma(&t, dst, !(flags & PVR_TXRLOAD_NONBLOCK));
+    else
+        txr_twiddle_sq(&t, dst);
+
+    return 0;
+}
+
+void pvr_txr_load_wait(void) {
+    mutex_lock_scoped(&txr_mutex);
+    txr_dma_wait();
+}
+
+/* VQ encode a texture into main RAM, and then load that. */
+static void txr_load_vq(const void *src, pvr_ptr_t dst, uint32_t w,
+                        uint32_t h, uint32_t flags) {
+    semaphore_t *lock = (semaphore_t *)&pvr_state.dma_lock;
+    size_t size = pvr_txr_vq_size(w, h);
+    void *buf;
+
+    if(!(buf = aligned_alloc(32, size))) {
+        dbglog(DBG_ERROR, "pvr_txr_load_ex: out of memory for VQ\n");
+        return;
+    }
+
+    if(pvr_txr_vq_encode(src, buf, w, h, flags,
+                         PVR_TXR_VQ_QUALITY_DEFAULT) < 0) {
+        dbglog(DBG_ERROR, "pvr_txr_load_ex: can't VQ encode texture\n");
+        free(buf);
+        return;
+    }
+
+    if(flags & PVR_TXRLOAD_DMA) {
+        sem_wait(lock);
+        pvr_txr_load_dma(buf, dst, size, true, NULL, 0);
+        sem_signal(lock);
+    }
+    else {
+        pvr_txr_load(buf, dst, size);
+    }
+
+    free(buf);
+}
+
+/*
+   Load texture data from an SH-4 buffer into PVR RAM, twiddling it
+   in the process.
+
+   - w and h must be a power of 2
+   - flags must be a logical OR of the various texture loading
+     flags available:
+       PVR_TXRLOAD_4BPP, _8BPP, _16BPP, _32BPP (not supported yet)
+       PVR_TXRLOAD_VQ_LOAD (16bpp only, with a PVR_TXRLOAD_VQ_* format)
+       PVR_TXRLOAD_INVERT (not with VQ)
+       PVR_TXRLOAD_DMA, PVR_TXRLOAD_NONBLOCK (not with VQ)
+
+*/
+void pvr_txr_load_ex(const void *src, pvr_ptr_t dst, uint32_t w, uint32_t h,
+                     uint32_t flags) {
+    uint32_t bpp;
+
+    /* Make sure we're attempting something we can do */
+    switch(flags & PVR_TXRLOAD_FMT_MASK) {
+        case PVR_TXRLOAD_4BPP:
+            bpp = 4;
+            break;
+        case PVR_TXRLOAD_8BPP:
+            bpp = 8;
+            break;
+        case PVR_TXRLOAD_16BPP:
+            bpp = 16;
+            break;
+        default:
+            assert_msg(0, "Invalid format specifier in `flags'");
+            bpp = 8;
+    }
+
+    if(flags & PVR_TXRLOAD_VQ_LOAD) {
+        assert_msg(bpp == 16, "VQ compression is only supported for 16bpp");
+        txr_load_vq(src, dst, w, h, flags);
+        return;
+    }
+
+    if(txr_twiddle_tiled(src, dst, w, h, bpp, flags) < 0)
+        txr_twiddle_slow(src, dst, w, h, bpp,
+                         (flags & PVR_TXRLOAD_INVERT_Y) ? 1 : 0);
+}
+
 /* Load a KOS Platform Independent Image (subject to restraint checking) */
 void pvr_txr_load_kimg(const kos_img_t *img, pvr_ptr_t dst, uint32_t flags) {
     uint32_t fmt, w, h;
@@ -182,11 +507,19 @@ void pvr_txr_load_kimg(const kos_img_t *img, pvr_ptr_t dst, uint32_t flags) {
                || h == 256 || h == 512 || h == 1024, "Non power-of-2 image height in input kos_img_t");
 
     /* Convert it to a PVR image type */
+    flags &= ~PVR_TXRLOAD_VQ_FMT_MASK;
+
     switch(fmt) {
         case KOS_IMG_FMT_RGB565:
+            fmt = PVR_TXRLOAD_16BPP;
+            break;
         case KOS_IMG_FMT_ARGB4444:
+            fmt = PVR_TXRLOAD_16BPP;
+            flags |= PVR_TXRLOAD_VQ_ARGB4444;
+            break;
         case KOS_IMG_FMT_ARGB1555:
             fmt = PVR_TXRLOAD_16BPP;
+            flags |= PVR_TXRLOAD_VQ_ARGB1555;
             break;
         case KOS_IMG_FMT_PAL4BPP:
             fmt = PVR_TXRLOAD_4BPP;
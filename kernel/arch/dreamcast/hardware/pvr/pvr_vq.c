@@ -0,0 +1,461 @@
+/* KallistiOS ##version##
+
+   pvr_vq.c
+
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dc/pvr.h>
+
+/*
+
+   Run-time VQ compression.
+
+   A VQ texture is a codebook of 256 entries, each one a 2x2 block of 16-bit
+   texels, followed by a byte for every 2x2 block of the texture saying which
+   entry to draw it with, in twiddled order. That's about an eighth of the
+   size of the texture itself.
+
+   The codebook is built with the LBG (k-means) algorithm, run for a few
+   iterations at most over a sample of the texture's blocks, and then every
+   block is given the entry closest to it. How big the sample is and how many
+   iterations are allowed is what the quality setting controls.
+
+   All the work is done on 8-bit components: with A, R, G and B for each of
+   its 4 texels, each block is a point in 16 dimensions. Most of the time is
+   spent looking for the closest of 256 of those, so the codebook is kept
+   sorted by the sum of the components of each entry. The squared distance
+   between two points is at least the square of the difference between their
+   sums over 16, so the search starts from the entry with the closest sum and
+   works outwards, stopping on each side as soon as nothing further that way
+   can beat the best found so far.
+
+*/
+
+#define VQ_CODES            256
+#define VQ_DIM              16
+#define VQ_CODEBOOK_SIZE    (VQ_CODES * 8)
+#define VQ_SUM_MAX          (VQ_DIM * 255)
+
+/* Most blocks sampled to build the codebook at the lowest quality */
+#define VQ_SAMPLES_MIN      1024
+
+/* Stop iterating once the error improves by less than 1/VQ_CONVERGED */
+#define VQ_CONVERGED        256
+
+/* A 2x2 block: A, R, G, B of the top left, bottom left, top right and
+   bottom right texels, which is the order they're stored in the codebook. */
+typedef struct {
+    uint8_t c[VQ_DIM];
+} vq_vec_t;
+
+typedef struct {
+    vq_vec_t code[VQ_CODES];
+    int sum[VQ_CODES];
+    int count;
+} vq_book_t;
+
+typedef struct {
+    vq_book_t book;
+    uint32_t acc[VQ_CODES][VQ_DIM];
+    uint32_t members[VQ_CODES];
+    uint32_t hist[VQ_SUM_MAX + 1];
+    vq_vec_t *samples;
+    int *sums;
+    size_t nsamples;
+} vq_work_t;
+
+static inline void vq_unpack(uint8_t *c, uint16_t p, uint32_t fmt) {
+    uint32_t r, g, b;
+
+    switch(fmt) {
+        case PVR_TXRLOAD_VQ_ARGB1555:
+            c[0] = (p & 0x8000) ? 255 : 0;
+            r = (p >> 10) & 31;
+            g = (p >> 5) & 31;
+            b = p & 31;
+            c[1] = (r << 3) | (r >> 2);
+            c[2] = (g << 3) | (g >> 2);
+            c[3] = (b << 3) | (b >> 2);
+            break;
+
+        case PVR_TXRLOAD_VQ_ARGB4444:
+            c[0] = (p >> 12) * 17;
+            c[1] = ((p >> 8) & 15) * 17;
+            c[2] = ((p >> 4) & 15) * 17;
+            c[3] = (p & 15) * 17;
+            break;
+
+        default:
+            r = p >> 11;
+            g = (p >> 5) & 63;
+            b = p & 31;
+            c[0] = 255;
+            c[1] = (r << 3) | (r >> 2);
+            c[2] = (g << 2) | (g >> 4);
+            c[3] = (b << 3) | (b >> 2);
+            break;
+    }
+}
+
+static inline uint16_t vq_pack(const uint8_t *c, uint32_t fmt) {
+    switch(fmt) {
+        case PVR_TXRLOAD_VQ_ARGB1555:
+            return ((c[0] >= 128) << 15) |
+                   (((c[1] * 31 + 127) / 255) << 10) |
+                   (((c[2] * 31 + 127) / 255) << 5) |
+                   ((c[3] * 31 + 127) / 255);
+
+        case PVR_TXRLOAD_VQ_ARGB4444:
+            return (((c[0] * 15 + 127) / 255) << 12) |
+                   (((c[1] * 15 + 127) / 255) << 8) |
+                   (((c[2] * 15 + 127) / 255) << 4) |
+                   ((c[3] * 15 + 127) / 255);
+
+        default:
+            return (((c[1] * 31 + 127) / 255) << 11) |
+                   (((c[2] * 63 + 127) / 255) << 5) |
+                   ((c[3] * 31 + 127) / 255);
+    }
+}
+
+static int vq_sum(const vq_vec_t *v) {
+    int i, sum = 0;
+
+    for(i = 0; i < VQ_DIM; i++)
+        sum += v->c[i];
+
+    return sum;
+}
+
+/* Read the 2x2 block with its top left texel at (x, y). */
+static int vq_read(vq_vec_t *v, const uint16_t *src, uint32_t w, uint32_t x,
+                   uint32_t y, uint32_t fmt) {
+    const uint16_t *p = src + y * w + x;
+
+    vq_unpack(v->c + 0, p[0], fmt);
+    vq_unpack(v->c + 4, p[w], fmt);
+    vq_unpack(v->c + 8, p[1], fmt);
+    vq_unpack(v->c + 12, p[w + 1], fmt);
+
+    return vq_sum(v);
+}
+
+/* Squared distance between two blocks, giving up once it's past limit. */
+static inline uint32_t vq_dist(const vq_vec_t *a, const vq_vec_t *b,
+                               uint32_t limit) {
+    uint32_t d = 0;
+    int i, j, e;
+
+    for(i = 0; i < VQ_DIM; i += 4) {
+        for(j = i; j < i + 4; j++) {
+            e = a->c[j] - b->c[j];
+            d += e * e;
+        }
+
+        if(d >= limit)
+            break;
+    }
+
+    return d;
+}
+
+/* Find the codebook entry closest to a block with the given sum. */
+static int vq_nearest(const vq_book_t *b, const vq_vec_t *v, int sum,
+                      uint32_t *dist) {
+    uint32_t best = UINT32_MAX, d, bound;
+    int lo = 0, hi = b->count, mid, l, r, rv = 0;
+
+    while(lo < hi) {
+        mid = (lo + hi) / 2;
+
+        if(b->sum[mid] < sum)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    l = lo - 1;
+    r = lo;
+
+    while(l >= 0 || r < b->count) {
+        if(r < b->count) {
+            bound = (uint32_t)((b->sum[r] - sum) * (b->sum[r] - sum)) / VQ_DIM;
+
+            if(bound >= best) {
+                r = b->count;
+            }
+            else {
+                if((d = vq_dist(&b->code[r], v, best)) < best) {
+                    best = d;
+                    rv = r;
+                }
+
+                r++;
+            }
+        }
+
+        if(l >= 0) {
+            bound = (uint32_t)((sum - b->sum[l]) * (sum - b->sum[l])) / VQ_DIM;
+
+            if(bound >= best) {
+                l = -1;
+            }
+            else {
+                if((d = vq_dist(&b->code[l], v, best)) < best) {
+                    best = d;
+                    rv = l;
+                }
+
+                l--;
+            }
+        }
+    }
+
+    *dist = best;
+    return rv;
+}
+
+/* Sort the codebook by sum. It's nearly sorted already after the first
+   pass, so insertion sort does well. */
+static void vq_sort(vq_book_t *b) {
+    vq_vec_t v;
+    int i, j, s;
+
+    for(i = 1; i < b->count; i++) {
+        v = b->code[i];
+        s = b->sum[i];
+
+        for(j = i; j > 0 && b->sum[j - 1] > s; j--) {
+            b->code[j] = b->code[j - 1];
+            b->sum[j] = b->sum[j - 1];
+        }
+
+        b->code[j] = v;
+        b->sum[j] = s;
+    }
+}
+
+/* Start with entries spread evenly through the samples in order of sum, so
+   that everything from the darkest blocks to the brightest is covered. The
+   samples are put in order with a counting sort, as sums are small. */
+static int vq_seed(vq_work_t *w) {
+    vq_book_t *b = &w->book;
+    size_t i, n = w->nsamples;
+    uint32_t *order;
+    int s;
+
+    if(!(order = malloc(n * sizeof(uint32_t))))
+        return -1;
+
+    memset(w->hist, 0, sizeof(w->hist));
+
+    for(i = 0; i < n; i++)
+        ++w->hist[w->sums[i]];
+
+    for(s = 1; s <= VQ_SUM_MAX; s++)
+        w->hist[s] += w->hist[s - 1];
+
+    for(i = n; i-- > 0;)
+        order[--w->hist[w->sums[i]]] = i;
+
+    b->count = n < VQ_CODES ? n : VQ_CODES;
+
+    for(i = 0; i < (size_t)b->count; i++) {
+        b->code[i] = w->samples[order[i * n / b->count]];
+        b->sum[i] = w->sums[order[i * n / b->count]];
+    }
+
+    free(order);
+
+    return 0;
+}
+
+/* One LBG iteration: move every entry to the middle of the samples closest
+   to it. Returns the total error before moving them. */
+static uint64_t vq_iterate(vq_work_t *w) {
+    vq_book_t *b = &w->book;
+    uint64_t total = 0;
+    uint32_t d, worst = 0;
+    size_t i, worst_i = 0, spare = 0;
+    int k, j;
+
+    memset(w->acc, 0, sizeof(w->acc));
+    memset(w->members, 0, sizeof(w->members));
+
+    for(i = 0; i < w->nsamples; i++) {
+        k = vq_nearest(b, &w->samples[i], w->sums[i], &d);
+        total += d;
+
+        if(d > worst) {
+            worst = d;
+            worst_i = i;
+        }
+
+        for(j = 0; j < VQ_DIM; j++)
+            w->acc[k][j] += w->samples[i].c[j];
+
+        ++w->members[k];
+    }
+
+    for(k = 0; k < b->count; k++) {
+        if(w->members[k]) {
+            for(j = 0; j < VQ_DIM; j++) {
+                b->code[k].c[j] = (w->acc[k][j] + w->members[k] / 2) /
+                                  w->members[k];
+            }
+        }
+        else if(worst) {
+            /* Nobody's using this one, so give it to the block that fits
+               worst of all... */
+            b->code[k] = w->samples[worst_i];
+            worst = 0;
+        }
+        else {
+            /* ...or to some other block, if that's been done already. */
+            spare = (spare + 7919) % w->nsamples;
+            b->code[k] = w->samples[spare];
+        }
+
+        b->sum[k] = vq_sum(&b->code[k]);
+    }
+
+    vq_sort(b);
+
+    return total;
+}
+
+/* Round the codebook to what the texture format can hold, so that the final
+   choice of entries is made with the colours that will actually be seen. */
+static void vq_quantize(vq_book_t *b, uint32_t fmt) {
+    int k, t;
+
+    for(k = 0; k < b->count; k++) {
+        for(t = 0; t < VQ_DIM; t += 4)
+            vq_unpack(b->code[k].c + t, vq_pack(b->code[k].c + t, fmt), fmt);
+
+        b->sum[k] = vq_sum(&b->code[k]);
+    }
+
+    vq_sort(b);
+}
+
+/* Spread the bits of v out to the even bits of the result. */
+static inline uint32_t spread_bits(uint32_t v) {
+    v &= 0x0000ffff;
+    v = (v | (v << 8)) & 0x00ff00ff;
+    v = (v | (v << 4)) & 0x0f0f0f0f;
+    v = (v | (v << 2)) & 0x33333333;
+    v = (v | (v << 1)) & 0x55555555;
+
+    return v;
+}
+
+/* Rounded up to a whole number of store queue writes */
+size_t pvr_txr_vq_size(uint32_t w, uint32_t h) {
+    return (VQ_CODEBOOK_SIZE + w * h / 4 + 31) & ~31;
+}
+
+int pvr_txr_vq_encode(const void *src, void *dst, uint32_t w, uint32_t h,
+                      uint32_t flags, int quality) {
+    const uint16_t *pixels = (const uint16_t *)src;
+    uint16_t *codebook = (uint16_t *)dst;
+    uint8_t *index = (uint8_t *)dst + VQ_CODEBOOK_SIZE;
+    uint32_t fmt = flags & PVR_TXRLOAD_VQ_FMT_MASK;
+    uint32_t bw = w / 2, bh = h / 2, m, mask, bx, by, d;
+    size_t blocks = bw * bh, i, n, blk;
+    uint64_t err, last = UINT64_MAX;
+    vq_vec_t v;
+    vq_work_t *work = NULL;
+    int it, t, sum;
+
+    if(w < 2 || h < 2 || (w & (w - 1)) || (h & (h - 1))) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if(quality < PVR_TXR_VQ_QUALITY_FASTEST)
+        quality = PVR_TXR_VQ_QUALITY_FASTEST;
+    else if(quality > PVR_TXR_VQ_QUALITY_BEST)
+        quality = PVR_TXR_VQ_QUALITY_BEST;
+
+    n = (size_t)VQ_SAMPLES_MIN << quality;
+
+    if(n > blocks)
+        n = blocks;
+
+    if(!(work = malloc(sizeof(vq_work_t))))
+        goto nomem;
+
+    work->samples = malloc(n * sizeof(vq_vec_t));
+    work->sums = malloc(n * sizeof(int));
+    work->nsamples = n;
+
+    if(!work->samples || !work->sums)
+        goto nomem;
+
+    /* Sample blocks evenly from the whole texture. */
+    for(i = 0; i < n; i++) {
+        blk = i * blocks / n;
+        work->sums[i] = vq_read(&work->samples[i], pixels, w,
+                                (blk % bw) * 2, (blk / bw) * 2, fmt);
+    }
+
+    if(vq_seed(work) < 0)
+        goto nomem;
+
+    for(it = 0; it < 2 + 2 * quality; it++) {
+        err = vq_iterate(work);
+
+        if(last - err < last / VQ_CONVERGED)
+            break;
+
+        last = err;
+    }
+
+    vq_quantize(&work->book, fmt);
+
+    /* Unused entries are left black. */
+    memset(codebook, 0, VQ_CODEBOOK_SIZE);
+
+    for(i = 0; i < (size_t)work->book.count; i++) {
+        for(t = 0; t < 4; t++)
+            codebook[i * 4 + t] = vq_pack(work->book.code[i].c + t * 4, fmt);
+    }
+
+    memset(index + blocks, 0, pvr_txr_vq_size(w, h) - VQ_CODEBOOK_SIZE -
+           blocks);
+
+    /* The indices are twiddled like a texture, and if it isn't square, made
+       of squares one after the other. */
+    m = bw < bh ? bw : bh;
+    mask = m - 1;
+
+    for(by = 0; by < bh; by++) {
+        for(bx = 0; bx < bw; bx++) {
+            sum = vq_read(&v, pixels, w, bx * 2, by * 2, fmt);
+            index[(spread_bits(by & mask) | (spread_bits(bx & mask) << 1)) +
+                  (bx / m + by / m) * m * m] =
+                vq_nearest(&work->book, &v, sum, &d);
+        }
+    }
+
+    free(work->sums);
+    free(work->samples);
+    free(work);
+
+    return 0;
+
+nomem:
+    if(work) {
+        free(work->sums);
+        free(work->samples);
+        free(work);
+    }
+
+    errno = ENOMEM;
+    return -1;
+}
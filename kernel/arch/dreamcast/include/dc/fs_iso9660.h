@@ -29,6 +29,8 @@
 #include <kos/cdefs.h>
 __BEGIN_DECLS
 
+#include <kos/blockcache.h>
+
 /** \addtogroup gdrom
     @{
 */
@@ -43,6 +45,16 @@ __BEGIN_DECLS
 */
 int iso_reset(void);
 
+/** \brief  Get the statistics of the ISO9660 block caches.
+
+    The driver keeps directory sectors and file data sectors in two separate
+    caches. Either pointer may be NULL if that cache is of no interest.
+
+    \param  inode           Where to store the directory cache statistics.
+    \param  data            Where to store the data cache statistics.
+*/
+void iso_cache_stats(blockcache_stats_t *inode, blockcache_stats_t *data);
+
 /* \cond */
 void fs_iso9660_init(void);
 void fs_iso9660_shutdown(void);
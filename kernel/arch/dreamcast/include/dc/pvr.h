@@ -819,7 +819,10 @@ int pvr_vertex_dma_enabled(void);
 
     \note
     Each buffer should actually be twice as long as what you will need to hold
-    two frames worth of data).
+    two frames worth of data). If the list is going to be streamed to the TA
+    with pvr_list_flush(), or is allowed to be streamed once it fills up, then
+    it doesn't have to hold a whole frame; a few kilobytes are generally
+    enough to keep the DMA busy.
 
     \warning
     You should generally not try to do this at any time besides before a frame
@@ -862,6 +865,83 @@ void *pvr_vertbuf_tail(pvr_list_t list);
 */
 void pvr_vertbuf_written(pvr_list_t list, size_t amt);
 
+/** \brief   Reserve room in the DMA buffer for the given list, to build
+             primitives in place.
+    \ingroup pvr_vertex_dma
+
+    This returns a pointer to at least \p size contiguous bytes at the end of
+    the list's vertex buffer. Primitives written there don't have to be copied
+    in by pvr_list_prim(), and are checked once per batch rather than once per
+    primitive. Once they've been written, call pvr_vertbuf_commit() with the
+    number of bytes used; nothing else may be added to the list in between.
+
+    If there isn't enough room left, the list starts being streamed to the TA
+    to make some (see pvr_list_flush()).
+
+    \param  list            The primitive list to write to.
+    \param  size            The number of bytes to reserve. Must be a multiple
+                            of 32, and no more than the buffer holds for one
+                            frame (half the length given to pvr_set_vertbuf()).
+
+    \return                 Where to write the data (32-byte aligned), or NULL
+                            if there's no room and the list can't be streamed,
+                            or if the list was already sent to the TA.
+
+    \sa pvr_vertbuf_reserve_strip()
+*/
+void *pvr_vertbuf_reserve(pvr_list_t list, size_t size);
+
+/** \brief   Add data written to reserved room to the given list.
+    \ingroup pvr_vertex_dma
+
+    \param  list            The primitive list that was written to.
+    \param  size            Number of bytes written, starting from what
+                            pvr_vertbuf_reserve() returned. Must be a multiple
+                            of 32, and no more than was reserved.
+*/
+void pvr_vertbuf_commit(pvr_list_t list, size_t size);
+
+/** \brief   Reserve room for a strip of vertices in the DMA buffer for the
+             given list.
+    \ingroup pvr_vertex_dma
+
+    This is pvr_vertbuf_reserve(), for \p count vertices. There's no need to
+    set the flags of the vertices, as pvr_vertbuf_commit_strip() takes care of
+    that.
+
+    \param  list            The primitive list to write to.
+    \param  count           The number of vertices in the strip.
+
+    \return                 The vertices to fill in, or NULL on error.
+*/
+static inline pvr_vertex_t *pvr_vertbuf_reserve_strip(pvr_list_t list,
+                                                      size_t count) {
+    return (pvr_vertex_t *)pvr_vertbuf_reserve(list,
+                                               count * sizeof(pvr_vertex_t));
+}
+
+/** \brief   Add a strip of vertices written in place to the given list.
+    \ingroup pvr_vertex_dma
+
+    This marks the last vertex as the end of the strip, and all of the others
+    as regular vertices, then commits them.
+
+    \param  list            The primitive list that was written to.
+    \param  verts           The vertices, as returned by
+                            pvr_vertbuf_reserve_strip().
+    \param  count           The number of vertices in the strip (at least 1).
+*/
+static inline void pvr_vertbuf_commit_strip(pvr_list_t list,
+                                            pvr_vertex_t *verts, size_t count) {
+    size_t i;
+
+    for(i = 0; i < count - 1; i++)
+        verts[i].flags = PVR_CMD_VERTEX;
+
+    verts[count - 1].flags = PVR_CMD_VERTEX_EOL;
+    pvr_vertbuf_commit(list, count * sizeof(pvr_vertex_t));
+}
+
 /** \brief   Begin collecting data for a frame of 3D output to the off-screen
              frame buffer.
     \ingroup pvr_scene_mgmt
@@ -997,6 +1077,10 @@ void pvr_send_to_ta(void *data);
     Data will be queued in a vertex buffer, thus one must be available for the
     list specified (will be asserted by the code).
 
+    If the buffer is full, the list will be streamed to the TA from then on,
+    as if pvr_list_flush() had been called on it. If that's not possible
+    (because another list is being submitted directly), it is an error.
+
     \param  list            The list to submit to.
     \param  data            The primitive to submit.
     \param  size            The size of the primitive in bytes. This must be a
@@ -1010,13 +1094,26 @@ int pvr_list_prim(pvr_list_t list, const void *data, size_t size);
 /** \brief   Flush the buffered data of the given list type to the TA.
     \ingroup pvr_list_mgmt
 
-    This function is currently not implemented, and calling it will result in an
-    assertion failure. It is intended to be used later in a "hybrid" mode where
-    both direct and DMA TA submission is possible.
+    This starts sending the list to the TA by DMA without waiting for
+    pvr_scene_finish(), so that the TA can work on it while the rest is being
+    generated. From then on, the list's vertex buffer is used as a ring, and
+    each half of it is sent as soon as it has been filled; calling this
+    function again sends whatever has been added since the last time.
+
+    Only one list can be streamed at a time, since the TA takes them one at a
+    time. The list is ended when another list needs the TA (because it's being
+    streamed or submitted directly) or when the scene is finished, and nothing
+    more can be added to it in the current scene after that.
+
+    If data are written to a streamed list with pvr_vertbuf_tail() and
+    pvr_vertbuf_written(), they're only sent when this function is called, and
+    they must fit before the end of the buffer.
 
     \param  list            The list to flush.
 
-    \retval -1              On error (it is not possible to succeed).
+    \retval 0               On success (including if there was nothing to send).
+    \retval -1              If the list was already ended in this scene, or if
+                            the TA is busy with a list being submitted directly.
 */
 int pvr_list_flush(pvr_list_t list);
 
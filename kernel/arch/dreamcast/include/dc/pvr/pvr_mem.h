@@ -25,6 +25,7 @@
 #define __DC_PVR_PVR_MEM_H
 
 #include <stdint.h>
+#include <stddef.h>
 
 #include <kos/cdefs.h>
 __BEGIN_DECLS
@@ -48,9 +49,56 @@ typedef void *pvr_ptr_t;
     \brief                   Memory management API for VRAM
     \ingroup                 pvr_vram
 
-    PVR memory management in KOS uses a modified dlmalloc; see the
-    source file pvr_mem_core.c for more info. 
+    The allocator keeps all of its bookkeeping in main RAM, so allocating and
+    freeing never touch VRAM itself. Free blocks are kept in two-level
+    segregated free lists (TLSF), so finding one takes constant time.
+
+    Blocks from pvr_mem_malloc() stay where they are until they're freed.
+    Blocks behind a handle (see pvr_mem_handle_alloc()) can be moved by
+    pvr_mem_compact() to undo fragmentation, and can be copied out to main
+    RAM when VRAM runs short, if they're marked as evictable. Both are done
+    only to handles that haven't been used for a few frames and aren't
+    locked, so that the PVR never reads a texture from where it used to be.
+*/
+
+/** \brief   Handle to a movable block of texture memory.
+    \ingroup pvr_mem_mgmt
+
+    \sa pvr_mem_handle_alloc()
+*/
+typedef struct pvr_mem_handle *pvr_mem_handle_t;
+
+/** \brief   Allow a handle's block to be evicted to main RAM.
+    \ingroup pvr_mem_mgmt
+
+    If this flag is passed to pvr_mem_handle_alloc(), the block may be copied
+    out to main RAM (and its VRAM given to someone else) when an allocation
+    would otherwise fail, least recently used first. It's copied back the
+    next time pvr_mem_handle_ptr() or pvr_mem_handle_lock() is called on it.
 */
+#define PVR_MEM_EVICTABLE   0x0001
+
+/** \brief   Texture memory statistics.
+    \ingroup pvr_mem_mgmt
+
+    \sa pvr_mem_get_stats()
+*/
+typedef struct pvr_mem_stats {
+    size_t total;               /**< \brief Size of the pool, in bytes */
+    size_t free;                /**< \brief Free bytes */
+    size_t largest_free;        /**< \brief Size of the largest free block */
+    size_t free_blocks;         /**< \brief Number of free blocks */
+    size_t used_blocks;         /**< \brief Number of allocated blocks */
+    unsigned int fragmentation; /**< \brief Percentage of the free memory
+                                             not in the largest free block */
+    size_t handles_resident;    /**< \brief Handles with their data in VRAM */
+    size_t handles_evicted;     /**< \brief Handles evicted to main RAM */
+    size_t evicted_bytes;       /**< \brief Main RAM used by evicted handles */
+    size_t evictions;           /**< \brief Total evictions */
+    size_t restores;            /**< \brief Total copies back into VRAM */
+    size_t compactions;         /**< \brief Total compaction passes */
+    size_t bytes_moved;         /**< \brief Total bytes moved by compaction */
+} pvr_mem_stats_t;
 
 /** \brief   Allocate a chunk of memory from texture space.
     \ingroup pvr_mem_mgmt
@@ -60,6 +108,9 @@ typedef void *pvr_ptr_t;
     normal pointer that can be directly written to if one desires to do so. All
     allocations will be aligned to a 32-byte boundary.
 
+    The block will never be moved. If there isn't room for it, idle evictable
+    handles are evicted and the pool is compacted before giving up.
+
     \param  size            The amount of memory to allocate
     
     \return                 A pointer to the memory on success, NULL on error
@@ -86,7 +137,8 @@ size_t pvr_mem_available(void);
     \ingroup pvr_mem_mgmt
 
     This will essentially free any blocks allocated within the pool. There's
-    generally not many good reasons for doing this.
+    generally not many good reasons for doing this. Handles that still exist
+    are left evicted, with nothing in them.
 */
 void pvr_mem_reset(void);
 
@@ -98,6 +150,94 @@ void pvr_mem_reset(void);
 */
 void pvr_mem_initialize(pvr_ptr_t pvr_texture_base, size_t available_memory);
 
+/** \brief   Allocate a movable block of texture memory.
+    \ingroup pvr_mem_mgmt
+
+    This allocates a block that stays in VRAM while it's in use, but that may
+    be moved by pvr_mem_compact(), or evicted to main RAM if
+    \ref PVR_MEM_EVICTABLE is given, once it hasn't been used for a few
+    frames. Its current address is given by pvr_mem_handle_ptr().
+
+    \param  size            The amount of memory to allocate
+    \param  flags           0, or \ref PVR_MEM_EVICTABLE
+
+    \return                 The new handle on success, NULL on error
+*/
+pvr_mem_handle_t pvr_mem_handle_alloc(size_t size, int flags);
+
+/** \brief   Free a movable block of texture memory.
+    \ingroup pvr_mem_mgmt
+
+    \param  h               The handle to free (may be NULL)
+*/
+void pvr_mem_handle_free(pvr_mem_handle_t h);
+
+/** \brief   Get the address of a handle's block, and mark it as used.
+    \ingroup pvr_mem_mgmt
+
+    This brings the block back into VRAM if it was evicted, and marks it as
+    used in the current frame, so that it won't be moved or evicted while
+    the PVR may still be reading it. It should be called in every frame that
+    uses the block, and the address it returns shouldn't be kept past the
+    next call to pvr_mem_compact() or an allocation.
+
+    \param  h               The handle
+    \return                 The block's address, or NULL if it was evicted
+                            and there's no room to bring it back
+*/
+pvr_ptr_t pvr_mem_handle_ptr(pvr_mem_handle_t h);
+
+/** \brief   Pin a handle's block in VRAM.
+    \ingroup pvr_mem_mgmt
+
+    This is like pvr_mem_handle_ptr(), but the block also won't be moved or
+    evicted until pvr_mem_handle_unlock() is called as many times as this
+    was.
+
+    \param  h               The handle
+    \return                 The block's address, or NULL on error
+*/
+pvr_ptr_t pvr_mem_handle_lock(pvr_mem_handle_t h);
+
+/** \brief   Unpin a handle's block.
+    \ingroup pvr_mem_mgmt
+
+    \param  h               The handle, previously locked
+*/
+void pvr_mem_handle_unlock(pvr_mem_handle_t h);
+
+/** \brief   Check whether a handle's block is in VRAM.
+    \ingroup pvr_mem_mgmt
+
+    \param  h               The handle
+    \return                 Non-zero if it's in VRAM, zero if it's evicted
+*/
+int pvr_mem_handle_resident(pvr_mem_handle_t h);
+
+/** \brief   Defragment the PVR RAM pool.
+    \ingroup pvr_mem_mgmt
+
+    This slides every block behind a handle that isn't locked and hasn't been
+    used in the last few frames down into the free space before it, merging
+    holes together. The data is copied through main RAM, and written back
+    with the store queues. Blocks from pvr_mem_malloc() stay where they are.
+
+    This takes a while if there's a lot to move, so it's best done at a time
+    when a dropped frame won't be noticed, like during a loading screen.
+
+    \return                 The number of bytes moved
+*/
+size_t pvr_mem_compact(void);
+
+/** \brief   Get statistics about the PVR RAM pool.
+    \ingroup pvr_mem_mgmt
+
+    \param  stats           Where to store the statistics
+    \retval 0               On success
+    \retval -1              If the PVR hasn't been initialized
+*/
+int pvr_mem_get_stats(pvr_mem_stats_t *stats);
+
 /** \brief   Print the list of allocated blocks in the PVR RAM pool.
     \ingroup pvr_mem_mgmt
 
@@ -108,7 +248,7 @@ void pvr_mem_print_list(void);
 /** \brief   Print statistics about the PVR RAM pool.
     \ingroup pvr_mem_mgmt
 
-    This prints out statistics like what malloc_stats() provides. Also, if
+    This prints out the statistics from pvr_mem_get_stats(). Also, if
     KM_DBG is enabled in pvr_mem.c, it prints the list of allocated blocks.
 */
 void pvr_mem_stats(void);
@@ -26,6 +26,7 @@
 #define __DC_PVR_PVR_TEXTURE_H
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
 #include <kos/cdefs.h>
@@ -109,7 +110,7 @@ void pvr_txr_load(const void *src, pvr_ptr_t dst, size_t count);
 #define PVR_TXRLOAD_16BPP           0x03    /**< \brief 16BPP format */
 #define PVR_TXRLOAD_FMT_MASK        0x0f    /**< \brief Bits used for basic formats */
 
-#define PVR_TXRLOAD_VQ_LOAD         0x10    /**< \brief Do VQ encoding (not supported yet, if ever) */
+#define PVR_TXRLOAD_VQ_LOAD         0x10    /**< \brief Do VQ encoding (16BPP only) */
 #define PVR_TXRLOAD_INVERT_Y        0x20    /**< \brief Invert the Y axis while loading */
 #define PVR_TXRLOAD_FMT_VQ          0x40    /**< \brief Texture is already VQ encoded */
 #define PVR_TXRLOAD_FMT_TWIDDLED    0x80    /**< \brief Texture is already twiddled */
@@ -117,6 +118,25 @@ void pvr_txr_load(const void *src, pvr_ptr_t dst, size_t count);
 #define PVR_TXRLOAD_DMA             0x8000  /**< \brief Use DMA to load the texture */
 #define PVR_TXRLOAD_NONBLOCK        0x4000  /**< \brief Use non-blocking loads (only for DMA) */
 #define PVR_TXRLOAD_SQ              0x2000  /**< \brief Use Store Queues to load */
+
+#define PVR_TXRLOAD_VQ_RGB565       0x0000  /**< \brief VQ encode from RGB565 */
+#define PVR_TXRLOAD_VQ_ARGB1555     0x0100  /**< \brief VQ encode from ARGB1555 */
+#define PVR_TXRLOAD_VQ_ARGB4444     0x0200  /**< \brief VQ encode from ARGB4444 */
+#define PVR_TXRLOAD_VQ_FMT_MASK     0x0300  /**< \brief Bits used for VQ source formats */
+/** @} */
+
+/** \defgroup pvr_txr_vq_quality    VQ Quality
+    \brief                          Quality settings for run-time VQ encoding
+    \ingroup                        pvr_txr_mgmt
+
+    Higher settings build the codebook from more of the texture, and refine
+    it for longer. Each step up roughly doubles the time it takes to build.
+
+    @{
+*/
+#define PVR_TXR_VQ_QUALITY_FASTEST  0   /**< \brief Fastest encoding */
+#define PVR_TXR_VQ_QUALITY_DEFAULT  3   /**< \brief Used by pvr_txr_load_ex() */
+#define PVR_TXR_VQ_QUALITY_BEST     7   /**< \brief Best quality */
 /** @} */
 
 /** \brief   Load texture data from an SH-4 buffer into PVR RAM, twiddling it in
@@ -125,12 +145,24 @@ void pvr_txr_load(const void *src, pvr_ptr_t dst, size_t count);
 
     This function loads a texture to the PVR's RAM with the specified set of
     flags. It will currently always twiddle the data, whether you ask it to or
-    not, and many of the parameters are just plain not supported at all...
-    Pretty much the only supported flag, other than the format ones is the
-    PVR_TXRLOAD_INVERT_Y one.
+    not. Other than the format ones, the supported flags are
+    \ref PVR_TXRLOAD_INVERT_Y, and \ref PVR_TXRLOAD_DMA with
+    \ref PVR_TXRLOAD_NONBLOCK.
+
+    With \ref PVR_TXRLOAD_VQ_LOAD (and \ref PVR_TXRLOAD_16BPP), the texture is
+    VQ encoded with pvr_txr_vq_encode() at \ref PVR_TXR_VQ_QUALITY_DEFAULT
+    first, and dst needs room for pvr_txr_vq_size() bytes. Say which 16-bit
+    format the source is in with one of the PVR_TXRLOAD_VQ_* formats, and
+    use \ref PVR_TXRFMT_VQ_ENABLE when drawing with it.
+
+    The texture is twiddled 32 bytes at a time in the cache, and written out
+    with the store queues, or with DMA if \ref PVR_TXRLOAD_DMA is given. With
+    DMA, twiddling the next part of the texture overlaps with sending the
+    last, and if \ref PVR_TXRLOAD_NONBLOCK is given as well, this returns
+    before the last part has been sent (see pvr_txr_load_wait()).
 
-    This will be slower than using pvr_txr_load() in pretty much all cases, so
-    unless you need to twiddle your texture, just use that instead.
+    Textures smaller than a 32-byte block, or a dst that isn't 32-byte
+    aligned, are done one pixel at a time instead, which is much slower.
 
     \param  src             The location to copy from.
     \param  dst             The location to copy to.
@@ -143,6 +175,57 @@ void pvr_txr_load(const void *src, pvr_ptr_t dst, size_t count);
 void pvr_txr_load_ex(const void *src, pvr_ptr_t dst,
                      uint32_t w, uint32_t h, uint32_t flags);
 
+/** \brief   Wait for a non-blocking texture load to finish.
+    \ingroup pvr_txr_mgmt
+
+    This waits until the last part of a texture loaded by pvr_txr_load_ex()
+    with \ref PVR_TXRLOAD_DMA and \ref PVR_TXRLOAD_NONBLOCK has been sent.
+    It returns right away if there's none in progress.
+*/
+void pvr_txr_load_wait(void);
+
+/** \brief   Get the size of a VQ encoded texture.
+    \ingroup pvr_txr_mgmt
+
+    \param  w               The width of the texture, in pixels.
+    \param  h               The height of the texture, in pixels.
+    \return                 The size of the codebook and the indices, in bytes,
+                            rounded up to a multiple of 32.
+*/
+size_t pvr_txr_vq_size(uint32_t w, uint32_t h);
+
+/** \brief   VQ encode a 16-bit texture.
+    \ingroup pvr_txr_mgmt
+
+    This builds a 256 entry codebook of 2x2 blocks for the texture, and
+    writes it out followed by the twiddled indices, ready to be loaded with
+    pvr_txr_load() and drawn with \ref PVR_TXRFMT_VQ_ENABLE and
+    \ref PVR_TXRFMT_TWIDDLED.
+
+    The codebook is built with a few iterations of the LBG (k-means)
+    algorithm over a sample of the texture's blocks. The quality setting
+    trades time for how good the result looks: the lowest one takes a
+    fraction of the time of the highest, for a few dB less PSNR.
+
+    \param  src             The texture, in main RAM.
+    \param  dst             Where to write the result, in main RAM. It needs
+                            room for pvr_txr_vq_size() bytes.
+    \param  w               The width of the texture, a power of two.
+    \param  h               The height of the texture, a power of two.
+    \param  flags           The format of the source: one of the
+                            PVR_TXRLOAD_VQ_* formats.
+    \param  quality         From \ref PVR_TXR_VQ_QUALITY_FASTEST to
+                            \ref PVR_TXR_VQ_QUALITY_BEST.
+    \retval 0               On success.
+    \retval -1              On failure. Sets errno as appropriate.
+
+    \par    Error Conditions:
+    \em     EINVAL - the size isn't a power of two \n
+    \em     ENOMEM - out of memory
+*/
+int pvr_txr_vq_encode(const void *src, void *dst, uint32_t w, uint32_t h,
+                      uint32_t flags, int quality);
+
 /** \brief   Load a KOS Platform Independent Image (subject to constraint
              checking).
     \ingroup pvr_txr_mgmt
@@ -168,9 +251,9 @@ void pvr_txr_load_ex(const void *src, pvr_ptr_t dst,
                             \ref PVR_TXRLOAD_FMT_NOTWIDDLE (or equivalently
                             \ref PVR_TXRLOAD_FMT_TWIDDLED) and
                             \ref PVR_TXRLOAD_INVERT_Y in the flags.
-    \note                   DMA and Store Queue based loading is not available
-                            from this function if it twiddles the texture while
-                            loading.
+    \note                   When the texture is twiddled while loading, it's
+                            always written with the Store Queues, unless
+                            \ref PVR_TXRLOAD_DMA is given.
 */
 void pvr_txr_load_kimg(const kos_img_t *img, pvr_ptr_t dst, uint32_t flags);
 
@@ -0,0 +1,430 @@
+/* KallistiOS ##version##
+
+   blockcache.c
+*/
+
+/* This is a block cache for the filesystems that sit on a kos_blockdev_t.
+   Entries live on one LRU list (least recently used first) and in a hash
+   table keyed by their first device block, so that both the lookup and the
+   LRU update are done in constant time.
+
+   There is no locking in here; every user already serializes the accesses to
+   its filesystem, and that covers its caches too. Keeping the kernel out of
+   this file also lets the filesystems that can be built outside of KOS carry
+   it along. */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/queue.h>
+
+#include <kos/blockdev.h>
+#include <kos/blockcache.h>
+
+#define BC_FLAG_VALID       1
+#define BC_FLAG_DIRTY       2
+#define BC_FLAG_READAHEAD   4   /* Read ahead, and not looked up since */
+
+/* How many entries can go to or come from the device in one request. */
+#define BC_STAGE_ENTRIES    (BLOCKCACHE_READAHEAD * 2)
+
+typedef struct bc_entry {
+    TAILQ_ENTRY(bc_entry) lru;
+    LIST_ENTRY(bc_entry) hash;
+    uint64_t block;
+    uint32_t count;
+    uint32_t flags;
+    uint8_t *data;
+} bc_entry_t;
+
+TAILQ_HEAD(bc_lru, bc_entry);
+LIST_HEAD(bc_bucket, bc_entry);
+
+struct kos_blockcache {
+    struct kos_blockdev *dev;
+    uint64_t dev_blocks;
+    size_t bpe;
+    size_t entry_size;
+    size_t nentries;
+    size_t readahead;
+    unsigned int hash_shift;
+
+    /* The block right after the last lookup, to spot sequential access */
+    uint64_t next;
+
+    struct bc_lru lru;
+    struct bc_bucket *buckets;
+    bc_entry_t *entries;
+    bc_entry_t **sorted;
+
+    uint8_t *data;
+    uint8_t *stage;
+    size_t stage_entries;
+
+    blockcache_stats_t stats;
+};
+
+static inline struct bc_bucket *bc_bucket(kos_blockcache_t *bc,
+                                          uint64_t block) {
+    uint32_t h = (uint32_t)block ^ (uint32_t)(block >> 32);
+
+    /* Fibonacci hashing, so that entries spaced by the entry size still
+       spread out over the whole table. */
+    return &bc->buckets[(h * 2654435761U) >> bc->hash_shift];
+}
+
+static bc_entry_t *bc_lookup(kos_blockcache_t *bc, uint64_t block) {
+    bc_entry_t *e;
+
+    LIST_FOREACH(e, bc_bucket(bc, block), hash) {
+        if(e->block == block)
+            return e;
+    }
+
+    return NULL;
+}
+
+static inline void bc_touch(kos_blockcache_t *bc, bc_entry_t *e) {
+    TAILQ_REMOVE(&bc->lru, e, lru);
+    TAILQ_INSERT_TAIL(&bc->lru, e, lru);
+}
+
+/* Hand an entry back to the LRU end of the list, invalid. */
+static void bc_drop(kos_blockcache_t *bc, bc_entry_t *e) {
+    if(e->flags & BC_FLAG_VALID)
+        LIST_REMOVE(e, hash);
+
+    e->flags = 0;
+    TAILQ_REMOVE(&bc->lru, e, lru);
+    TAILQ_INSERT_HEAD(&bc->lru, e, lru);
+}
+
+/* Free up the least recently used entry, writing it back first if needed. The
+   entry is moved to the MRU end, so that consecutive calls return different
+   entries. If the write-back fails, the entry stays dirty but still goes to
+   the MRU end, so that the next request tries another one rather than
+   failing on the same block forever. */
+static bc_entry_t *bc_evict(kos_blockcache_t *bc) {
+    bc_entry_t *e = TAILQ_FIRST(&bc->lru);
+
+    if(e->flags & BC_FLAG_DIRTY) {
+        if(bc->dev->write_blocks(bc->dev, e->block, e->count, e->data)) {
+            bc_touch(bc, e);
+            errno = EIO;
+            return NULL;
+        }
+
+        ++bc->stats.writebacks;
+        ++bc->stats.writeback_runs;
+    }
+
+    if(e->flags & BC_FLAG_VALID) {
+        LIST_REMOVE(e, hash);
+        ++bc->stats.evictions;
+    }
+
+    e->flags = 0;
+    bc_touch(bc, e);
+
+    return e;
+}
+
+static void bc_insert(kos_blockcache_t *bc, bc_entry_t *e, uint64_t block,
+                      size_t count, uint32_t flags) {
+    e->block = block;
+    e->count = count;
+    e->flags = flags;
+    LIST_INSERT_HEAD(bc_bucket(bc, block), e, hash);
+}
+
+/* How many whole entries after the given one can be read along with it. */
+static size_t bc_readahead_count(kos_blockcache_t *bc, uint64_t block) {
+    size_t i;
+
+    for(i = 0; i < bc->readahead; i++) {
+        block += bc->bpe;
+
+        if(block + bc->bpe > bc->dev_blocks || bc_lookup(bc, block))
+            break;
+    }
+
+    return i;
+}
+
+/* Read n whole entries in one go, starting with the one that was asked for.
+   Returns that first entry. */
+static bc_entry_t *bc_fill(kos_blockcache_t *bc, uint64_t block, size_t n) {
+    size_t esz = bc->bpe << bc->dev->l_block_size;
+    bc_entry_t *e, *rv = NULL;
+    size_t i;
+
+    if(bc->dev->read_blocks(bc->dev, block, n * bc->bpe, bc->stage))
+        return NULL;
+
+    for(i = 0; i < n; i++) {
+        if(!(e = bc_evict(bc)))
+            break;
+
+        memcpy(e->data, bc->stage + i * esz, esz);
+
+        if(i) {
+            bc_insert(bc, e, block + i * bc->bpe, bc->bpe,
+                      BC_FLAG_VALID | BC_FLAG_READAHEAD);
+            ++bc->stats.readaheads;
+        }
+        else {
+            bc_insert(bc, e, block, bc->bpe, BC_FLAG_VALID);
+            rv = e;
+        }
+    }
+
+    return rv;
+}
+
+static inline int bc_check(kos_blockcache_t *bc, size_t count) {
+    if(!count || count > bc->bpe) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return 0;
+}
+
+uint8_t *blockcache_read(kos_blockcache_t *bc, uint64_t block, size_t count) {
+    bc_entry_t *e;
+    size_t n = 0;
+    int seq;
+
+    if(bc_check(bc, count))
+        return NULL;
+
+    seq = (block == bc->next);
+    bc->next = block + count;
+
+    if((e = bc_lookup(bc, block))) {
+        ++bc->stats.hits;
+
+        if(e->flags & BC_FLAG_READAHEAD) {
+            ++bc->stats.readahead_hits;
+            e->flags &= ~BC_FLAG_READAHEAD;
+        }
+
+        bc_touch(bc, e);
+        return e->data;
+    }
+
+    ++bc->stats.misses;
+
+    if(seq && count == bc->bpe)
+        n = bc_readahead_count(bc, block);
+
+    /* If reading ahead fails (say, because we ran off the end of a disc whose
+       size we don't know), still try to get what was asked for. */
+    if(n && (e = bc_fill(bc, block, n + 1)))
+        return e->data;
+
+    if(!(e = bc_evict(bc)))
+        return NULL;
+
+    if(bc->dev->read_blocks(bc->dev, block, count, e->data)) {
+        bc_drop(bc, e);
+        errno = EIO;
+        return NULL;
+    }
+
+    bc_insert(bc, e, block, count, BC_FLAG_VALID);
+    return e->data;
+}
+
+uint8_t *blockcache_claim(kos_blockcache_t *bc, uint64_t block, size_t count) {
+    bc_entry_t *e;
+
+    if(bc_check(bc, count))
+        return NULL;
+
+    if((e = bc_lookup(bc, block))) {
+        e->flags = (e->flags & ~BC_FLAG_READAHEAD) | BC_FLAG_DIRTY;
+        bc_touch(bc, e);
+        return e->data;
+    }
+
+    if(!(e = bc_evict(bc)))
+        return NULL;
+
+    bc_insert(bc, e, block, count, BC_FLAG_VALID | BC_FLAG_DIRTY);
+    return e->data;
+}
+
+int blockcache_mark_dirty(kos_blockcache_t *bc, uint64_t block) {
+    bc_entry_t *e = bc_lookup(bc, block);
+
+    if(!e) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    e->flags |= BC_FLAG_DIRTY;
+    bc_touch(bc, e);
+    return 0;
+}
+
+static int bc_cmp(const void *a, const void *b) {
+    const bc_entry_t *ea = *(const bc_entry_t * const *)a;
+    const bc_entry_t *eb = *(const bc_entry_t * const *)b;
+
+    return (ea->block > eb->block) - (ea->block < eb->block);
+}
+
+int blockcache_flush(kos_blockcache_t *bc) {
+    size_t l = bc->dev->l_block_size;
+    size_t i, j, k, n = 0, blocks, off;
+    const uint8_t *buf;
+    bc_entry_t *e;
+    int rv = 0;
+
+    TAILQ_FOREACH(e, &bc->lru, lru) {
+        if(e->flags & BC_FLAG_DIRTY)
+            bc->sorted[n++] = e;
+    }
+
+    if(!n)
+        return 0;
+
+    qsort(bc->sorted, n, sizeof(bc_entry_t *), bc_cmp);
+
+    for(i = 0; i < n; i = j) {
+        /* Find the run of entries that follow each other on the device. */
+        blocks = bc->sorted[i]->count;
+
+        for(j = i + 1; j < n && j - i < bc->stage_entries; j++) {
+            e = bc->sorted[j - 1];
+
+            if(bc->sorted[j]->block != e->block + e->count)
+                break;
+
+            blocks += bc->sorted[j]->count;
+        }
+
+        if(j - i == 1) {
+            buf = bc->sorted[i]->data;
+        }
+        else {
+            for(k = i, off = 0; k < j; k++) {
+                memcpy(bc->stage + off, bc->sorted[k]->data,
+                       bc->sorted[k]->count << l);
+                off += bc->sorted[k]->count << l;
+            }
+
+            buf = bc->stage;
+        }
+
+        if(bc->dev->write_blocks(bc->dev, bc->sorted[i]->block, blocks, buf)) {
+            errno = EIO;
+            rv = -1;
+            continue;
+        }
+
+        for(k = i; k < j; k++)
+            bc->sorted[k]->flags &= ~BC_FLAG_DIRTY;
+
+        bc->stats.writebacks += j - i;
+        ++bc->stats.writeback_runs;
+    }
+
+    return rv;
+}
+
+void blockcache_invalidate(kos_blockcache_t *bc) {
+    size_t i;
+
+    for(i = 0; i < bc->nentries; i++)
+        bc_drop(bc, &bc->entries[i]);
+
+    bc->next = UINT64_MAX;
+}
+
+void blockcache_set_readahead(kos_blockcache_t *bc, size_t entries) {
+    if(entries > bc->nentries / 4)
+        entries = bc->nentries / 4;
+
+    if(entries > bc->stage_entries - 1)
+        entries = bc->stage_entries - 1;
+
+    bc->readahead = entries;
+}
+
+void blockcache_get_stats(const kos_blockcache_t *bc,
+                          blockcache_stats_t *stats) {
+    *stats = bc->stats;
+}
+
+void blockcache_reset_stats(kos_blockcache_t *bc) {
+    memset(&bc->stats, 0, sizeof(bc->stats));
+}
+
+kos_blockcache_t *blockcache_create(struct kos_blockdev *dev,
+                                    size_t blocks_per_entry, size_t entries) {
+    kos_blockcache_t *bc;
+    size_t i, nbuckets = 2;
+
+    if(!dev || !blocks_per_entry || entries < 2) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    if(!(bc = (kos_blockcache_t *)calloc(1, sizeof(kos_blockcache_t)))) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    bc->dev = dev;
+    bc->dev_blocks = dev->count_blocks ? dev->count_blocks(dev) : UINT64_MAX;
+    bc->bpe = blocks_per_entry;
+    bc->nentries = entries;
+    bc->next = UINT64_MAX;
+
+    /* Keep every entry 32-byte aligned, for the devices that use DMA. */
+    bc->entry_size = ((blocks_per_entry << dev->l_block_size) + 31) & ~31;
+    bc->stage_entries = entries < BC_STAGE_ENTRIES ? entries : BC_STAGE_ENTRIES;
+
+    /* Aim for about one entry per bucket. */
+    for(bc->hash_shift = 31; nbuckets < entries; nbuckets <<= 1)
+        --bc->hash_shift;
+
+    bc->buckets = (struct bc_bucket *)calloc(nbuckets, sizeof(struct bc_bucket));
+    bc->entries = (bc_entry_t *)calloc(entries, sizeof(bc_entry_t));
+    bc->sorted = (bc_entry_t **)malloc(entries * sizeof(bc_entry_t *));
+    bc->data = (uint8_t *)aligned_alloc(32, entries * bc->entry_size);
+    bc->stage = (uint8_t *)aligned_alloc(32,
+                                         bc->stage_entries * bc->entry_size);
+
+    if(!bc->buckets || !bc->entries || !bc->sorted || !bc->data ||
+       !bc->stage) {
+        blockcache_destroy(bc);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    TAILQ_INIT(&bc->lru);
+
+    for(i = 0; i < nbuckets; i++)
+        LIST_INIT(&bc->buckets[i]);
+
+    for(i = 0; i < entries; i++) {
+        bc->entries[i].data = bc->data + i * bc->entry_size;
+        TAILQ_INSERT_TAIL(&bc->lru, &bc->entries[i], lru);
+    }
+
+    blockcache_set_readahead(bc, BLOCKCACHE_READAHEAD);
+
+    return bc;
+}
+
+void blockcache_destroy(kos_blockcache_t *bc) {
+    free(bc->stage);
+    free(bc->data);
+    free(bc->sorted);
+    free(bc->entries);
+    free(bc->buckets);
+    free(bc);
+}
@@ -28,12 +28,15 @@ something like this:
 */
 
 #include <stdatomic.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <string.h>
 #include <assert.h>
 #include <errno.h>
 #include <stdlib.h>
 #include <limits.h>
+#include <poll.h>
+#include <sys/uio.h>
 
 #include <kos/fs.h>
 #include <kos/thread.h>
@@ -254,23 +257,27 @@ file_t fs_open_handle(vfs_handler_t *vfs, void *vhnd) {
 }
 
 vfs_handler_t *fs_get_handler(file_t fd) {
+    fs_hnd_t *h = fd_table[fd];
+
     /* Make sure it exists */
-    if(!fd_table[fd]) {
+    if(!h) {
         errno = EBADF;
         return NULL;
     }
 
-    return fd_table[fd]->handler;
+    return h->handler;
 }
 
 void *fs_get_handle(file_t fd) {
+    fs_hnd_t *h = fd_table[fd];
+
     /* Make sure it exists */
-    if(!fd_table[fd]) {
+    if(!h) {
         errno = EBADF;
         return NULL;
     }
 
-    return fd_table[fd]->hnd;
+    return h->hnd;
 }
 
 file_t fs_dup(file_t oldfd) {
@@ -343,10 +350,18 @@ int fs_close(file_t fd) {
 
     if(!h) return -1;
 
-    /* Deref it and remove it from our table */
+    /* Wake up anyone polling the fd, and drop its epoll registrations */
+    __poll_event_trigger(fd, POLLNVAL);
+
+    /* Remove it from our table before the deref, so that nobody can find the
+       handle through the fd while it's being torn down. */
+    if(!atomic_compare_exchange_strong(&fd_table[fd], &h, NULL)) {
+        errno = EBADF;
+        return -1;
+    }
+
     retval = fs_hnd_unref(h);
 
-    atomic_store(&fd_table[fd], NULL);
     return retval ? -1 : 0;
 }
 
@@ -377,6 +392,187 @@ ssize_t fs_write(file_t fd, const void *buffer, size_t cnt) {
     return h->handler->write(h->hnd, buffer, cnt);
 }
 
+static int fs_iov_check(const struct iovec *iov, int iovcnt) {
+    size_t total = 0;
+    int i;
+
+    if(iovcnt <= 0 || iovcnt > IOV_MAX) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    for(i = 0; i < iovcnt; i++) {
+        if(iov[i].iov_len > SSIZE_MAX - total) {
+            errno = EINVAL;
+            return -1;
+        }
+
+        total += iov[i].iov_len;
+    }
+
+    return 0;
+}
+
+ssize_t fs_readv(file_t fd, const struct iovec *iov, int iovcnt) {
+    fs_hnd_t *h = fs_map_hnd(fd);
+    ssize_t rv, total = 0;
+    int i;
+
+    if(!h) return -1;
+
+    if(h->handler == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if(fs_iov_check(iov, iovcnt))
+        return -1;
+
+    if(h->handler->readv)
+        return h->handler->readv(h->hnd, iov, iovcnt);
+
+    if(h->handler->read == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* Fall back to one read per buffer, stopping at the first short one. */
+    for(i = 0; i < iovcnt; i++) {
+        rv = h->handler->read(h->hnd, iov[i].iov_base, iov[i].iov_len);
+
+        if(rv < 0)
+            return total ? total : -1;
+
+        total += rv;
+
+        if((size_t)rv < iov[i].iov_len)
+            break;
+    }
+
+    return total;
+}
+
+ssize_t fs_writev(file_t fd, const struct iovec *iov, int iovcnt) {
+    fs_hnd_t *h = fs_map_hnd(fd);
+    ssize_t rv, total = 0;
+    int i;
+
+    if(!h) return -1;
+
+    if(h->handler == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if(fs_iov_check(iov, iovcnt))
+        return -1;
+
+    if(h->handler->writev)
+        return h->handler->writev(h->hnd, iov, iovcnt);
+
+    if(h->handler->write == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    for(i = 0; i < iovcnt; i++) {
+        rv = h->handler->write(h->hnd, iov[i].iov_base, iov[i].iov_len);
+
+        if(rv < 0)
+            return total ? total : -1;
+
+        total += rv;
+
+        if((size_t)rv < iov[i].iov_len)
+            break;
+    }
+
+    return total;
+}
+
+/* Emulate a positional read or write with seeks around a normal one. This
+   is not atomic with respect to other users of the same descriptor. */
+static ssize_t fs_hnd_prw(fs_hnd_t *h, void *buffer, size_t cnt,
+                          _off64_t offset, bool wr) {
+    vfs_handler_t *vfs = h->handler;
+    _off64_t old;
+    ssize_t rv;
+    int err;
+
+    if(wr ? !vfs->write : !vfs->read) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if(vfs->seek64 && vfs->tell64) {
+        old = vfs->tell64(h->hnd);
+        if(old < 0 || vfs->seek64(h->hnd, offset, SEEK_SET) < 0)
+            return -1;
+    }
+    else if(vfs->seek && vfs->tell) {
+        if(offset > INT32_MAX) {
+            errno = EOVERFLOW;
+            return -1;
+        }
+
+        old = vfs->tell(h->hnd);
+        if(old < 0 || vfs->seek(h->hnd, (off_t)offset, SEEK_SET) < 0)
+            return -1;
+    }
+    else {
+        errno = ESPIPE;
+        return -1;
+    }
+
+    if(wr)
+        rv = vfs->write(h->hnd, buffer, cnt);
+    else
+        rv = vfs->read(h->hnd, buffer, cnt);
+
+    /* Put the file pointer back, without clobbering errno. */
+    err = errno;
+
+    if(vfs->seek64 && vfs->tell64)
+        vfs->seek64(h->hnd, old, SEEK_SET);
+    else
+        vfs->seek(h->hnd, (off_t)old, SEEK_SET);
+
+    errno = err;
+    return rv;
+}
+
+ssize_t fs_pread(file_t fd, void *buffer, size_t cnt, _off64_t offset) {
+    fs_hnd_t *h = fs_map_hnd(fd);
+
+    if(!h) return -1;
+
+    if(h->handler == NULL || offset < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if(h->handler->pread64)
+        return h->handler->pread64(h->hnd, buffer, cnt, offset);
+
+    return fs_hnd_prw(h, buffer, cnt, offset, false);
+}
+
+ssize_t fs_pwrite(file_t fd, const void *buffer, size_t cnt, _off64_t offset) {
+    fs_hnd_t *h = fs_map_hnd(fd);
+
+    if(!h) return -1;
+
+    if(h->handler == NULL || offset < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if(h->handler->pwrite64)
+        return h->handler->pwrite64(h->hnd, buffer, cnt, offset);
+
+    return fs_hnd_prw(h, (void *)buffer, cnt, offset, true);
+}
+
 off_t fs_seek(file_t fd, off_t offset, int whence) {
     fs_hnd_t *h = fs_map_hnd(fd);
 
@@ -182,7 +182,11 @@ static vfs_handler_t vh = {
     NULL,               /* total64 */
     NULL,               /* readlink */
     dev_rewinddir,
-    NULL                /* fstat */
+    NULL,               /* fstat */
+    NULL,               /* readv */
+    NULL,               /* writev */
+    NULL,               /* pread64 */
+    NULL                /* pwrite64 */
 };
 
 void fs_dev_init(void) {
@@ -243,7 +243,11 @@ static vfs_handler_t vh = {
     NULL,               /* total64 */
     NULL,               /* readlink */
     NULL,
-    null_fstat
+    null_fstat,
+    NULL,               /* readv */
+    NULL,               /* writev */
+    NULL,               /* pread64 */
+    NULL                /* pwrite64 */
 };
 
 void fs_null_init(void) {
@@ -802,7 +802,11 @@ static vfs_handler_t vh = {
     NULL,
     NULL,
     pty_rewinddir,
-    pty_fstat
+    pty_fstat,
+    NULL,               /* readv */
+    NULL,               /* writev */
+    NULL,               /* pread64 */
+    NULL                /* pwrite64 */
 };
 
 /* Are we initialized? */
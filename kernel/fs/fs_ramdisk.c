@@ -43,6 +43,8 @@ cache data from disk rather than as a general purpose file system.
 #include <stdlib.h>
 #include <assert.h>
 #include <errno.h>
+#include <stdbool.h>
+#include <sys/uio.h>
 
 #ifdef __STRICT_ANSI__
 /* Newlib doesn't prototype this function in strict standards compliant mode, so
@@ -379,62 +381,178 @@ static int ramdisk_close(void * h) {
     return 0;
 }
 
+/* Check that a handle is valid for reading. Assumes we hold rd_mutex. */
+static inline bool ramdisk_fd_readable(file_t fd) {
+    return fd < FS_RAMDISK_MAX_FILES && fh[fd].file != NULL && !fh[fd].dir;
+}
+
+/* Check that a handle is valid for writing. Assumes we hold rd_mutex. */
+static inline bool ramdisk_fd_writable(file_t fd) {
+    return ramdisk_fd_readable(fd) && fh[fd].file->openfor == OPENFOR_WRITE;
+}
+
+/* Read from a file at the given position. Assumes we hold rd_mutex and that
+   the handle is valid. */
+static size_t ramdisk_read_at(file_t fd, void *buf, size_t bytes,
+                              uintptr_t pos) {
+    /* Is there enough left? */
+    if(pos >= fh[fd].file->size)
+        return 0;
+
+    if((pos + bytes) > fh[fd].file->size)
+        bytes = fh[fd].file->size - pos;
+
+    /* Copy out the requested amount */
+    memcpy(buf, ((uint8_t *)fh[fd].file->data) + pos, bytes);
+
+    return bytes;
+}
+
+/* Write to a file at the given position. Assumes we hold rd_mutex and that
+   the handle is valid. */
+static ssize_t ramdisk_write_at(file_t fd, const void *buf, size_t bytes,
+                                uintptr_t pos) {
+    /* Is there enough left? */
+    if((pos + bytes) > fh[fd].file->datasize) {
+        /* We need to realloc the block */
+        void * np = realloc(fh[fd].file->data, (pos + bytes) + 4096);
+
+        if(np == NULL)
+            return -1;
+
+        fh[fd].file->data = np;
+        fh[fd].file->datasize = (pos + bytes) + 4096;
+    }
+
+    /* Zero out any gap left by writing past the end of the file */
+    if(pos > fh[fd].file->size)
+        memset(((uint8_t *)fh[fd].file->data) + fh[fd].file->size, 0,
+               pos - fh[fd].file->size);
+
+    /* Copy in the requested amount */
+    memcpy(((uint8_t *)fh[fd].file->data) + pos, buf, bytes);
+
+    if(fh[fd].file->size < pos + bytes) {
+        fh[fd].file->size = pos + bytes;
+    }
+
+    return bytes;
+}
+
 /* Read from a file */
 static ssize_t ramdisk_read(void * h, void *buf, size_t bytes) {
-    ssize_t rv = -1;
     file_t  fd = (file_t)h;
 
     mutex_lock_scoped(&rd_mutex);
 
     /* Check that the fd is valid */
-    if(fd < FS_RAMDISK_MAX_FILES && fh[fd].file != NULL && !fh[fd].dir) {
-        /* Is there enough left? */
-        if((fh[fd].ptr + bytes) > fh[fd].file->size)
-            bytes = fh[fd].file->size - fh[fd].ptr;
-
-        /* Copy out the requested amount */
-        memcpy(buf, ((uint8_t *)fh[fd].file->data) + fh[fd].ptr, bytes);
-        fh[fd].ptr += bytes;
+    if(!ramdisk_fd_readable(fd))
+        return -1;
 
-        rv = bytes;
-    }
+    bytes = ramdisk_read_at(fd, buf, bytes, fh[fd].ptr);
+    fh[fd].ptr += bytes;
 
-    return rv;
+    return bytes;
 }
 
 /* Write to a file */
 static ssize_t ramdisk_write(void * h, const void *buf, size_t bytes) {
-    ssize_t rv = -1;
+    ssize_t rv;
     file_t  fd = (file_t)h;
 
     mutex_lock_scoped(&rd_mutex);
 
     /* Check that the fd is valid */
-    if(fd < FS_RAMDISK_MAX_FILES && fh[fd].file != NULL && !fh[fd].dir && fh[fd].file->openfor == OPENFOR_WRITE) {
-        /* Is there enough left? */
-        if((fh[fd].ptr + bytes) > fh[fd].file->datasize) {
-            /* We need to realloc the block */
-            void * np = realloc(fh[fd].file->data, (fh[fd].ptr + bytes) + 4096);
+    if(!ramdisk_fd_writable(fd))
+        return -1;
 
-            if(np == NULL)
-                return -1;
+    rv = ramdisk_write_at(fd, buf, bytes, fh[fd].ptr);
+    if(rv > 0)
+        fh[fd].ptr += rv;
 
-            fh[fd].file->data = np;
-            fh[fd].file->datasize = (fh[fd].ptr + bytes) + 4096;
-        }
+    return rv;
+}
 
-        /* Copy out the requested amount */
-        memcpy(((uint8_t *)fh[fd].file->data) + fh[fd].ptr, buf, bytes);
+/* Read from a file into several buffers, under one lock */
+static ssize_t ramdisk_readv(void * h, const struct iovec *iov, int iovcnt) {
+    size_t bytes, total = 0;
+    file_t  fd = (file_t)h;
+    int i;
+
+    mutex_lock_scoped(&rd_mutex);
+
+    if(!ramdisk_fd_readable(fd))
+        return -1;
+
+    for(i = 0; i < iovcnt; i++) {
+        bytes = ramdisk_read_at(fd, iov[i].iov_base, iov[i].iov_len,
+                                fh[fd].ptr);
         fh[fd].ptr += bytes;
+        total += bytes;
 
-        if(fh[fd].file->size < fh[fd].ptr) {
-            fh[fd].file->size = fh[fd].ptr;
-        }
+        if(bytes < iov[i].iov_len)
+            break;
+    }
+
+    return total;
+}
+
+/* Write to a file from several buffers, under one lock */
+static ssize_t ramdisk_writev(void * h, const struct iovec *iov, int iovcnt) {
+    ssize_t rv, total = 0;
+    file_t  fd = (file_t)h;
+    int i;
+
+    mutex_lock_scoped(&rd_mutex);
+
+    if(!ramdisk_fd_writable(fd))
+        return -1;
 
-        rv = bytes;
+    for(i = 0; i < iovcnt; i++) {
+        rv = ramdisk_write_at(fd, iov[i].iov_base, iov[i].iov_len,
+                              fh[fd].ptr);
+        if(rv < 0)
+            return total ? total : -1;
+
+        fh[fd].ptr += rv;
+        total += rv;
     }
 
-    return rv;
+    return total;
+}
+
+/* Read from a file at a given offset; the file pointer is left alone. */
+static ssize_t ramdisk_pread64(void * h, void *buf, size_t bytes,
+                               _off64_t offset) {
+    file_t  fd = (file_t)h;
+
+    mutex_lock_scoped(&rd_mutex);
+
+    if(!ramdisk_fd_readable(fd))
+        return -1;
+
+    if(offset > UINT32_MAX)
+        return 0;
+
+    return ramdisk_read_at(fd, buf, bytes, (uintptr_t)offset);
+}
+
+/* Write to a file at a given offset; the file pointer is left alone. */
+static ssize_t ramdisk_pwrite64(void * h, const void *buf, size_t bytes,
+                                _off64_t offset) {
+    file_t  fd = (file_t)h;
+
+    mutex_lock_scoped(&rd_mutex);
+
+    if(!ramdisk_fd_writable(fd))
+        return -1;
+
+    if(offset + bytes > UINT32_MAX) {
+        errno = EFBIG;
+        return -1;
+    }
+
+    return ramdisk_write_at(fd, buf, bytes, (uintptr_t)offset);
 }
 
 /* Seek elsewhere in a file */
@@ -744,7 +862,11 @@ static vfs_handler_t vh = {
     NULL,               /* total64 XXX */
     NULL,               /* readlink XXX */
     ramdisk_rewinddir,
-    ramdisk_fstat
+    ramdisk_fstat,
+    ramdisk_readv,
+    ramdisk_writev,
+    ramdisk_pread64,
+    ramdisk_pwrite64
 };
 
 /* Attach a piece of memory to a file. This works somewhat like open for
@@ -29,6 +29,7 @@ on sunsite.unc.edu in /pub/Linux/system/recovery/, or as a package under Debian
 #include <stdio.h>
 #include <assert.h>
 #include <errno.h>
+#include <sys/uio.h>
 
 #define ROMFS_MAXFN 128
 #define ROMFH_HRD 0
@@ -297,6 +298,54 @@ static ssize_t romdisk_read(void *h, void *buf, size_t bytes) {
     return bytes;
 }
 
+/* Read a file into several buffers */
+static ssize_t romdisk_readv(void *h, const struct iovec *iov, int iovcnt) {
+    rd_fd_t *fd = (rd_fd_t *)h;
+    size_t bytes, total = 0;
+    int i;
+
+    /* Check that the fd is valid */
+    if(romdisk_fd_invalid(fd) || fd->dir) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    for(i = 0; i < iovcnt && fd->ptr < fd->size; i++) {
+        bytes = iov[i].iov_len;
+
+        if((fd->ptr + bytes) > fd->size)
+            bytes = fd->size - fd->ptr;
+
+        memcpy(iov[i].iov_base, fd->mnt->image + fd->index + fd->ptr, bytes);
+        fd->ptr += bytes;
+        total += bytes;
+    }
+
+    return total;
+}
+
+/* Read from a file at a given offset; the file pointer is left alone. */
+static ssize_t romdisk_pread64(void *h, void *buf, size_t bytes,
+                               _off64_t offset) {
+    rd_fd_t *fd = (rd_fd_t *)h;
+
+    /* Check that the fd is valid */
+    if(romdisk_fd_invalid(fd) || fd->dir) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if(offset >= fd->size)
+        return 0;
+
+    if((offset + bytes) > fd->size)
+        bytes = fd->size - offset;
+
+    memcpy(buf, fd->mnt->image + fd->index + offset, bytes);
+
+    return bytes;
+}
+
 /* Just to get the errno that might be better recognized upstream. */
 static ssize_t romdisk_write(void *h, const void *buf, size_t bytes) {
     (void)h;
@@ -615,7 +664,11 @@ static vfs_handler_t vh = {
     NULL,                       /* total64 */
     NULL,                       /* readlink */
     romdisk_rewinddir,
-    romdisk_fstat
+    romdisk_fstat,
+    romdisk_readv,
+    NULL,                       /* writev */
+    romdisk_pread64,
+    NULL                        /* pwrite64 */
 };
 
 /* Are we initialized? */
@@ -9,10 +9,12 @@
 #include <kos/fs.h>
 #include <kos/fs_socket.h>
 #include <kos/net.h>
+#include <kos/timer.h>
 
 #include <errno.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include <sys/queue.h>
 #include <sys/socket.h>
@@ -131,7 +133,11 @@ static vfs_handler_t vh = {
     NULL,            /* total64 */
     NULL,            /* readlink */
     NULL,            /* rewinddir */
-    fs_socket_fstat  /* fstat */
+    fs_socket_fstat, /* fstat */
+    NULL,            /* readv */
+    NULL,            /* writev */
+    NULL,            /* pread64 */
+    NULL             /* pwrite64 */
 };
 
 /* Have we been initialized? */
@@ -505,6 +511,257 @@ ssize_t sendto(int sock, const void *message, size_t length, int flags,
                                  dest_len);
 }
 
+/* Receive into the buffers of a message one at a time, for protocols that
+   don't handle messages themselves. Only the first buffer waits for data. */
+static ssize_t recvmsg_fallback(net_socket_t *hnd, struct msghdr *msg,
+                                int flags) {
+    struct sockaddr *addr = (struct sockaddr *)msg->msg_name;
+    socklen_t *alen = addr ? &msg->msg_namelen : NULL;
+    ssize_t rv, total = 0;
+    int i;
+
+    for(i = 0; i < msg->msg_iovlen; ++i) {
+        if(!msg->msg_iov[i].iov_len)
+            continue;
+
+        rv = hnd->protocol->recvfrom(hnd, msg->msg_iov[i].iov_base,
+                                     msg->msg_iov[i].iov_len, flags, addr,
+                                     alen);
+
+        if(rv < 0)
+            return total ? total : -1;
+
+        total += rv;
+
+        if((size_t)rv < msg->msg_iov[i].iov_len)
+            break;
+
+        flags |= MSG_DONTWAIT;
+        addr = NULL;
+        alen = NULL;
+    }
+
+    msg->msg_controllen = 0;
+    msg->msg_flags = 0;
+
+    return total;
+}
+
+static ssize_t sendmsg_fallback(net_socket_t *hnd, const struct msghdr *msg,
+                                int flags) {
+    ssize_t rv, total = 0;
+    int i;
+
+    for(i = 0; i < msg->msg_iovlen; ++i) {
+        rv = hnd->protocol->sendto(hnd, msg->msg_iov[i].iov_base,
+                                   msg->msg_iov[i].iov_len, flags,
+                                   (const struct sockaddr *)msg->msg_name,
+                                   msg->msg_namelen);
+
+        if(rv < 0)
+            return total ? total : -1;
+
+        total += rv;
+
+        if((size_t)rv < msg->msg_iov[i].iov_len)
+            break;
+    }
+
+    return total;
+}
+
+static int sock_recvmmsg(net_socket_t *hnd, struct mmsghdr *msgvec,
+                         unsigned int vlen, int flags) {
+    unsigned int i;
+    ssize_t rv;
+
+    if(hnd->protocol->recvmmsg)
+        return hnd->protocol->recvmmsg(hnd, msgvec, vlen, flags);
+
+    for(i = 0; i < vlen; ++i) {
+        rv = recvmsg_fallback(hnd, &msgvec[i].msg_hdr, flags);
+
+        if(rv < 0)
+            return i ? (int)i : -1;
+
+        msgvec[i].msg_len = rv;
+
+        if(!rv)
+            return i + 1;
+
+        if(flags & MSG_WAITFORONE)
+            flags |= MSG_DONTWAIT;
+    }
+
+    return vlen;
+}
+
+static int sock_sendmmsg(net_socket_t *hnd, struct mmsghdr *msgvec,
+                         unsigned int vlen, int flags) {
+    unsigned int i;
+    ssize_t rv;
+
+    if(hnd->protocol->sendmmsg)
+        return hnd->protocol->sendmmsg(hnd, msgvec, vlen, flags);
+
+    for(i = 0; i < vlen; ++i) {
+        rv = sendmsg_fallback(hnd, &msgvec[i].msg_hdr, flags);
+
+        if(rv < 0)
+            return i ? (int)i : -1;
+
+        msgvec[i].msg_len = rv;
+    }
+
+    return vlen;
+}
+
+ssize_t recvmsg(int sock, struct msghdr *msg, int flags) {
+    net_socket_t *hnd;
+    struct mmsghdr mmsg;
+    int rv;
+
+    hnd = (net_socket_t *)fs_get_handle(sock);
+
+    if(hnd == NULL) {
+        errno = EBADF;
+        return -1;
+    }
+
+    /* Make sure this is actually a socket. */
+    if(fs_get_handler(sock) != &vh) {
+        errno = ENOTSOCK;
+        return -1;
+    }
+
+    if(msg == NULL) {
+        errno = EFAULT;
+        return -1;
+    }
+
+    mmsg.msg_hdr = *msg;
+    mmsg.msg_len = 0;
+    rv = sock_recvmmsg(hnd, &mmsg, 1, flags & ~MSG_WAITFORONE);
+
+    if(rv < 0)
+        return -1;
+
+    *msg = mmsg.msg_hdr;
+    return rv ? (ssize_t)mmsg.msg_len : 0;
+}
+
+int recvmmsg(int sock, struct mmsghdr *msgvec, unsigned int vlen, int flags,
+             struct timespec *timeout) {
+    net_socket_t *hnd;
+    uint64_t end;
+    unsigned int count = 0;
+    int rv;
+
+    hnd = (net_socket_t *)fs_get_handle(sock);
+
+    if(hnd == NULL) {
+        errno = EBADF;
+        return -1;
+    }
+
+    /* Make sure this is actually a socket. */
+    if(fs_get_handler(sock) != &vh) {
+        errno = ENOTSOCK;
+        return -1;
+    }
+
+    if(msgvec == NULL && vlen) {
+        errno = EFAULT;
+        return -1;
+    }
+
+    if(!timeout)
+        return sock_recvmmsg(hnd, msgvec, vlen, flags);
+
+    if(timeout->tv_sec < 0 || timeout->tv_nsec < 0 ||
+       timeout->tv_nsec >= 1000000000) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* Wait for one message at a time, checking the time after each. */
+    end = timer_ns_gettime64() + (uint64_t)timeout->tv_sec * 1000000000 +
+          timeout->tv_nsec;
+
+    while(count < vlen) {
+        rv = sock_recvmmsg(hnd, msgvec + count, vlen - count,
+                           flags | MSG_WAITFORONE);
+
+        if(rv < 0)
+            return count ? (int)count : -1;
+        else if(!rv)
+            break;
+
+        count += rv;
+
+        if((flags & (MSG_WAITFORONE | MSG_DONTWAIT)) ||
+           timer_ns_gettime64() >= end)
+            break;
+    }
+
+    return count;
+}
+
+ssize_t sendmsg(int sock, const struct msghdr *msg, int flags) {
+    net_socket_t *hnd;
+    struct mmsghdr mmsg;
+
+    hnd = (net_socket_t *)fs_get_handle(sock);
+
+    if(hnd == NULL) {
+        errno = EBADF;
+        return -1;
+    }
+
+    /* Make sure this is actually a socket. */
+    if(fs_get_handler(sock) != &vh) {
+        errno = ENOTSOCK;
+        return -1;
+    }
+
+    if(msg == NULL) {
+        errno = EFAULT;
+        return -1;
+    }
+
+    mmsg.msg_hdr = *msg;
+    mmsg.msg_len = 0;
+
+    if(sock_sendmmsg(hnd, &mmsg, 1, flags) < 0)
+        return -1;
+
+    return mmsg.msg_len;
+}
+
+int sendmmsg(int sock, struct mmsghdr *msgvec, unsigned int vlen, int flags) {
+    net_socket_t *hnd;
+
+    hnd = (net_socket_t *)fs_get_handle(sock);
+
+    if(hnd == NULL) {
+        errno = EBADF;
+        return -1;
+    }
+
+    /* Make sure this is actually a socket. */
+    if(fs_get_handler(sock) != &vh) {
+        errno = ENOTSOCK;
+        return -1;
+    }
+
+    if(msgvec == NULL && vlen) {
+        errno = EFAULT;
+        return -1;
+    }
+
+    return sock_sendmmsg(hnd, msgvec, vlen, flags);
+}
+
 int shutdown(int sock, int how) {
     net_socket_t *hnd;
 
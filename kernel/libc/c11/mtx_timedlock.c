@@ -10,7 +10,7 @@
 int mtx_timedlock(mtx_t *restrict mtx, const struct timespec *restrict ts) {
     int ms = 0;
 
-    if(mtx->type > MUTEX_TYPE_RECURSIVE) {
+    if(!MUTEX_TYPE_VALID(mtx->type)) {
         errno = EINVAL;
         return -1;
     }
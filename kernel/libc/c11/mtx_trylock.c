@@ -8,7 +8,7 @@
 #include <errno.h>
 
 int mtx_trylock(mtx_t *mtx) {
-    if(mtx->type > MUTEX_TYPE_RECURSIVE) {
+    if(!MUTEX_TYPE_VALID(mtx->type)) {
         errno = EINVAL;
         return -1;
     }
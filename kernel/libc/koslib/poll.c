@@ -7,94 +7,125 @@
 
 #include <poll.h>
 #include <errno.h>
+#include <stdbool.h>
+#include <stdlib.h>
 #include <sys/queue.h>
+#include <sys/epoll.h>
 
 #include <kos/fs.h>
 #include <kos/irq.h>
 #include <kos/mutex.h>
 #include <kos/cond.h>
+#include <kos/timer.h>
 
-struct poll_int {
-    LIST_ENTRY(poll_int) entry;
-    struct pollfd *fds;
-    nfds_t nfds;
-    int nmatched;
-    condvar_t cv;
-};
+/* Someone (a thread in poll() or an epoll instance) waiting for events on one
+   fd. These hang off of a list per fd, so that delivering an event only looks
+   at the parties that are interested in that fd. */
+typedef struct poll_sub {
+    LIST_ENTRY(poll_sub) entry;
+    int fd;
+    short events;
+    void (*notify)(struct poll_sub *sub, short revents);
+} poll_sub_t;
 
-LIST_HEAD(polllist, poll_int) poll_list;
+LIST_HEAD(poll_subs, poll_sub);
 
+static struct poll_subs fd_subs[FD_SETSIZE];
+
+/* Protects the per-fd lists, and everything hanging off of them. */
 static mutex_t mutex = MUTEX_INITIALIZER;
 
+static inline void poll_sub_add(poll_sub_t *sub) {
+    LIST_INSERT_HEAD(&fd_subs[sub->fd], sub, entry);
+}
+
 void __poll_event_trigger(int fd, short event) {
-    struct poll_int *i;
-    nfds_t j;
-    int gotone = 0;
+    poll_sub_t *sub, *next;
     short mask;
 
+    if(fd < 0 || fd >= FD_SETSIZE)
+        return;
+
     if(mutex_lock_irqsafe(&mutex))
         /* XXXX: Uhh... this is bad... */
         return;
 
-    /* Look through the list of poll fds for any that match */
-    LIST_FOREACH(i, &poll_list, entry) {
-        for(j = 0; j < i->nfds; ++j) {
-            if(i->fds[j].fd == fd) {
-                mask = i->fds[j].events | POLLERR | POLLHUP | POLLNVAL;
-                if(event & mask) {
-                    i->fds[j].revents |= event & mask;
-                    ++i->nmatched;
-                    gotone = 1;
-                }
-            }
-        }
+    /* The callbacks are allowed to unsubscribe themselves. */
+    for(sub = LIST_FIRST(&fd_subs[fd]); sub; sub = next) {
+        next = LIST_NEXT(sub, entry);
+        mask = sub->events | POLLERR | POLLHUP | POLLNVAL;
 
-        /* If we got any events, signal the waiting thread to wake it up. */
-        if(gotone) {
-            cond_signal(&i->cv);
-            gotone = 0;
-        }
+        if(event & mask)
+            sub->notify(sub, event & mask);
     }
 
     mutex_unlock(&mutex);
 }
 
+/* Current state of an fd, as far as the events asked for are concerned. */
+static short poll_fd(int fd, short events) {
+    vfs_handler_t *hndl;
+    void *hnd;
+
+    if(fd < 0 || fd >= FD_SETSIZE)
+        return POLLNVAL;
+
+    hndl = fs_get_handler(fd);
+    hnd = fs_get_handle(fd);
+
+    /* If we didn't get one of these, then assume its a bad fd. */
+    if(!hndl || !hnd)
+        return POLLNVAL;
+
+    /* Assume its a regular file if there's no poll method in the handler. */
+    if(!hndl->poll)
+        return (POLLRDNORM | POLLWRNORM) & events;
+
+    return hndl->poll(hnd, events);
+}
+
+/********************************************************************************/
+/* poll() */
+
+struct poll_int {
+    int nmatched;
+    condvar_t cv;
+};
+
+struct poll_waiter {
+    poll_sub_t sub;
+    struct poll_int *p;
+    struct pollfd *pfd;
+};
+
+/* Sets up to this size keep their waiters on the stack, so that the common
+   case of a handful of fds doesn't go through malloc() on every call. */
+#define POLL_STACK_WAITERS  8
+
+static void poll_notify(poll_sub_t *sub, short revents) {
+    struct poll_waiter *w = (struct poll_waiter *)sub;
+
+    if(!w->pfd->revents)
+        ++w->p->nmatched;
+
+    w->pfd->revents |= revents;
+    cond_signal(&w->p->cv);
+}
+
 int poll(struct pollfd fds[], nfds_t nfds, int timeout) {
-    struct poll_int p = { { 0 }, fds, nfds, 0, COND_INITIALIZER };
+    struct poll_int p = { 0, COND_INITIALIZER };
+    struct poll_waiter stack_w[POLL_STACK_WAITERS];
+    struct poll_waiter *w = stack_w;
     int tmp;
     nfds_t i;
-    vfs_handler_t *hndl;
-    void *hnd;
 
     if(mutex_lock_irqsafe(&mutex))
         return -1;
 
     /* Check if any of the fds already match */
     for(i = 0; i < nfds; ++i) {
-        hndl = fs_get_handler(fds[i].fd);
-        hnd = fs_get_handle(fds[i].fd);
-        fds[i].revents = 0;
-
-        /* If we didn't get one of these, then assume its a bad fd. */
-        if(!hndl || !hnd) {
-            fds[i].revents = POLLNVAL;
+        if((fds[i].revents = poll_fd(fds[i].fd, fds[i].events)))
             ++p.nmatched;
-            continue;
-        }
-
-        if(!hndl->poll) {
-            /* Assume its a regular file if there's no poll method in the
-               handler. */
-            if(fds[i].events & (POLLRDNORM | POLLWRNORM)) {
-                fds[i].revents |= (POLLRDNORM | POLLWRNORM) & fds[i].events;
-                ++p.nmatched;
-            }
-        }
-        else {
-            if((fds[i].revents = hndl->poll(hnd, fds[i].events))) {
-                ++p.nmatched;
-            }
-        }
     }
 
     /* If the user specified a 0 timeout, or we've already matched something,
@@ -112,12 +143,27 @@ int poll(struct pollfd fds[], nfds_t nfds, int timeout) {
         return -1;
     }
 
+    if(nfds > POLL_STACK_WAITERS &&
+       !(w = (struct poll_waiter *)malloc(sizeof(*w) * nfds))) {
+        mutex_unlock(&mutex);
+        errno = ENOMEM;
+        return -1;
+    }
+
     /* Map to the value used by cond_wait_timed() */
     if(timeout == -1)
         timeout = 0;
 
-    /* Add this instance to the list */
-    LIST_INSERT_HEAD(&poll_list, &p, entry);
+    /* Subscribe to each of the fds. None of them is out of range, or it would
+       have been flagged as invalid above. */
+    for(i = 0; i < nfds; ++i) {
+        w[i].sub.fd = fds[i].fd;
+        w[i].sub.events = fds[i].events;
+        w[i].sub.notify = poll_notify;
+        w[i].p = &p;
+        w[i].pfd = &fds[i];
+        poll_sub_add(&w[i].sub);
+    }
 
     tmp = errno;
     if(cond_wait_timed(&p.cv, &mutex, timeout)) {
@@ -129,9 +175,425 @@ int poll(struct pollfd fds[], nfds_t nfds, int timeout) {
     tmp = p.nmatched;
 
 out:
-    /* Remove this instance from the list */
-    LIST_REMOVE(&p, entry);
+    for(i = 0; i < nfds; ++i)
+        LIST_REMOVE(&w[i].sub, entry);
 
     mutex_unlock(&mutex);
+
+    if(w != stack_w)
+        free(w);
+
     return tmp;
 }
+
+/********************************************************************************/
+/* epoll */
+
+struct eventpoll;
+
+/* One fd in an epoll instance */
+typedef struct epitem {
+    poll_sub_t sub;
+    LIST_ENTRY(epitem) entry;       /* In the instance's list of fds */
+    TAILQ_ENTRY(epitem) ready;      /* In the instance's ready list */
+    struct eventpoll *ep;
+    struct epoll_event event;
+    bool subscribed;                /* Not disabled by EPOLLONESHOT */
+    bool queued;                    /* On the ready list */
+} epitem_t;
+
+TAILQ_HEAD(epitem_queue, epitem);
+
+/* The fd holds one reference, and each thread in epoll_wait() another, so that
+   closing the fd doesn't free the instance out from under a waiter. */
+typedef struct eventpoll {
+    LIST_ENTRY(eventpoll) entry;    /* In the list of open instances */
+    LIST_HEAD(, epitem) items;
+    struct epitem_queue ready;
+    condvar_t cv;
+    int refcnt;
+    bool closing;
+} eventpoll_t;
+
+/* Instances whose fd hasn't been closed */
+static LIST_HEAD(, eventpoll) ep_list = LIST_HEAD_INITIALIZER(ep_list);
+
+/* Drop a reference. Call with the mutex held; returns true if the caller
+   should free the instance once it has let go of the mutex. */
+static bool ep_put(eventpoll_t *ep) {
+    return --ep->refcnt == 0;
+}
+
+static void ep_free(eventpoll_t *ep) {
+    cond_destroy(&ep->cv);
+    free(ep);
+}
+
+static void ep_queue(epitem_t *it) {
+    if(!it->queued) {
+        TAILQ_INSERT_TAIL(&it->ep->ready, it, ready);
+        it->queued = true;
+        cond_signal(&it->ep->cv);
+    }
+}
+
+static void ep_remove(epitem_t *it) {
+    if(it->subscribed)
+        LIST_REMOVE(&it->sub, entry);
+
+    if(it->queued)
+        TAILQ_REMOVE(&it->ep->ready, it, ready);
+
+    LIST_REMOVE(it, entry);
+    free(it);
+}
+
+static void ep_notify(poll_sub_t *sub, short revents) {
+    epitem_t *it = (epitem_t *)sub;
+
+    /* The fd is being closed; it goes away from the set along with it. */
+    if(revents & POLLNVAL)
+        ep_remove(it);
+    else
+        ep_queue(it);
+}
+
+static void ep_subscribe(epitem_t *it) {
+    it->sub.events = (short)(it->event.events & 0xff);
+
+    if(!it->subscribed) {
+        poll_sub_add(&it->sub);
+        it->subscribed = true;
+    }
+
+    /* Don't miss anything that happened before we started listening. */
+    if(poll_fd(it->sub.fd, it->sub.events) &
+       (it->sub.events | POLLERR | POLLHUP))
+        ep_queue(it);
+}
+
+static epitem_t *ep_find(eventpoll_t *ep, int fd) {
+    poll_sub_t *sub;
+
+    LIST_FOREACH(sub, &fd_subs[fd], entry) {
+        if(sub->notify == ep_notify && ((epitem_t *)sub)->ep == ep)
+            return (epitem_t *)sub;
+    }
+
+    return NULL;
+}
+
+/* Move whatever is ready over to the user's array. Level-triggered fds go
+   back on the ready list, and are checked again on the next call. */
+static int ep_collect(eventpoll_t *ep, struct epoll_event *events,
+                      int maxevents) {
+    struct epitem_queue again = TAILQ_HEAD_INITIALIZER(again);
+    epitem_t *it;
+    short revents;
+    int n = 0;
+
+    while(n < maxevents && (it = TAILQ_FIRST(&ep->ready))) {
+        TAILQ_REMOVE(&ep->ready, it, ready);
+        it->queued = false;
+
+        revents = poll_fd(it->sub.fd, it->sub.events) &
+                  (it->sub.events | POLLERR | POLLHUP);
+
+        /* Spurious, or dealt with since */
+        if(!revents)
+            continue;
+
+        events[n].events = (uint16_t)revents;
+        events[n].data = it->event.data;
+        ++n;
+
+        if(it->event.events & EPOLLONESHOT) {
+            LIST_REMOVE(&it->sub, entry);
+            it->subscribed = false;
+        }
+        else if(!(it->event.events & EPOLLET)) {
+            TAILQ_INSERT_TAIL(&again, it, ready);
+            it->queued = true;
+        }
+    }
+
+    TAILQ_CONCAT(&ep->ready, &again, ready);
+    return n;
+}
+
+static int ep_close(void *h) {
+    eventpoll_t *ep = (eventpoll_t *)h;
+    bool last;
+
+    mutex_lock(&mutex);
+
+    while(!LIST_EMPTY(&ep->items))
+        ep_remove(LIST_FIRST(&ep->items));
+
+    /* Kick out anyone still waiting; the last of them frees the instance. */
+    LIST_REMOVE(ep, entry);
+    ep->closing = true;
+    cond_broadcast(&ep->cv);
+    last = ep_put(ep);
+
+    mutex_unlock(&mutex);
+
+    if(last)
+        ep_free(ep);
+
+    return 0;
+}
+
+/* Only the current state; events on an epoll fd are not propagated to other
+   pollers. */
+static short ep_poll(void *h, short events) {
+    eventpoll_t *ep = (eventpoll_t *)h;
+
+    return TAILQ_EMPTY(&ep->ready) ? 0 : (events & POLLRDNORM);
+}
+
+static vfs_handler_t ep_vh = {
+    /* Name handler */
+    {
+        { 0 },          /* Name */
+        0,              /* tbfi */
+        0x00010000,     /* Version 1.0 */
+        0,              /* Flags */
+        NMMGR_TYPE_VFS,
+        NMMGR_LIST_INIT,
+    },
+
+    0, NULL,            /* No cache, privdata */
+
+    NULL,               /* open */
+    ep_close,           /* close */
+    NULL,               /* read */
+    NULL,               /* write */
+    NULL,               /* seek */
+    NULL,               /* tell */
+    NULL,               /* total */
+    NULL,               /* readdir */
+    NULL,               /* ioctl */
+    NULL,               /* rename */
+    NULL,               /* unlink */
+    NULL,               /* mmap */
+    NULL,               /* complete */
+    NULL,               /* stat */
+    NULL,               /* mkdir */
+    NULL,               /* rmdir */
+    NULL,               /* fcntl */
+    ep_poll,            /* poll */
+    NULL,               /* link */
+    NULL,               /* symlink */
+    NULL,               /* seek64 */
+    NULL,               /* tell64 */
+    NULL,               /* total64 */
+    NULL,               /* readlink */
+    NULL,               /* rewinddir */
+    NULL,               /* fstat */
+    NULL,               /* readv */
+    NULL,               /* writev */
+    NULL,               /* pread64 */
+    NULL                /* pwrite64 */
+};
+
+/* Call with the mutex held. The fd's handle is looked for among the open
+   instances, rather than trusting the fd's handler, as the fd can be closed
+   and reused in between looking at one and the other. An instance that is
+   found can't be freed until the mutex is let go of. */
+static eventpoll_t *ep_get(int epfd) {
+    eventpoll_t *ep;
+    void *hnd;
+
+    if(epfd < 0 || epfd >= FD_SETSIZE || !(hnd = fs_get_handle(epfd))) {
+        errno = EBADF;
+        return NULL;
+    }
+
+    LIST_FOREACH(ep, &ep_list, entry) {
+        if(ep == hnd)
+            return ep;
+    }
+
+    errno = EINVAL;
+    return NULL;
+}
+
+int epoll_create1(int flags) {
+    eventpoll_t *ep;
+    int fd;
+
+    if(flags & ~EPOLL_CLOEXEC) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if(!(ep = (eventpoll_t *)malloc(sizeof(eventpoll_t)))) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    LIST_INIT(&ep->items);
+    TAILQ_INIT(&ep->ready);
+    cond_init(&ep->cv);
+    ep->refcnt = 1;
+    ep->closing = false;
+
+    mutex_lock(&mutex);
+    LIST_INSERT_HEAD(&ep_list, ep, entry);
+    mutex_unlock(&mutex);
+
+    if((fd = fs_open_handle(&ep_vh, ep)) < 0) {
+        mutex_lock(&mutex);
+        LIST_REMOVE(ep, entry);
+        mutex_unlock(&mutex);
+
+        ep_free(ep);
+        return -1;
+    }
+
+    return fd;
+}
+
+int epoll_create(int size) {
+    if(size <= 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return epoll_create1(0);
+}
+
+int epoll_ctl(int epfd, int op, int fd, struct epoll_event *event) {
+    eventpoll_t *ep;
+    epitem_t *it;
+
+    if(fd < 0 || fd >= FD_SETSIZE || !fs_get_handle(fd)) {
+        errno = EBADF;
+        return -1;
+    }
+
+    if(fd == epfd || (op != EPOLL_CTL_DEL && !event)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    mutex_lock_scoped(&mutex);
+
+    /* Look the instance up with the mutex held, so that it can't be closed
+       (and freed) while we're working on it. */
+    if(!(ep = ep_get(epfd)))
+        return -1;
+
+    it = ep_find(ep, fd);
+
+    switch(op) {
+        case EPOLL_CTL_ADD:
+            if(it) {
+                errno = EEXIST;
+                return -1;
+            }
+
+            if(!(it = (epitem_t *)calloc(1, sizeof(epitem_t)))) {
+                errno = ENOMEM;
+                return -1;
+            }
+
+            it->sub.fd = fd;
+            it->sub.notify = ep_notify;
+            it->ep = ep;
+            it->event = *event;
+            LIST_INSERT_HEAD(&ep->items, it, entry);
+            ep_subscribe(it);
+            return 0;
+
+        case EPOLL_CTL_MOD:
+            if(!it) {
+                errno = ENOENT;
+                return -1;
+            }
+
+            it->event = *event;
+            ep_subscribe(it);
+            return 0;
+
+        case EPOLL_CTL_DEL:
+            if(!it) {
+                errno = ENOENT;
+                return -1;
+            }
+
+            ep_remove(it);
+            return 0;
+
+        default:
+            errno = EINVAL;
+            return -1;
+    }
+}
+
+int epoll_wait(int epfd, struct epoll_event *events, int maxevents,
+               int timeout) {
+    eventpoll_t *ep;
+    uint64_t deadline = 0;
+    int64_t left;
+    int n, err = errno;
+    bool last;
+
+    if(!events || maxevents <= 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if(timeout > 0)
+        deadline = timer_ms_gettime64() + timeout;
+
+    if(mutex_lock_irqsafe(&mutex))
+        return -1;
+
+    /* Look the instance up with the mutex held, so that it can't be closed
+       before we get our reference on it. */
+    if(!(ep = ep_get(epfd))) {
+        mutex_unlock(&mutex);
+        return -1;
+    }
+
+    ++ep->refcnt;
+
+    while(!(n = ep_collect(ep, events, maxevents)) && timeout) {
+        /* We can't actually wait while we're in an interrupt. */
+        if(irq_inside_int()) {
+            err = EPERM;
+            n = -1;
+            break;
+        }
+
+        if(timeout > 0) {
+            left = deadline - timer_ms_gettime64();
+
+            if(left <= 0)
+                break;
+
+            cond_wait_timed(&ep->cv, &mutex, left);
+        }
+        else {
+            cond_wait(&ep->cv, &mutex);
+        }
+
+        /* The fd was closed while we slept. */
+        if(ep->closing) {
+            err = EBADF;
+            n = -1;
+            break;
+        }
+    }
+
+    last = ep_put(ep);
+    mutex_unlock(&mutex);
+
+    if(last)
+        ep_free(ep);
+
+    errno = err;
+    return n;
+}
@@ -0,0 +1,12 @@
+/* KallistiOS ##version##
+
+   pread.c
+
+*/
+
+#include <unistd.h>
+#include <kos/fs.h>
+
+ssize_t pread(int fd, void *buf, size_t nbytes, off_t offset) {
+    return fs_pread(fd, buf, nbytes, offset);
+}
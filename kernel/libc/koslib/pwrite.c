@@ -0,0 +1,12 @@
+/* KallistiOS ##version##
+
+   pwrite.c
+
+*/
+
+#include <unistd.h>
+#include <kos/fs.h>
+
+ssize_t pwrite(int fd, const void *buf, size_t nbytes, off_t offset) {
+    return fs_pwrite(fd, buf, nbytes, offset);
+}
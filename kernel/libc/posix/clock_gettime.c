@@ -82,18 +82,18 @@ int clock_gettime(clockid_t clk_id, struct timespec *ts) {
             ts->tv_nsec = nsecs;
             return 0;
 
-        /* Use the sum of all kthread-specific CPU time counters (in ms) */
+        /* Use the sum of all kthread-specific CPU time counters (in us) */
         case CLOCK_PROCESS_CPUTIME_ID:
-            div_result = lldiv(thd_get_total_cpu_time(), 1000);
+            div_result = lldiv(thd_get_total_cpu_time_us(), 1000000);
             ts->tv_sec = div_result.quot;
-            ts->tv_nsec = div_result.rem * 1000000;
+            ts->tv_nsec = div_result.rem * 1000;
             return 0;
 
-        /* Use the kthread-specific CPU time counters (in ms) */
+        /* Use the kthread-specific CPU time counters (in us) */
         case CLOCK_THREAD_CPUTIME_ID:
-            div_result = lldiv(thd_get_cpu_time(thd_get_current()), 1000);
+            div_result = lldiv(thd_get_cpu_time_us(thd_get_current()), 1000000);
             ts->tv_sec = div_result.quot;
-            ts->tv_nsec = div_result.rem * 1000000;
+            ts->tv_nsec = div_result.rem * 1000;
             return 0;
 
         default:
@@ -55,7 +55,7 @@ int setrlimit(int resource, const struct rlimit *rlp) {
 
 /* The structure of this is based around thd_pslist */
 int getrusage(int who, struct rusage *r_usage) {
-    uint64_t ms_time, cpu_total = 0;
+    uint64_t us_time, cpu_total = 0;
 
     if((who > RUSAGE_CHILDREN) || (who < RUSAGE_SELF)) {
         errno = EINVAL;
@@ -74,16 +74,16 @@ int getrusage(int who, struct rusage *r_usage) {
     }
 
     irq_disable_scoped();
-    ms_time = timer_ms_gettime64();
+    us_time = timer_us_gettime64();
 
-    cpu_total = thd_get_total_cpu_time();
-    ms_time -= cpu_total;
+    cpu_total = thd_get_total_cpu_time_us();
+    us_time -= cpu_total;
 
-    r_usage->ru_utime.tv_sec  = cpu_total / 1000;
-    r_usage->ru_utime.tv_usec = (cpu_total % 1000) * 1000;
+    r_usage->ru_utime.tv_sec  = cpu_total / 1000000;
+    r_usage->ru_utime.tv_usec = cpu_total % 1000000;
 
-    r_usage->ru_stime.tv_sec  = ms_time / 1000;
-    r_usage->ru_stime.tv_usec = (ms_time % 1000) * 1000;
+    r_usage->ru_stime.tv_sec  = us_time / 1000000;
+    r_usage->ru_stime.tv_usec = us_time % 1000000;
 
     return 0;
 }
@@ -12,11 +12,15 @@
 #include <stdio.h>
 #include <stdint.h>
 
+#include <sys/queue.h>
+
 #include <kos/dbglog.h>
+#include <kos/irq.h>
 #include <kos/net.h>
 #include <kos/thread.h>
 #include <kos/timer.h>
 
+#include "net_core.h"
 #include "net_ipv4.h"
 
 /*
@@ -38,11 +42,29 @@ typedef struct {
     uint8_t pr_recv[6];
 } __packed arp_pkt_t;
 
+/* Number of buckets in the ARP cache. Must be a power of two. */
+#define ARP_HASH_SIZE       32
+
+/* Most packets held for an address that is being looked up. Past that, the
+   oldest ones are dropped. */
+#define ARP_PENDING_MAX     8
+
+/* How long entries last without being used, and how long to wait for a reply
+   before asking again, in milliseconds. */
+#define ARP_TIMEOUT         (120 * 1000)
+#define ARP_QUERY_RETRY     (5 * 1000)
+
+/* Number of buckets looked at for expired entries on each call into the
+   cache, so that the cost of cleaning up is spread out. */
+#define ARP_GC_BUCKETS      2
+
+TAILQ_HEAD(netarp_pending, net_pbuf);
+
 /* Structure describing an ARP entry; each entry contains a MAC address,
    an IP address, and a timestamp from 'jiffies'. The timestamp allows
    aging and eventual removal. */
 typedef struct netarp {
-    /* ARP cache list handle */
+    /* ARP cache bucket handle */
     LIST_ENTRY(netarp)  ac_list;
 
     /* Mac address */
@@ -51,17 +73,15 @@ typedef struct netarp {
     /* Associated IP address */
     uint8_t             ip[4];
 
+    /* Set once the MAC address is known */
+    int                 resolved;
+
     /* Cache entry time; if zero, this entry won't expire */
     uint64_t            timestamp;
 
-    /* Optional packet to send when the entry is filled in */
-    ip_hdr_t            *pkt;
-
-    /* Additional data for that packet, if any */
-    uint8_t             *data;
-
-    /* Size of the additional data for the packet */
-    int                 data_size;
+    /* Packets to send when the entry is filled in, oldest first */
+    struct netarp_pending pending;
+    int                 pending_count;
 } netarp_t;
 
 /* Define the list type */
@@ -70,75 +90,124 @@ LIST_HEAD(netarp_list, netarp);
 /**************************************************************************/
 /* Variables */
 
-/* ARP cache */
-struct netarp_list net_arp_cache = LIST_HEAD_INITIALIZER(0);
+/* ARP cache, hashed on the IP address. Changes to it are made with interrupts
+   disabled, since packets come in from interrupts on some devices. */
+static struct netarp_list net_arp_cache[ARP_HASH_SIZE];
+
+/* Next bucket to garbage collect */
+static unsigned int arp_gc_next;
 
 /**************************************************************************/
 /* Cache management */
 
-/* Garbage collect timed out entries */
-static int net_arp_gc(netif_t *nif) {
-    netarp_t *a1, *a2;
-    uint64_t now = timer_ms_gettime64();
+static inline struct netarp_list *arp_bucket(const uint8_t ip[4]) {
+    unsigned int h = ip[0] ^ ip[1] ^ ip[2] ^ (ip[3] * 7);
 
-    a1 = LIST_FIRST(&net_arp_cache);
+    return &net_arp_cache[h & (ARP_HASH_SIZE - 1)];
+}
 
-    while(a1 != NULL) {
-        a2 = LIST_NEXT(a1, ac_list);
+static netarp_t *arp_find(const uint8_t ip[4]) {
+    netarp_t *cur;
 
-        if(a1->timestamp) {
-            if(now >= (a1->timestamp + 120 * 1000)) {
-                LIST_REMOVE(a1, ac_list);
+    LIST_FOREACH(cur, arp_bucket(ip), ac_list) {
+        if(!memcmp(ip, cur->ip, 4))
+            return cur;
+    }
 
-                if(a1->pkt) {
-                    free(a1->pkt);
-                    free(a1->data);
-                }
+    return NULL;
+}
 
-                free(a1);
-                a1 = a2;
-                continue;
-            }
+static void arp_free(netarp_t *a) {
+    net_pbuf_t *pb;
 
-            /* If the entry is incomplete and it's been more than 5 seconds
-               since we queried it, try again. */
-            if(a1->mac[0] == 0 && a1->mac[1] == 0 && a1->mac[2] == 0 &&
-               a1->mac[3] == 0 && a1->mac[4] == 0 && a1->mac[5] == 0 &&
-               now > (a1->timestamp + 5 * 1000)) {
-                net_arp_query(nif, a1->ip);
-            }
+    LIST_REMOVE(a, ac_list);
+
+    while((pb = TAILQ_FIRST(&a->pending))) {
+        TAILQ_REMOVE(&a->pending, pb, pkt_queue);
+        net_pbuf_free(pb);
+    }
+
+    free(a);
+}
+
+/* Garbage collect timed out entries, a couple of buckets at a time. Entries
+   that are found while looking something up are checked on the spot, so
+   nothing stale gets used in the meantime. Must be called with interrupts
+   disabled. */
+static void net_arp_gc(uint64_t now) {
+    netarp_t *a1, *a2;
+    int i;
+
+    for(i = 0; i < ARP_GC_BUCKETS; ++i) {
+        a1 = LIST_FIRST(&net_arp_cache[arp_gc_next]);
+        arp_gc_next = (arp_gc_next + 1) & (ARP_HASH_SIZE - 1);
+
+        while(a1 != NULL) {
+            a2 = LIST_NEXT(a1, ac_list);
+
+            if(a1->timestamp && now >= a1->timestamp + ARP_TIMEOUT)
+                arp_free(a1);
+
+            a1 = a2;
         }
+    }
+}
+
+/* Add a packet to those waiting on an entry, dropping the oldest one if there
+   are too many. Must be called with interrupts disabled. */
+static void arp_queue(netarp_t *a, net_pbuf_t *pkt) {
+    net_pbuf_t *old;
 
-        a1 = a2;
+    if(a->pending_count == ARP_PENDING_MAX) {
+        old = TAILQ_FIRST(&a->pending);
+        TAILQ_REMOVE(&a->pending, old, pkt_queue);
+        net_pbuf_free(old);
+        --a->pending_count;
     }
 
-    return 0;
+    TAILQ_INSERT_TAIL(&a->pending, net_pbuf_ref(pkt), pkt_queue);
+    ++a->pending_count;
 }
 
 /* Add an entry to the ARP cache manually */
 int net_arp_insert(netif_t *nif, const uint8_t mac[6], const uint8_t ip[4],
                    uint64_t timestamp) {
+    struct netarp_pending pending = TAILQ_HEAD_INITIALIZER(pending);
     netarp_t *cur;
+    net_pbuf_t *pkt;
+
+    {
+        irq_disable_scoped();
+
+        net_arp_gc(timer_ms_gettime64());
 
-    /* First make sure the entry isn't already there */
-    LIST_FOREACH(cur, &net_arp_cache, ac_list) {
-        if(!memcmp(ip, cur->ip, 4)) {
+        /* First make sure the entry isn't already there */
+        if((cur = arp_find(ip))) {
             memcpy(cur->mac, mac, 6);
             cur->timestamp = timestamp;
+            cur->resolved = 1;
 
-            /* Send our queued packet, if we have one */
-            if(cur->pkt) {
-                net_ipv4_send_packet(nif, cur->pkt, cur->data, cur->data_size);
-                free(cur->pkt);
-                free(cur->data);
+            /* Take the packets waiting on it, to send them below */
+            TAILQ_CONCAT(&pending, &cur->pending, pkt_queue);
+            cur->pending_count = 0;
+        }
+    }
 
-                cur->pkt = NULL;
-                cur->data = NULL;
-                cur->data_size = 0;
+    if(cur) {
+        /* Send them all off together */
+        if(!TAILQ_EMPTY(&pending)) {
+            net_tx_begin();
+
+            while((pkt = TAILQ_FIRST(&pending))) {
+                TAILQ_REMOVE(&pending, pkt, pkt_queue);
+                net_ipv4_output(nif, pkt);
+                net_pbuf_free(pkt);
             }
 
-            return 0;
+            net_tx_end();
         }
+
+        return 0;
     }
 
     /* It's not there, add an entry */
@@ -149,102 +218,140 @@ int net_arp_insert(netif_t *nif, const uint8_t mac[6], const uint8_t ip[4],
 
     memcpy(cur->mac, mac, 6);
     memcpy(cur->ip, ip, 4);
+    cur->resolved = 1;
     cur->timestamp = timestamp;
-    cur->pkt = NULL;
-    cur->data = NULL;
-    cur->data_size = 0;
-    LIST_INSERT_HEAD(&net_arp_cache, cur, ac_list);
+    TAILQ_INIT(&cur->pending);
+    cur->pending_count = 0;
+
+    irq_disable_scoped();
 
-    /* Garbage collect expired entries */
-    net_arp_gc(nif);
+    /* Someone else may have added it in the meantime. */
+    if(arp_find(ip)) {
+        free(cur);
+        return 0;
+    }
+
+    LIST_INSERT_HEAD(arp_bucket(ip), cur, ac_list);
 
     return 0;
 }
 
 /* Look up an entry from the ARP cache; if no entry is found, then an ARP
-   query will be sent and an error will be returned. Thus your packet send
-   should also fail. Later when the transmit retries, hopefully the answer
-   will have arrived. */
+   query will be sent and an error will be returned. If a packet is given, it
+   is held on to and sent once the reply comes in. */
 int net_arp_lookup(netif_t *nif, const uint8_t ip_in[4], uint8_t mac_out[6],
-                   const ip_hdr_t *pkt, const uint8_t *data, int data_size) {
-    netarp_t *cur;
+                   net_pbuf_t *pkt) {
+    uint64_t now = timer_ms_gettime64();
+    netarp_t *cur, *ent;
+    int query = 0, rv = 0;
 
-    /* Garbage collect expired entries */
-    net_arp_gc(nif);
+    {
+        irq_disable_scoped();
 
-    /* Look for the entry */
-    LIST_FOREACH(cur, &net_arp_cache, ac_list) {
-        if(!memcmp(ip_in, cur->ip, 4)) {
-            if(cur->mac[0] == 0 && cur->mac[1] == 0 &&
-               cur->mac[2] == 0 && cur->mac[3] == 0 &&
-               cur->mac[4] == 0 && cur->mac[5] == 0) {
-                return -1;
-            }
+        net_arp_gc(now);
+
+        /* Look for the entry, dropping it if it's too old to use */
+        if((cur = arp_find(ip_in)) && cur->timestamp &&
+           now >= cur->timestamp + ARP_TIMEOUT) {
+            arp_free(cur);
+            cur = NULL;
+        }
 
+        if(cur && cur->resolved) {
             memcpy(mac_out, cur->mac, 6);
 
             if(cur->timestamp != 0)
-                cur->timestamp = timer_ms_gettime64();
+                cur->timestamp = now;
 
             return 0;
         }
-    }
+        else if(cur) {
+            /* Still waiting on a reply. Hold on to the packet, and ask again
+               if it's been a while. */
+            if(pkt) {
+                arp_queue(cur, pkt);
+                rv = -2;
+            }
+            else {
+                rv = -1;
+            }
 
-    /* It's not there... Add an incomplete ARP entry */
-    cur = (netarp_t *)malloc(sizeof(netarp_t));
+            if(now > cur->timestamp + ARP_QUERY_RETRY) {
+                cur->timestamp = now;
+                query = 1;
+            }
+        }
+    }
 
-    if(cur == NULL)
-        return -3;
+    if(!cur) {
+        /* It's not there... Add an incomplete ARP entry */
+        ent = (netarp_t *)malloc(sizeof(netarp_t));
 
-    memset(cur, 0, sizeof(netarp_t));
-    memcpy(cur->ip, ip_in, 4);
-    cur->timestamp = timer_ms_gettime64();
+        if(ent == NULL)
+            return -3;
 
-    /* Copy our packet if we have one to copy. */
-    if(pkt && data && data_size) {
-        cur->data = (uint8_t *)malloc(data_size);
+        memset(ent, 0, sizeof(netarp_t));
+        memcpy(ent->ip, ip_in, 4);
+        ent->timestamp = now;
+        TAILQ_INIT(&ent->pending);
 
-        if(cur->data) {
-            cur->pkt = (ip_hdr_t *)malloc(sizeof(ip_hdr_t));
+        {
+            irq_disable_scoped();
 
-            if(!cur->pkt) {
-                free(cur->data);
-                cur->data = NULL;
+            /* Use the one that showed up in the meantime, if there is one. */
+            if((cur = arp_find(ip_in))) {
+                free(ent);
             }
             else {
-                memcpy(cur->pkt, pkt, sizeof(ip_hdr_t));
-                memcpy(cur->data, data, data_size);
-                cur->data_size = data_size;
+                cur = ent;
+                LIST_INSERT_HEAD(arp_bucket(ip_in), cur, ac_list);
             }
+
+            if(cur->resolved) {
+                memcpy(mac_out, cur->mac, 6);
+                return 0;
+            }
+
+            /* Hang on to our packet if we have one. */
+            if(pkt)
+                arp_queue(cur, pkt);
         }
-    }
 
-    LIST_INSERT_HEAD(&net_arp_cache, cur, ac_list);
+        query = 1;
+        rv = -2;
+    }
 
     /* Generate an ARP who-has packet */
-    net_arp_query(nif, ip_in);
+    if(query)
+        net_arp_query(nif, ip_in);
 
     /* Return failure */
     memset(mac_out, 0, 6);
-    return -2;
+    return rv;
 }
 
 /* Do a reverse ARP lookup: look for an IP for a given mac address; note
-   that if this fails, you have no recourse. */
+   that if this fails, you have no recourse. This has to look through the
+   whole cache, since it is hashed on the IP address. */
 int net_arp_revlookup(netif_t *nif, uint8_t ip_out[4], const uint8_t mac_in[6]) {
     netarp_t *cur;
+    int i;
 
     (void)nif;
 
+    irq_disable_scoped();
+
     /* Look for the entry */
-    LIST_FOREACH(cur, &net_arp_cache, ac_list) {
-        if(!memcmp(mac_in, cur->mac, 6)) {
-            memcpy(ip_out, cur->ip, 4);
+    for(i = 0; i < ARP_HASH_SIZE; ++i) {
+        LIST_FOREACH(cur, &net_arp_cache[i], ac_list) {
+            if(cur->resolved && !memcmp(mac_in, cur->mac, 6)) {
+                memcpy(ip_out, cur->ip, 4);
 
-            if(cur->timestamp != 0)
-                cur->timestamp = timer_ms_gettime64();
+                if(cur->timestamp != 0)
+                    cur->timestamp = timer_ms_gettime64();
 
-            return 0;
+                return 0;
+            }
         }
     }
 
@@ -365,30 +472,27 @@ int net_arp_query(netif_t *nif, const uint8_t ip[4]) {
 
 /* Init */
 int net_arp_init(void) {
+    int i;
+
     /* Initialize the ARP cache */
-    LIST_INIT(&net_arp_cache);
+    for(i = 0; i < ARP_HASH_SIZE; ++i)
+        LIST_INIT(&net_arp_cache[i]);
+
+    arp_gc_next = 0;
 
     return 0;
 }
 
 /* Shutdown */
 void net_arp_shutdown(void) {
-    /* Free all ARP entries */
-    netarp_t *a1, *a2;
-
-    a1 = LIST_FIRST(&net_arp_cache);
+    netarp_t *a;
+    int i;
 
-    while(a1 != NULL) {
-        a2 = LIST_NEXT(a1, ac_list);
+    irq_disable_scoped();
 
-        if(a1->pkt) {
-            free(a1->pkt);
-            free(a1->data);
-        }
-
-        free(a1);
-        a1 = a2;
+    /* Free all ARP entries */
+    for(i = 0; i < ARP_HASH_SIZE; ++i) {
+        while((a = LIST_FIRST(&net_arp_cache[i])))
+            arp_free(a);
     }
-
-    LIST_INIT(&net_arp_cache);
 }
@@ -14,6 +14,8 @@
 #include <kos/net.h>
 #include <kos/fs_socket.h>
 #include <kos/dbglog.h>
+#include <kos/irq.h>
+#include <kos/thread.h>
 #include <kos/workqueue.h>
 
 #include "net_core.h"
@@ -47,6 +49,16 @@ netif_t *net_default_dev = NULL;
 
 workqueue_t *net_wq;
 
+/* Frames held back between net_tx_begin() and net_tx_end(). Only one thread
+   can be building a batch at a time; everyone else sends straight away. */
+static struct {
+    kthread_t *owner;
+    int depth;
+    netif_t *nif;
+    int count;
+    net_pbuf_t *pkts[NET_TX_BATCH_MAX];
+} tx_batch;
+
 /**************************************************************************/
 /* Driver list management
    Note that this stuff might be used before net_core is actually
@@ -101,6 +113,90 @@ struct netif_list * net_get_if_list(void) {
     return &net_if_list;
 }
 
+/*****************************************************************************/
+/* Transmit */
+
+int net_tx_batch(netif_t *nif, net_pbuf_t *const *pkts, int count) {
+    int i, rv;
+
+    if(nif->if_tx_batch) {
+        for(i = 0; i < count; i += rv) {
+            rv = nif->if_tx_batch(nif, pkts + i, count - i, NETIF_BLOCK);
+
+            if(rv <= 0)
+                break;
+        }
+
+        return i;
+    }
+
+    for(i = 0; i < count; i++) {
+        if(nif->if_tx(nif, pkts[i]->data, pkts[i]->len,
+                      NETIF_BLOCK) != NETIF_TX_OK)
+            break;
+    }
+
+    if(nif->if_tx_commit)
+        nif->if_tx_commit(nif);
+
+    return i;
+}
+
+static void tx_flush(void) {
+    int i;
+
+    if(!tx_batch.count)
+        return;
+
+    net_tx_batch(tx_batch.nif, tx_batch.pkts, tx_batch.count);
+
+    for(i = 0; i < tx_batch.count; i++)
+        net_pbuf_free(tx_batch.pkts[i]);
+
+    tx_batch.count = 0;
+}
+
+int net_tx(netif_t *nif, net_pbuf_t *pb) {
+    if(irq_inside_int() || tx_batch.owner != thd_current) {
+        if(nif->if_tx(nif, pb->data, pb->len, NETIF_BLOCK) != NETIF_TX_OK)
+            return -1;
+
+        return 0;
+    }
+
+    if(tx_batch.count == NET_TX_BATCH_MAX || tx_batch.nif != nif)
+        tx_flush();
+
+    tx_batch.nif = nif;
+    tx_batch.pkts[tx_batch.count++] = net_pbuf_ref(pb);
+
+    return 0;
+}
+
+void net_tx_begin(void) {
+    if(irq_inside_int())
+        return;
+
+    irq_disable_scoped();
+
+    if(!tx_batch.owner)
+        tx_batch.owner = thd_current;
+
+    if(tx_batch.owner == thd_current)
+        tx_batch.depth++;
+}
+
+void net_tx_end(void) {
+    if(irq_inside_int() || tx_batch.owner != thd_current)
+        return;
+
+    if(--tx_batch.depth)
+        return;
+
+    tx_flush();
+    tx_batch.owner = NULL;
+}
+
 /*****************************************************************************/
 /* Init/shutdown */
 
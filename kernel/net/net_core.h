@@ -12,10 +12,23 @@
 
 __BEGIN_DECLS
 
+#include <kos/net.h>
 #include <kos/workqueue.h>
 
 extern workqueue_t *net_wq;
 
+/* Send a frame (starting at the Ethernet header) on a device. Between
+   net_tx_begin() and net_tx_end(), the frame is referenced and held back, so
+   that the lot can go to the device in one batch. Anywhere else, including
+   in interrupts and in threads other than the one building a batch, it's
+   sent right away. */
+int net_tx(netif_t *nif, net_pbuf_t *pb);
+
+/* Start holding back the frames this thread sends with net_tx(). Calls may
+   be nested; the frames go out at the outermost net_tx_end(). */
+void net_tx_begin(void);
+void net_tx_end(void);
+
 __END_DECLS
 
 #endif /* !__LOCAL_NET_CORE_H */
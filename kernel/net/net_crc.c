@@ -5,47 +5,100 @@
 
 */
 
+#include <stdint.h>
 #include <kos/net.h>
 
-/* Calculate a CRC-32 checksum over a given block of data. Somewhat inspired by
-   the CRC32 function in Figure 14-6 of http://www.hackersdelight.org/crc.pdf */
-uint32_t __pure net_crc32le(const uint8_t *data, int size) {
-    int i;
-    uint32_t rv = 0xFFFFFFFF;
-
-    for(i = 0; i < size; ++i) {
-        rv ^= data[i];
-        rv = (0xEDB88320 & (-(rv & 1))) ^(rv >> 1);
-        rv = (0xEDB88320 & (-(rv & 1))) ^(rv >> 1);
-        rv = (0xEDB88320 & (-(rv & 1))) ^(rv >> 1);
-        rv = (0xEDB88320 & (-(rv & 1))) ^(rv >> 1);
-        rv = (0xEDB88320 & (-(rv & 1))) ^(rv >> 1);
-        rv = (0xEDB88320 & (-(rv & 1))) ^(rv >> 1);
-        rv = (0xEDB88320 & (-(rv & 1))) ^(rv >> 1);
-        rv = (0xEDB88320 & (-(rv & 1))) ^(rv >> 1);
+/* Tables for calculating the CRC-32 eight bytes at a time ("slicing-by-8").
+   crc_table[0] is the usual table for doing it a byte at a time, and
+   crc_table[k][n] is the CRC of byte n followed by k zero bytes. They are
+   built the first time they are needed. */
+static uint32_t crc_table[8][256];
+static volatile int crc_table_built;
+
+static void crc_build_table(void) {
+    uint32_t c;
+    int i, j;
+
+    for(i = 0; i < 256; ++i) {
+        c = i;
+
+        for(j = 0; j < 8; ++j)
+            c = (0xEDB88320 & (-(c & 1))) ^ (c >> 1);
+
+        crc_table[0][i] = c;
+    }
+
+    for(i = 0; i < 256; ++i) {
+        c = crc_table[0][i];
+
+        for(j = 1; j < 8; ++j) {
+            c = crc_table[0][c & 0xFF] ^ (c >> 8);
+            crc_table[j][i] = c;
+        }
     }
 
-    return ~rv;
+    crc_table_built = 1;
 }
 
-/* This one isn't quite as nice as the one above for little-endian... */
-uint32_t __pure net_crc32be(const uint8_t *data, int size) {
-    int i, j;
-    uint32_t rv = 0xFFFFFFFF, b, c;
+/* Run the CRC-32 register over a block of data, without the inversions at
+   either end. */
+static uint32_t crc32_update(uint32_t crc, const uint8_t *data, size_t size) {
+    typedef uint32_t __attribute__((may_alias)) alias_u32_t;
+    uint32_t a, b;
 
-    for(i = 0; i < size; ++i) {
-        b = data[i];
+    if(!crc_table_built)
+        crc_build_table();
 
-        for(j = 0; j < 8; ++j) {
-            c = ((rv & 0x80000000) ? 1 : 0) ^(b & 1);
-            b >>= 1;
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    /* Get to a 32-bit boundary a byte at a time, then do eight at once. */
+    for(; size && ((uintptr_t)data & 3); --size)
+        crc = crc_table[0][(crc ^ *data++) & 0xFF] ^ (crc >> 8);
 
-            if(c)   rv = ((rv << 1) ^ 0x04C11DB6) | c;
-            else    rv <<= 1;
-        }
+    for(; size >= 8; size -= 8, data += 8) {
+        a = ((const alias_u32_t *)data)[0] ^ crc;
+        b = ((const alias_u32_t *)data)[1];
+
+        crc = crc_table[7][a & 0xFF] ^ crc_table[6][(a >> 8) & 0xFF] ^
+              crc_table[5][(a >> 16) & 0xFF] ^ crc_table[4][a >> 24] ^
+              crc_table[3][b & 0xFF] ^ crc_table[2][(b >> 8) & 0xFF] ^
+              crc_table[1][(b >> 16) & 0xFF] ^ crc_table[0][b >> 24];
     }
+#else
+    (void)a;
+    (void)b;
+#endif
 
-    return rv;
+    for(; size; --size)
+        crc = crc_table[0][(crc ^ *data++) & 0xFF] ^ (crc >> 8);
+
+    return crc;
+}
+
+static inline uint32_t bitrev32(uint32_t x) {
+    x = ((x >> 1) & 0x55555555) | ((x & 0x55555555) << 1);
+    x = ((x >> 2) & 0x33333333) | ((x & 0x33333333) << 2);
+    x = ((x >> 4) & 0x0F0F0F0F) | ((x & 0x0F0F0F0F) << 4);
+    x = ((x >> 8) & 0x00FF00FF) | ((x & 0x00FF00FF) << 8);
+
+    return (x >> 16) | (x << 16);
+}
+
+/* Calculate a CRC-32 checksum over a given block of data. */
+uint32_t __pure net_crc32le(const uint8_t *data, int size) {
+    return ~crc32_update(0xFFFFFFFF, data, size);
+}
+
+uint32_t __pure net_crc32le_update(uint32_t crc, const uint8_t *data,
+                                   size_t size) {
+    return ~crc32_update(~crc, data, size);
+}
+
+/* This one feeds the bits of each byte in least significant bit first, like
+   the one above, but shifts the register the other way. That makes it the same
+   as the one above with the bits of the register reversed, and without the
+   final inversion. */
+uint32_t __pure net_crc32be(const uint8_t *data, int size) {
+    return bitrev32(crc32_update(0xFFFFFFFF, data, size));
 }
 
 /* Based on code found at: http://www.ccsinfo.com/forum/viewtopic.php?t=24977 */
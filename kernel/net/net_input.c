@@ -8,8 +8,10 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <kos/net.h>
+#include "net_core.h"
 #include "net_ipv4.h"
 #include "net_ipv6.h"
+#include "net_pbuf.h"
 
 /*
 
@@ -59,6 +61,34 @@ int net_input(netif_t *device, const uint8_t *data, int len) {
         return 0;
 }
 
+/* Process an incoming packet, letting the stack keep the buffer if it wants */
+int net_input_pbuf(netif_t *device, net_pbuf_t *pb) {
+    net_pbuf_rx_t rx;
+    int rv;
+
+    net_pbuf_rx_enter(&rx, pb);
+    rv = net_input(device, pb->data, pb->len);
+    net_pbuf_rx_leave(&rx);
+
+    return rv;
+}
+
+/* Process a batch of incoming packets, and send the replies together */
+int net_input_batch(netif_t *device, net_pbuf_t *const *pkts, int count) {
+    int i, done = 0;
+
+    net_tx_begin();
+
+    for(i = 0; i < count; i++) {
+        if(net_input_pbuf(device, pkts[i]) >= 0)
+            done++;
+    }
+
+    net_tx_end();
+
+    return done;
+}
+
 /* Setup an input target; returns the old target */
 net_input_func net_input_set_target(net_input_func t) {
     net_input_func old = net_input_target;
@@ -23,37 +23,163 @@
 #include <kos/fs_socket.h>
 #include <kos/timer.h>
 
+#include "net_core.h"
 #include "net_ipv4.h"
 #include "net_icmp.h"
+#include "net_pbuf.h"
 
 static net_ipv4_stats_t ipv4_stats = { 0 };
 
-static inline uint16_t checksum_one(uint16_t val, uint16_t sum) {
-    uint16_t result;
+typedef uint16_t __attribute__((may_alias)) alias_u16_t;
+typedef uint32_t __attribute__((may_alias)) alias_u32_t;
 
-    return __builtin_add_overflow(val, sum, &result) + result;
-}
+/* Fold a sum of 16-bit words down to 16 bits, adding the carries back in. */
+static inline uint16_t checksum_fold(uint64_t sum) {
+    uint32_t rv;
 
-/* Perform an IP-style checksum on a block of data */
-uint16_t __pure net_ipv4_checksum(const uint8_t *data, size_t bytes, uint16_t sum) {
-    typedef uint16_t __attribute__((may_alias)) alias_u16_t;
+    sum = (sum & 0xFFFFFFFF) + (sum >> 32);
+    rv = (uint32_t)sum + (uint32_t)(sum >> 32);
+    rv = (rv & 0xFFFF) + (rv >> 16);
+    rv = (rv & 0xFFFF) + (rv >> 16);
 
-    /* Make sure we don't do any unaligned memory accesses */
-    if((uintptr_t)data & 1) {
-        sum = checksum_one(*data, sum);
-        bytes--;
+    return (uint16_t)rv;
+}
+
+/* Add up a block of data for the Internet checksum. The data is added 32 bits
+   at a time, letting the carries pile up in the top of a 64-bit sum that is
+   only folded down at the end. If the data starts on an odd address, it is
+   added up as if there were a zero byte in front of it, which swaps the bytes
+   of the sum around; they get swapped back before returning. */
+static uint16_t checksum_partial(const uint8_t *data, size_t bytes) {
+    union { uint8_t b[2]; uint16_t w; } tmp;
+    int odd = (uintptr_t)data & 1;
+    uint64_t sum = 0;
+    uint16_t rv;
+
+    if(odd && bytes) {
+        tmp.b[0] = 0;
+        tmp.b[1] = *data;
+        sum = tmp.w;
         data++;
+        bytes--;
+    }
+
+    if(((uintptr_t)data & 2) && bytes >= 2) {
+        sum += *(const alias_u16_t *)data;
+        data += 2;
+        bytes -= 2;
+    }
+
+    for(; bytes >= 16; bytes -= 16, data += 16) {
+        sum += ((const alias_u32_t *)data)[0];
+        sum += ((const alias_u32_t *)data)[1];
+        sum += ((const alias_u32_t *)data)[2];
+        sum += ((const alias_u32_t *)data)[3];
     }
 
-    /* Compute checksum two bytes at a time */
-    for(; bytes > 1; bytes -= 2, data += 2)
-        sum = checksum_one(*(const alias_u16_t *)data, sum);
+    for(; bytes >= 4; bytes -= 4, data += 4)
+        sum += *(const alias_u32_t *)data;
+
+    if(bytes >= 2) {
+        sum += *(const alias_u16_t *)data;
+        data += 2;
+        bytes -= 2;
+    }
 
     /* Handle the last byte, if we have an odd byte count */
-    if(bytes)
-        sum = checksum_one(*data, sum);
+    if(bytes) {
+        tmp.b[0] = *data;
+        tmp.b[1] = 0;
+        sum += tmp.w;
+    }
+
+    rv = checksum_fold(sum);
+
+    if(odd)
+        rv = (uint16_t)((rv << 8) | (rv >> 8));
+
+    return rv;
+}
+
+/* Same as above, copying the data to dst along the way. This only works if
+   both are aligned the same way, so otherwise copy first and add up the copy,
+   which is still in the cache. */
+static uint16_t checksum_copy_partial(uint8_t *dst, const uint8_t *src,
+                                      size_t bytes) {
+    union { uint8_t b[2]; uint16_t w; } tmp;
+    int odd = (uintptr_t)src & 1;
+    uint64_t sum = 0;
+    uint32_t a, b, c, d;
+    uint16_t rv;
+
+    if(((uintptr_t)dst ^ (uintptr_t)src) & 3) {
+        memcpy(dst, src, bytes);
+        return checksum_partial(dst, bytes);
+    }
+
+    if(odd && bytes) {
+        tmp.b[0] = 0;
+        tmp.b[1] = *dst++ = *src++;
+        sum = tmp.w;
+        bytes--;
+    }
+
+    if(((uintptr_t)src & 2) && bytes >= 2) {
+        sum += *(alias_u16_t *)dst = *(const alias_u16_t *)src;
+        dst += 2;
+        src += 2;
+        bytes -= 2;
+    }
+
+    for(; bytes >= 16; bytes -= 16, dst += 16, src += 16) {
+        a = ((const alias_u32_t *)src)[0];
+        b = ((const alias_u32_t *)src)[1];
+        c = ((const alias_u32_t *)src)[2];
+        d = ((const alias_u32_t *)src)[3];
+        ((alias_u32_t *)dst)[0] = a;
+        ((alias_u32_t *)dst)[1] = b;
+        ((alias_u32_t *)dst)[2] = c;
+        ((alias_u32_t *)dst)[3] = d;
+        sum += a;
+        sum += b;
+        sum += c;
+        sum += d;
+    }
+
+    for(; bytes >= 4; bytes -= 4, dst += 4, src += 4)
+        sum += *(alias_u32_t *)dst = *(const alias_u32_t *)src;
+
+    if(bytes >= 2) {
+        sum += *(alias_u16_t *)dst = *(const alias_u16_t *)src;
+        dst += 2;
+        src += 2;
+        bytes -= 2;
+    }
+
+    if(bytes) {
+        tmp.b[0] = *dst = *src;
+        tmp.b[1] = 0;
+        sum += tmp.w;
+    }
+
+    rv = checksum_fold(sum);
 
-    return ~sum;
+    if(odd)
+        rv = (uint16_t)((rv << 8) | (rv >> 8));
+
+    return rv;
+}
+
+/* Perform an IP-style checksum on a block of data */
+uint16_t __pure net_ipv4_checksum(const uint8_t *data, size_t bytes, uint16_t sum) {
+    return ~checksum_fold((uint32_t)checksum_partial(data, bytes) + sum);
+}
+
+/* Copy a block of data, and perform an IP-style checksum on it */
+uint16_t net_ipv4_checksum_copy(uint8_t *dst, const uint8_t *src, size_t bytes,
+                                uint16_t sum) {
+    return ~checksum_fold((uint32_t)checksum_copy_partial(dst, src, bytes) +
+                          sum);
 }
 
 /* Determine if a given IP is in the current network */
@@ -81,10 +207,11 @@ static int __pure is_broadcast(const uint8_t dest[4], const uint8_t bc[4]) {
     return 1;
 }
 
-/* Send a packet on the specified network adapter */
-int net_ipv4_send_packet(netif_t *net, ip_hdr_t *hdr, const uint8_t *data,
-                         size_t size) {
-    alignas(32) uint8_t pkt[size + sizeof(ip_hdr_t) + sizeof(eth_hdr_t)];
+/* Send a packet that starts with its IPv4 header on the specified network
+   adapter. The packet needs room for the ethernet header in front of it. */
+int net_ipv4_output(netif_t *net, net_pbuf_t *pb) {
+    const ip_hdr_t *hdr = (const ip_hdr_t *)pb->data;
+    net_pbuf_rx_t rx;
     uint8_t dest_ip[4];
     uint8_t dest_mac[6];
     eth_hdr_t *ehdr;
@@ -103,27 +230,20 @@ int net_ipv4_send_packet(netif_t *net, ip_hdr_t *hdr, const uint8_t *data,
 
     /* Is this a loopback address (127/8)? */
     if(dest_ip[0] == 0x7F) {
-        /* Put the IP header / data into our packet */
-        memcpy(pkt, hdr, 4 * (hdr->version_ihl & 0x0f));
-        memcpy(pkt + 4 * (hdr->version_ihl & 0x0f), data, size);
-
         ++ipv4_stats.pkt_sent;
 
-        /* Send it "away" */
-        net_ipv4_input(NULL, pkt, 4 * (hdr->version_ihl & 0x0f) + size, NULL);
+        /* Send it "away", letting the receiving end keep the buffer */
+        net_pbuf_rx_enter(&rx, pb);
+        net_ipv4_input(NULL, pb->data, pb->len, NULL);
+        net_pbuf_rx_leave(&rx);
 
         return 0;
     }
     else if(net->flags & NETIF_NOETH) {
-        /* Put the IP header / data into our packet */
-        memcpy(pkt, hdr, 4 * (hdr->version_ihl & 0x0f));
-        memcpy(pkt + 4 * (hdr->version_ihl & 0x0f), data, size);
-
         ++ipv4_stats.pkt_sent;
 
         /* Send it away */
-        return net->if_tx(net, pkt, 4 * (hdr->version_ihl & 0x0f) + size,
-                          NETIF_BLOCK);
+        return net->if_tx(net, pb->data, pb->len, NETIF_BLOCK);
     }
 
     /* Are we sending a broadcast packet? */
@@ -140,7 +260,7 @@ int net_ipv4_send_packet(netif_t *net, ip_hdr_t *hdr, const uint8_t *data,
         /* Get our destination's MAC address. If we do not have the MAC address
            cached, return a distinguished error to the upper-level protocol so
            that it can decide what to do. */
-        err = net_arp_lookup(net, dest_ip, dest_mac, hdr, data, size);
+        err = net_arp_lookup(net, dest_ip, dest_mac, pb);
 
         if(err == -1) {
             errno = ENETUNREACH;
@@ -154,31 +274,51 @@ int net_ipv4_send_packet(netif_t *net, ip_hdr_t *hdr, const uint8_t *data,
         }
     }
 
-    /* Fill in the ethernet header */
-    ehdr = (eth_hdr_t *)pkt;
+    /* Fill in the ethernet header, in front of the IP header */
+    if(!(ehdr = (eth_hdr_t *)net_pbuf_push(pb, sizeof(eth_hdr_t)))) {
+        errno = ENOBUFS;
+        ++ipv4_stats.pkt_send_failed;
+        return -1;
+    }
+
     memcpy(ehdr->dest, dest_mac, 6);
     memcpy(ehdr->src, net->mac_addr, 6);
     ehdr->type[0] = 0x08;
     ehdr->type[1] = 0x00;
 
-    /* Put the IP header / data into our ethernet packet */
-    memcpy(pkt + sizeof(eth_hdr_t), hdr, 4 * (hdr->version_ihl & 0x0f));
-    memcpy(pkt + sizeof(eth_hdr_t) + 4 * (hdr->version_ihl & 0x0f), data,
-           size);
-
     ++ipv4_stats.pkt_sent;
 
-    /* Send it away */
-    net->if_tx(net, pkt, sizeof(ip_hdr_t) + size + sizeof(eth_hdr_t),
-               NETIF_BLOCK);
+    /* Send it away, or add it to the batch being built */
+    net_tx(net, pb);
 
     return 0;
 }
 
-int net_ipv4_send(netif_t *net, const uint8_t *data, size_t size, int id, int ttl,
-                  int proto, uint32_t src, uint32_t dst) {
-    ip_hdr_t hdr;
+/* Send a packet on the specified network adapter */
+int net_ipv4_send_packet(netif_t *net, ip_hdr_t *hdr, const uint8_t *data,
+                         size_t size) {
+    size_t hdrlen = 4 * (hdr->version_ihl & 0x0f);
+    net_pbuf_t *pb;
+    int rv;
+
+    if(!(pb = net_pbuf_alloc(sizeof(eth_hdr_t) + hdrlen, size))) {
+        errno = ENOBUFS;
+        ++ipv4_stats.pkt_send_failed;
+        return -1;
+    }
+
+    /* Put the IP header / data into our packet */
+    net_pbuf_copy(pb->data, data, size);
+    memcpy(net_pbuf_push(pb, hdrlen), hdr, hdrlen);
+
+    rv = net_ipv4_output(net, pb);
+    net_pbuf_free(pb);
 
+    return rv;
+}
+
+static void ipv4_fill_hdr(ip_hdr_t *hdr, size_t size, int id, int ttl,
+                          int proto, uint32_t src, uint32_t dst) {
     /* If the ID is -1, generate a random ID value that can be used in case the
        packet gets fragmented. */
     if(id == -1) {
@@ -186,22 +326,56 @@ int net_ipv4_send(netif_t *net, const uint8_t *data, size_t size, int id, int tt
     }
 
     /* Fill in the IPv4 Header */
-    hdr.version_ihl = 0x45;
-    hdr.tos = 0;
-    hdr.length = htons(size + 20);
-    hdr.packet_id = id;
-    hdr.flags_frag_offs = 0;
-    hdr.ttl = ttl;
-    hdr.protocol = proto;
-    hdr.checksum = 0;
-    hdr.src = src;
-    hdr.dest = dst;
-
-    hdr.checksum = net_ipv4_checksum((uint8_t *)&hdr, sizeof(ip_hdr_t), 0);
+    hdr->version_ihl = 0x45;
+    hdr->tos = 0;
+    hdr->length = htons(size + 20);
+    hdr->packet_id = id;
+    hdr->flags_frag_offs = 0;
+    hdr->ttl = ttl;
+    hdr->protocol = proto;
+    hdr->checksum = 0;
+    hdr->src = src;
+    hdr->dest = dst;
+
+    hdr->checksum = net_ipv4_checksum((uint8_t *)hdr, sizeof(ip_hdr_t), 0);
+}
+
+int net_ipv4_send(netif_t *net, const uint8_t *data, size_t size, int id, int ttl,
+                  int proto, uint32_t src, uint32_t dst) {
+    ip_hdr_t hdr;
+
+    ipv4_fill_hdr(&hdr, size, id, ttl, proto, src, dst);
 
     return net_ipv4_frag_send(net, &hdr, data, size);
 }
 
+/* Send the data in a packet buffer, adding the IP header in front of it in
+   place unless the packet has to be fragmented. */
+int net_ipv4_send_pbuf(netif_t *net, net_pbuf_t *pb, int id, int ttl,
+                       int proto, uint32_t src, uint32_t dst) {
+    ip_hdr_t hdr;
+    uint8_t *ip;
+
+    if(net == NULL) {
+        net = net_default_dev;
+
+        if(!net) {
+            errno = ENETDOWN;
+            return -1;
+        }
+    }
+
+    ipv4_fill_hdr(&hdr, pb->len, id, ttl, proto, src, dst);
+
+    if(pb->len + sizeof(ip_hdr_t) > net->mtu ||
+       !(ip = net_pbuf_push(pb, sizeof(ip_hdr_t))))
+        return net_ipv4_frag_send(net, &hdr, pb->data, pb->len);
+
+    memcpy(ip, &hdr, sizeof(ip_hdr_t));
+
+    return net_ipv4_output(net, pb);
+}
+
 int net_ipv4_input(netif_t *src, const uint8_t *pkt, size_t pktsize,
                    const eth_hdr_t *eth) {
     const ip_hdr_t *ip;
@@ -290,5 +464,9 @@ uint16_t __pure net_ipv4_checksum_pseudo(in_addr_t src, in_addr_t dst, uint8_t p
 }
 
 net_ipv4_stats_t net_ipv4_get_stats(void) {
-    return ipv4_stats;
+    net_ipv4_stats_t rv = ipv4_stats;
+
+    net_ipv4_frag_get_stats(&rv);
+
+    return rv;
 }
@@ -25,11 +25,13 @@ typedef struct {
     uint16_t length;
 } __packed ipv4_pseudo_hdr_t;
 
-uint16_t __pure net_ipv4_checksum(const uint8_t *data, size_t bytes, uint16_t start);
 int net_ipv4_send_packet(netif_t *net, ip_hdr_t *hdr, const uint8_t *data,
                          size_t size);
 int net_ipv4_send(netif_t *net, const uint8_t *data, size_t size, int id, int ttl,
                   int proto, uint32_t src, uint32_t dst);
+int net_ipv4_send_pbuf(netif_t *net, net_pbuf_t *pb, int id, int ttl,
+                       int proto, uint32_t src, uint32_t dst);
+int net_ipv4_output(netif_t *net, net_pbuf_t *pb);
 int net_ipv4_input(netif_t *src, const uint8_t *pkt, size_t pktsize,
                    const eth_hdr_t *eth);
 int net_ipv4_input_proto(netif_t *net, const ip_hdr_t *ip, const uint8_t *data);
@@ -42,6 +44,7 @@ int net_ipv4_frag_send(netif_t *net, ip_hdr_t *hdr, const uint8_t *data,
                        size_t size);
 int net_ipv4_reassemble(netif_t *net, const ip_hdr_t *hdr, const uint8_t *data,
                         size_t size);
+void net_ipv4_frag_get_stats(net_ipv4_stats_t *stats);
 int net_ipv4_frag_init(void);
 void net_ipv4_frag_shutdown(void);
 
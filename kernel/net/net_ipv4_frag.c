@@ -7,8 +7,8 @@
 
 #include <string.h>
 #include <stdlib.h>
-#include <string.h>
 #include <errno.h>
+#include <sys/queue.h>
 #include <arpa/inet.h>
 
 #include <kos/net.h>
@@ -17,13 +17,41 @@
 
 #include "net_core.h"
 #include "net_ipv4.h"
-
-#define MAX(a, b) a > b ? a : b;
+#include "net_pbuf.h"
 
 #define IP_FRAG_POLL_PERIOD_MS 2000
 
+/* Number of buckets in the table of datagrams being reassembled. Must be a
+   power of two. */
+#define IP_FRAG_HASH_SIZE   16
+
+/* Most memory that datagrams being reassembled may hold at once. When a new
+   fragment would take things over this, the oldest datagrams are thrown out
+   to make room. */
+#define IP_FRAG_MEM_MAX     (256 * 1024)
+
+/* Most holes (gaps in the data received so far) a datagram may have. Fragments
+   normally arrive more or less in order, leaving one or two. */
+#define IP_FRAG_MAX_HOLES   16
+
+/* Size of the first buffer for a datagram whose length isn't known yet. */
+#define IP_FRAG_INITIAL_SIZE    2048
+
+/* Largest amount of data an IPv4 datagram can carry. */
+#define IP_FRAG_MAX_SIZE    65535
+
+/* End of the hole past the last fragment, until the last one comes in. */
+#define IP_FRAG_INFINITY    0xFFFFFFFF
+
+/* A range of bytes not received yet, inclusive at both ends (RFC 815). */
+struct ip_frag_hole {
+    uint32_t first;
+    uint32_t last;
+};
+
 struct ip_frag {
-    TAILQ_ENTRY(ip_frag) listhnd;
+    LIST_ENTRY(ip_frag) hashhnd;        /* In its bucket of frag_hash */
+    TAILQ_ENTRY(ip_frag) listhnd;       /* In frags, oldest first */
 
     uint32_t src;
     uint32_t dst;
@@ -31,19 +59,73 @@ struct ip_frag {
     uint8_t proto;
 
     ip_hdr_t hdr;
-    uint8_t *data;
-    uint8_t bitfield[8192];
-    int cur_length;
+    net_pbuf_t *pb;                     /* The data received so far */
+    size_t mem;                         /* Memory charged to the budget */
     int total_length;
     uint64_t death_time;
+
+    int hole_count;
+    struct ip_frag_hole holes[IP_FRAG_MAX_HOLES];
 };
 
 TAILQ_HEAD(ip_frag_list, ip_frag);
+LIST_HEAD(ip_frag_bucket, ip_frag);
 
 static struct ip_frag_list frags;
+static struct ip_frag_bucket frag_hash[IP_FRAG_HASH_SIZE];
+static size_t frag_mem;
 static mutex_t frag_mutex = MUTEX_INITIALIZER;
 static int initted = 0;
 
+static struct {
+    uint32_t frags;
+    uint32_t ok;
+    uint32_t timeout;
+    uint32_t evicted;
+    uint32_t failed;
+} frag_stats;
+
+static inline struct ip_frag_bucket *frag_bucket(uint32_t src, uint32_t dst,
+                                                 uint16_t ident,
+                                                 uint8_t proto) {
+    uint32_t h = src ^ dst ^ ident ^ proto;
+
+    h ^= h >> 16;
+    h ^= h >> 8;
+
+    return &frag_hash[h & (IP_FRAG_HASH_SIZE - 1)];
+}
+
+/* Throw a datagram away. Must be called with frag_mutex held. */
+static void frag_free(struct ip_frag *f) {
+    LIST_REMOVE(f, hashhnd);
+    TAILQ_REMOVE(&frags, f, listhnd);
+    frag_mem -= f->mem;
+    net_pbuf_free(f->pb);
+    free(f);
+}
+
+/* Throw out the oldest datagrams (other than keep) until there's room for
+   size more bytes. Returns -1 if there can't be. */
+static int frag_make_room(size_t size, const struct ip_frag *keep) {
+    struct ip_frag *f, *n;
+
+    f = TAILQ_FIRST(&frags);
+
+    while(frag_mem + size > IP_FRAG_MEM_MAX && f) {
+        n = TAILQ_NEXT(f, listhnd);
+
+        if(f != keep) {
+            frag_free(f);
+            ++frag_stats.evicted;
+        }
+
+        f = n;
+    }
+
+    return frag_mem + size > IP_FRAG_MEM_MAX ? -1 : 0;
+}
+
 /* IP fragment "thread" -- this thread is set up to delete fragments for which
    the "death_time" has passed. This is run approximately once every two
    seconds (since death_time is always on the order of seconds). */
@@ -61,9 +143,8 @@ static void net_ipv4_frag_job(workqueue_t *wq, workqueue_job_t *job) {
         n = TAILQ_NEXT(f, listhnd);
 
         if(f->death_time < now) {
-            TAILQ_REMOVE(&frags, f, listhnd);
-            free(f->data);
-            free(f);
+            frag_free(f);
+            ++frag_stats.timeout;
         }
 
         f = n;
@@ -73,123 +154,140 @@ static void net_ipv4_frag_job(workqueue_t *wq, workqueue_job_t *job) {
     workqueue_enqueue(wq, job);
 }
 
-/* Set the bits in the bitfield for the given set of fragment blocks. */
-static inline void set_bits(uint8_t *bitfield, int start, int end) {
-    /* Use a slightly more efficient method when dealing with an end that is not
-       in the same byte as the start. */
-    if((end >> 3) > (start >> 3)) {
-        int bits = start & 0x07;
-
-        /* Finish off anything in the start byte... */
-        while(bits && bits < 8) {
-            bitfield[start >> 3] |= (1 << bits);
-            ++bits;
-        }
+/* Make sure the buffer for a datagram can hold at least end bytes, moving it
+   to a bigger one if needed. */
+static int frag_grow(struct ip_frag *frag, size_t end, int last) {
+    net_pbuf_t *pb;
+    size_t size, have = frag->pb ? frag->pb->len : 0;
+
+    if(end <= have)
+        return 0;
 
-        /* ...and the start of the end byte. */
-        bits = end & 0x07;
-        bitfield[end >> 3] |= (1 << bits) - 1;
+    /* Unless this is the end, leave room for a few more fragments. */
+    if(last)
+        size = end;
+    else if(!have)
+        size = end > IP_FRAG_INITIAL_SIZE ? end : IP_FRAG_INITIAL_SIZE;
+    else
+        size = end > have * 2 ? end : have * 2;
 
-        /* Now, fill anything in in the middle. */
-        bits = (end >> 3) - ((start + 1) >> 3);
-        memset(bitfield + ((start + 1) >> 3), 0xFF, bits);
-    }
-    /* Fall back to brute-forcing it for when the two are in the same byte. */
-    else {
-        --end;
+    if(size > IP_FRAG_MAX_SIZE)
+        size = IP_FRAG_MAX_SIZE;
 
-        while(end >= start) {
-            bitfield[end >> 3] |= (1 << (end & 0x07));
-            --end;
-        }
+    if(frag_make_room(size - have, frag))
+        return -1;
+
+    if(!(pb = net_pbuf_alloc(0, size)))
+        return -1;
+
+    if(frag->pb) {
+        memcpy(pb->data, frag->pb->data, have);
+        net_pbuf_free(frag->pb);
     }
+
+    frag->pb = pb;
+    frag->mem += size - have;
+    frag_mem += size - have;
+
+    return 0;
 }
 
-/* Check if all bits in the bitfield that should be set are set. */
-static inline int __pure all_bits_set(const uint8_t *bitfield, int end) {
-    int i;
+/* Take the bytes first to last (inclusive) out of the list of holes, as in
+   steps 1-7 of the algorithm in RFC 815. A fragment that covers several holes
+   removes those in the middle, and can only split one of them in two, so the
+   list grows by one at most. Returns -1 if it would grow too long. */
+static int frag_fill_holes(struct ip_frag *frag, uint32_t first,
+                           uint32_t last, int more) {
+    struct ip_frag_hole holes[IP_FRAG_MAX_HOLES + 1];
+    const struct ip_frag_hole *h;
+    int i, count = 0;
+
+    for(i = 0; i < frag->hole_count; ++i) {
+        h = &frag->holes[i];
+
+        /* The last fragment leaves nothing past its end to wait for. */
+        if(!more && h->first > last)
+            continue;
+
+        if(first > h->last || last < h->first) {
+            holes[count++] = *h;
+            continue;
+        }
 
-    /* Make sure each of the beginning bytes are fully set. */
-    for(i = 0; i < (end >> 3); ++i) {
-        if(bitfield[i] != 0xFF) {
-            return 0;
+        if(first > h->first) {
+            holes[count].first = h->first;
+            holes[count++].last = first - 1;
         }
-    }
 
-    /* Check the last byte to make sure it has the right number of bits set. */
-    if(bitfield[(end >> 3)] != ((1 << (end & 0x07)) - 1)) {
-        return 0;
+        if(last < h->last && more) {
+            holes[count].first = last + 1;
+            holes[count++].last = h->last;
+        }
     }
 
-    return 1;
+    if(count > IP_FRAG_MAX_HOLES)
+        return -1;
+
+    memcpy(frag->holes, holes, count * sizeof(struct ip_frag_hole));
+    frag->hole_count = count;
+
+    return 0;
 }
 
-/* Import the data for a fragment, potentially passing it onward in processing,
-   if the whole datagram has arrived. */
-static int frag_import(netif_t *src, const ip_hdr_t *hdr, const uint8_t *data,
-                       size_t size, uint16_t flags, struct ip_frag *frag) {
-    void *tmp;
-    int fo = flags & 0x1FFF;
-    int tl = ntohs(hdr->length);
-    int start = (fo << 3);
-    int ihl = (hdr->version_ihl & 0x0F) << 2;
-    int end = start + tl - ihl;
-    int rv = 0;
+/* Import the data for a fragment. If that completes the datagram, it is taken
+   out of the table and returned, otherwise NULL is returned. The datagram is
+   thrown away if the fragment doesn't fit in with the rest of it. */
+static struct ip_frag *frag_import(const ip_hdr_t *hdr, const uint8_t *data,
+                                   size_t size, uint16_t flags,
+                                   struct ip_frag *frag) {
+    int more = flags & 0x2000;
+    uint32_t start = (flags & 0x1FFF) << 3;
+    uint32_t end = start + size;
     uint64_t now = timer_ms_gettime64();
 
-    (void)size;
-
-    /* Reallocate space for the data buffer, if needed. */
-    if(end > frag->cur_length) {
-        tmp = realloc(frag->data, end);
+    /* Everything but the last fragment has to be a multiple of 8 bytes, and
+       nothing can go past the end of the datagram, once that's known. */
+    if(!size || end > IP_FRAG_MAX_SIZE || (more && (size & 7)) ||
+       (frag->total_length && end > (uint32_t)frag->total_length) ||
+       (!more && frag->total_length && end != (uint32_t)frag->total_length))
+        goto fail;
 
-        if(!tmp) {
-            errno = ENOMEM;
-            rv = -1;
-            goto out;
-        }
+    if(frag_grow(frag, end, !more))
+        goto fail;
 
-        frag->data = tmp;
-    }
+    if(frag_fill_holes(frag, start, end - 1, more))
+        goto fail;
 
-    memcpy(frag->data + start, data, end - start);
-    set_bits(frag->bitfield, fo, fo + (((tl - ihl) + 7) >> 3));
+    memcpy(frag->pb->data + start, data, size);
 
     /* If the MF flag is not set, set the data length. */
-    if(!(flags & 0x2000)) {
+    if(!more)
         frag->total_length = end;
-    }
 
     /* If the fragment offset is zero, store the header. */
-    if(!fo) {
+    if(!start)
         frag->hdr = *hdr;
-    }
 
-    /* If the total length is not zero, and all the bits in the bitfield are
-       set, we continue on. */
-    if(frag->total_length &&
-            all_bits_set(frag->bitfield, frag->total_length >> 3)) {
-        /* Set the right length. Don't worry about updating the checksum, since
-           net_ipv4_input_proto doesn't check it anyway. */
-        frag->hdr.length = htons(frag->total_length +
-                                 ((frag->hdr.version_ihl & 0x0F) << 2));
-
-        rv = net_ipv4_input_proto(src, &frag->hdr, frag->data);
-
-        /* Remove the fragment from our buffer. */
+    /* Once there are no holes left, the datagram is complete. */
+    if(!frag->hole_count) {
+        LIST_REMOVE(frag, hashhnd);
         TAILQ_REMOVE(&frags, frag, listhnd);
-        free(frag->data);
-        free(frag);
+        frag_mem -= frag->mem;
+        ++frag_stats.ok;
 
-        goto out;
+        return frag;
     }
 
     /* Update the timer. */
-    frag->death_time = MAX(frag->death_time, (now + hdr->ttl * 1000));
+    if(frag->death_time < now + hdr->ttl * 1000)
+        frag->death_time = now + hdr->ttl * 1000;
 
-out:
-    mutex_unlock(&frag_mutex);
-    return rv;
+    return NULL;
+
+fail:
+    frag_free(frag);
+    ++frag_stats.failed;
+    return NULL;
 }
 
 /* IPv4 fragmentation procedure. This is basically a direct implementation of
@@ -241,13 +339,19 @@ int net_ipv4_frag_send(netif_t *net, ip_hdr_t *hdr, const uint8_t *data,
     return net_ipv4_frag_send(net, hdr, data + ds, size - ds);
 }
 
-/* IPv4 fragment reassembly procedure. This (along with the frag_import function
-   above are basically a direct implementation of the example IP reassembly
-   routine on pages 27-29 of RFC 791. */
+/* IPv4 fragment reassembly procedure. Fragments are matched up to their
+   datagram through a hash table, and the parts of the datagram that are still
+   missing are tracked with a list of hole descriptors, as described in
+   RFC 815. The whole datagram is put together in a packet buffer, which is
+   handed up as the packet being received so that the protocol can keep it
+   without copying. */
 int net_ipv4_reassemble(netif_t *src, const ip_hdr_t *hdr, const uint8_t *data,
                         size_t size) {
     uint16_t flags = ntohs(hdr->flags_frag_offs);
+    struct ip_frag_bucket *b;
     struct ip_frag *f;
+    net_pbuf_rx_t rx;
+    int rv;
 
     /* If the fragment offset is zero and the MF flag is 0, this is the whole
        packet. Treat it as such. */
@@ -260,36 +364,73 @@ int net_ipv4_reassemble(netif_t *src, const ip_hdr_t *hdr, const uint8_t *data,
     if(mutex_lock_irqsafe(&frag_mutex))
         return -1;
 
+    ++frag_stats.frags;
+
     /* Find the packet if we already have this one in our data buffer. */
-    TAILQ_FOREACH(f, &frags, listhnd) {
+    b = frag_bucket(hdr->src, hdr->dest, hdr->packet_id, hdr->protocol);
+
+    LIST_FOREACH(f, b, hashhnd) {
         if(f->src == hdr->src && f->dst == hdr->dest &&
-           f->ident == hdr->packet_id && f->proto == hdr->protocol) {
-            /* We've got it, import the data (this function handles unlocking
-               the mutex when its done). */
-            return frag_import(src, hdr, data, size, flags, f);
-        }
+           f->ident == hdr->packet_id && f->proto == hdr->protocol)
+            break;
     }
 
-    /* We don't have a fragment with that identifier, so make one. */
-    f = (struct ip_frag *)malloc(sizeof(struct ip_frag));
-
     if(!f) {
-        errno = ENOMEM;
-        return -1;
+        /* We don't have a fragment with that identifier, so make one. */
+        if(frag_make_room(sizeof(struct ip_frag), NULL) ||
+           !(f = (struct ip_frag *)malloc(sizeof(struct ip_frag)))) {
+            ++frag_stats.failed;
+            mutex_unlock(&frag_mutex);
+            errno = ENOMEM;
+            return -1;
+        }
+
+        memset(f, 0, sizeof(struct ip_frag));
+        f->src = hdr->src;
+        f->dst = hdr->dest;
+        f->ident = hdr->packet_id;
+        f->proto = hdr->protocol;
+        f->mem = sizeof(struct ip_frag);
+        f->hole_count = 1;
+        f->holes[0].first = 0;
+        f->holes[0].last = IP_FRAG_INFINITY;
+
+        frag_mem += f->mem;
+        LIST_INSERT_HEAD(b, f, hashhnd);
+        TAILQ_INSERT_TAIL(&frags, f, listhnd);
     }
 
-    f->src = hdr->src;
-    f->dst = hdr->dest;
-    f->ident = hdr->packet_id;
-    f->proto = hdr->protocol;
-    f->data = NULL;
-    f->cur_length = 0;
-    f->total_length = 0;
-    memset(f->bitfield, 0, sizeof(f->bitfield));
+    f = frag_import(hdr, data, size, flags, f);
+    mutex_unlock(&frag_mutex);
+
+    if(!f)
+        return 0;
+
+    /* Set the right length. Don't worry about updating the checksum, since
+       net_ipv4_input_proto doesn't check it anyway. */
+    f->hdr.length = htons(f->total_length + ((f->hdr.version_ihl & 0x0F) << 2));
+    f->hdr.flags_frag_offs = 0;
+    f->pb->len = f->total_length;
+
+    net_pbuf_rx_enter(&rx, f->pb);
+    rv = net_ipv4_input_proto(src, &f->hdr, f->pb->data);
+    net_pbuf_rx_leave(&rx);
+
+    net_pbuf_free(f->pb);
+    free(f);
 
-    TAILQ_INSERT_TAIL(&frags, f, listhnd);
+    return rv;
+}
+
+void net_ipv4_frag_get_stats(net_ipv4_stats_t *stats) {
+    mutex_lock_scoped(&frag_mutex);
 
-    return frag_import(src, hdr, data, size, flags, f);
+    stats->frag_recv = frag_stats.frags;
+    stats->frag_reasm_ok = frag_stats.ok;
+    stats->frag_reasm_timeout = frag_stats.timeout;
+    stats->frag_reasm_evicted = frag_stats.evicted;
+    stats->frag_reasm_failed = frag_stats.failed;
+    stats->frag_mem = frag_mem;
 }
 
 static workqueue_job_t net_ipv4_frag_wq_job = {
@@ -297,8 +438,15 @@ static workqueue_job_t net_ipv4_frag_wq_job = {
 };
 
 int net_ipv4_frag_init(void) {
+    int i;
+
     if(!initted) {
         TAILQ_INIT(&frags);
+
+        for(i = 0; i < IP_FRAG_HASH_SIZE; ++i)
+            LIST_INIT(&frag_hash[i]);
+
+        frag_mem = 0;
         net_ipv4_frag_wq_job.time_ms = timer_ms_gettime64() + IP_FRAG_POLL_PERIOD_MS;
         workqueue_enqueue(net_wq, &net_ipv4_frag_wq_job);
     }
@@ -308,21 +456,18 @@ int net_ipv4_frag_init(void) {
 }
 
 void net_ipv4_frag_shutdown(void) {
-    struct ip_frag *c, *n;
+    struct ip_frag *f;
 
     if(initted) {
         workqueue_cancel(net_wq, &net_ipv4_frag_wq_job);
 
-        c = TAILQ_FIRST(&frags);
+        mutex_lock(&frag_mutex);
 
-        while(c) {
-            n = TAILQ_NEXT(c, listhnd);
-            free(c->data);
-            free(c->bitfield);
-            c = n;
-        }
+        while((f = TAILQ_FIRST(&frags)))
+            frag_free(f);
+
+        mutex_unlock(&frag_mutex);
     }
 
     initted = 0;
-    TAILQ_INIT(&frags);
 }
@@ -13,6 +13,7 @@
 #include <kos/fs_socket.h>
 #include <errno.h>
 
+#include "net_core.h"
 #include "net_ipv6.h"
 #include "net_icmp6.h"
 #include "net_ipv4.h"
@@ -61,6 +62,26 @@ static int __pure is_in_network(netif_t *net, const struct in6_addr *ip) {
     return 0;
 }
 
+/* Send a packet that starts with its IPv6 header to a known link-layer
+   address. The packet needs room for the ethernet header in front of it. */
+int net_ipv6_output_eth(netif_t *net, net_pbuf_t *pb, const uint8_t dest[6]) {
+    eth_hdr_t *ehdr;
+
+    if(!(ehdr = (eth_hdr_t *)net_pbuf_push(pb, sizeof(eth_hdr_t)))) {
+        ++ipv6_stats.pkt_send_failed;
+        return -1;
+    }
+
+    memcpy(ehdr->dest, dest, 6);
+    memcpy(ehdr->src, net->mac_addr, 6);
+    ehdr->type[0] = 0x86;
+    ehdr->type[1] = 0xDD;
+
+    ++ipv6_stats.pkt_sent;
+
+    return net_tx(net, pb);
+}
+
 /* Send a packet on the specified network adapter */
 int net_ipv6_send_packet(netif_t *net, ipv6_hdr_t *hdr, const uint8_t *data,
                          size_t data_size) {
@@ -194,6 +215,35 @@ int net_ipv6_send(netif_t *net, const uint8_t *data, size_t data_size,
     return net_ipv6_send_packet(net, &hdr, data, data_size);
 }
 
+/* Only IPv4 can send a packet buffer as is so far, anything else goes through
+   the usual path. */
+int net_ipv6_send_pbuf(netif_t *net, net_pbuf_t *pb, int hop_limit, int proto,
+                       const struct in6_addr *src, const struct in6_addr *dst) {
+    if(!IN6_IS_ADDR_V4MAPPED(src) || !IN6_IS_ADDR_V4MAPPED(dst))
+        return net_ipv6_send(net, pb->data, pb->len, hop_limit, proto, src,
+                             dst);
+
+    if(!net) {
+        net = net_default_dev;
+
+        if(!net) {
+            errno = ENETDOWN;
+            return -1;
+        }
+    }
+
+    if(!hop_limit) {
+        if(net->hop_limit)
+            hop_limit = net->hop_limit;
+        else
+            hop_limit = 255;
+    }
+
+    return net_ipv4_send_pbuf(net, pb, -1, hop_limit, proto,
+                              src->__s6_addr.__s6_addr32[3],
+                              dst->__s6_addr.__s6_addr32[3]);
+}
+
 int net_ipv6_input(netif_t *src, const uint8_t *pkt, size_t pktsize,
                    const eth_hdr_t *eth) {
     ipv6_hdr_t *ip;
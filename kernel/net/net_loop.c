@@ -0,0 +1,272 @@
+/* KallistiOS ##version##
+
+   kernel/net/net_loop.c
+
+*/
+
+#include <string.h>
+#include <sys/queue.h>
+
+#include <kos/net.h>
+#include <kos/irq.h>
+#include <kos/dbglog.h>
+#include <kos/worker_thread.h>
+
+#include "net_pbuf.h"
+
+/*
+
+  Loopback network device.
+
+  Every frame sent on this device is received back on it, as if it were
+  plugged into a switch with nothing else on it. Since it still speaks
+  Ethernet, everything from ARP up goes through the same paths it would with
+  real hardware, which makes it possible to drive (and time) the whole stack
+  without any.
+
+  Frames are queued as they are sent, and handed back to the stack in batches
+  by a worker thread, so that the sending side never runs the receiving side
+  from inside itself.
+
+*/
+
+/* Most frames waiting to be received before new ones get dropped */
+#define LOOP_QUEUE_MAX  256
+
+static netif_t loop_if;
+
+static TAILQ_HEAD(, net_pbuf) loop_queue = TAILQ_HEAD_INITIALIZER(loop_queue);
+static int loop_queued;
+
+static kthread_worker_t *loop_worker;
+
+static const kthread_attr_t loop_worker_attr = {
+    .label = "net-loop"
+};
+
+/* Put a frame on the receive queue. Takes over the caller's reference. */
+static int loop_enqueue(net_pbuf_t *pb) {
+    {
+        irq_disable_scoped();
+
+        if(loop_queued < LOOP_QUEUE_MAX) {
+            TAILQ_INSERT_TAIL(&loop_queue, pb, pkt_queue);
+            ++loop_queued;
+            pb = NULL;
+        }
+    }
+
+    if(pb) {
+        net_pbuf_free(pb);
+        return NETIF_TX_ERROR;
+    }
+
+    return NETIF_TX_OK;
+}
+
+static void loop_rx(void *data) {
+    net_pbuf_t *pkts[NET_TX_BATCH_MAX];
+    int i, count;
+
+    (void)data;
+
+    do {
+        count = 0;
+
+        {
+            irq_disable_scoped();
+
+            while(count < NET_TX_BATCH_MAX && !TAILQ_EMPTY(&loop_queue)) {
+                pkts[count] = TAILQ_FIRST(&loop_queue);
+                TAILQ_REMOVE(&loop_queue, pkts[count], pkt_queue);
+                --loop_queued;
+                ++count;
+            }
+        }
+
+        net_input_batch(&loop_if, pkts, count);
+
+        for(i = 0; i < count; i++)
+            net_pbuf_free(pkts[i]);
+    } while(count == NET_TX_BATCH_MAX);
+}
+
+static void loop_flush(void) {
+    net_pbuf_t *pb;
+
+    irq_disable_scoped();
+
+    while((pb = TAILQ_FIRST(&loop_queue))) {
+        TAILQ_REMOVE(&loop_queue, pb, pkt_queue);
+        net_pbuf_free(pb);
+    }
+
+    loop_queued = 0;
+}
+
+static int loop_if_detect(netif_t *self) {
+    self->flags |= NETIF_DETECTED;
+    return 0;
+}
+
+static int loop_if_init(netif_t *self) {
+    self->flags |= NETIF_INITIALIZED;
+    return 0;
+}
+
+static int loop_if_shutdown(netif_t *self) {
+    self->flags &= ~(NETIF_DETECTED | NETIF_INITIALIZED | NETIF_RUNNING);
+    return 0;
+}
+
+static int loop_if_start(netif_t *self) {
+    if(!(self->flags & NETIF_INITIALIZED))
+        return -1;
+
+    if(self->flags & NETIF_RUNNING)
+        return 0;
+
+    loop_worker = thd_worker_create_ex(&loop_worker_attr, loop_rx, NULL);
+
+    if(!loop_worker)
+        return -1;
+
+    self->flags |= NETIF_RUNNING;
+    return 0;
+}
+
+static int loop_if_stop(netif_t *self) {
+    if(!(self->flags & NETIF_RUNNING))
+        return 0;
+
+    self->flags &= ~NETIF_RUNNING;
+
+    thd_worker_destroy(loop_worker);
+    loop_worker = NULL;
+    loop_flush();
+
+    return 0;
+}
+
+static int loop_if_tx(netif_t *self, const uint8_t *data, int len,
+                      int blocking) {
+    net_pbuf_t *pb;
+
+    (void)blocking;
+
+    if(!(self->flags & NETIF_RUNNING))
+        return NETIF_TX_ERROR;
+
+    /* Copy it, as a driver would copy it out to the hardware. */
+    if(!(pb = net_pbuf_alloc_rx(0, len)))
+        return NETIF_TX_ERROR;
+
+    net_pbuf_copy(pb->data, data, len);
+
+    if(loop_enqueue(pb) != NETIF_TX_OK)
+        return NETIF_TX_ERROR;
+
+    thd_worker_wakeup(loop_worker);
+    return NETIF_TX_OK;
+}
+
+static int loop_if_tx_batch(netif_t *self, net_pbuf_t *const *pkts, int count,
+                            int blocking) {
+    int i;
+
+    (void)blocking;
+
+    if(!(self->flags & NETIF_RUNNING))
+        return NETIF_TX_ERROR;
+
+    /* The buffers are never changed once they've been sent, so there's no
+       need to copy them: just keep them until they've been received. */
+    for(i = 0; i < count; i++) {
+        if(loop_enqueue(net_pbuf_ref(pkts[i])) != NETIF_TX_OK)
+            break;
+    }
+
+    thd_worker_wakeup(loop_worker);
+    return i;
+}
+
+static int loop_if_tx_commit(netif_t *self) {
+    (void)self;
+    return 0;
+}
+
+static int loop_if_rx_poll(netif_t *self) {
+    (void)self;
+    return 0;
+}
+
+static int loop_if_set_flags(netif_t *self, uint32_t flags_and,
+                             uint32_t flags_or) {
+    self->flags = (self->flags & flags_and) | flags_or;
+    return 0;
+}
+
+static int loop_if_set_mc(netif_t *self, const uint8_t *list, int count) {
+    (void)self;
+    (void)list;
+    (void)count;
+    return 0;
+}
+
+int net_loop_init(void) {
+    static const uint8_t mac[6] = { 0x02, 0x00, 0x00, 0x00, 0x00, 0x01 };
+
+    if(loop_if.flags & NETIF_REGISTERED)
+        return 0;
+
+    memset(&loop_if, 0, sizeof(loop_if));
+
+    loop_if.name = "lo";
+    loop_if.descr = "Loopback";
+    loop_if.index = 0;
+    loop_if.dev_id = 0;
+    loop_if.flags = NETIF_NO_FLAGS;
+    memcpy(loop_if.mac_addr, mac, 6);
+
+    /* 10.0.0.1/8, so that there's a subnet to talk to */
+    loop_if.ip_addr[0] = 10;
+    loop_if.ip_addr[3] = 1;
+    loop_if.netmask[0] = 255;
+    loop_if.broadcast[0] = 10;
+    loop_if.broadcast[1] = 255;
+    loop_if.broadcast[2] = 255;
+    loop_if.broadcast[3] = 255;
+    loop_if.mtu = 1500;
+
+    loop_if.if_detect = loop_if_detect;
+    loop_if.if_init = loop_if_init;
+    loop_if.if_shutdown = loop_if_shutdown;
+    loop_if.if_start = loop_if_start;
+    loop_if.if_stop = loop_if_stop;
+    loop_if.if_tx = loop_if_tx;
+    loop_if.if_tx_commit = loop_if_tx_commit;
+    loop_if.if_rx_poll = loop_if_rx_poll;
+    loop_if.if_set_flags = loop_if_set_flags;
+    loop_if.if_set_mc = loop_if_set_mc;
+    loop_if.if_tx_batch = loop_if_tx_batch;
+
+    if(net_reg_device(&loop_if) < 0) {
+        dbglog(DBG_ERROR, "net_loop: can't register the device\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+int net_loop_shutdown(void) {
+    if(!(loop_if.flags & NETIF_REGISTERED))
+        return -1;
+
+    loop_if_stop(&loop_if);
+    loop_if_shutdown(&loop_if);
+
+    if(net_default_dev == &loop_if)
+        net_set_default(NULL);
+
+    return net_unreg_device(&loop_if);
+}
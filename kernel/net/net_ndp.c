@@ -11,11 +11,14 @@
 #include <string.h>
 #include <netinet/in.h>
 #include <sys/queue.h>
+#include <kos/irq.h>
 #include <kos/net.h>
 #include <kos/timer.h>
 
+#include "net_core.h"
 #include "net_ipv6.h"
 #include "net_icmp6.h"
+#include "net_pbuf.h"
 
 /* This file implements the Neighbor Discovery Protocol for IPv6. Basically, NDP
    acts much like ARP does for IPv4. It is responsible for keeping track of the
@@ -23,6 +26,19 @@
    through ICMPv6 packets. NDP is specified in RFC 4861. Note however, that, for
    the time being at least, this isn't fully compliant with that spec. */
 
+/* Number of buckets in the NDP cache. Must be a power of two. */
+#define NDP_HASH_SIZE       32
+
+/* Most packets held for an address that is being looked up. Past that, the
+   oldest ones are dropped. */
+#define NDP_PENDING_MAX     8
+
+/* Number of buckets looked at for expired entries on each call into the
+   cache, so that the cost of cleaning up is spread out. */
+#define NDP_GC_BUCKETS      2
+
+TAILQ_HEAD(ndp_pending, net_pbuf);
+
 /* Structure describing a NDP entry. Analogous to the netarp_t for ARP. */
 typedef struct ndp_entry {
     LIST_ENTRY(ndp_entry)   entry;
@@ -30,13 +46,18 @@ typedef struct ndp_entry {
     uint64_t                last_reachable;
     int                     state;
     uint8_t                 mac[6];
-    ipv6_hdr_t              *pkt;
-    uint8_t                 *data;
-    int                     data_size;
+    struct ndp_pending      pending;    /* Packets waiting for the address */
+    int                     pending_count;
 } ndp_entry_t;
 
 LIST_HEAD(ndp_list, ndp_entry);
-static struct ndp_list ndp_cache = LIST_HEAD_INITIALIZER(0);
+
+/* NDP cache, hashed on the IPv6 address. Changes to it are made with
+   interrupts disabled, like the ARP cache. */
+static struct ndp_list ndp_cache[NDP_HASH_SIZE];
+
+/* Next bucket to garbage collect */
+static unsigned int ndp_gc_next;
 
 /* List of states for the ndp entry */
 #define NDP_STATE_INCOMPLETE    0
@@ -45,38 +66,144 @@ static struct ndp_list ndp_cache = LIST_HEAD_INITIALIZER(0);
 #define NDP_STATE_DELAY         3
 #define NDP_STATE_PROBE         4
 
+static inline struct ndp_list *ndp_bucket(const struct in6_addr *ip) {
+    /* The interface identifier is the part most likely to differ. */
+    uint32_t h = ip->__s6_addr.__s6_addr32[2] ^ ip->__s6_addr.__s6_addr32[3];
+
+    h ^= h >> 16;
+    h ^= h >> 8;
+
+    return &ndp_cache[h & (NDP_HASH_SIZE - 1)];
+}
+
+static ndp_entry_t *ndp_find(const struct in6_addr *ip) {
+    ndp_entry_t *i;
+
+    LIST_FOREACH(i, ndp_bucket(ip), entry) {
+        if(!memcmp(ip, &i->ip, sizeof(struct in6_addr)))
+            return i;
+    }
+
+    return NULL;
+}
+
+static void ndp_free(ndp_entry_t *i) {
+    net_pbuf_t *pb;
+
+    LIST_REMOVE(i, entry);
+
+    while((pb = TAILQ_FIRST(&i->pending))) {
+        TAILQ_REMOVE(&i->pending, pb, pkt_queue);
+        net_pbuf_free(pb);
+    }
+
+    free(i);
+}
+
+static int ndp_expired(const ndp_entry_t *i, uint64_t now) {
+    /* If we haven't gotten a reachable confirmation within 10 minutes, its
+       pretty safe to remove it. Also, remove any incomplete entries that
+       are still incomplete after a few seconds have passed. */
+    return i->last_reachable + 600000 < now ||
+           (i->state == NDP_STATE_INCOMPLETE && i->last_reachable + 2000 < now);
+}
+
+/* Look at the next few buckets for entries to throw out. Must be called with
+   interrupts disabled. */
+static void ndp_gc_step(uint64_t now) {
+    ndp_entry_t *i, *tmp;
+    int j;
+
+    for(j = 0; j < NDP_GC_BUCKETS; ++j) {
+        i = LIST_FIRST(&ndp_cache[ndp_gc_next]);
+        ndp_gc_next = (ndp_gc_next + 1) & (NDP_HASH_SIZE - 1);
+
+        while(i) {
+            tmp = LIST_NEXT(i, entry);
+
+            if(ndp_expired(i, now))
+                ndp_free(i);
+
+            i = tmp;
+        }
+    }
+}
+
 void net_ndp_gc(void) {
     ndp_entry_t *i, *tmp;
     uint64_t now = timer_ms_gettime64();
+    int j;
 
-    i = LIST_FIRST(&ndp_cache);
+    irq_disable_scoped();
 
-    while(i) {
-        tmp = LIST_NEXT(i, entry);
+    for(j = 0; j < NDP_HASH_SIZE; ++j) {
+        i = LIST_FIRST(&ndp_cache[j]);
 
-        /* If we haven't gotten a reachable confirmation within 10 minutes, its
-           pretty safe to remove it. Also, remove any incomplete entries that
-           are still incomplete after a few seconds have passed. */
-        if(i->last_reachable + 600000 < now ||
-                (i->state == NDP_STATE_INCOMPLETE &&
-                 i->last_reachable + 2000 < now)) {
-            LIST_REMOVE(i, entry);
+        while(i) {
+            tmp = LIST_NEXT(i, entry);
 
-            if(i->pkt) {
-                free(i->pkt);
-                free(i->data);
-            }
+            if(ndp_expired(i, now))
+                ndp_free(i);
 
-            free(i);
+            i = tmp;
         }
+    }
+}
+
+/* Hold on to a copy of a packet until the address is known, dropping the
+   oldest one if there are too many. The copy is made with room for the
+   Ethernet header. */
+static void ndp_queue(ndp_entry_t *i, net_pbuf_t *pb) {
+    net_pbuf_t *old;
+
+    if(i->pending_count == NDP_PENDING_MAX) {
+        old = TAILQ_FIRST(&i->pending);
+        TAILQ_REMOVE(&i->pending, old, pkt_queue);
+        net_pbuf_free(old);
+        --i->pending_count;
+    }
+
+    TAILQ_INSERT_TAIL(&i->pending, pb, pkt_queue);
+    ++i->pending_count;
+}
+
+static net_pbuf_t *ndp_copy_pkt(const ipv6_hdr_t *pkt, const uint8_t *data,
+                                int data_size) {
+    net_pbuf_t *pb;
+
+    if(!pkt || !data || !data_size)
+        return NULL;
+
+    if(!(pb = net_pbuf_alloc(sizeof(eth_hdr_t),
+                             sizeof(ipv6_hdr_t) + data_size)))
+        return NULL;
+
+    memcpy(pb->data, pkt, sizeof(ipv6_hdr_t));
+    net_pbuf_copy(pb->data + sizeof(ipv6_hdr_t), data, data_size);
+
+    return pb;
+}
+
+/* Send the packets that were waiting on an address, now that it's known. */
+static void ndp_send_pending(netif_t *net, struct ndp_pending *pending,
+                             const uint8_t mac[6]) {
+    net_pbuf_t *pb;
+
+    net_tx_begin();
 
-        i = tmp;
+    while((pb = TAILQ_FIRST(pending))) {
+        TAILQ_REMOVE(pending, pb, pkt_queue);
+        net_ipv6_output_eth(net, pb, mac);
+        net_pbuf_free(pb);
     }
+
+    net_tx_end();
 }
 
 int net_ndp_insert(netif_t *net, const uint8_t mac[6], const struct in6_addr *ip,
                    int unsol) {
-    ndp_entry_t *i;
+    struct ndp_pending pending = TAILQ_HEAD_INITIALIZER(pending);
+    ndp_entry_t *i, *n;
     uint64_t now = timer_ms_gettime64();
 
     /* Don't allow any multicast or unspecified addresses to end up in the NDP
@@ -85,9 +212,13 @@ int net_ndp_insert(netif_t *net, const uint8_t mac[6], const struct in6_addr *ip
         return -1;
     }
 
-    /* Look through the list first to see if its there */
-    LIST_FOREACH(i, &ndp_cache, entry) {
-        if(!memcmp(ip, &i->ip, sizeof(struct in6_addr))) {
+    {
+        irq_disable_scoped();
+
+        ndp_gc_step(now);
+
+        /* Look through the cache first to see if its there */
+        if((i = ndp_find(ip))) {
             /* We found it, update everything */
             if(unsol && memcmp(i->mac, mac, 6)) {
                 i->state = NDP_STATE_STALE;
@@ -99,42 +230,44 @@ int net_ndp_insert(netif_t *net, const uint8_t mac[6], const struct in6_addr *ip
             memcpy(i->mac, mac, 6);
             i->last_reachable = now;
 
-            /* Send our queued packet, if we have one */
-            if(i->pkt) {
-                net_ipv6_send_packet(net, i->pkt, i->data, i->data_size);
-                free(i->pkt);
-                free(i->data);
+            /* Take our queued packets, to send them below */
+            TAILQ_CONCAT(&pending, &i->pending, pkt_queue);
+            i->pending_count = 0;
+        }
+    }
 
-                i->pkt = NULL;
-                i->data = NULL;
-                i->data_size = 0;
-            }
+    if(i) {
+        if(!TAILQ_EMPTY(&pending))
+            ndp_send_pending(net, &pending, mac);
 
-            return 0;
-        }
+        return 0;
     }
 
     /* No entry exists yet, so create one */
-    if(!(i = (ndp_entry_t *)malloc(sizeof(ndp_entry_t)))) {
+    if(!(n = (ndp_entry_t *)malloc(sizeof(ndp_entry_t)))) {
         return -1;
     }
 
-    memset(i, 0, sizeof(ndp_entry_t));
-    memcpy(&i->ip, ip, sizeof(struct in6_addr));
-    memcpy(i->mac, mac, 6);
-    i->last_reachable = now;
+    memset(n, 0, sizeof(ndp_entry_t));
+    memcpy(&n->ip, ip, sizeof(struct in6_addr));
+    memcpy(n->mac, mac, 6);
+    n->last_reachable = now;
+    TAILQ_INIT(&n->pending);
 
     if(unsol) {
-        i->state = NDP_STATE_STALE;
+        n->state = NDP_STATE_STALE;
     }
     else {
-        i->state = NDP_STATE_REACHABLE;
+        n->state = NDP_STATE_REACHABLE;
     }
 
-    LIST_INSERT_HEAD(&ndp_cache, i, entry);
+    irq_disable_scoped();
 
-    /* Garbage collect! */
-    net_ndp_gc();
+    /* Someone else may have added it in the meantime. */
+    if(ndp_find(ip))
+        free(n);
+    else
+        LIST_INSERT_HEAD(ndp_bucket(ip), n, entry);
 
     return 0;
 }
@@ -159,87 +292,107 @@ static void net_ndp_send_sol(netif_t *net, const struct in6_addr *ip) {
 
 int net_ndp_lookup(netif_t *net, const struct in6_addr *ip, uint8_t mac_out[6],
                    const ipv6_hdr_t *pkt, const uint8_t *data, int data_size) {
-    ndp_entry_t *i;
+    ndp_entry_t *i, *n = NULL;
+    net_pbuf_t *pb;
     uint64_t now = timer_ms_gettime64();
+    int found = 0, stale = 0;
 
-    /* Garbage collect, so we don't end up returning really stale entries */
-    net_ndp_gc();
+    {
+        irq_disable_scoped();
 
-    /* Look for the entry */
-    LIST_FOREACH(i, &ndp_cache, entry) {
-        if(!memcmp(ip, &i->ip, sizeof(struct in6_addr))) {
-            if(i->state == NDP_STATE_INCOMPLETE) {
-                memset(mac_out, 0, 6);
-                return -1;
-            }
-            else if(i->state == NDP_STATE_STALE) {
-                net_ndp_send_sol(net, ip);
-            }
+        ndp_gc_step(now);
+
+        /* Look for the entry, so we don't end up returning a really stale
+           one */
+        if((i = ndp_find(ip)) && ndp_expired(i, now)) {
+            ndp_free(i);
+            i = NULL;
+        }
 
+        if(i && i->state != NDP_STATE_INCOMPLETE) {
             memcpy(mac_out, i->mac, 6);
-            return 0;
+            stale = i->state == NDP_STATE_STALE;
+            found = 1;
+        }
+        else if(i) {
+            found = -1;
         }
     }
 
-    /* Its not there, add an incomplete entry and solicit the info */
-    if(!(i = (ndp_entry_t *)malloc(sizeof(ndp_entry_t)))) {
-        return -1;
+    if(found > 0) {
+        if(stale)
+            net_ndp_send_sol(net, ip);
+
+        return 0;
     }
 
-    memset(i, 0, sizeof(ndp_entry_t));
-    memcpy(&i->ip, ip, sizeof(struct in6_addr));
-    i->last_reachable = now;
-    i->state = NDP_STATE_INCOMPLETE;
+    memset(mac_out, 0, 6);
 
-    /* Copy our packet if we have one to copy. */
-    if(pkt && data && data_size) {
-        i->data = (uint8_t *)malloc(data_size);
+    /* Copy the packet, to send once we have an answer. */
+    pb = ndp_copy_pkt(pkt, data, data_size);
 
-        if(i->data) {
-            i->pkt = (ipv6_hdr_t *)malloc(sizeof(ipv6_hdr_t));
+    if(found < 0 && !pb)
+        return -1;
 
-            if(!i->pkt) {
-                free(i->data);
-                i->data = NULL;
-            }
-            else {
-                memcpy(i->pkt, pkt, sizeof(ipv6_hdr_t));
-                memcpy(i->data, data, data_size);
-                i->data_size = data_size;
-            }
+    /* Its not there, add an incomplete entry and solicit the info */
+    if(!found) {
+        if(!(n = (ndp_entry_t *)malloc(sizeof(ndp_entry_t)))) {
+            net_pbuf_free(pb);
+            return -1;
         }
+
+        memset(n, 0, sizeof(ndp_entry_t));
+        memcpy(&n->ip, ip, sizeof(struct in6_addr));
+        n->last_reachable = now;
+        n->state = NDP_STATE_INCOMPLETE;
+        TAILQ_INIT(&n->pending);
     }
 
-    LIST_INSERT_HEAD(&ndp_cache, i, entry);
+    {
+        irq_disable_scoped();
 
-    net_ndp_send_sol(net, ip);
+        /* Things may have changed while interrupts were enabled. */
+        if(!(i = ndp_find(ip)) && n) {
+            i = n;
+            n = NULL;
+            LIST_INSERT_HEAD(ndp_bucket(ip), i, entry);
+        }
+
+        if(i && pb) {
+            ndp_queue(i, pb);
+            pb = NULL;
+        }
+    }
+
+    free(n);
+    net_pbuf_free(pb);
+
+    if(!found)
+        net_ndp_send_sol(net, ip);
 
-    memset(mac_out, 0, 6);
     return -2;
 }
 
 int net_ndp_init(void) {
+    int i;
+
+    for(i = 0; i < NDP_HASH_SIZE; ++i)
+        LIST_INIT(&ndp_cache[i]);
+
+    ndp_gc_next = 0;
+
     return 0;
 }
 
 void net_ndp_shutdown(void) {
-    /* Free all entries */
-    ndp_entry_t *i, *tmp;
-
-    i = LIST_FIRST(&ndp_cache);
-
-    while(i) {
-        tmp = LIST_NEXT(i, entry);
+    ndp_entry_t *i;
+    int j;
 
-        if(i->pkt) {
-            free(i->pkt);
-            free(i->data);
-        }
+    irq_disable_scoped();
 
-        free(i);
-        i = tmp;
+    /* Free all entries */
+    for(j = 0; j < NDP_HASH_SIZE; ++j) {
+        while((i = LIST_FIRST(&ndp_cache[j])))
+            ndp_free(i);
     }
-
-    /* Reinit the list to the clean state, in case we call net_ndp_init later */
-    LIST_INIT(&ndp_cache);
 }
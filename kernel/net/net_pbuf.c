@@ -0,0 +1,244 @@
+/* KallistiOS ##version##
+
+   kernel/net/net_pbuf.c
+
+*/
+
+#include <stdalign.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/queue.h>
+
+#include <kos/net.h>
+#include <kos/irq.h>
+#include <kos/thread.h>
+
+#include "net_pbuf.h"
+
+/*
+
+  Packet buffers.
+
+  The pool is a static array of buffers, handed out from a free list with
+  interrupts disabled, so that drivers can allocate receive buffers inside
+  their interrupt handlers. Only buffers that don't fit in the pool, or that
+  are needed when it has run dry, come from the heap. The last
+  NET_PBUF_RX_RESERVE buffers in the pool are only handed out by
+  net_pbuf_alloc_rx(), so that the stack holding on to buffers can't leave a
+  driver with nothing to receive into.
+
+  While a driver hands a packet to the stack with net_input_pbuf(), its buffer
+  is made the "current" receive buffer of the thread doing so. A protocol that
+  wants to keep some of the packet around checks whether what it has been
+  passed lies within it with net_pbuf_rx_hold(), and if so, takes a reference
+  instead of copying. This saves having to pass the buffer through every layer
+  of the input path, some of which (like fragment reassembly) hand up data that
+  isn't in the buffer at all. Several threads (drivers' receive threads, the
+  loopback device) can be receiving at once, so each net_pbuf_rx_enter() adds
+  a frame, on the caller's stack, to a list of them, tagged with the thread.
+
+*/
+
+static net_pbuf_t pool[NET_PBUF_POOL_SIZE];
+static alignas(32) uint8_t pool_mem[NET_PBUF_POOL_SIZE][NET_PBUF_BUFSIZE];
+
+static TAILQ_HEAD(, net_pbuf) pool_free = TAILQ_HEAD_INITIALIZER(pool_free);
+static int pool_nfree;
+static int pool_initted;
+
+/* Receive frames of all threads, most recent first */
+static LIST_HEAD(, net_pbuf_rx) rx_frames = LIST_HEAD_INITIALIZER(rx_frames);
+
+static net_pbuf_stats_t pbuf_stats;
+
+static void pool_init(void) {
+    int i;
+
+    for(i = 0; i < NET_PBUF_POOL_SIZE; ++i) {
+        pool[i].buf = pool_mem[i];
+        pool[i].size = NET_PBUF_BUFSIZE;
+        TAILQ_INSERT_TAIL(&pool_free, &pool[i], pkt_queue);
+    }
+
+    pool_nfree = NET_PBUF_POOL_SIZE;
+    pool_initted = 1;
+}
+
+static net_pbuf_t *pool_get(size_t size, int rx) {
+    net_pbuf_t *pb;
+
+    irq_disable_scoped();
+
+    if(!pool_initted)
+        pool_init();
+
+    if(size > NET_PBUF_BUFSIZE || (!rx && pool_nfree <= NET_PBUF_RX_RESERVE) ||
+       !(pb = TAILQ_FIRST(&pool_free)))
+        return NULL;
+
+    TAILQ_REMOVE(&pool_free, pb, pkt_queue);
+    --pool_nfree;
+    ++pbuf_stats.pool_allocs;
+    ++pbuf_stats.in_use;
+
+    return pb;
+}
+
+static net_pbuf_t *heap_get(size_t size) {
+    net_pbuf_t *pb;
+    size_t hdrsz = (sizeof(net_pbuf_t) + 31) & ~31;
+
+    if(irq_inside_int() || !(pb = aligned_alloc(32, (hdrsz + size + 31) & ~31)))
+        return NULL;
+
+    pb->buf = (uint8_t *)pb + hdrsz;
+    pb->size = size;
+
+    irq_disable_scoped();
+    ++pbuf_stats.heap_allocs;
+    ++pbuf_stats.in_use;
+
+    return pb;
+}
+
+/* Where a buffer may come from */
+#define PBUF_POOL       0x01    /* The pool, leaving the reserve alone */
+#define PBUF_POOL_RX    0x02    /* The pool, reserve included */
+#define PBUF_HEAP       0x04    /* The heap */
+
+static net_pbuf_t *pbuf_alloc(size_t headroom, size_t len, int from) {
+    net_pbuf_t *pb = NULL;
+    int heap = 0;
+
+    if(from & (PBUF_POOL | PBUF_POOL_RX))
+        pb = pool_get(headroom + len, from & PBUF_POOL_RX);
+
+    if(!pb) {
+        if(!(from & PBUF_HEAP) || !(pb = heap_get(headroom + len))) {
+            irq_disable_scoped();
+            ++pbuf_stats.alloc_failed;
+            return NULL;
+        }
+
+        heap = 1;
+    }
+
+    pb->data = pb->buf + headroom;
+    pb->len = len;
+    pb->refcnt = 1;
+    pb->heap = heap;
+
+    return pb;
+}
+
+net_pbuf_t *net_pbuf_alloc(size_t headroom, size_t len) {
+    return pbuf_alloc(headroom, len, PBUF_POOL | PBUF_HEAP);
+}
+
+net_pbuf_t *net_pbuf_alloc_rx(size_t headroom, size_t len) {
+    return pbuf_alloc(headroom, len, PBUF_POOL_RX | PBUF_HEAP);
+}
+
+net_pbuf_t *net_pbuf_alloc_heap(size_t headroom, size_t len) {
+    return pbuf_alloc(headroom, len, PBUF_HEAP);
+}
+
+net_pbuf_t *net_pbuf_ref(net_pbuf_t *pb) {
+    irq_disable_scoped();
+    ++pb->refcnt;
+
+    return pb;
+}
+
+void net_pbuf_free(net_pbuf_t *pb) {
+    if(!pb)
+        return;
+
+    {
+        irq_disable_scoped();
+
+        if(--pb->refcnt)
+            return;
+
+        --pbuf_stats.in_use;
+
+        if(!pb->heap) {
+            TAILQ_INSERT_HEAD(&pool_free, pb, pkt_queue);
+            ++pool_nfree;
+            return;
+        }
+    }
+
+    free(pb);
+}
+
+uint8_t *net_pbuf_push(net_pbuf_t *pb, size_t len) {
+    if((size_t)(pb->data - pb->buf) < len)
+        return NULL;
+
+    pb->data -= len;
+    pb->len += len;
+
+    return pb->data;
+}
+
+uint8_t *net_pbuf_pull(net_pbuf_t *pb, size_t len) {
+    if(pb->len < len)
+        return NULL;
+
+    pb->data += len;
+    pb->len -= len;
+
+    return pb->data;
+}
+
+net_pbuf_stats_t net_pbuf_get_stats(void) {
+    irq_disable_scoped();
+    return pbuf_stats;
+}
+
+void net_pbuf_rx_enter(net_pbuf_rx_t *rx, net_pbuf_t *pb) {
+    rx->pb = pb;
+    rx->owner = thd_current;
+
+    irq_disable_scoped();
+    LIST_INSERT_HEAD(&rx_frames, rx, entry);
+}
+
+void net_pbuf_rx_leave(net_pbuf_rx_t *rx) {
+    irq_disable_scoped();
+    LIST_REMOVE(rx, entry);
+}
+
+net_pbuf_t *net_pbuf_rx_hold(const uint8_t *data, size_t len) {
+    net_pbuf_rx_t *rx;
+    net_pbuf_t *pb;
+
+    irq_disable_scoped();
+
+    /* The pointer check is what makes this safe: only the code handling one
+       of this thread's packets can have been passed a pointer into it, and the
+       thread holds on to it until it leaves, so it can't be freed under us. */
+    LIST_FOREACH(rx, &rx_frames, entry) {
+        pb = rx->pb;
+
+        if(rx->owner != thd_current || data < pb->data ||
+           data + len > pb->data + pb->len)
+            continue;
+
+        ++pb->refcnt;
+        ++pbuf_stats.rx_held;
+
+        return pb;
+    }
+
+    return NULL;
+}
+
+void net_pbuf_copy(void *dst, const void *src, size_t len) {
+    memcpy(dst, src, len);
+
+    irq_disable_scoped();
+    ++pbuf_stats.copies;
+    pbuf_stats.copy_bytes += len;
+}
@@ -0,0 +1,44 @@
+/* KallistiOS ##version##
+
+   kernel/net/net_pbuf.h
+
+*/
+
+#ifndef __LOCAL_NET_PBUF_H
+#define __LOCAL_NET_PBUF_H
+
+#include <kos/cdefs.h>
+
+__BEGIN_DECLS
+
+#include <sys/queue.h>
+#include <kos/net.h>
+#include <kos/thread.h>
+
+/* A packet being received by a thread, between net_pbuf_rx_enter() and
+   net_pbuf_rx_leave(). These live on the stack of the thread receiving. */
+typedef struct net_pbuf_rx {
+    LIST_ENTRY(net_pbuf_rx) entry;
+    net_pbuf_t *pb;
+    kthread_t *owner;
+} net_pbuf_rx_t;
+
+/* Make pb a packet being received by the calling thread, until the matching
+   net_pbuf_rx_leave() with the same rx. */
+void net_pbuf_rx_enter(net_pbuf_rx_t *rx, net_pbuf_t *pb);
+void net_pbuf_rx_leave(net_pbuf_rx_t *rx);
+
+/* Take a reference to a packet the calling thread is receiving, if the len
+   bytes at data are part of it. Returns NULL if they aren't. */
+net_pbuf_t *net_pbuf_rx_hold(const uint8_t *data, size_t len);
+
+/* Allocate a buffer from the heap only, leaving the pool to the drivers.
+   Fails inside an interrupt. */
+net_pbuf_t *net_pbuf_alloc_heap(size_t headroom, size_t len);
+
+/* Copy packet data between buffers, and count it in the statistics. */
+void net_pbuf_copy(void *dst, const void *src, size_t len);
+
+__END_DECLS
+
+#endif /* !__LOCAL_NET_PBUF_H */
@@ -20,7 +20,9 @@
 #include <kos/mutex.h>
 #include <kos/thread.h>
 #include <kos/rwsem.h>
+#include <kos/genwait.h>
 #include <kos/fs_socket.h>
+#include <kos/worker_thread.h>
 
 #include <kos/timer.h>
 
@@ -74,22 +76,23 @@
    real socket created for them until they are accept()ed.
 
    On matching sockets:
-   All new sockets (including those created by accept()) are added to the head
-   of the list. Since we cannot bind a socket to an already used port for
-   listening, that means that any fully-created sockets should appear in the
-   list in front of those created for listening to a port (and thus that are
-   only partially-created). This simplifies the procedure for finding matching
-   sockets for incoming packets, since this makes sure that the fully-created
-   socket will be found first if it exists when simply iterating through the
-   list of sockets.
+   Incoming packets are matched against the connected sockets first, then
+   against the listening ones, which makes sure that the fully-created socket
+   for a connection will be found if it exists, rather than the socket that
+   listens on its port. Both sets are kept in hash tables, so finding a socket
+   doesn't depend on how many others there are (see tcp_port_hash()).
 
    On what's actually here:
-   I didn't bother implementing any TCP extensions beyond RFC 793. That means
-   that I just ignore things like the timestamp option and the selective
-   acknowledgement option. That also means that the window size maxes out at
-   65535. Some extensions may be implemented in the future, if I see fit to do
-   so. That all said, everything in here works just fine over IPv4 or IPv6, and
-   can be used just fine to communicate with "normal" TCP/IP implementations.
+   Beyond RFC 793, the retransmission timeout is computed from the measured
+   round-trip time as described in RFC 6298, and the amount of data in flight
+   is limited by a congestion window managed with slow start, congestion
+   avoidance and NewReno fast retransmit/recovery (RFC 5681 and RFC 6582).
+   The window scale and timestamp options of RFC 7323 are negotiated when the
+   other side supports them, which allows for windows over 65535 bytes and one
+   RTT sample per ACK. The selective acknowledgement option is ignored, and
+   there is no PAWS check. That all said, everything in here works just fine
+   over IPv4 or IPv6, and can be used just fine to communicate with "normal"
+   TCP/IP implementations.
 */
 
 typedef struct tcp_hdr {
@@ -113,18 +116,23 @@ struct lsock {
     uint32_t isn;
     uint32_t wnd;
     uint16_t mss;
+    int8_t wscale;          /* -1 if the SYN had no window scale option */
+    uint8_t ts_ok;
+    uint32_t ts_recent;
 };
 
 /* Send/receive variables... */
 struct sndrec {
     uint32_t una;
     uint32_t nxt;
+    uint32_t max;           /* Highest nxt so far (nxt goes back on RTO) */
     uint32_t wnd;
     uint32_t up;
     uint32_t wl1;
     uint32_t wl2;
     uint32_t iss;
     uint16_t mss;
+    uint8_t wscale;
 };
 
 struct rcvrec {
@@ -132,8 +140,30 @@ struct rcvrec {
     uint32_t wnd;
     uint32_t up;
     uint32_t irs;
+    uint8_t wscale;
 };
 
+/* Congestion control, RTT estimation and RFC 7323 state. srtt and rttvar are
+   kept scaled by 8 and 4 respectively, as in BSD, so that the RFC 6298 gains
+   are just shifts. All times are in milliseconds. */
+struct ccrec {
+    uint32_t cwnd;
+    uint32_t ssthresh;
+    uint32_t recover;       /* snd.max when loss recovery was entered */
+    uint32_t srtt;
+    uint32_t rttvar;
+    uint32_t rto;
+    uint32_t rtt_seq;       /* Segment being timed, if rtt_time != 0 */
+    uint64_t rtt_time;
+    uint32_t ts_recent;
+    uint8_t dupacks;
+    uint8_t flags;
+};
+
+#define TCP_CC_RECOVERY     0x01    /* In fast recovery */
+#define TCP_CC_TSTAMP       0x02    /* Timestamps negotiated */
+#define TCP_CC_WSCALE       0x04    /* Window scaling negotiated */
+
 /* Out-of-order segment table for TCP reassembly */
 #define TCP_OOO_MAX 32
 
@@ -142,8 +172,18 @@ struct tcp_ooo_seg {
     uint16_t len;
 };
 
+/* Per-socket timers */
+#define TCP_TIMER_REXMT     0   /* Retransmission, window probes and SYNs */
+#define TCP_TIMER_DELACK    1   /* Delayed ACK */
+#define TCP_TIMER_KEEP      2   /* Keepalive */
+#define TCP_TIMER_2MSL      3   /* TIME-WAIT, and freeing closed sockets */
+#define TCP_TIMER_COUNT     4
+
 struct tcp_sock {
     LIST_ENTRY(tcp_sock) sock_list;
+    LIST_ENTRY(tcp_sock) port_list;     /* In tcp_ports, once bound */
+    LIST_ENTRY(tcp_sock) conn_list;     /* In tcp_conns, once connected */
+    LIST_ENTRY(tcp_sock) listen_list;   /* In tcp_listeners, while listening */
     struct sockaddr_in6 local_addr;
     struct sockaddr_in6 remote_addr;
 
@@ -156,6 +196,15 @@ struct tcp_sock {
     int hop_limit;
     uint32_t rcvbuf_sz;
     uint32_t sndbuf_sz;
+    uint32_t keepidle;      /* Keepalive settings, in seconds */
+    uint32_t keepintvl;
+    uint32_t keepcnt;
+
+    /* Expiry times of the timers (0 when stopped), and the time the socket is
+       queued for in tcp_timerq (0 when it isn't). */
+    uint64_t timers[TCP_TIMER_COUNT];
+    uint64_t timer_due;
+    TAILQ_ENTRY(tcp_sock) timer_list;
 
     union {
         struct {
@@ -170,6 +219,7 @@ struct tcp_sock {
             netif_t *net;
             struct sndrec snd;
             struct rcvrec rcv;
+            struct ccrec cc;
             uint8_t *rcvbuf;
             uint32_t rcvbuf_cur_sz;
             uint32_t rcvbuf_head;
@@ -179,7 +229,8 @@ struct tcp_sock {
             uint32_t sndbuf_head;
             uint32_t sndbuf_acked;
             uint32_t sndbuf_tail;
-            uint64_t timer;
+            uint64_t last_rcv;      /* For keepalives */
+            uint32_t keep_probes;
             condvar_t send_cv;
             condvar_t recv_cv;
             struct tcp_ooo_seg ooo[TCP_OOO_MAX];
@@ -194,11 +245,29 @@ LIST_HEAD(tcp_sock_list, tcp_sock);
 static struct tcp_sock_list tcp_socks = LIST_HEAD_INITIALIZER(0);
 static rw_semaphore_t tcp_sem = RWSEM_INITIALIZER;
 
-/* Default starting window size for connections. Must fit in uint16_t (max
-   65535 without RFC 1323 window scaling). Larger = more in-flight data =
+/* Sizes of the lookup tables (see tcp_port_hash()). Both must be powers of
+   two. */
+#define TCP_PORT_HASH_SIZE  64
+#define TCP_CONN_HASH_BITS  8
+#define TCP_CONN_HASH_SIZE  (1 << TCP_CONN_HASH_BITS)
+
+static struct tcp_sock_list tcp_ports[TCP_PORT_HASH_SIZE];
+static struct tcp_sock_list tcp_listeners[TCP_PORT_HASH_SIZE];
+static struct tcp_sock_list tcp_conns[TCP_CONN_HASH_SIZE];
+
+/* Range of local ports picked for sockets that aren't bound to one, as
+   suggested by RFC 6335 */
+#define TCP_EPHEMERAL_MIN   49152
+#define TCP_EPHEMERAL_MAX   65535
+
+/* Default starting window size for connections. Larger = more in-flight data =
    better throughput on links with any latency or reordering. */
 #define TCP_DEFAULT_WINDOW  65535
 
+/* Largest buffer size (and thus window) that can be set with SO_RCVBUF and
+   SO_SNDBUF. Anything over 65535 needs the window scale option. */
+#define TCP_MAX_WINDOW      (1024 * 1024)
+
 /* Default MSS */
 #define TCP_DEFAULT_MSS     1460
 
@@ -206,14 +275,36 @@ static rw_semaphore_t tcp_sem = RWSEM_INITIALIZER;
    to be 15 seconds, since that's what Mac OS X does. */
 #define TCP_DEFAULT_MSL     15000
 
-/* Default retransmission timeout (in milliseconds). */
-#define TCP_DEFAULT_RTTO    2000
+/* Retransmission timeout before any RTT has been measured, and the bounds on
+   it (in milliseconds). The lower bound is the same as most other stacks, rather
+   than the 1 second suggested by RFC 6298. */
+#define TCP_INITIAL_RTO     1000
+#define TCP_MIN_RTO         200
+#define TCP_MAX_RTO         60000
+
+/* Number of duplicate ACKs that trigger a fast retransmit */
+#define TCP_DUPACK_THRESH   3
+
+/* Upper bound of the congestion window: the largest window that can be
+   advertised */
+#define TCP_MAX_CWND        (65535U << 14)
 
 /* Default hop limit (or ttl for IPv4) for new sockets */
 #define TCP_DEFAULT_HOPS    64
 
-/* Period at which the workqueue job will run */
-#define TCP_POLL_PERIOD_MS  10
+/* How long an ACK may be held back, waiting for more data to ack or for
+   something to piggyback it on (in milliseconds) */
+#define TCP_DELACK_MS       5
+
+/* Default keepalive idle time, probe interval (both in seconds) and number of
+   unanswered probes before giving up. RFC 1122 asks for at least two hours of
+   idle time, the rest is what most other stacks do. */
+#define TCP_DEFAULT_KEEPIDLE    7200
+#define TCP_DEFAULT_KEEPINTVL   75
+#define TCP_DEFAULT_KEEPCNT     9
+
+/* Largest value of any of the above that can be set */
+#define TCP_MAX_KEEPALIVE       32767
 
 /* Flags that can be set in the off_flags field of the above struct */
 #define TCP_FLAG_FIN    0x01
@@ -245,10 +336,19 @@ static rw_semaphore_t tcp_sem = RWSEM_INITIALIZER;
 #define TCP_IFLAG_CANBEDEL      0x00000001
 #define TCP_IFLAG_QUEUEDCLOSE   0x00000002
 #define TCP_IFLAG_ACCEPTWAIT    0x00000004
+#define TCP_IFLAG_KEEPALIVE     0x00000008
 
 #define TCP_OPT_EOL             0
 #define TCP_OPT_NOP             1
 #define TCP_OPT_MSS             2
+#define TCP_OPT_WSCALE          3
+#define TCP_OPT_TSTAMP          8
+
+/* Length of the timestamp option, padded with two NOPs */
+#define TCP_TSTAMP_LEN          12
+
+/* Largest allowed window scale shift (RFC 7323) */
+#define TCP_MAX_WSCALE          14
 
 /* A few macros for comparing sequence numbers */
 #define SEQ_LT(x, y)    (((int32_t)((x) - (y))) < 0)
@@ -257,6 +357,7 @@ static rw_semaphore_t tcp_sem = RWSEM_INITIALIZER;
 #define SEQ_GE(x, y)    (((int32_t)((x) - (y))) >= 0)
 
 #define MAX(x, y)       ((x) > (y) ? (x) : (y))
+#define MIN(x, y)       ((x) < (y) ? (x) : (y))
 
 /* Forward declarations */
 static fs_socket_proto_t proto;
@@ -266,9 +367,257 @@ static void tcp_rst(netif_t *net, const struct in6_addr *src,
                     uint32_t ack);
 static int tcp_send_syn(struct tcp_sock *sock, int ack);
 static void tcp_send_ack(struct tcp_sock *sock);
-static void tcp_send_data(struct tcp_sock *sock, int resend);
+static void tcp_send_data(struct tcp_sock *sock);
 static void tcp_send_fin_ack(struct tcp_sock *sock);
 
+static inline void tcp_put32(uint8_t *p, uint32_t v) {
+    p[0] = (uint8_t)(v >> 24);
+    p[1] = (uint8_t)(v >> 16);
+    p[2] = (uint8_t)(v >> 8);
+    p[3] = (uint8_t)v;
+}
+
+static inline uint32_t tcp_get32(const uint8_t *p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+           ((uint32_t)p[2] << 8) | p[3];
+}
+
+/* Smallest window scale shift that lets us advertise the whole buffer */
+static uint8_t tcp_wscale(uint32_t size) {
+    uint8_t shift = 0;
+
+    while(shift < TCP_MAX_WSCALE && (size >> shift) > 65535)
+        ++shift;
+
+    return shift;
+}
+
+/* Set up the congestion window, once the MSS and options are known. */
+static void tcp_cc_init(struct tcp_sock *sock) {
+    struct ccrec *cc = &sock->data.cc;
+    uint32_t mss;
+
+    /* The MSS doesn't account for options, so leave room for the timestamps
+       that go in every segment. */
+    if((cc->flags & TCP_CC_TSTAMP) && sock->data.snd.mss > 2 * TCP_TSTAMP_LEN)
+        sock->data.snd.mss -= TCP_TSTAMP_LEN;
+
+    /* Initial window, as per RFC 5681 */
+    mss = sock->data.snd.mss;
+
+    if(mss > 2190)
+        cc->cwnd = 2 * mss;
+    else if(mss > 1095)
+        cc->cwnd = 3 * mss;
+    else
+        cc->cwnd = 4 * mss;
+
+    cc->ssthresh = TCP_MAX_CWND;
+    cc->recover = sock->data.snd.iss;
+}
+
+/* Feed an RTT measurement to the RFC 6298 estimator, and recompute the
+   retransmission timeout from it. */
+static void tcp_rtt_update(struct tcp_sock *sock, uint32_t rtt) {
+    struct ccrec *cc = &sock->data.cc;
+    int32_t delta;
+
+    if(!cc->srtt) {
+        /* First measurement: SRTT = R, RTTVAR = R / 2 */
+        cc->srtt = rtt << 3;
+        cc->rttvar = rtt << 1;
+    }
+    else {
+        /* SRTT += (R - SRTT) / 8, RTTVAR += (|SRTT - R| - RTTVAR) / 4 */
+        delta = (int32_t)rtt - (int32_t)(cc->srtt >> 3);
+        cc->srtt += delta;
+
+        if(delta < 0)
+            delta = -delta;
+
+        cc->rttvar += delta - (cc->rttvar >> 2);
+    }
+
+    /* RTO = SRTT + max(G, 4 * RTTVAR), where the clock granularity G is the
+       one millisecond resolution of the timers. */
+    cc->rto = (cc->srtt >> 3) + MAX(1, cc->rttvar);
+
+    if(cc->rto < TCP_MIN_RTO)
+        cc->rto = TCP_MIN_RTO;
+    else if(cc->rto > TCP_MAX_RTO)
+        cc->rto = TCP_MAX_RTO;
+}
+
+/* Timers...
+
+   Each socket keeps the expiry time of each of its timers, and sits in
+   tcp_timerq, sorted by time, under the earliest of them. A single worker
+   thread sleeps until the head of the queue is due, so nothing runs at all
+   while no timer is pending. Most timers get pushed back far more often than
+   they expire (the retransmission timer is restarted by every ACK), so moving a
+   timer later doesn't touch the queue: the socket is just requeued under its
+   real earliest time when the stale one comes up. The queue is protected by
+   disabling IRQs, since timers are armed from the input path. */
+TAILQ_HEAD(tcp_timer_list, tcp_sock);
+
+static struct tcp_timer_list tcp_timerq = TAILQ_HEAD_INITIALIZER(tcp_timerq);
+static kthread_worker_t *tcp_timer_worker;
+static int tcp_timer_quit;
+
+/* Make sure the socket is in the queue no later than the given time. */
+static void tcp_timer_enqueue(struct tcp_sock *sock, uint64_t due) {
+    struct tcp_sock *i;
+
+    irq_disable_scoped();
+
+    if(sock->timer_due) {
+        if(sock->timer_due <= due)
+            return;
+
+        TAILQ_REMOVE(&tcp_timerq, sock, timer_list);
+    }
+
+    sock->timer_due = due;
+
+    /* New timers tend to be the latest ones, so look from the tail. */
+    TAILQ_FOREACH_REVERSE(i, &tcp_timerq, tcp_timer_list, timer_list) {
+        if(i->timer_due <= due) {
+            TAILQ_INSERT_AFTER(&tcp_timerq, i, sock, timer_list);
+            return;
+        }
+    }
+
+    /* This is the next timer to expire, so the worker has to know about it. */
+    TAILQ_INSERT_HEAD(&tcp_timerq, sock, timer_list);
+
+    if(tcp_timer_worker) {
+        genwait_wake_all(&tcp_timerq);
+        thd_worker_wakeup(tcp_timer_worker);
+    }
+}
+
+static void tcp_timer_arm(struct tcp_sock *sock, int timer, uint32_t ms) {
+    uint64_t due = timer_ms_gettime64() + ms;
+
+    sock->timers[timer] = due;
+    tcp_timer_enqueue(sock, due);
+}
+
+static inline void tcp_timer_stop(struct tcp_sock *sock, int timer) {
+    sock->timers[timer] = 0;
+}
+
+/* Take a socket out of the queue, before freeing it. */
+static void tcp_timer_clear(struct tcp_sock *sock) {
+    irq_disable_scoped();
+
+    memset(sock->timers, 0, sizeof(sock->timers));
+
+    if(sock->timer_due) {
+        TAILQ_REMOVE(&tcp_timerq, sock, timer_list);
+        sock->timer_due = 0;
+    }
+}
+
+/* (Re)start the keepalive timer from the last segment received. */
+static void tcp_keep_arm(struct tcp_sock *sock) {
+    if(!(sock->intflags & TCP_IFLAG_KEEPALIVE)) {
+        tcp_timer_stop(sock, TCP_TIMER_KEEP);
+        return;
+    }
+
+    sock->data.last_rcv = timer_ms_gettime64();
+    sock->data.keep_probes = 0;
+    tcp_timer_arm(sock, TCP_TIMER_KEEP, sock->keepidle * 1000);
+}
+
+/* The connection is over: stop its timers, and get the socket freed if the
+   user is already done with it. */
+static void tcp_timer_closed(struct tcp_sock *sock) {
+    memset(sock->timers, 0, sizeof(sock->timers));
+
+    if(sock->intflags & TCP_IFLAG_CANBEDEL)
+        tcp_timer_arm(sock, TCP_TIMER_2MSL, 0);
+}
+
+/* Lookup tables...
+
+   Every socket with a local port is in tcp_ports, hashed by that port, which
+   is what bind() and the ephemeral port allocator look at. Sockets with a
+   remote end are also in tcp_conns, hashed by the remote address and both
+   ports, and listening sockets are in tcp_listeners, hashed by their port.
+   Incoming segments are matched against tcp_conns first, then against
+   tcp_listeners, so they only ever look at one bucket of each. The tables
+   are only modified with the write lock on tcp_sem held. */
+static inline uint32_t tcp_port_hash(uint16_t port) {
+    return ntohs(port) & (TCP_PORT_HASH_SIZE - 1);
+}
+
+static inline uint32_t tcp_conn_hash(const struct in6_addr *raddr,
+                                     uint16_t rport, uint16_t lport) {
+    uint32_t h;
+
+    h = raddr->__s6_addr.__s6_addr32[0] ^ raddr->__s6_addr.__s6_addr32[1] ^
+        raddr->__s6_addr.__s6_addr32[2] ^ raddr->__s6_addr.__s6_addr32[3];
+    h ^= ((uint32_t)rport << 16) | lport;
+
+    /* Fibonacci hashing, to spread the bits over the whole table */
+    return (h * 0x9E3779B1) >> (32 - TCP_CONN_HASH_BITS);
+}
+
+static void tcp_hash_port(struct tcp_sock *sock) {
+    LIST_INSERT_HEAD(&tcp_ports[tcp_port_hash(sock->local_addr.sin6_port)],
+                     sock, port_list);
+}
+
+static void tcp_hash_conn(struct tcp_sock *sock) {
+    uint32_t h = tcp_conn_hash(&sock->remote_addr.sin6_addr,
+                               sock->remote_addr.sin6_port,
+                               sock->local_addr.sin6_port);
+
+    LIST_INSERT_HEAD(&tcp_conns[h], sock, conn_list);
+}
+
+/* Take a socket out of tcp_ports and tcp_conns, before freeing it. Listening
+   sockets leave tcp_listeners when they're closed. */
+static void tcp_unhash(struct tcp_sock *sock) {
+    if(sock->local_addr.sin6_port)
+        LIST_REMOVE(sock, port_list);
+
+    if(sock->remote_addr.sin6_port)
+        LIST_REMOVE(sock, conn_list);
+}
+
+static int tcp_port_in_use(uint16_t port) {
+    struct tcp_sock *i;
+
+    LIST_FOREACH(i, &tcp_ports[tcp_port_hash(port)], port_list) {
+        if(i->local_addr.sin6_port == port)
+            return 1;
+    }
+
+    return 0;
+}
+
+/* Pick a free local port (in network byte order), or return 0 if they're all
+   taken. The search picks up where the last one stopped, so it normally ends
+   with the first port it looks at. */
+static uint16_t tcp_ephemeral_port(void) {
+    static uint16_t next = TCP_EPHEMERAL_MIN;
+    uint32_t tries;
+    uint16_t port;
+
+    for(tries = 0; tries <= TCP_EPHEMERAL_MAX - TCP_EPHEMERAL_MIN; ++tries) {
+        port = next;
+        next = port == TCP_EPHEMERAL_MAX ? TCP_EPHEMERAL_MIN : port + 1;
+
+        if(!tcp_port_in_use(htons(port)))
+            return htons(port);
+    }
+
+    return 0;
+}
+
 /* Sockets interface... */
 static int net_tcp_socket(net_socket_t *hnd, int domain, int type, int proto) {
     struct tcp_sock *sock;
@@ -294,6 +643,9 @@ static int net_tcp_socket(net_socket_t *hnd, int domain, int type, int proto) {
     sock->hop_limit = TCP_DEFAULT_HOPS;
     sock->rcvbuf_sz = TCP_DEFAULT_WINDOW;
     sock->sndbuf_sz = TCP_DEFAULT_WINDOW;
+    sock->keepidle = TCP_DEFAULT_KEEPIDLE;
+    sock->keepintvl = TCP_DEFAULT_KEEPINTVL;
+    sock->keepcnt = TCP_DEFAULT_KEEPCNT;
 
     if(rwsem_write_lock_irqsafe(&tcp_sem)) {
         free(sock);
@@ -379,6 +731,7 @@ retry:
        as appropriate. */
     switch(sock->state) {
         case TCP_STATE_LISTEN:
+            LIST_REMOVE(sock, listen_list);
 
             for(i = sock->listen.head; i < sock->listen.tail; ++i) {
                 ls = sock->listen.queue + i;
@@ -422,7 +775,7 @@ retry:
             /* Don't have to worry about queued packets, since we don't allow
                any queueing until after the connection is established. */
             tcp_send_fin_ack(sock);
-            ++sock->data.snd.nxt;
+            sock->data.snd.max = ++sock->data.snd.nxt;
             sock->state = TCP_STATE_FIN_WAIT_1;
             goto ret_no_remove;
 
@@ -434,7 +787,7 @@ retry:
             }
 
             tcp_send_fin_ack(sock);
-            ++sock->data.snd.nxt;
+            sock->data.snd.max = ++sock->data.snd.nxt;
             sock->state = TCP_STATE_CLOSING;
             goto ret_no_remove;
 
@@ -455,6 +808,8 @@ retry:
 
 ret_remove:
     LIST_REMOVE(sock, sock_list);
+    tcp_unhash(sock);
+    tcp_timer_clear(sock);
     mutex_unlock(&sock->mutex);
     mutex_destroy(&sock->mutex);
     free(sock);
@@ -464,7 +819,7 @@ ret_remove:
 
 ret_no_remove:
     if(sock->state != TCP_STATE_LISTEN)
-        sock->intflags = TCP_IFLAG_CANBEDEL;
+        sock->intflags |= TCP_IFLAG_CANBEDEL;
 
     if(sock->state == TCP_STATE_ESTABLISHED ||
             sock->state == TCP_STATE_CLOSE_WAIT)
@@ -472,8 +827,13 @@ ret_no_remove:
 
     sock->sock = FILEHND_INVALID;
 
-    /* Don't free anything here, it will be dealt with later on in the
-       workqueue job. */
+    /* Don't free anything here, it will be dealt with later on by the timer
+       thread. A socket that is already closed can go right away, unless
+       accept() still has to tear it down. */
+    if((sock->state & 0x0F) == TCP_STATE_CLOSED &&
+       !(sock->intflags & TCP_IFLAG_ACCEPTWAIT))
+        tcp_timer_arm(sock, TCP_TIMER_2MSL, 0);
+
     mutex_unlock(&sock->mutex);
     rwsem_write_unlock(&tcp_sem);
     return;
@@ -530,6 +890,7 @@ static int net_tcp_accept(net_socket_t *hnd, struct sockaddr *addr,
             free(sock->listen.queue);
             cond_destroy(&sock->listen.cv);
             LIST_REMOVE(sock, sock_list);
+            tcp_unhash(sock);
             mutex_unlock(&sock->mutex);
             mutex_destroy(&sock->mutex);
             free(sock);
@@ -624,6 +985,10 @@ static int net_tcp_accept(net_socket_t *hnd, struct sockaddr *addr,
     sock2->hop_limit = sock->hop_limit;
     sock2->rcvbuf_sz = sock->rcvbuf_sz;
     sock2->sndbuf_sz = sock->sndbuf_sz;
+    sock2->intflags = sock->intflags & TCP_IFLAG_KEEPALIVE;
+    sock2->keepidle = sock->keepidle;
+    sock2->keepintvl = sock->keepintvl;
+    sock2->keepcnt = sock->keepcnt;
     sock2->data.rcv.wnd = sock->rcvbuf_sz;
 
     /* Fill in the address, if they asked for it. */
@@ -719,6 +1084,7 @@ static int net_tcp_accept(net_socket_t *hnd, struct sockaddr *addr,
        by the wording of the RFC... */
     sock2->data.snd.iss = (uint32_t)(timer_us_gettime64() >> 2);
     sock2->data.snd.nxt = sock2->data.snd.iss + 1;
+    sock2->data.snd.max = sock2->data.snd.nxt;
     sock2->data.snd.una = sock2->data.snd.iss;
     sock2->data.snd.wnd = lsock.wnd;
     sock2->data.snd.wl1 = sock2->data.snd.iss;
@@ -726,14 +1092,33 @@ static int net_tcp_accept(net_socket_t *hnd, struct sockaddr *addr,
     sock2->data.rcv.nxt = lsock.isn + 1;
     sock2->data.rcv.irs = lsock.isn;
 
+    /* Only scale the windows if the other side asked for it too. */
+    if(lsock.wscale >= 0) {
+        sock2->data.cc.flags |= TCP_CC_WSCALE;
+        sock2->data.snd.wscale = lsock.wscale;
+        sock2->data.rcv.wscale = tcp_wscale(sock2->rcvbuf_sz);
+    }
+
+    if(lsock.ts_ok) {
+        sock2->data.cc.flags |= TCP_CC_TSTAMP;
+        sock2->data.cc.ts_recent = lsock.ts_recent;
+    }
+
+    sock2->data.cc.rto = TCP_INITIAL_RTO;
+    tcp_cc_init(sock2);
+
     /* Since nothing else has a pointer to this socket, this will not fail. */
     mutex_trylock(&sock2->mutex);
 
     /* Send the <SYN,ACK> packet now, add it to the list, and clean up. */
     tcp_send_syn(sock2, 1);
-    sock2->data.timer = timer_ms_gettime64();
+    tcp_timer_arm(sock2, TCP_TIMER_REXMT, sock2->data.cc.rto);
+    sock2->data.cc.rtt_time = timer_ms_gettime64();
+    sock2->data.cc.rtt_seq = sock2->data.snd.iss;
     fd = sock2->sock;
     LIST_INSERT_HEAD(&tcp_socks, sock2, sock_list);
+    tcp_hash_port(sock2);
+    tcp_hash_conn(sock2);
     mutex_unlock(&sock2->mutex);
 
     sock->state &= ~TCP_STATE_ACCEPTING;
@@ -745,7 +1130,7 @@ static int net_tcp_accept(net_socket_t *hnd, struct sockaddr *addr,
 
 static int net_tcp_bind(net_socket_t *hnd, const struct sockaddr *addr,
                         socklen_t addr_len) {
-    struct tcp_sock *sock, *iter;
+    struct tcp_sock *sock;
     struct sockaddr_in *realaddr4;
     struct sockaddr_in6 realaddr6;
 
@@ -832,64 +1217,29 @@ static int net_tcp_bind(net_socket_t *hnd, const struct sockaddr *addr,
     if(realaddr6.sin6_port != 0) {
         /* Make sure we don't already have a socket bound to the port
            specified */
-        LIST_FOREACH(iter, &tcp_socks, sock_list) {
-            if(iter == sock)
-                continue;
-
-            if(mutex_lock_irqsafe(&iter->mutex)) {
-                mutex_unlock(&sock->mutex);
-                rwsem_write_unlock(&tcp_sem);
-                return -1;
-            }
-
-            if(iter->local_addr.sin6_port == realaddr6.sin6_port) {
-                mutex_unlock(&iter->mutex);
-                mutex_unlock(&sock->mutex);
-                rwsem_write_unlock(&tcp_sem);
-                errno = EADDRINUSE;
-                return -1;
-            }
-
-            mutex_unlock(&iter->mutex);
+        if(tcp_port_in_use(realaddr6.sin6_port)) {
+            mutex_unlock(&sock->mutex);
+            rwsem_write_unlock(&tcp_sem);
+            errno = EADDRINUSE;
+            return -1;
         }
 
         sock->local_addr = realaddr6;
     }
     else {
-        static uint16_t next_bind_ephemeral = 1024;
-        uint16_t port = next_bind_ephemeral, tmp = 0;
-
-        /* Grab the first unused port >= next_bind_ephemeral. */
-        while(tmp != port) {
-            tmp = port;
-
-            LIST_FOREACH(iter, &tcp_socks, sock_list) {
-                if(iter == sock)
-                    continue;
-
-                if(mutex_lock_irqsafe(&iter->mutex)) {
-                    mutex_unlock(&sock->mutex);
-                    rwsem_write_unlock(&tcp_sem);
-                    return -1;
-                }
-
-                if(iter->local_addr.sin6_port == htons(port)) {
-                    mutex_unlock(&iter->mutex);
-                    ++port;
-                    if(port > 65000) port = 1024;
-                    break;
-                }
+        sock->local_addr = realaddr6;
+        sock->local_addr.sin6_port = tcp_ephemeral_port();
 
-                mutex_unlock(&iter->mutex);
-            }
+        if(!sock->local_addr.sin6_port) {
+            mutex_unlock(&sock->mutex);
+            rwsem_write_unlock(&tcp_sem);
+            errno = EADDRINUSE;
+            return -1;
         }
-
-        sock->local_addr = realaddr6;
-        sock->local_addr.sin6_port = htons(port);
-        next_bind_ephemeral = port + 1;
-        if(next_bind_ephemeral > 65000) next_bind_ephemeral = 1024;
     }
 
+    tcp_hash_port(sock);
+
     /* Release the locks, we're done */
     mutex_unlock(&sock->mutex);
     rwsem_write_unlock(&tcp_sem);
@@ -899,7 +1249,7 @@ static int net_tcp_bind(net_socket_t *hnd, const struct sockaddr *addr,
 
 static int net_tcp_connect(net_socket_t *hnd, const struct sockaddr *addr,
                            socklen_t addr_len) {
-    struct tcp_sock *sock, *iter;
+    struct tcp_sock *sock;
     struct sockaddr_in *realaddr4;
     struct sockaddr_in6 realaddr6;
 
@@ -992,36 +1342,14 @@ static int net_tcp_connect(net_socket_t *hnd, const struct sockaddr *addr,
 
     /* See if the socket is already bound to a local port */
     if(!sock->local_addr.sin6_port) {
-        static uint16_t next_ephemeral = 1024;
-        uint16_t port = next_ephemeral, tmp = 0;
-
-        /* Grab the first unused port >= 1024. This is, unfortunately, O(n^2) */
-        while(tmp != port) {
-            tmp = port;
-
-            LIST_FOREACH(iter, &tcp_socks, sock_list) {
-                if(iter == sock)
-                    continue;
-
-                if(mutex_lock_irqsafe(&iter->mutex)) {
-                    mutex_unlock(&sock->mutex);
-                    rwsem_write_unlock(&tcp_sem);
-                    return -1;
-                }
-
-                if(iter->local_addr.sin6_port == htons(port)) {
-                    mutex_unlock(&iter->mutex);
-                    ++port;
-                    break;
-                }
-
-                mutex_unlock(&iter->mutex);
-            }
+        if(!(sock->local_addr.sin6_port = tcp_ephemeral_port())) {
+            mutex_unlock(&sock->mutex);
+            rwsem_write_unlock(&tcp_sem);
+            errno = EADDRNOTAVAIL;
+            return -1;
         }
 
-        sock->local_addr.sin6_port = htons(port);
-        next_ephemeral = port + 1;
-        if(next_ephemeral > 65000) next_ephemeral = 1024;
+        tcp_hash_port(sock);
 
         if(addr->sa_family == AF_INET) {
             sock->local_addr.sin6_addr.__s6_addr.__s6_addr16[5] = 0xFFFF;
@@ -1031,8 +1359,13 @@ static int net_tcp_connect(net_socket_t *hnd, const struct sockaddr *addr,
     }
 
     /* Set the remote address on the socket and go to the SYN-SENT state (this
-       includes setting up all the data we need for that). */
+       includes setting up all the data we need for that). A previous attempt
+       that ran out of memory may have left it in tcp_conns already. */
+    if(sock->remote_addr.sin6_port)
+        LIST_REMOVE(sock, conn_list);
+
     sock->remote_addr = realaddr6;
+    tcp_hash_conn(sock);
 
     if(!(sock->data.rcvbuf = (uint8_t *)malloc(sock->rcvbuf_sz))) {
         errno = ENOBUFS;
@@ -1074,6 +1407,9 @@ static int net_tcp_connect(net_socket_t *hnd, const struct sockaddr *addr,
     sock->data.snd.iss = timer_us_gettime64() >> 2;
     sock->data.snd.una = sock->data.snd.iss;
     sock->data.snd.nxt = sock->data.snd.iss + 1;
+    sock->data.snd.max = sock->data.snd.nxt;
+    sock->data.rcv.wscale = tcp_wscale(sock->rcvbuf_sz);
+    sock->data.cc.rto = TCP_INITIAL_RTO;
     sock->state = TCP_STATE_SYN_SENT;
 
     /* Send a <SYN> packet */
@@ -1083,6 +1419,10 @@ static int net_tcp_connect(net_socket_t *hnd, const struct sockaddr *addr,
         return -1;
     }
 
+    tcp_timer_arm(sock, TCP_TIMER_REXMT, sock->data.cc.rto);
+    sock->data.cc.rtt_time = timer_ms_gettime64();
+    sock->data.cc.rtt_seq = sock->data.snd.iss;
+
     /* Release the write lock... */
     rwsem_write_unlock(&tcp_sem);
 
@@ -1100,6 +1440,7 @@ static int net_tcp_connect(net_socket_t *hnd, const struct sockaddr *addr,
                        2 * TCP_DEFAULT_MSL)) {
         errno = ETIMEDOUT;
         sock->state = TCP_STATE_CLOSED;
+        tcp_timer_stop(sock, TCP_TIMER_REXMT);
         mutex_unlock(&sock->mutex);
         return -1;
     }
@@ -1124,15 +1465,15 @@ static int net_tcp_listen(net_socket_t *hnd, int backlog) {
         backlog = 1;
 
     /* Lock the socket's mutex, since we're going to be manipulating its state
-       in here... */
-    if(!(sock = net_tcp_read_lock_and_get_sock(hnd, &tcp_sem)))
+       in here... The write lock is needed to add it to tcp_listeners. */
+    if(!(sock = net_tcp_write_lock_and_get_sock(hnd, &tcp_sem)))
         return -1;
 
     /* Make sure the socket is still in the closed state, otherwise we can't
        actually move it to the listening state */
     if(sock->state != TCP_STATE_CLOSED) {
         mutex_unlock(&sock->mutex);
-        rwsem_read_unlock(&tcp_sem);
+        rwsem_write_unlock(&tcp_sem);
         errno = EINVAL;
         return -1;
     }
@@ -1140,7 +1481,7 @@ static int net_tcp_listen(net_socket_t *hnd, int backlog) {
     /* Make sure the socket has been bound */
     if(!sock->local_addr.sin6_port) {
         mutex_unlock(&sock->mutex);
-        rwsem_read_unlock(&tcp_sem);
+        rwsem_write_unlock(&tcp_sem);
         errno = EDESTADDRREQ;
         return -1;
     }
@@ -1150,7 +1491,7 @@ static int net_tcp_listen(net_socket_t *hnd, int backlog) {
 
     if(!sock->listen.queue) {
         mutex_unlock(&sock->mutex);
-        rwsem_read_unlock(&tcp_sem);
+        rwsem_write_unlock(&tcp_sem);
         errno = ENOBUFS;
         return -1;
     }
@@ -1159,7 +1500,7 @@ static int net_tcp_listen(net_socket_t *hnd, int backlog) {
         free(sock->listen.queue);
         sock->listen.queue = NULL;
         mutex_unlock(&sock->mutex);
-        rwsem_read_unlock(&tcp_sem);
+        rwsem_write_unlock(&tcp_sem);
         errno = ENOBUFS;
         return -1;
     }
@@ -1167,10 +1508,12 @@ static int net_tcp_listen(net_socket_t *hnd, int backlog) {
     sock->listen.backlog = backlog;
     sock->listen.head = sock->listen.tail = 0;
     sock->state = TCP_STATE_LISTEN;
+    LIST_INSERT_HEAD(&tcp_listeners[tcp_port_hash(sock->local_addr.sin6_port)],
+                     sock, listen_list);
 
     /* We're done now, clean up the locks */
     mutex_unlock(&sock->mutex);
-    rwsem_read_unlock(&tcp_sem);
+    rwsem_write_unlock(&tcp_sem);
 
     return 0;
 }
@@ -1291,8 +1634,8 @@ static ssize_t net_tcp_recvfrom(net_socket_t *hnd, void *buffer, size_t length,
             sock->data.ack_pending = 0;
         }
         /* Flush any pending delayed ACK now that the app has read.
-           This gets the ACK out immediately instead of waiting up to
-           10ms for the timer, reducing effective RTT significantly. */
+           This gets the ACK out immediately instead of waiting for the
+           delayed ACK timer, reducing effective RTT significantly. */
         else if(sock->data.ack_pending > 0) {
             tcp_send_ack(sock);
             sock->data.ack_pending = 0;
@@ -1485,7 +1828,7 @@ static ssize_t net_tcp_sendto(net_socket_t *hnd, const void *message,
     }
 
     /* Send some data! */
-    tcp_send_data(sock, 0);
+    tcp_send_data(sock);
 
 out:
     mutex_unlock(&sock->mutex);
@@ -1538,6 +1881,10 @@ static int net_tcp_getsockopt(net_socket_t *hnd, int level, int option_name,
                     /* Checking/resetting errors not implemented */
                     goto simply_return;
 
+                case SO_KEEPALIVE:
+                    tmp = !!(sock->intflags & TCP_IFLAG_KEEPALIVE);
+                    goto copy_int;
+
                 case SO_RCVBUF:
                     tmp = sock->rcvbuf_sz;
                     goto copy_int;
@@ -1586,6 +1933,18 @@ static int net_tcp_getsockopt(net_socket_t *hnd, int level, int option_name,
                 case TCP_NODELAY:
                     tmp = 1;
                     goto copy_int;
+
+                case TCP_KEEPIDLE:
+                    tmp = sock->keepidle;
+                    goto copy_int;
+
+                case TCP_KEEPINTVL:
+                    tmp = sock->keepintvl;
+                    goto copy_int;
+
+                case TCP_KEEPCNT:
+                    tmp = sock->keepcnt;
+                    goto copy_int;
             }
 
             break;
@@ -1645,17 +2004,23 @@ static int net_tcp_setsockopt(net_socket_t *hnd, int level, int option_name,
                         goto ret_inval;
 
                     tmp = *(uint32_t *)option_value;
-                    /* Receive buffer size must be in the range 256 - 65535 */
+                    /* Receive buffer size must be in the range 256 -
+                       TCP_MAX_WINDOW */
                     if(tmp < 256)
                         tmp = 256;
-                    else if(tmp > 65535)
-                        tmp = 65535;
+                    else if(tmp > TCP_MAX_WINDOW)
+                        tmp = TCP_MAX_WINDOW;
+
+                    /* The buffers only exist once the socket is connected. */
+                    if(sock->state != TCP_STATE_CLOSED &&
+                       sock->state != TCP_STATE_LISTEN) {
+                        new_ptr = realloc(sock->data.rcvbuf, tmp);
+                        if(!new_ptr)
+                            goto ret_nomem;
 
-                    new_ptr = realloc(sock->data.rcvbuf, tmp);
-                    if(!new_ptr)
-                        goto ret_nomem;
+                        sock->data.rcvbuf = new_ptr;
+                    }
 
-                    sock->data.rcvbuf = new_ptr;
                     sock->rcvbuf_sz = tmp;
                     goto ret_success;
 
@@ -1664,20 +2029,37 @@ static int net_tcp_setsockopt(net_socket_t *hnd, int level, int option_name,
                         goto ret_inval;
 
                     tmp = *(uint32_t *)option_value;
-                    /* Send buffer size must be in the range 2048 - 65535 */
+                    /* Send buffer size must be in the range 2048 -
+                       TCP_MAX_WINDOW */
                     if(tmp < 2048)
                         tmp = 2048;
-                    else if(tmp > 65535)
-                        tmp = 65535;
+                    else if(tmp > TCP_MAX_WINDOW)
+                        tmp = TCP_MAX_WINDOW;
 
-                    new_ptr = realloc(sock->data.sndbuf, tmp);
-                    if(!new_ptr) {
-                        goto ret_nomem;
+                    if(sock->state != TCP_STATE_CLOSED &&
+                       sock->state != TCP_STATE_LISTEN) {
+                        new_ptr = realloc(sock->data.sndbuf, tmp);
+                        if(!new_ptr)
+                            goto ret_nomem;
+
+                        sock->data.sndbuf = new_ptr;
                     }
 
-                    sock->data.sndbuf = new_ptr;
                     sock->sndbuf_sz = tmp;
                     goto ret_success;
+
+                case SO_KEEPALIVE:
+                    if(option_len != sizeof(int))
+                        goto ret_inval;
+
+                    tmp = *((int *)option_value);
+
+                    if(tmp)
+                        sock->intflags |= TCP_IFLAG_KEEPALIVE;
+                    else
+                        sock->intflags &= ~TCP_IFLAG_KEEPALIVE;
+
+                    goto keep_rearm;
             }
 
             break;
@@ -1753,6 +2135,26 @@ static int net_tcp_setsockopt(net_socket_t *hnd, int level, int option_name,
                         goto ret_inval;
 
                     goto ret_success;
+
+                case TCP_KEEPIDLE:
+                case TCP_KEEPINTVL:
+                case TCP_KEEPCNT:
+                    if(option_len != sizeof(int))
+                        goto ret_inval;
+
+                    tmp = *((int *)option_value);
+
+                    if(tmp < 1 || tmp > TCP_MAX_KEEPALIVE)
+                        goto ret_inval;
+
+                    if(option_name == TCP_KEEPIDLE)
+                        sock->keepidle = tmp;
+                    else if(option_name == TCP_KEEPINTVL)
+                        sock->keepintvl = tmp;
+                    else
+                        sock->keepcnt = tmp;
+
+                    goto keep_rearm;
             }
 
             break;
@@ -1776,6 +2178,12 @@ ret_nomem:
     errno = ENOMEM;
     return -1;
 
+keep_rearm:
+    /* Apply the new keepalive settings to a connected socket. */
+    if(sock->state == TCP_STATE_ESTABLISHED ||
+       sock->state == TCP_STATE_CLOSE_WAIT)
+        tcp_keep_arm(sock);
+
 ret_success:
     mutex_unlock(&sock->mutex);
     rwsem_read_unlock(&tcp_sem);
@@ -2101,9 +2509,38 @@ static void tcp_bpkt_rst(netif_t *net, const struct in6_addr *src,
 }
 
 static int tcp_send_syn(struct tcp_sock *sock, int ack) {
-    uint8_t rawpkt[sizeof(tcp_hdr_t) + 4];
+    uint8_t rawpkt[sizeof(tcp_hdr_t) + 20];
     tcp_hdr_t *hdr = (tcp_hdr_t *)rawpkt;
+    uint8_t *opt = hdr->options;
     uint16_t cs;
+    int sz;
+
+    /* Fill in our SYN options. We always send the MSS. The window scale and
+       timestamp options go in our own SYN, and in a <SYN,ACK> only if the other
+       side sent them too. */
+    *opt++ = TCP_OPT_MSS;
+    *opt++ = 4;
+    *opt++ = (TCP_DEFAULT_MSS >> 8) & 0xFF;
+    *opt++ = TCP_DEFAULT_MSS & 0xFF;
+
+    if(!ack || (sock->data.cc.flags & TCP_CC_WSCALE)) {
+        *opt++ = TCP_OPT_NOP;
+        *opt++ = TCP_OPT_WSCALE;
+        *opt++ = 3;
+        *opt++ = sock->data.rcv.wscale;
+    }
+
+    if(!ack || (sock->data.cc.flags & TCP_CC_TSTAMP)) {
+        *opt++ = TCP_OPT_NOP;
+        *opt++ = TCP_OPT_NOP;
+        *opt++ = TCP_OPT_TSTAMP;
+        *opt++ = 10;
+        tcp_put32(opt, (uint32_t)timer_ms_gettime64());
+        tcp_put32(opt + 4, ack ? sock->data.cc.ts_recent : 0);
+        opt += 8;
+    }
+
+    sz = opt - rawpkt;
 
     /* Fill in the base packet */
     hdr->src_port = sock->local_addr.sin6_port;
@@ -2112,165 +2549,375 @@ static int tcp_send_syn(struct tcp_sock *sock, int ack) {
     hdr->ack = htonl(sock->data.rcv.nxt);
 
     if(ack) {
-        hdr->off_flags = htons(TCP_FLAG_SYN | TCP_FLAG_ACK | TCP_OFFSET(6));
+        hdr->off_flags = htons(TCP_FLAG_SYN | TCP_FLAG_ACK | TCP_OFFSET(sz >> 2));
     }
     else {
-        hdr->off_flags = htons(TCP_FLAG_SYN | TCP_OFFSET(6));
+        hdr->off_flags = htons(TCP_FLAG_SYN | TCP_OFFSET(sz >> 2));
     }
 
-    hdr->wnd = htons(sock->data.rcv.wnd);
+    /* The window in a SYN is never scaled. */
+    hdr->wnd = htons(MIN(sock->data.rcv.wnd, 65535));
     hdr->checksum = 0;
     hdr->urg = 0;
 
-    /* Fill in our SYN options. The only one we worry about right now is MSS. */
-    hdr->options[0] = TCP_OPT_MSS;
-    hdr->options[1] = 4;
-    hdr->options[2] = (TCP_DEFAULT_MSS >> 8) & 0xFF;
-    hdr->options[3] = TCP_DEFAULT_MSS & 0xFF;
-
     /* Calculate the real checksum */
     cs = net_ipv6_checksum_pseudo(&sock->local_addr.sin6_addr,
                                   &sock->remote_addr.sin6_addr,
-                                  sizeof(tcp_hdr_t) + 4, IPPROTO_TCP);
-    hdr->checksum = net_ipv4_checksum(rawpkt, sizeof(tcp_hdr_t) + 4, cs);
+                                  sz, IPPROTO_TCP);
+    hdr->checksum = net_ipv4_checksum(rawpkt, sz, cs);
 
-    return net_ipv6_send(sock->data.net, rawpkt, sizeof(tcp_hdr_t) + 4,
+    return net_ipv6_send(sock->data.net, rawpkt, sz,
                          sock->hop_limit, IPPROTO_TCP,
                          &sock->local_addr.sin6_addr,
                          &sock->remote_addr.sin6_addr);
 }
 
-static void tcp_send_fin_ack(struct tcp_sock *sock) {
-    uint8_t rawpkt[sizeof(tcp_hdr_t)];
-    tcp_hdr_t *hdr = (tcp_hdr_t *)rawpkt;
-    uint16_t cs;
+/* Fill in the header of a segment on a synchronized connection, along with the
+   timestamp option if it is in use. Returns the length of the header. */
+static int tcp_fill_hdr(struct tcp_sock *sock, tcp_hdr_t *hdr, uint32_t seq,
+                        uint16_t flags) {
+    int sz = sizeof(tcp_hdr_t);
 
-    /* Fill in the base packet */
     hdr->src_port = sock->local_addr.sin6_port;
     hdr->dst_port = sock->remote_addr.sin6_port;
-    hdr->seq = htonl(sock->data.snd.nxt);
+    hdr->seq = htonl(seq);
     hdr->ack = htonl(sock->data.rcv.nxt);
-    hdr->off_flags = htons(TCP_FLAG_FIN | TCP_FLAG_ACK | TCP_OFFSET(5));
-    hdr->wnd = htons(sock->data.rcv.wnd);
+    hdr->wnd = htons(MIN(sock->data.rcv.wnd >> sock->data.rcv.wscale, 65535));
     hdr->checksum = 0;
     hdr->urg = 0;
 
-    /* Calculate the real checksum */
-    cs = net_ipv6_checksum_pseudo(&sock->local_addr.sin6_addr,
-                                  &sock->remote_addr.sin6_addr,
-                                  sizeof(tcp_hdr_t), IPPROTO_TCP);
-    hdr->checksum = net_ipv4_checksum(rawpkt, sizeof(tcp_hdr_t), cs);
+    if(sock->data.cc.flags & TCP_CC_TSTAMP) {
+        hdr->options[0] = TCP_OPT_NOP;
+        hdr->options[1] = TCP_OPT_NOP;
+        hdr->options[2] = TCP_OPT_TSTAMP;
+        hdr->options[3] = 10;
+        tcp_put32(hdr->options + 4, (uint32_t)timer_ms_gettime64());
+        tcp_put32(hdr->options + 8, sock->data.cc.ts_recent);
+        sz += TCP_TSTAMP_LEN;
+    }
+
+    hdr->off_flags = htons(flags | TCP_OFFSET(sz >> 2));
+    return sz;
+}
+
+/* Add up the pseudo header for the checksum of a len byte segment. */
+static uint16_t tcp_pseudo_sum(struct tcp_sock *sock, size_t len) {
+    return net_ipv6_checksum_pseudo(&sock->local_addr.sin6_addr,
+                                    &sock->remote_addr.sin6_addr, len,
+                                    IPPROTO_TCP);
+}
+
+/* Checksum and send a segment built with tcp_fill_hdr() in a packet buffer.
+   Everything past the first hlen bytes, along with the pseudo header, has
+   already been added up into sum. */
+static void tcp_send_pbuf(struct tcp_sock *sock, net_pbuf_t *pb, int hlen,
+                          uint16_t sum) {
+    tcp_hdr_t *hdr = (tcp_hdr_t *)pb->data;
+
+    hdr->checksum = net_ipv4_checksum(pb->data, hlen, sum);
 
-    net_ipv6_send(sock->data.net, rawpkt, sizeof(tcp_hdr_t), sock->hop_limit,
-                  IPPROTO_TCP, &sock->local_addr.sin6_addr,
-                  &sock->remote_addr.sin6_addr);
+    net_ipv6_send_pbuf(sock->data.net, pb, sock->hop_limit, IPPROTO_TCP,
+                       &sock->local_addr.sin6_addr,
+                       &sock->remote_addr.sin6_addr);
+}
+
+/* Checksum and send a segment built with tcp_fill_hdr(). */
+static void tcp_send_pkt(struct tcp_sock *sock, uint8_t *rawpkt, int sz) {
+    net_pbuf_t *pb;
+
+    if(!(pb = net_pbuf_alloc(NET_PBUF_HEADROOM, sz)))
+        return;
+
+    memcpy(pb->data, rawpkt, sz);
+    tcp_send_pbuf(sock, pb, sz, tcp_pseudo_sum(sock, sz));
+    net_pbuf_free(pb);
+}
+
+static void tcp_send_fin_ack(struct tcp_sock *sock) {
+    uint8_t rawpkt[sizeof(tcp_hdr_t) + TCP_TSTAMP_LEN];
+    int sz;
+
+    sz = tcp_fill_hdr(sock, (tcp_hdr_t *)rawpkt, sock->data.snd.nxt,
+                      TCP_FLAG_FIN | TCP_FLAG_ACK);
+    tcp_send_pkt(sock, rawpkt, sz);
 }
 
 static void tcp_send_ack(struct tcp_sock *sock) {
-    tcp_hdr_t hdr;
-    uint16_t c;
+    uint8_t rawpkt[sizeof(tcp_hdr_t) + TCP_TSTAMP_LEN];
+    int sz;
 
-    /* Fill in the base packet */
-    hdr.src_port = sock->local_addr.sin6_port;
-    hdr.dst_port = sock->remote_addr.sin6_port;
-    hdr.seq = htonl(sock->data.snd.nxt);
-    hdr.ack = htonl(sock->data.rcv.nxt);
-    hdr.off_flags = htons(TCP_FLAG_ACK | TCP_OFFSET(5));
-    hdr.wnd = htons(sock->data.rcv.wnd);
-    hdr.checksum = 0;
-    hdr.urg = 0;
+    sz = tcp_fill_hdr(sock, (tcp_hdr_t *)rawpkt, sock->data.snd.nxt,
+                      TCP_FLAG_ACK);
+    tcp_send_pkt(sock, rawpkt, sz);
+}
 
-    /* Calculate the real checksum */
-    c = net_ipv6_checksum_pseudo(&sock->local_addr.sin6_addr,
-                                 &sock->remote_addr.sin6_addr,
-                                 sizeof(tcp_hdr_t), IPPROTO_TCP);
-    hdr.checksum = net_ipv4_checksum((const uint8_t *)&hdr, sizeof(tcp_hdr_t), c);
+/* Send a keepalive probe: an old sequence number, that the other side has to
+   answer with an ACK. */
+static void tcp_send_keepalive(struct tcp_sock *sock) {
+    uint8_t rawpkt[sizeof(tcp_hdr_t) + TCP_TSTAMP_LEN];
+    int sz;
 
-    net_ipv6_send(sock->data.net, (const uint8_t *)&hdr, sizeof(tcp_hdr_t),
-                  sock->hop_limit, IPPROTO_TCP, &sock->local_addr.sin6_addr,
-                  &sock->remote_addr.sin6_addr);
+    sz = tcp_fill_hdr(sock, (tcp_hdr_t *)rawpkt, sock->data.snd.una - 1,
+                      TCP_FLAG_ACK);
+    tcp_send_pkt(sock, rawpkt, sz);
 }
 
-static void tcp_send_data(struct tcp_sock *sock, int resend) {
-    uint32_t wnd = sock->data.snd.wnd, snd;
-    int sz = sizeof(tcp_hdr_t);
-    uint8_t rawpkt[1500];
-    tcp_hdr_t *hdr = (tcp_hdr_t *)rawpkt;
-    uint16_t cs;
-    uint8_t *sb, *buf;
-    uint32_t seq, unacked, head;
+/* Send the FIN that close() left for when the send buffer is empty. */
+static void tcp_send_queued_fin(struct tcp_sock *sock) {
+    if(sock->data.sndbuf_cur_sz || !(sock->intflags & TCP_IFLAG_QUEUEDCLOSE))
+        return;
+
+    if(sock->state == TCP_STATE_ESTABLISHED)
+        sock->state = TCP_STATE_FIN_WAIT_1;
+    else if(sock->state == TCP_STATE_CLOSE_WAIT)
+        sock->state = TCP_STATE_CLOSING;
+    else
+        return;
+
+    tcp_send_fin_ack(sock);
+    sock->data.snd.max = ++sock->data.snd.nxt;
+}
 
-    if(!resend) {
-        seq = sock->data.snd.nxt;
-        unacked = sock->data.snd.nxt - sock->data.snd.una;
-        wnd -= unacked;
-        head = sock->data.sndbuf_head;
+/* Send one segment, with len bytes from the send buffer starting at offset
+   head. */
+static void tcp_send_seg(struct tcp_sock *sock, uint32_t seq, uint32_t head,
+                         uint32_t len) {
+    net_pbuf_t *pb;
+    uint8_t *buf;
+    uint16_t sum;
+    int sz, tmp;
+
+    /* Build the segment where the lower layers can add their headers in front
+       of it, so that it doesn't get copied again on its way out. */
+    if(!(pb = net_pbuf_alloc(NET_PBUF_HEADROOM,
+                             sizeof(tcp_hdr_t) + TCP_TSTAMP_LEN + len)))
+        return;
+
+    sz = tcp_fill_hdr(sock, (tcp_hdr_t *)pb->data, seq, TCP_FLAG_ACK);
+    buf = pb->data + sz;
+    pb->len = sz + len;
+
+    /* Copy in the data, adding it up for the checksum on the way */
+    sum = tcp_pseudo_sum(sock, pb->len);
+
+    if(head + len <= sock->sndbuf_sz) {
+        sum = ~net_ipv4_checksum_copy(buf, sock->data.sndbuf + head, len, sum);
     }
     else {
-        seq = sock->data.snd.una;
-        unacked = 0;
-        head = sock->data.sndbuf_acked;
+        tmp = sock->sndbuf_sz - head;
+        memcpy(buf, sock->data.sndbuf + head, tmp);
+        memcpy(buf + tmp, sock->data.sndbuf, len - tmp);
+        sum = ~net_ipv4_checksum(buf, len, sum);
     }
 
-    if(!wnd)
-        wnd = 1;
+    tcp_send_pbuf(sock, pb, sz, sum);
+    net_pbuf_free(pb);
 
-    /* Fill in the base packet */
-    hdr->src_port = sock->local_addr.sin6_port;
-    hdr->dst_port = sock->remote_addr.sin6_port;
-    hdr->ack = htonl(sock->data.rcv.nxt);
-    hdr->off_flags = htons(TCP_FLAG_ACK | TCP_OFFSET(5));
-    hdr->wnd = htons(sock->data.rcv.wnd);
-    hdr->urg = 0;
+    /* The segment acknowledges everything we've received so far. */
+    sock->data.ack_pending = 0;
+}
+
+/* Send as much of the buffered data as the send and congestion windows
+   allow. */
+static void tcp_send_data(struct tcp_sock *sock) {
+    struct ccrec *cc = &sock->data.cc;
+    uint32_t inflight = sock->data.snd.nxt - sock->data.snd.una;
+    uint32_t wnd = MIN(sock->data.snd.wnd, cc->cwnd);
+    uint32_t avail, snd, head;
+    uint64_t now;
 
-    /* Put on some data if we should do so */
-    while(sock->data.sndbuf_cur_sz - unacked && wnd) {
-        hdr->seq = htonl(seq);
-        hdr->checksum = 0;
-        buf = rawpkt + sizeof(tcp_hdr_t);
-        sb = sock->data.sndbuf + head;
-        snd = wnd;
+    if(sock->data.sndbuf_cur_sz <= inflight)
+        return;
 
-        if(snd > sock->data.snd.mss)
-            snd = sock->data.snd.mss;
+    avail = wnd > inflight ? wnd - inflight : 0;
 
-        if(snd > sock->data.sndbuf_cur_sz - unacked)
-            snd = sock->data.sndbuf_cur_sz - unacked;
+    /* Probe a closed window with a single byte. */
+    if(!sock->data.snd.wnd && !inflight)
+        avail = 1;
 
-        /* Copy in the data */
-        if(head + snd <= sock->sndbuf_sz) {
-            memcpy(buf, sb, snd);
-            head += snd;
+    if(!avail)
+        return;
 
-            if(head == sock->sndbuf_sz)
-                head = 0;
-        }
-        else {
-            sz = sock->sndbuf_sz - head;
-            memcpy(buf, sb, sz);
-            memcpy(buf + sz, sock->data.sndbuf, snd - sz);
-            head = snd - sz;
+    now = timer_ms_gettime64();
+
+    /* Start the retransmission timer, if it wasn't already running. This
+       also takes care of probing a closed window again. */
+    if(!inflight)
+        tcp_timer_arm(sock, TCP_TIMER_REXMT, cc->rto);
+
+    head = sock->data.sndbuf_head;
+
+    /* Hand the segments to the device all at once. */
+    net_tx_begin();
+
+    while(sock->data.sndbuf_cur_sz - inflight && avail) {
+        snd = MIN(avail, sock->data.snd.mss);
+        snd = MIN(snd, sock->data.sndbuf_cur_sz - inflight);
+
+        /* Time one segment per RTT, if we don't have timestamps to do better.
+           Following Karn's algorithm, this is never a retransmission. */
+        if(!cc->rtt_time && !(cc->flags & TCP_CC_TSTAMP) &&
+           SEQ_GE(sock->data.snd.nxt, sock->data.snd.max)) {
+            cc->rtt_time = now;
+            cc->rtt_seq = sock->data.snd.nxt;
         }
 
-        sz = snd + sizeof(tcp_hdr_t);
-        wnd -= snd;
-        seq += snd;
-        unacked += snd;
+        tcp_send_seg(sock, sock->data.snd.nxt, head, snd);
+
+        head += snd;
 
-        /* Calculate the checksum */
-        cs = net_ipv6_checksum_pseudo(&sock->local_addr.sin6_addr,
-                                      &sock->remote_addr.sin6_addr, sz,
-                                      IPPROTO_TCP);
-        hdr->checksum = net_ipv4_checksum(rawpkt, sz, cs);
+        if(head >= sock->sndbuf_sz)
+            head -= sock->sndbuf_sz;
 
-        net_ipv6_send(sock->data.net, rawpkt, sz, sock->hop_limit, IPPROTO_TCP,
-                      &sock->local_addr.sin6_addr,
-                      &sock->remote_addr.sin6_addr);
+        sock->data.snd.nxt += snd;
+        inflight += snd;
+        avail -= snd;
     }
 
-    sock->data.timer = timer_ms_gettime64();
+    net_tx_end();
+
     sock->data.sndbuf_head = head;
-    sock->data.snd.nxt = seq;
+
+    if(SEQ_GT(sock->data.snd.nxt, sock->data.snd.max))
+        sock->data.snd.max = sock->data.snd.nxt;
+}
+
+/* Resend the first unacknowledged segment, for a fast retransmit or a partial
+   ACK during fast recovery. */
+static void tcp_retransmit(struct tcp_sock *sock) {
+    uint32_t len = MIN(sock->data.snd.mss, sock->data.sndbuf_cur_sz);
+
+    if(!len)
+        return;
+
+    /* Karn's algorithm: don't take an RTT sample from a resent segment. */
+    if(SEQ_LT(sock->data.cc.rtt_seq, sock->data.snd.una + len))
+        sock->data.cc.rtt_time = 0;
+
+    tcp_send_seg(sock, sock->data.snd.una, sock->data.sndbuf_acked, len);
+}
+
+/* The retransmission timer expired. Assume everything in flight was lost, and
+   go back to the first unacknowledged byte with a one segment window. */
+static void tcp_rto(struct tcp_sock *sock) {
+    struct ccrec *cc = &sock->data.cc;
+    uint32_t flight = sock->data.snd.max - sock->data.snd.una;
+    uint32_t mss = sock->data.snd.mss;
+
+    /* A closed window being probed doesn't say anything about congestion. */
+    if(flight && sock->data.snd.wnd) {
+        cc->ssthresh = MAX(flight / 2, 2 * mss);
+        cc->cwnd = mss;
+        cc->recover = sock->data.snd.max;
+        cc->flags &= ~TCP_CC_RECOVERY;
+        cc->dupacks = 0;
+    }
+
+    /* Back off the timer, as per RFC 6298 section 5.5. */
+    cc->rto = MIN(cc->rto * 2, TCP_MAX_RTO);
+    cc->rtt_time = 0;
+
+    sock->data.snd.nxt = sock->data.snd.una;
+    sock->data.sndbuf_head = sock->data.sndbuf_acked;
+    tcp_send_data(sock);
+    tcp_timer_arm(sock, TCP_TIMER_REXMT, cc->rto);
+}
+
+/* Process an ACK that covers new data. */
+static void tcp_ack_new(struct tcp_sock *s, uint32_t ack, int acksyn,
+                        uint32_t tsecr) {
+    struct ccrec *cc = &s->data.cc;
+    uint32_t acked = ack - s->data.snd.una - acksyn;
+    uint32_t mss = s->data.snd.mss;
+    uint64_t now = timer_ms_gettime64();
+
+    /* Our FIN isn't in the buffer. */
+    if(acked > s->data.sndbuf_cur_sz)
+        acked = s->data.sndbuf_cur_sz;
+
+    s->data.sndbuf_acked += acked;
+    s->data.sndbuf_cur_sz -= acked;
+    s->data.snd.una = ack;
+
+    if(s->data.sndbuf_acked >= s->sndbuf_sz)
+        s->data.sndbuf_acked -= s->sndbuf_sz;
+
+    /* After a timeout, the other side may ack data we haven't resent yet. */
+    if(SEQ_LT(s->data.snd.nxt, ack)) {
+        s->data.snd.nxt = ack;
+        s->data.sndbuf_head = s->data.sndbuf_acked;
+    }
+
+    /* Take an RTT sample, from the timestamp if we have one. */
+    if(tsecr) {
+        tcp_rtt_update(s, (uint32_t)now - tsecr);
+    }
+    else if(cc->rtt_time && SEQ_GT(ack, cc->rtt_seq)) {
+        tcp_rtt_update(s, (uint32_t)(now - cc->rtt_time));
+        cc->rtt_time = 0;
+    }
+
+    if(cc->flags & TCP_CC_RECOVERY) {
+        if(SEQ_GE(ack, cc->recover)) {
+            /* Full ACK: deflate the window and leave fast recovery. */
+            cc->cwnd = MIN(cc->ssthresh, s->data.snd.max - ack + mss);
+            cc->flags &= ~TCP_CC_RECOVERY;
+        }
+        else {
+            /* Partial ACK: the segment after this one was lost too. Deflate
+               the window by what was acked, and resend that segment. */
+            cc->cwnd = cc->cwnd > acked + mss ? cc->cwnd - acked : mss;
+
+            if(acked >= mss)
+                cc->cwnd += mss;
+
+            tcp_retransmit(s);
+        }
+    }
+    else {
+        if(cc->cwnd < cc->ssthresh)
+            /* Slow start, with the increase capped at one MSS per ACK */
+            cc->cwnd += MIN(acked, mss);
+        else if(acked)
+            /* Congestion avoidance: about one MSS per RTT */
+            cc->cwnd += MAX(mss * mss / cc->cwnd, 1);
+
+        /* Keep recover just behind una, so that it can't fall so far behind
+           that the sequence comparisons wrap around. */
+        if(SEQ_GT(ack, cc->recover))
+            cc->recover = ack - 1;
+    }
+
+    if(cc->cwnd > TCP_MAX_CWND)
+        cc->cwnd = TCP_MAX_CWND;
+
+    cc->dupacks = 0;
+
+    /* Restart the retransmission timer for whatever is still in flight. */
+    if(s->data.snd.una == s->data.snd.max)
+        tcp_timer_stop(s, TCP_TIMER_REXMT);
+    else
+        tcp_timer_arm(s, TCP_TIMER_REXMT, cc->rto);
+}
+
+/* Process a duplicate ACK, as defined in RFC 5681. */
+static void tcp_ack_dup(struct tcp_sock *s) {
+    struct ccrec *cc = &s->data.cc;
+    uint32_t mss = s->data.snd.mss;
+
+    if(cc->flags & TCP_CC_RECOVERY) {
+        /* Each duplicate means another segment has left the network. */
+        cc->cwnd += mss;
+    }
+    else if(++cc->dupacks == TCP_DUPACK_THRESH &&
+            SEQ_GT(s->data.snd.una, cc->recover)) {
+        /* Fast retransmit, then fast recovery (RFC 6582) */
+        cc->ssthresh = MAX((s->data.snd.max - s->data.snd.una) / 2, 2 * mss);
+        cc->recover = s->data.snd.max;
+        cc->flags |= TCP_CC_RECOVERY;
+        tcp_retransmit(s);
+        cc->cwnd = cc->ssthresh + TCP_DUPACK_THRESH * mss;
+    }
 }
 
 #define ADDR_EQUAL(a1, a2) \
@@ -2279,6 +2926,21 @@ static void tcp_send_data(struct tcp_sock *sock, int resend) {
      ((a1).__s6_addr.__s6_addr32[2] == (a2).__s6_addr.__s6_addr32[2]) && \
      ((a1).__s6_addr.__s6_addr32[3] == (a2).__s6_addr.__s6_addr32[3]))
 
+/* See if a socket can take a segment sent to the given local address. */
+static inline int sock_accepts(const struct tcp_sock *i,
+                               const struct in6_addr *dst, int domain) {
+    /* Ignore any sockets that are IPv6 only when we have an incoming IPv4
+       packet, or any that are IPv4 only when we have an incoming IPv6
+       packet. */
+    if((domain == AF_INET && (i->flags & FS_SOCKET_V6ONLY)) ||
+            (domain == AF_INET6 && i->domain == AF_INET))
+        return 0;
+
+    /* See if it matches the local address, if the socket has one */
+    return IN6_IS_ADDR_UNSPECIFIED(&i->local_addr.sin6_addr) ||
+           ADDR_EQUAL(i->local_addr.sin6_addr, *dst);
+}
+
 /* Match a socket to an incoming packet. If an actual socket is returned, it is
    the caller's responsibility  to release the socket's mutex when they're done
    with it. */
@@ -2287,70 +2949,60 @@ static struct tcp_sock *find_sock(const struct in6_addr *src,
                                   uint16_t sport, uint16_t dport, int domain) {
     struct tcp_sock *i;
 
-    LIST_FOREACH(i, &tcp_socks, sock_list) {
+    /* A connection takes precedence over a socket listening on its port. */
+    LIST_FOREACH(i, &tcp_conns[tcp_conn_hash(src, sport, dport)], conn_list) {
         /* Ignore any closed sockets */
         if(i->state == TCP_STATE_CLOSED)
             continue;
 
-        /* Ignore any sockets that are IPv6 only when we have an incoming IPv4
-           packet, or any that are IPv4 only when we have an incoming IPv6
-           packet. */
-        if((domain == AF_INET && (i->flags & FS_SOCKET_V6ONLY)) ||
-                (domain == AF_INET6 && i->domain == AF_INET))
-            continue;
-
-        /* See if the remote end matches what's in the socket */
-        if(!IN6_IS_ADDR_UNSPECIFIED(&i->remote_addr.sin6_addr) &&
-                (!ADDR_EQUAL(i->remote_addr.sin6_addr, *src) ||
-                 i->remote_addr.sin6_port != sport))
+        if(i->remote_addr.sin6_port != sport ||
+                i->local_addr.sin6_port != dport ||
+                !ADDR_EQUAL(i->remote_addr.sin6_addr, *src))
             continue;
 
-        /* See if it matches the local end */
-        if((!IN6_IS_ADDR_UNSPECIFIED(&i->local_addr.sin6_addr) &&
-                !ADDR_EQUAL(i->local_addr.sin6_addr, *dst)) ||
-                i->local_addr.sin6_port != dport)
-            continue;
-
-        if(mutex_lock_irqsafe(&i->mutex))
-            return (struct tcp_sock *) -1;
+        if(sock_accepts(i, dst, domain))
+            goto found;
+    }
 
-        /* Because we always add new sockets to the head of the list, this
-           should be sufficient to match the socket. See the comment at the top
-           of the file for more discussion of this, if you're interested. */
-        return i;
+    LIST_FOREACH(i, &tcp_listeners[tcp_port_hash(dport)], listen_list) {
+        if(i->local_addr.sin6_port == dport && sock_accepts(i, dst, domain))
+            goto found;
     }
 
     return NULL;
-}
 
-extern void __poll_event_trigger(int fd, short event);
+found:
+    if(mutex_lock_irqsafe(&i->mutex))
+        return (struct tcp_sock *) -1;
+
+    return i;
+}
 
 /* This function is basically a direct implementation of the first two and a
    half steps of the SEGMENT ARRIVES event processing defined in RFC 793 on
    pages 65 and 66. There are a few parts that are omitted and some are put off
    until actually accepting the connection. */
-static int listen_pkt(netif_t *src, const struct in6_addr *srca,
-                      const struct in6_addr *dsta, const tcp_hdr_t *tcp,
-                      struct tcp_sock *s, uint16_t flags, int size) {
-    int j = 0;
-    int end_of_opts;
-    uint16_t mss = 576;
-
-    (void)size;
-
-    /* Incoming segments with a RST should be ignored */
-    if(flags & TCP_FLAG_RST)
-        return 0;
+/* The options we care about from an incoming segment */
+struct tcp_opts {
+    uint16_t mss;           /* 0 if not present */
+    int8_t wscale;          /* -1 if not present */
+    uint8_t ts_ok;
+    uint32_t tsval;
+    uint32_t tsecr;
+};
 
-    /* Incoming segments with an ACK cause a RST to be generated */
-    if(flags & TCP_FLAG_ACK)
-        return -1;
+/* Parse the options of an incoming segment. Returns -1 if they're malformed. */
+static int tcp_parse_opts(const tcp_hdr_t *tcp, uint16_t flags,
+                          struct tcp_opts *o) {
+    const uint8_t *opt = tcp->options;
+    int j = 0, end_of_opts = TCP_GET_OFFSET(flags) - 20;
 
-    /* Parse options now, in case we need to update the max segment size. */
-    end_of_opts = TCP_GET_OFFSET(flags) - 20;
+    o->mss = 0;
+    o->wscale = -1;
+    o->ts_ok = 0;
 
     while(j < end_of_opts) {
-        switch(tcp->options[j]) {
+        switch(opt[j]) {
             case TCP_OPT_EOL:
                 j = end_of_opts;
                 break;
@@ -2360,23 +3012,70 @@ static int listen_pkt(netif_t *src, const struct in6_addr *srca,
                 break;
 
             case TCP_OPT_MSS:
-                if(j + 4 > end_of_opts || tcp->options[j + 1] != 4)
+                if(j + 4 > end_of_opts || opt[j + 1] != 4)
                     return -1;
 
-                mss = (tcp->options[j + 2] << 8) | tcp->options[j + 3];
+                o->mss = (opt[j + 2] << 8) | opt[j + 3];
                 j += 4;
                 break;
 
+            case TCP_OPT_WSCALE:
+                if(j + 3 > end_of_opts || opt[j + 1] != 3)
+                    return -1;
+
+                o->wscale = MIN(opt[j + 2], TCP_MAX_WSCALE);
+                j += 3;
+                break;
+
+            case TCP_OPT_TSTAMP:
+                if(j + 10 > end_of_opts || opt[j + 1] != 10)
+                    return -1;
+
+                o->ts_ok = 1;
+                o->tsval = tcp_get32(opt + j + 2);
+                o->tsecr = tcp_get32(opt + j + 6);
+                j += 10;
+                break;
+
             default:
 
                 /* Skip unknown options */
-                if(j + 1 > end_of_opts || j + tcp->options[j + 1] > end_of_opts)
+                if(j + 1 >= end_of_opts || opt[j + 1] < 2 ||
+                   j + opt[j + 1] > end_of_opts)
                     return -1;
 
-                j += tcp->options[j + 1];
+                j += opt[j + 1];
         }
     }
 
+    return 0;
+}
+
+static int listen_pkt(netif_t *src, const struct in6_addr *srca,
+                      const struct in6_addr *dsta, const tcp_hdr_t *tcp,
+                      struct tcp_sock *s, uint16_t flags, int size) {
+    int j;
+    uint16_t mss = 576;
+    struct tcp_opts opts;
+    struct lsock *ls;
+
+    (void)size;
+
+    /* Incoming segments with a RST should be ignored */
+    if(flags & TCP_FLAG_RST)
+        return 0;
+
+    /* Incoming segments with an ACK cause a RST to be generated */
+    if(flags & TCP_FLAG_ACK)
+        return -1;
+
+    /* Parse options now, in case we need to update the max segment size. */
+    if(tcp_parse_opts(tcp, flags, &opts))
+        return -1;
+
+    if(opts.mss)
+        mss = opts.mss;
+
     /* Silently cap the MSS... */
     if(mss > 1460)
         mss = 1460;
@@ -2386,11 +3085,16 @@ static int listen_pkt(netif_t *src, const struct in6_addr *srca,
        next thing is to make sure that we don't already have this connection in
        the queue... */
     for(j = s->listen.head; j < s->listen.tail; ++j) {
-        if(ADDR_EQUAL(s->listen.queue[j].remote_addr.sin6_addr, *srca) &&
-                ADDR_EQUAL(s->listen.queue[j].local_addr.sin6_addr, *dsta) &&
-                s->listen.queue[j].remote_addr.sin6_port == tcp->src_port) {
-            s->listen.queue[j].isn = ntohl(tcp->seq);
-            s->listen.queue[j].mss = mss;
+        ls = &s->listen.queue[j];
+
+        if(ADDR_EQUAL(ls->remote_addr.sin6_addr, *srca) &&
+                ADDR_EQUAL(ls->local_addr.sin6_addr, *dsta) &&
+                ls->remote_addr.sin6_port == tcp->src_port) {
+            ls->isn = ntohl(tcp->seq);
+            ls->mss = mss;
+            ls->wscale = opts.wscale;
+            ls->ts_ok = opts.ts_ok;
+            ls->ts_recent = opts.tsval;
             return 0;
         }
     }
@@ -2401,14 +3105,18 @@ static int listen_pkt(netif_t *src, const struct in6_addr *srca,
 
     /* The rest of the processing is put off until the program does an accept().
        Save the connection in the list of incoming sockets. */
-    s->listen.queue[s->listen.tail].net = src;
-    s->listen.queue[s->listen.tail].remote_addr.sin6_addr = *srca;
-    s->listen.queue[s->listen.tail].remote_addr.sin6_port = tcp->src_port;
-    s->listen.queue[s->listen.tail].local_addr.sin6_addr = *dsta;
-    s->listen.queue[s->listen.tail].local_addr.sin6_port = tcp->dst_port;
-    s->listen.queue[s->listen.tail].isn = ntohl(tcp->seq);
-    s->listen.queue[s->listen.tail].mss = mss;
-    s->listen.queue[s->listen.tail].wnd = ntohs(tcp->wnd);
+    ls = &s->listen.queue[s->listen.tail];
+    ls->net = src;
+    ls->remote_addr.sin6_addr = *srca;
+    ls->remote_addr.sin6_port = tcp->src_port;
+    ls->local_addr.sin6_addr = *dsta;
+    ls->local_addr.sin6_port = tcp->dst_port;
+    ls->isn = ntohl(tcp->seq);
+    ls->mss = mss;
+    ls->wnd = ntohs(tcp->wnd);
+    ls->wscale = opts.wscale;
+    ls->ts_ok = opts.ts_ok;
+    ls->ts_recent = opts.tsval;
     ++s->listen.count;
     ++s->listen.tail;
 
@@ -2430,7 +3138,7 @@ static int synsent_pkt(netif_t *src, const struct in6_addr *srca,
                        struct tcp_sock *s, uint16_t flags, int size) {
     uint32_t ack, seq;
     int sz = size - TCP_GET_OFFSET(flags), gotack = 0;
-    int j = 0, end_of_opts, mss = 536;
+    struct tcp_opts opts;
 
     (void)src;
 
@@ -2452,6 +3160,7 @@ static int synsent_pkt(netif_t *src, const struct in6_addr *srca,
     if(flags & TCP_FLAG_RST) {
         if(gotack) {
             s->state = TCP_STATE_CLOSED | TCP_STATE_RESET;
+            tcp_timer_stop(s, TCP_TIMER_REXMT);
             __poll_event_trigger(s->sock, POLLHUP);
             cond_signal(&s->data.recv_cv);
             cond_signal(&s->data.send_cv);
@@ -2463,43 +3172,36 @@ static int synsent_pkt(netif_t *src, const struct in6_addr *srca,
 
     /* Next, we check the SYN bit */
     if(flags & TCP_FLAG_SYN) {
+        if(tcp_parse_opts(tcp, flags, &opts))
+            return -1;
+
         s->data.rcv.nxt = seq + 1;
         s->data.rcv.irs = seq;
 
-        end_of_opts = TCP_GET_OFFSET(flags) - 20;
-
-        while(j < end_of_opts) {
-            switch(tcp->options[j]) {
-                case TCP_OPT_EOL:
-                    j = end_of_opts;
-                    break;
-
-                case TCP_OPT_NOP:
-                    ++j;
-                    break;
-
-                case TCP_OPT_MSS:
-
-                    if(j + 4 > end_of_opts || tcp->options[j + 1] != 4)
-                        return -1;
-
-                    mss = (tcp->options[j + 2] << 8) | tcp->options[j + 3];
-                    j += 4;
-                    break;
+        if(!opts.mss)
+            opts.mss = 536;
 
-                default:
+        s->data.snd.mss = opts.mss > 1460 ? 1460 : opts.mss;
+        s->data.snd.wnd = ntohs(tcp->wnd);
+        s->data.snd.wl1 = seq;
+        s->data.snd.wl2 = ack;
 
-                    /* Skip unknown options */
-                    if(j + 1 > end_of_opts ||
-                            j + tcp->options[j + 1] > end_of_opts)
-                        return -1;
+        /* We offered both window scaling and timestamps in our SYN, so they're
+           on if the other side offered them too. */
+        if(opts.wscale >= 0) {
+            s->data.cc.flags |= TCP_CC_WSCALE;
+            s->data.snd.wscale = opts.wscale;
+        }
+        else {
+            s->data.rcv.wscale = 0;
+        }
 
-                    j += tcp->options[j + 1];
-            }
+        if(opts.ts_ok) {
+            s->data.cc.flags |= TCP_CC_TSTAMP;
+            s->data.cc.ts_recent = opts.tsval;
         }
 
-        s->data.snd.mss = mss > 1460 ? 1460 : mss;
-        s->data.snd.wnd = htons(tcp->wnd);
+        tcp_cc_init(s);
 
         if(gotack) {
             s->data.snd.una = ack;
@@ -2507,7 +3209,15 @@ static int synsent_pkt(netif_t *src, const struct in6_addr *srca,
             /* If the ack covers our iss, then we've established the connection.
                Update the state and ack it. */
             if(SEQ_GT(ack, s->data.snd.iss)) {
+                if(s->data.cc.rtt_time) {
+                    tcp_rtt_update(s, (uint32_t)(timer_ms_gettime64() -
+                                                 s->data.cc.rtt_time));
+                    s->data.cc.rtt_time = 0;
+                }
+
                 s->state = TCP_STATE_ESTABLISHED;
+                tcp_timer_stop(s, TCP_TIMER_REXMT);
+                tcp_keep_arm(s);
                 tcp_send_ack(s);
                 __poll_event_trigger(s->sock, POLLWRNORM | POLLWRBAND);
                 cond_signal(&s->data.send_cv);
@@ -2599,11 +3309,12 @@ static uint32_t tcp_ooo_consume(struct tcp_sock *s) {
 static int process_pkt(netif_t *src, const struct in6_addr *srca,
                        const struct in6_addr *dsta, const tcp_hdr_t *tcp,
                        struct tcp_sock *s, uint16_t flags, size_t size) {
-    uint32_t seq, ack, up;
+    uint32_t seq, ack, up, wnd;
     size_t sz;
     int bad_pkt = 0, tmp, acksyn = 0;
     const uint8_t *buf = (const uint8_t *)tcp;
     uint8_t *rb;
+    struct tcp_opts opts;
 
     (void)src;
 
@@ -2611,6 +3322,12 @@ static int process_pkt(netif_t *src, const struct in6_addr *srca,
     seq = ntohl(tcp->seq);
     ack = ntohl(tcp->ack);
 
+    /* The only options that matter after the handshake are the timestamps. */
+    opts.ts_ok = 0;
+
+    if((s->data.cc.flags & TCP_CC_TSTAMP) && tcp_parse_opts(tcp, flags, &opts))
+        return 0;
+
     /* Check the validity of the incoming segment's sequence number */
     sz = size - TCP_GET_OFFSET(flags);
     buf += TCP_GET_OFFSET(flags);
@@ -2647,6 +3364,11 @@ static int process_pkt(netif_t *src, const struct in6_addr *srca,
         return 0;
     }
 
+    /* Remember the timestamp to echo back, as per RFC 7323 section 4.3. */
+    if(opts.ts_ok && SEQ_LE(seq, s->data.rcv.nxt) &&
+       SEQ_GE(opts.tsval, s->data.cc.ts_recent))
+        s->data.cc.ts_recent = opts.tsval;
+
     /* See if we have a reset, and process it */
     if(flags & TCP_FLAG_RST) {
         if(s->state == TCP_STATE_SYN_SENT) {
@@ -2662,6 +3384,7 @@ static int process_pkt(netif_t *src, const struct in6_addr *srca,
         }
         else {
             s->state = TCP_STATE_RESET | TCP_STATE_CLOSED;
+            tcp_timer_closed(s);
             __poll_event_trigger(s->sock, POLLHUP);
             cond_signal(&s->data.recv_cv);
             cond_signal(&s->data.send_cv);
@@ -2686,9 +3409,12 @@ static int process_pkt(netif_t *src, const struct in6_addr *srca,
 
     /* The state changes how we handle the rest... */
     if(s->state == TCP_STATE_SYN_RECEIVED) {
-        if(SEQ_LE(s->data.snd.una, ack) && SEQ_LE(ack, s->data.snd.nxt)) {
+        if(SEQ_LE(s->data.snd.una, ack) && SEQ_LE(ack, s->data.snd.max)) {
             s->state = TCP_STATE_ESTABLISHED;
             acksyn = 1;
+
+            /* Make sure the window gets taken from this segment. */
+            s->data.snd.wl1 = seq - 1;
         }
         else {
             tcp_bpkt_rst(s->data.net, srca, dsta, tcp, sz);
@@ -2696,30 +3422,45 @@ static int process_pkt(netif_t *src, const struct in6_addr *srca,
         }
     }
 
+    wnd = (uint32_t)ntohs(tcp->wnd) << s->data.snd.wscale;
+
     /* Check the ack number for validity */
-    if(SEQ_LT(s->data.snd.una, ack) && SEQ_LE(ack, s->data.snd.nxt)) {
-        s->data.sndbuf_acked += (int32_t)(ack - s->data.snd.una - acksyn);
-        s->data.sndbuf_cur_sz -= (int32_t)(ack - s->data.snd.una - acksyn);
-        s->data.snd.una = ack;
+    if(SEQ_LT(s->data.snd.una, ack) && SEQ_LE(ack, s->data.snd.max)) {
+        tcp_ack_new(s, ack, acksyn, opts.ts_ok ? opts.tsecr : 0);
         __poll_event_trigger(s->sock, POLLWRNORM | POLLWRBAND);
         cond_signal(&s->data.send_cv);
-
-        if(s->data.sndbuf_acked >= s->sndbuf_sz)
-            s->data.sndbuf_acked -= s->sndbuf_sz;
-
-        if(SEQ_LT(s->data.snd.wl1, seq) ||
-                (s->data.snd.wl1 == seq && SEQ_LE(s->data.snd.wl2, ack))) {
-            s->data.snd.wnd = ntohs(tcp->wnd);
-            s->data.snd.wl1 = seq;
-            s->data.snd.wl2 = ack;
-        }
     }
-    else if(SEQ_GT(ack, s->data.snd.nxt)) {
+    else if(SEQ_GT(ack, s->data.snd.max)) {
         /* This ACKs something we haven't sent, so try to correct the other side
            and return */
         tcp_send_ack(s);
         return 0;
     }
+    else if(ack == s->data.snd.una && !sz && !(flags & TCP_FLAG_FIN) &&
+            wnd == s->data.snd.wnd && s->data.snd.max != s->data.snd.una) {
+        tcp_ack_dup(s);
+    }
+
+    /* Update the send window, unless this segment is older than the one it was
+       last updated from. */
+    if(SEQ_GE(ack, s->data.snd.una) && (SEQ_LT(s->data.snd.wl1, seq) ||
+            (s->data.snd.wl1 == seq && SEQ_LE(s->data.snd.wl2, ack)))) {
+        s->data.snd.wnd = wnd;
+        s->data.snd.wl1 = seq;
+        s->data.snd.wl2 = ack;
+    }
+
+    /* The ACK may have made room for more data in one of the windows, or
+       finished off the data that a close() was waiting on. */
+    if(s->state == TCP_STATE_ESTABLISHED || s->state == TCP_STATE_CLOSE_WAIT) {
+        if(acksyn)
+            tcp_keep_arm(s);
+        else if(s->intflags & TCP_IFLAG_KEEPALIVE)
+            s->data.last_rcv = timer_ms_gettime64();
+
+        tcp_send_data(s);
+        tcp_send_queued_fin(s);
+    }
 
     /* We need to do a bit more processing in certain states... */
     switch(s->state) {
@@ -2737,7 +3478,7 @@ static int process_pkt(netif_t *src, const struct in6_addr *srca,
             /* If the FIN has been acked, go to TIME-WAIT */
             if(ack == s->data.snd.nxt) {
                 s->state = TCP_STATE_TIME_WAIT;
-                s->data.timer = timer_ms_gettime64();
+                tcp_timer_arm(s, TCP_TIMER_2MSL, 2 * TCP_DEFAULT_MSL);
                 break;
             }
             else {
@@ -2749,6 +3490,7 @@ static int process_pkt(netif_t *src, const struct in6_addr *srca,
             /* If the FIN has been acked, go to CLOSED */
             if(ack == s->data.snd.nxt) {
                 s->state = TCP_STATE_CLOSED;
+                tcp_timer_closed(s);
                 return 0;
             }
 
@@ -2756,7 +3498,7 @@ static int process_pkt(netif_t *src, const struct in6_addr *srca,
 
         case TCP_STATE_TIME_WAIT:
             /* ACK the FIN again, and restart the timer */
-            s->data.timer = timer_ms_gettime64();
+            tcp_timer_arm(s, TCP_TIMER_2MSL, 2 * TCP_DEFAULT_MSL);
             tcp_send_ack(s);
             break;
     }
@@ -2818,11 +3560,11 @@ static int process_pkt(netif_t *src, const struct in6_addr *srca,
                 __poll_event_trigger(s->sock, POLLRDNORM);
                 cond_signal(&s->data.recv_cv);
 
-                /* Delayed ACK: ACK every 2nd in-order segment to
+                /* Delayed ACK: ACK every 8th in-order segment to
                    reduce TX load on the RX thread (each ACK TX takes
                    ~150us during which RX is blocked, risking RTL8139
                    buffer overflow). Pending ACKs are flushed by the
-                   10ms timer in tcp_thd_cb. Also ACK immediately
+                   delayed ACK timer. Also ACK immediately
                    after consuming OOO segments (big jump in rcv.nxt
                    tells the sender to stop retransmitting). */
                 s->data.ack_pending++;
@@ -2830,6 +3572,9 @@ static int process_pkt(netif_t *src, const struct in6_addr *srca,
                     tcp_send_ack(s);
                     s->data.ack_pending = 0;
                 }
+                else if(!s->timers[TCP_TIMER_DELACK]) {
+                    tcp_timer_arm(s, TCP_TIMER_DELACK, TCP_DELACK_MS);
+                }
             }
             else if(SEQ_GT(seq, s->data.rcv.nxt)) {
                 /* --- Out-of-order segment: buffer for reassembly --- */
@@ -2880,11 +3625,11 @@ static int process_pkt(netif_t *src, const struct in6_addr *srca,
 
             case TCP_STATE_FIN_WAIT_2:
                 s->state = TCP_STATE_TIME_WAIT;
-                s->data.timer = timer_ms_gettime64();
+                tcp_timer_arm(s, TCP_TIMER_2MSL, 2 * TCP_DEFAULT_MSL);
                 break;
 
             case TCP_STATE_TIME_WAIT:
-                s->data.timer = timer_ms_gettime64();
+                tcp_timer_arm(s, TCP_TIMER_2MSL, 2 * TCP_DEFAULT_MSL);
                 break;
         }
     }
@@ -2930,6 +3675,16 @@ static int net_tcp_input(netif_t *src, int domain, const void *hdr,
 
     tcp = (const tcp_hdr_t *)data;
 
+    /* Make sure there's a whole header in there, options included. */
+    if(size < sizeof(tcp_hdr_t))
+        return 0;
+
+    flags = ntohs(tcp->off_flags);
+
+    if(TCP_GET_OFFSET(flags) < sizeof(tcp_hdr_t) ||
+       TCP_GET_OFFSET(flags) > size)
+        return 0;
+
     /* Check the TCP checksum */
     c = net_ipv6_checksum_pseudo(&srca, &dsta, size, IPPROTO_TCP);
     c = net_ipv4_checksum(data, size, c);
@@ -2940,8 +3695,6 @@ static int net_tcp_input(netif_t *src, int domain, const void *hdr,
         return 0;
     }
 
-    flags = ntohs(tcp->off_flags);
-
     if(rwsem_read_lock_irqsafe(&tcp_sem))
         return -1;
 
@@ -2994,88 +3747,124 @@ static int net_tcp_input(netif_t *src, int domain, const void *hdr,
     return 0;
 }
 
-static void net_tcp_job(workqueue_t *wq, workqueue_job_t *job) {
-    struct tcp_sock *i, *tmp;
-    uint64_t timer;
+/* The retransmission timer expired. Depending on the state, that means resending
+   our SYN, data that hasn't been acked, or probing a closed window. */
+static void tcp_timer_rexmt(struct tcp_sock *sock) {
+    struct ccrec *cc = &sock->data.cc;
 
-    rwsem_read_lock(&tcp_sem);
+    switch(sock->state) {
+        case TCP_STATE_SYN_SENT:
+        case TCP_STATE_SYN_RECEIVED:
+            tcp_send_syn(sock, sock->state == TCP_STATE_SYN_RECEIVED);
+            cc->rto = MIN(cc->rto * 2, TCP_MAX_RTO);
+            cc->rtt_time = 0;
+            tcp_timer_arm(sock, TCP_TIMER_REXMT, cc->rto);
+            break;
 
-    LIST_FOREACH(i, &tcp_socks, sock_list) {
-        mutex_lock_scoped(&i->mutex);
-        timer = timer_ms_gettime64();
+        case TCP_STATE_ESTABLISHED:
+        case TCP_STATE_CLOSE_WAIT:
+            if(sock->data.sndbuf_cur_sz)
+                tcp_rto(sock);
 
-        switch(i->state) {
-            case TCP_STATE_LISTEN:
-                break;
+            break;
+    }
+}
 
-            case TCP_STATE_SYN_SENT:
+static void tcp_timer_keep(struct tcp_sock *sock, uint64_t now) {
+    uint64_t idle = (uint64_t)sock->keepidle * 1000;
 
-                /* If our last <SYN> was sent more than one  retransmission
-                   timeout period ago and we are still in the SYN-SENT state,
-                   send another one. */
-                if(i->data.timer + TCP_DEFAULT_RTTO <= timer) {
-                    tcp_send_syn(i, 0);
-                    i->data.timer = timer;
-                }
+    if(!(sock->intflags & TCP_IFLAG_KEEPALIVE) ||
+       (sock->state != TCP_STATE_ESTABLISHED &&
+        sock->state != TCP_STATE_CLOSE_WAIT))
+        return;
 
-                break;
+    /* The timer isn't moved for every segment that comes in, so see if there
+       really wasn't anything for the whole idle time. */
+    if(sock->data.last_rcv + idle > now) {
+        sock->data.keep_probes = 0;
+        tcp_timer_arm(sock, TCP_TIMER_KEEP,
+                      (uint32_t)(sock->data.last_rcv + idle - now));
+        return;
+    }
 
-            case TCP_STATE_SYN_RECEIVED:
+    if(sock->data.keep_probes >= sock->keepcnt) {
+        /* The other side is gone. Drop the connection. */
+        tcp_rst(sock->data.net, &sock->local_addr.sin6_addr,
+                &sock->remote_addr.sin6_addr, sock->local_addr.sin6_port,
+                sock->remote_addr.sin6_port, TCP_FLAG_ACK | TCP_FLAG_RST,
+                sock->data.snd.nxt, sock->data.rcv.nxt);
+        sock->state = TCP_STATE_RESET | TCP_STATE_CLOSED;
+        tcp_timer_closed(sock);
+        __poll_event_trigger(sock->sock, POLLHUP);
+        cond_signal(&sock->data.recv_cv);
+        cond_signal(&sock->data.send_cv);
+        return;
+    }
 
-                /* If our last <SYN,ACK> was sent more than one  retransmission
-                   timeout period ago and we are still in the SYN-RECEIVED
-                   state, send another one. */
-                if(i->data.timer + TCP_DEFAULT_RTTO <= timer) {
-                    tcp_send_syn(i, 1);
-                    i->data.timer = timer;
-                }
+    tcp_send_keepalive(sock);
+    ++sock->data.keep_probes;
+    tcp_timer_arm(sock, TCP_TIMER_KEEP, sock->keepintvl * 1000);
+}
 
-                break;
+/* Run the timers of a socket that have expired, and requeue it for the next
+   one. Returns nonzero if the socket should be freed. */
+static int tcp_timer_expire(struct tcp_sock *sock, uint64_t now) {
+    uint64_t next = 0;
+    int i;
 
-            case TCP_STATE_TIME_WAIT:
+    for(i = 0; i < TCP_TIMER_COUNT; ++i) {
+        if(!sock->timers[i] || sock->timers[i] > now)
+            continue;
 
-                /* If the TIME-WAIT timer has expired, then clean up the rest of
-                   the connection (the fd was already taken care of by a close()
-                   call earlier that ended up putting us in this state). */
-                if(i->data.timer + 2 * TCP_DEFAULT_MSL <= timer)
-                    i->state = TCP_STATE_CLOSED;
+        sock->timers[i] = 0;
 
+        switch(i) {
+            case TCP_TIMER_REXMT:
+                tcp_timer_rexmt(sock);
                 break;
 
-            case TCP_STATE_ESTABLISHED:
-            case TCP_STATE_CLOSE_WAIT:
-
-                /* Flush pending delayed ACK. Without this, a single
-                   unACKed segment stalls the sender indefinitely. */
-                if(i->data.ack_pending > 0) {
-                    tcp_send_ack(i);
-                    i->data.ack_pending = 0;
+            case TCP_TIMER_DELACK:
+                /* Without this, a single unacked segment could stall the
+                   other side until it times out. */
+                if(sock->data.ack_pending > 0) {
+                    tcp_send_ack(sock);
+                    sock->data.ack_pending = 0;
                 }
 
-                if(i->data.sndbuf_cur_sz &&
-                        i->data.timer + TCP_DEFAULT_RTTO <= timer) {
-                    tcp_send_data(i, 1);
-                }
-                else if(!i->data.sndbuf_cur_sz &&
-                        (i->intflags & TCP_IFLAG_QUEUEDCLOSE)) {
-                    if(i->state == TCP_STATE_ESTABLISHED) {
-                        i->state = TCP_STATE_FIN_WAIT_1;
-                    }
-                    else {
-                        i->state = TCP_STATE_CLOSING;
-                    }
+                break;
 
-                    tcp_send_fin_ack(i);
-                    ++i->data.snd.nxt;
-                }
+            case TCP_TIMER_KEEP:
+                tcp_timer_keep(sock, now);
+                break;
+
+            case TCP_TIMER_2MSL:
+                /* If the TIME-WAIT timer has expired, then clean up the rest
+                   of the connection (the fd was already taken care of by a
+                   close() call earlier that ended up putting us in this
+                   state). */
+                if(sock->state == TCP_STATE_TIME_WAIT)
+                    sock->state = TCP_STATE_CLOSED;
 
                 break;
         }
     }
 
-    rwsem_read_unlock(&tcp_sem);
+    for(i = 0; i < TCP_TIMER_COUNT; ++i) {
+        if(sock->timers[i] && (!next || sock->timers[i] < next))
+            next = sock->timers[i];
+    }
+
+    if(next)
+        tcp_timer_enqueue(sock, next);
+
+    return (sock->intflags & TCP_IFLAG_CANBEDEL) &&
+           (sock->state & 0x0F) == TCP_STATE_CLOSED;
+}
+
+/* Free the sockets that are closed on both ends. */
+static void tcp_reap(void) {
+    struct tcp_sock *i, *tmp;
 
-    /* Go through and clean up any sockets that need to be destroyed. */
     rwsem_write_lock(&tcp_sem);
 
     i = LIST_FIRST(&tcp_socks);
@@ -3086,6 +3875,8 @@ static void net_tcp_job(workqueue_t *wq, workqueue_job_t *job) {
         if((i->intflags & TCP_IFLAG_CANBEDEL) &&
                 (i->state & 0x0F) == TCP_STATE_CLOSED) {
             LIST_REMOVE(i, sock_list);
+            tcp_unhash(i);
+            tcp_timer_clear(i);
             cond_destroy(&i->data.send_cv);
             cond_destroy(&i->data.recv_cv);
             mutex_destroy(&i->mutex);
@@ -3098,10 +3889,65 @@ static void net_tcp_job(workqueue_t *wq, workqueue_job_t *job) {
     }
 
     rwsem_write_unlock(&tcp_sem);
+}
+
+/* Body of the timer thread. This runs the timers that are due, then sleeps
+   until the next one is, or until an earlier one gets armed. It returns when
+   there are no timers left, and gets woken up again by the next one. */
+static void tcp_timer_thread(void *d) {
+    struct tcp_sock *s;
+    uint64_t now;
+    uint32_t flags;
+    int reap;
+
+    (void)d;
 
-    /* Reprogram the workqueue job */
-    job->time_ms = timer_ms_gettime64() + TCP_POLL_PERIOD_MS;
-    workqueue_enqueue(wq, job);
+    while(!tcp_timer_quit) {
+        reap = 0;
+
+        rwsem_read_lock(&tcp_sem);
+        now = timer_ms_gettime64();
+
+        for(;;) {
+            flags = irq_disable();
+            s = TAILQ_FIRST(&tcp_timerq);
+
+            if(!s || s->timer_due > now) {
+                irq_restore(flags);
+                break;
+            }
+
+            TAILQ_REMOVE(&tcp_timerq, s, timer_list);
+            s->timer_due = 0;
+            irq_restore(flags);
+
+            mutex_lock(&s->mutex);
+            reap |= tcp_timer_expire(s, now);
+            mutex_unlock(&s->mutex);
+        }
+
+        rwsem_read_unlock(&tcp_sem);
+
+        if(reap)
+            tcp_reap();
+
+        /* Check the queue with IRQs off, so that a timer armed from here on
+           wakes us up. */
+        flags = irq_disable();
+        s = TAILQ_FIRST(&tcp_timerq);
+
+        if(!s) {
+            irq_restore(flags);
+            break;
+        }
+
+        now = timer_ms_gettime64();
+
+        if(s->timer_due > now && !tcp_timer_quit)
+            genwait_wait(&tcp_timerq, "TCP timers", (int)(s->timer_due - now));
+
+        irq_restore(flags);
+    }
 }
 
 /* Protocol handler for fs_socket. */
@@ -3125,16 +3971,22 @@ static fs_socket_proto_t proto = {
     net_tcp_getsockname,                /* getsockname */
     net_tcp_getpeername,                /* getpeername */
     net_tcp_fcntl,                      /* fcntl */
-    net_tcp_poll                        /* poll */
+    net_tcp_poll,                       /* poll */
+    NULL,                               /* recvmmsg */
+    NULL                                /* sendmmsg */
 };
 
-static workqueue_job_t net_tcp_wq_job = {
-    .cb = net_tcp_job,
+static const kthread_attr_t tcp_timer_attr = {
+    .label = "tcp-timers",
 };
 
 int net_tcp_init(void) {
-    net_tcp_wq_job.time_ms = timer_ms_gettime64() + TCP_POLL_PERIOD_MS;
-    workqueue_enqueue(net_wq, &net_tcp_wq_job);
+    tcp_timer_quit = 0;
+    tcp_timer_worker = thd_worker_create_ex(&tcp_timer_attr, tcp_timer_thread,
+                                            NULL);
+
+    if(!tcp_timer_worker)
+        return -1;
 
     return fs_socket_proto_add(&proto);
 }
@@ -3142,8 +3994,13 @@ int net_tcp_init(void) {
 void net_tcp_shutdown(void) {
     struct tcp_sock *i, *tmp;
 
-    /* Cancel the job and make sure we can grab the lock */
-    workqueue_cancel(net_wq, &net_tcp_wq_job);
+    /* Stop the timer thread and make sure we can grab the lock */
+    if(tcp_timer_worker) {
+        tcp_timer_quit = 1;
+        genwait_wake_all(&tcp_timerq);
+        thd_worker_destroy(tcp_timer_worker);
+        tcp_timer_worker = NULL;
+    }
 
     /* Disable IRQs so we can kill the sockets in peace... */
     irq_disable_scoped();
@@ -3159,6 +4016,7 @@ void net_tcp_shutdown(void) {
         }
         else {
             LIST_REMOVE(i, sock_list);
+            tcp_unhash(i);
             cond_destroy(&i->data.send_cv);
             cond_destroy(&i->data.recv_cv);
             mutex_destroy(&i->mutex);
@@ -3171,6 +4029,7 @@ void net_tcp_shutdown(void) {
     }
 
     LIST_INIT(&tcp_socks);
+    TAILQ_INIT(&tcp_timerq);
 
     /* Remove us from fs_socket and clean up the semaphore */
     fs_socket_proto_remove(&proto);
@@ -5,6 +5,7 @@
 
 */
 
+#include <assert.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
@@ -21,8 +22,10 @@
 #include <netinet/udp.h>
 #include <netinet/udplite.h>
 
+#include "net_core.h"
 #include "net_ipv4.h"
 #include "net_ipv6.h"
+#include "net_pbuf.h"
 
 #if __GNUC__ >= 9
 #pragma GCC diagnostic push
@@ -32,6 +35,25 @@
 /* Default hop limit (or ttl for IPv4) for new sockets */
 #define UDP_DEFAULT_HOPS    64
 
+/* Number of buckets in the table of bound sockets. Must be a power of two. */
+#define UDP_PORT_HASH_SIZE  64
+
+/* Range of local ports picked for sockets that aren't bound to one, as
+   suggested by RFC 6335 */
+#define UDP_EPHEMERAL_MIN   49152
+#define UDP_EPHEMERAL_MAX   65535
+
+/* Receive buffer sizes (SO_RCVBUF). This is how much packet buffer memory the
+   datagrams waiting on a socket may hold before new ones get dropped. */
+#define UDP_DEFAULT_RCVBUF  32768
+#define UDP_MIN_RCVBUF      2048
+#define UDP_MAX_RCVBUF      (1024 * 1024)
+
+/* Pool buffers one socket may hold on to. Past this, its datagrams are copied
+   to the heap, so that a socket that isn't being read can't take the whole
+   pool away from everything else. */
+#define UDP_POOL_QUOTA      ((NET_PBUF_POOL_SIZE - NET_PBUF_RX_RESERVE) / 4)
+
 typedef struct {
     uint16_t src_port __packed;
     uint16_t dst_port __packed;
@@ -39,20 +61,27 @@ typedef struct {
     uint16_t checksum __packed;
 } udp_hdr_t;
 
+/* Received datagrams are queued in the packet buffers they came in, with this
+   in the scratch space of each buffer. */
 struct udp_pkt {
-    TAILQ_ENTRY(udp_pkt) pkt_queue;
     struct sockaddr_in6 from;
-    uint8_t *data;
+    const uint8_t *data;
     uint16_t datasize;
 };
 
-TAILQ_HEAD(udp_pkt_queue, udp_pkt);
+static_assert(sizeof(struct udp_pkt) <= sizeof(((net_pbuf_t *)0)->cb),
+              "struct udp_pkt doesn't fit in a packet buffer");
+
+#define UDP_PKT(pb) ((struct udp_pkt *)(pb)->cb)
+
+TAILQ_HEAD(udp_pkt_queue, net_pbuf);
 
 #define UDPSOCK_NO_CHECKSUM 0x00000001
 #define UDPSOCK_LITE_RCVCOV 0x00000002
 
 struct udp_sock {
     LIST_ENTRY(udp_sock) sock_list;
+    LIST_ENTRY(udp_sock) port_list;     /* In udp_ports, once bound */
     struct sockaddr_in6 local_addr;
     struct sockaddr_in6 remote_addr;
 
@@ -69,6 +98,9 @@ struct udp_sock {
     } udp_lite;
 
     struct udp_pkt_queue packets;
+    size_t rcvbuf;                      /* Limit on the memory queued */
+    size_t rcvqueued;                   /* Memory held by packets */
+    int pool_held;                      /* Pool buffers held by packets */
 };
 
 LIST_HEAD(udp_sock_list, udp_sock);
@@ -77,10 +109,62 @@ static struct udp_sock_list net_udp_sockets = LIST_HEAD_INITIALIZER(0);
 static mutex_t udp_mutex = MUTEX_INITIALIZER;
 static net_udp_stats_t udp_stats = { 0 };
 
+/* Every socket with a local port is also in here, hashed by that port, so that
+   incoming packets and bind() only have to look at the sockets that might be
+   using the port. Protected by udp_mutex, like the list itself. */
+static struct udp_sock_list udp_ports[UDP_PORT_HASH_SIZE];
+
+static inline struct udp_sock_list *udp_port_bucket(uint16_t port) {
+    return &udp_ports[ntohs(port) & (UDP_PORT_HASH_SIZE - 1)];
+}
+
+/* Set the local port of a socket (in network byte order), and move it to the
+   matching bucket. */
+static void udp_set_port(struct udp_sock *sock, uint16_t port) {
+    if(sock->local_addr.sin6_port)
+        LIST_REMOVE(sock, port_list);
+
+    sock->local_addr.sin6_port = port;
+
+    if(port)
+        LIST_INSERT_HEAD(udp_port_bucket(port), sock, port_list);
+}
+
+static int udp_port_in_use(uint16_t port, const struct udp_sock *self) {
+    struct udp_sock *i;
+
+    LIST_FOREACH(i, udp_port_bucket(port), port_list) {
+        if(i != self && i->local_addr.sin6_port == port)
+            return 1;
+    }
+
+    return 0;
+}
+
+/* Pick a free local port (in network byte order), or return 0 if they're all
+   taken. The search picks up where the last one stopped, so it normally ends
+   with the first port it looks at. */
+static uint16_t udp_ephemeral_port(void) {
+    static uint16_t next = UDP_EPHEMERAL_MIN;
+    uint32_t tries;
+    uint16_t port;
+
+    for(tries = 0; tries <= UDP_EPHEMERAL_MAX - UDP_EPHEMERAL_MIN; ++tries) {
+        port = next;
+        next = port == UDP_EPHEMERAL_MAX ? UDP_EPHEMERAL_MIN : port + 1;
+
+        if(!udp_port_in_use(htons(port), NULL))
+            return htons(port);
+    }
+
+    return 0;
+}
+
 static int net_udp_send_raw(netif_t *net, const struct sockaddr_in6 *src,
-                            const struct sockaddr_in6 *dst, const uint8_t *data,
-                            size_t size, uint32_t flags, int hops,
-                            uint32_t iflags, int proto, uint16_t cscov);
+                            const struct sockaddr_in6 *dst,
+                            const struct iovec *iov, int iovcnt, size_t size,
+                            uint32_t flags, int hops, uint32_t iflags,
+                            int proto, uint16_t cscov);
 
 static int net_udp_accept(net_socket_t *hnd, struct sockaddr *addr,
                           socklen_t *addr_len) {
@@ -93,7 +177,7 @@ static int net_udp_accept(net_socket_t *hnd, struct sockaddr *addr,
 
 static int net_udp_bind(net_socket_t *hnd, const struct sockaddr *addr,
                         socklen_t addr_len) {
-    struct udp_sock *udpsock, *iter;
+    struct udp_sock *udpsock;
     struct sockaddr_in *realaddr4;
     struct sockaddr_in6 realaddr6;
 
@@ -166,38 +250,20 @@ static int net_udp_bind(net_socket_t *hnd, const struct sockaddr *addr,
     if(realaddr6.sin6_port != 0) {
         /* Make sure we don't already have a socket bound to the port
            specified */
-        LIST_FOREACH(iter, &net_udp_sockets, sock_list) {
-            if(iter == udpsock)
-                continue;
-
-            if(iter->local_addr.sin6_port == realaddr6.sin6_port) {
-                mutex_unlock(&udp_mutex);
-                errno = EADDRINUSE;
-                return -1;
-            }
+        if(udp_port_in_use(realaddr6.sin6_port, udpsock)) {
+            mutex_unlock(&udp_mutex);
+            errno = EADDRINUSE;
+            return -1;
         }
-
-        udpsock->local_addr = realaddr6;
     }
-    else {
-        uint16_t port = 1024, tmp = 0;
-
-        /* Grab the first unused port >= 1024. This is, unfortunately, O(n^2) */
-        while(tmp != port) {
-            tmp = port;
-
-            LIST_FOREACH(iter, &net_udp_sockets, sock_list) {
-                if(iter->local_addr.sin6_port == port) {
-                    ++port;
-                    break;
-                }
-            }
-        }
-
-        udpsock->local_addr = realaddr6;
-        udpsock->local_addr.sin6_port = htons(port);
+    else if(!(realaddr6.sin6_port = udp_ephemeral_port())) {
+        mutex_unlock(&udp_mutex);
+        errno = EADDRINUSE;
+        return -1;
     }
 
+    udp_set_port(udpsock, realaddr6.sin6_port);
+    udpsock->local_addr = realaddr6;
     udpsock->sock = hnd->fd;
 
     mutex_unlock(&udp_mutex);
@@ -304,11 +370,87 @@ static int net_udp_listen(net_socket_t *hnd, int backlog) {
     return -1;
 }
 
-static ssize_t net_udp_recvfrom(net_socket_t *hnd, void *buffer, size_t length,
-                                int flags, struct sockaddr *addr,
-                                socklen_t *addr_len) {
+/* Take a received datagram off of a socket's queue and free it. */
+static void udp_dequeue(struct udp_sock *sock, net_pbuf_t *pb) {
+    TAILQ_REMOVE(&sock->packets, pb, pkt_queue);
+    sock->rcvqueued -= pb->size;
+
+    if(!pb->heap)
+        --sock->pool_held;
+
+    net_pbuf_free(pb);
+}
+
+/* Store the address a datagram came from in the form the socket uses. */
+static void udp_get_addr(const struct udp_sock *sock,
+                         const struct sockaddr_in6 *from,
+                         struct sockaddr *addr, socklen_t *addr_len) {
+    if(sock->domain == AF_INET) {
+        struct sockaddr_in realaddr;
+
+        memset(&realaddr, 0, sizeof(struct sockaddr_in));
+        realaddr.sin_family = AF_INET;
+        realaddr.sin_addr.s_addr = from->sin6_addr.__s6_addr.__s6_addr32[3];
+        realaddr.sin_port = from->sin6_port;
+
+        if(*addr_len < sizeof(struct sockaddr_in)) {
+            memcpy(addr, &realaddr, *addr_len);
+        }
+        else {
+            memcpy(addr, &realaddr, sizeof(struct sockaddr_in));
+            *addr_len = sizeof(struct sockaddr_in);
+        }
+    }
+    else if(sock->domain == AF_INET6) {
+        struct sockaddr_in6 realaddr6;
+
+        memset(&realaddr6, 0, sizeof(struct sockaddr_in6));
+        realaddr6.sin6_family = AF_INET6;
+        realaddr6.sin6_addr = from->sin6_addr;
+        realaddr6.sin6_port = from->sin6_port;
+
+        if(*addr_len < sizeof(struct sockaddr_in6)) {
+            memcpy(addr, &realaddr6, *addr_len);
+        }
+        else {
+            memcpy(addr, &realaddr6, sizeof(struct sockaddr_in6));
+            *addr_len = sizeof(struct sockaddr_in6);
+        }
+    }
+}
+
+/* Copy a received datagram out into the buffers of a message. Returns the
+   number of bytes copied. */
+static size_t udp_get_msg(const struct udp_sock *sock,
+                          const struct udp_pkt *pkt, struct msghdr *msg) {
+    const uint8_t *data = pkt->data;
+    size_t left = pkt->datasize, len;
+    int i;
+
+    for(i = 0; i < msg->msg_iovlen && left; ++i) {
+        len = msg->msg_iov[i].iov_len < left ? msg->msg_iov[i].iov_len : left;
+        memcpy(msg->msg_iov[i].iov_base, data, len);
+        data += len;
+        left -= len;
+    }
+
+    if(msg->msg_name)
+        udp_get_addr(sock, &pkt->from, (struct sockaddr *)msg->msg_name,
+                     &msg->msg_namelen);
+
+    msg->msg_controllen = 0;
+    msg->msg_flags = left ? MSG_TRUNC : 0;
+
+    return pkt->datasize - left;
+}
+
+/* Receive up to vlen datagrams, taking the lock once for the lot rather than
+   once per datagram. This backs recvfrom() as well. */
+static int net_udp_recvmmsg(net_socket_t *hnd, struct mmsghdr *msgvec,
+                            unsigned int vlen, int flags) {
     struct udp_sock *udpsock;
-    struct udp_pkt *pkt;
+    net_pbuf_t *pb, *next;
+    unsigned int i, count = 0;
 
     if(mutex_lock_irqsafe(&udp_mutex))
         return -1;
@@ -326,96 +468,114 @@ static ssize_t net_udp_recvfrom(net_socket_t *hnd, void *buffer, size_t length,
         return 0;
     }
 
-    if(buffer == NULL || (addr != NULL && addr_len == NULL)) {
-        mutex_unlock(&udp_mutex);
-        errno = EFAULT;
-        return -1;
+    for(i = 0; i < vlen; ++i) {
+        if(msgvec[i].msg_hdr.msg_iovlen < 0 ||
+           (msgvec[i].msg_hdr.msg_iovlen && !msgvec[i].msg_hdr.msg_iov)) {
+            mutex_unlock(&udp_mutex);
+            errno = EFAULT;
+            return -1;
+        }
     }
 
-    if(TAILQ_EMPTY(&udpsock->packets) &&
-       ((udpsock->flags & FS_SOCKET_NONBLOCK) || (flags & MSG_DONTWAIT) ||
-        irq_inside_int())) {
-        mutex_unlock(&udp_mutex);
-        errno = EWOULDBLOCK;
-        return -1;
-    }
+    for(;;) {
+        /* Take everything that's there, up to what was asked for. When
+           peeking, the datagrams stay put, so skip the ones we've already
+           looked at. That's done by counting rather than by keeping hold of
+           a pointer into the queue, as another reader can take datagrams off
+           of it (and free them) while we sleep. */
+        pb = TAILQ_FIRST(&udpsock->packets);
 
-    while(TAILQ_EMPTY(&udpsock->packets)) {
-        mutex_unlock(&udp_mutex);
-        genwait_wait(udpsock, "net_udp_recvfrom", 0);
-        mutex_lock(&udp_mutex);
-    }
+        if(flags & MSG_PEEK) {
+            for(i = 0; pb && i < count; ++i)
+                pb = TAILQ_NEXT(pb, pkt_queue);
+        }
 
-    pkt = TAILQ_FIRST(&udpsock->packets);
+        while(count < vlen && pb) {
+            next = TAILQ_NEXT(pb, pkt_queue);
+            msgvec[count].msg_len = udp_get_msg(udpsock, UDP_PKT(pb),
+                                                &msgvec[count].msg_hdr);
+            ++count;
 
-    if(pkt->datasize > length) {
-        memcpy(buffer, pkt->data, length);
-    }
-    else {
-        memcpy(buffer, pkt->data, pkt->datasize);
-        length = pkt->datasize;
-    }
+            if(!(flags & MSG_PEEK))
+                udp_dequeue(udpsock, pb);
 
-    if(addr != NULL) {
-        if(udpsock->domain == AF_INET) {
-            struct sockaddr_in realaddr;
+            pb = next;
+        }
 
-            memset(&realaddr, 0, sizeof(struct sockaddr_in));
-            realaddr.sin_family = AF_INET;
-            realaddr.sin_addr.s_addr =
-                pkt->from.sin6_addr.__s6_addr.__s6_addr32[3];
-            realaddr.sin_port = pkt->from.sin6_port;
+        if(count == vlen || (count && (flags & MSG_WAITFORONE)))
+            break;
 
-            if(*addr_len < sizeof(struct sockaddr_in)) {
-                memcpy(addr, &realaddr, *addr_len);
-            }
-            else {
-                memcpy(addr, &realaddr, sizeof(struct sockaddr_in));
-                *addr_len = sizeof(struct sockaddr_in);
+        if((udpsock->flags & FS_SOCKET_NONBLOCK) || (flags & MSG_DONTWAIT) ||
+           irq_inside_int()) {
+            if(!count) {
+                mutex_unlock(&udp_mutex);
+                errno = EWOULDBLOCK;
+                return -1;
             }
+
+            break;
         }
-        else if(udpsock->domain == AF_INET6) {
-            struct sockaddr_in6 realaddr6;
 
-            memset(&realaddr6, 0, sizeof(struct sockaddr_in6));
-            realaddr6.sin6_family = AF_INET6;
-            realaddr6.sin6_addr = pkt->from.sin6_addr;
-            realaddr6.sin6_port = pkt->from.sin6_port;
+        mutex_unlock(&udp_mutex);
+        genwait_wait(udpsock, "net_udp_recvmmsg", 0);
+        mutex_lock(&udp_mutex);
 
-            if(*addr_len < sizeof(struct sockaddr_in6)) {
-                memcpy(addr, &realaddr6, *addr_len);
-            }
-            else {
-                memcpy(addr, &realaddr6, sizeof(struct sockaddr_in6));
-                *addr_len = sizeof(struct sockaddr_in6);
-            }
-        }
+        if(udpsock->flags & (SHUT_RD << 24))
+            break;
     }
 
-    /* Remove the packet if we're pulling data out of the queue. */
-    if(!(flags & MSG_PEEK)) {
-        TAILQ_REMOVE(&udpsock->packets, pkt, pkt_queue);
-        free(pkt->data);
-        free(pkt);
+    mutex_unlock(&udp_mutex);
+
+    return count;
+}
+
+static ssize_t net_udp_recvfrom(net_socket_t *hnd, void *buffer, size_t length,
+                                int flags, struct sockaddr *addr,
+                                socklen_t *addr_len) {
+    struct iovec iov = { buffer, length };
+    struct mmsghdr msg;
+    int rv;
+
+    if(buffer == NULL || (addr != NULL && addr_len == NULL)) {
+        errno = EFAULT;
+        return -1;
     }
 
-    mutex_unlock(&udp_mutex);
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_hdr.msg_iov = &iov;
+    msg.msg_hdr.msg_iovlen = 1;
+
+    if(addr) {
+        msg.msg_hdr.msg_name = addr;
+        msg.msg_hdr.msg_namelen = *addr_len;
+    }
 
-    return length;
+    rv = net_udp_recvmmsg(hnd, &msg, 1, flags & ~MSG_WAITFORONE);
+
+    if(rv <= 0)
+        return rv;
+
+    if(addr)
+        *addr_len = msg.msg_hdr.msg_namelen;
+
+    return msg.msg_len;
 }
 
-static ssize_t net_udp_sendto(net_socket_t *hnd, const void *message,
-                              size_t length, int flags,
-                              const struct sockaddr *addr, socklen_t addr_len) {
-    struct udp_sock *udpsock;
-    struct sockaddr_in *realaddr;
-    struct sockaddr_in6 realaddr6;
-    uint32_t sflags, iflags;
-    int hops, proto;
-    uint16_t cscov;
+/* What's needed to send on a socket, copied out while holding the lock so
+   that the datagrams can be built and sent without it. */
+struct udp_send_state {
     struct sockaddr_in6 local_addr;
+    struct sockaddr_in6 remote_addr;
+    uint32_t flags;
+    uint32_t int_flags;
+    int domain;
+    int proto;
+    int hop_limit;
+    uint16_t cscov;
+};
 
-    (void)flags;
+static int udp_send_begin(net_socket_t *hnd, struct udp_send_state *st) {
+    struct udp_sock *udpsock;
 
     if(mutex_lock_irqsafe(&udp_mutex))
         return -1;
@@ -432,89 +592,170 @@ static ssize_t net_udp_sendto(net_socket_t *hnd, const void *message,
         goto err;
     }
 
-    if(!IN6_IS_ADDR_UNSPECIFIED(&udpsock->remote_addr.sin6_addr) &&
-       udpsock->remote_addr.sin6_port != 0) {
+    if(udpsock->local_addr.sin6_port == 0) {
+        udp_set_port(udpsock, udp_ephemeral_port());
+
+        if(udpsock->local_addr.sin6_port == 0) {
+            errno = EADDRNOTAVAIL;
+            goto err;
+        }
+    }
+
+    st->local_addr = udpsock->local_addr;
+    st->remote_addr = udpsock->remote_addr;
+    st->flags = udpsock->flags;
+    st->int_flags = udpsock->int_flags;
+    st->domain = udpsock->domain;
+    st->proto = udpsock->proto;
+    st->hop_limit = udpsock->hop_limit;
+    st->cscov = udpsock->udp_lite.send_cscov;
+    mutex_unlock(&udp_mutex);
+
+    return 0;
+
+err:
+    mutex_unlock(&udp_mutex);
+    return -1;
+}
+
+/* Work out where a datagram is going, from the address given to send it to
+   or the one the socket is connected to. */
+static int udp_send_dest(const struct udp_send_state *st,
+                         const struct sockaddr *addr, socklen_t addr_len,
+                         struct sockaddr_in6 *realaddr6) {
+    const struct sockaddr_in *realaddr;
+
+    if(!IN6_IS_ADDR_UNSPECIFIED(&st->remote_addr.sin6_addr) &&
+       st->remote_addr.sin6_port != 0) {
         if(addr) {
             errno = EISCONN;
-            goto err;
+            return -1;
         }
 
-        realaddr6 = udpsock->remote_addr;
+        *realaddr6 = st->remote_addr;
     }
     else if(addr == NULL) {
         errno = EDESTADDRREQ;
-        goto err;
+        return -1;
     }
-    else if(addr->sa_family != udpsock->domain) {
+    else if(addr->sa_family != st->domain) {
         errno = EAFNOSUPPORT;
-        goto err;
+        return -1;
     }
-    else if(udpsock->domain == AF_INET6) {
+    else if(st->domain == AF_INET6) {
         if(addr_len != sizeof(struct sockaddr_in6)) {
             errno = EINVAL;
-            goto err;
+            return -1;
         }
 
-        realaddr6 = *((struct sockaddr_in6 *)addr);
+        *realaddr6 = *((const struct sockaddr_in6 *)addr);
     }
-    else if(udpsock->domain == AF_INET) {
+    else if(st->domain == AF_INET) {
         if(addr_len != sizeof(struct sockaddr_in)) {
             errno = EINVAL;
-            goto err;
+            return -1;
         }
 
-        realaddr = (struct sockaddr_in *)addr;
-        memset(&realaddr6, 0, sizeof(struct sockaddr_in6));
-        realaddr6.sin6_family = AF_INET6;
-        realaddr6.sin6_addr.__s6_addr.__s6_addr16[5] = 0xFFFF;
-        realaddr6.sin6_addr.__s6_addr.__s6_addr32[3] =
+        realaddr = (const struct sockaddr_in *)addr;
+        memset(realaddr6, 0, sizeof(struct sockaddr_in6));
+        realaddr6->sin6_family = AF_INET6;
+        realaddr6->sin6_addr.__s6_addr.__s6_addr16[5] = 0xFFFF;
+        realaddr6->sin6_addr.__s6_addr.__s6_addr32[3] =
             realaddr->sin_addr.s_addr;
-        realaddr6.sin6_port = realaddr->sin_port;
+        realaddr6->sin6_port = realaddr->sin_port;
     }
     else {
         /* Shouldn't be able to get here... */
         errno = EBADF;
-        goto err;
+        return -1;
     }
 
-    if(message == NULL) {
+    return 0;
+}
+
+static ssize_t udp_send_msg(const struct udp_send_state *st,
+                            const struct msghdr *msg) {
+    struct sockaddr_in6 realaddr6;
+    size_t size = 0;
+    int i;
+
+    if(udp_send_dest(st, (const struct sockaddr *)msg->msg_name,
+                     msg->msg_namelen, &realaddr6))
+        return -1;
+
+    if(msg->msg_iovlen < 0 || (msg->msg_iovlen && !msg->msg_iov)) {
         errno = EFAULT;
-        goto err;
+        return -1;
     }
 
-    if(udpsock->local_addr.sin6_port == 0) {
-        uint16_t port = 1024, tmp = 0;
-        struct udp_sock *iter;
-
-        /* Grab the first unused port >= 1024. This is, unfortunately, O(n^2) */
-        while(tmp != port) {
-            tmp = port;
-
-            LIST_FOREACH(iter, &net_udp_sockets, sock_list) {
-                if(iter->local_addr.sin6_port == port) {
-                    ++port;
-                    break;
-                }
-            }
+    for(i = 0; i < msg->msg_iovlen; ++i) {
+        if(!msg->msg_iov[i].iov_base && msg->msg_iov[i].iov_len) {
+            errno = EFAULT;
+            return -1;
         }
 
-        udpsock->local_addr.sin6_port = htons(port);
+        size += msg->msg_iov[i].iov_len;
     }
 
-    local_addr = udpsock->local_addr;
-    sflags = udpsock->flags;
-    iflags = udpsock->int_flags;
-    hops = udpsock->hop_limit;
-    proto = udpsock->proto;
-    cscov = udpsock->udp_lite.send_cscov;
-    mutex_unlock(&udp_mutex);
+    return net_udp_send_raw(NULL, &st->local_addr, &realaddr6, msg->msg_iov,
+                            msg->msg_iovlen, size, st->flags, st->hop_limit,
+                            st->int_flags, st->proto, st->cscov);
+}
 
-    return net_udp_send_raw(NULL, &local_addr, &realaddr6,
-                            (const uint8_t *)message, length, sflags, hops,
-                            iflags, proto, cscov);
-err:
-    mutex_unlock(&udp_mutex);
-    return -1;
+static ssize_t net_udp_sendto(net_socket_t *hnd, const void *message,
+                              size_t length, int flags,
+                              const struct sockaddr *addr, socklen_t addr_len) {
+    struct udp_send_state st;
+    struct iovec iov = { (void *)message, length };
+    struct msghdr msg;
+
+    (void)flags;
+
+    if(udp_send_begin(hnd, &st))
+        return -1;
+
+    if(message == NULL) {
+        errno = EFAULT;
+        return -1;
+    }
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = (void *)addr;
+    msg.msg_namelen = addr_len;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+
+    return udp_send_msg(&st, &msg);
+}
+
+/* Send a batch of datagrams. The socket is only looked at once, and the
+   frames are held back so that the device gets them all together. */
+static int net_udp_sendmmsg(net_socket_t *hnd, struct mmsghdr *msgvec,
+                            unsigned int vlen, int flags) {
+    struct udp_send_state st;
+    unsigned int i;
+    ssize_t rv;
+
+    (void)flags;
+
+    if(!vlen)
+        return 0;
+
+    if(udp_send_begin(hnd, &st))
+        return -1;
+
+    net_tx_begin();
+
+    for(i = 0; i < vlen; ++i) {
+        if((rv = udp_send_msg(&st, &msgvec[i].msg_hdr)) < 0)
+            break;
+
+        msgvec[i].msg_len = rv;
+    }
+
+    net_tx_end();
+
+    return i ? (int)i : -1;
 }
 
 static int net_udp_shutdownsock(net_socket_t *hnd, int how) {
@@ -571,6 +812,7 @@ static int net_udp_socket(net_socket_t *hnd, int domain, int type, int proto) {
     udpsock->domain = domain;
     udpsock->proto = proto;
     udpsock->hop_limit = UDP_DEFAULT_HOPS;
+    udpsock->rcvbuf = UDP_DEFAULT_RCVBUF;
 
     if(mutex_lock_irqsafe(&udp_mutex)) {
         free(udpsock);
@@ -586,8 +828,7 @@ static int net_udp_socket(net_socket_t *hnd, int domain, int type, int proto) {
 
 static void net_udp_close(net_socket_t *hnd) {
     struct udp_sock *udpsock;
-    struct udp_pkt *pkt;
-    struct udp_pkt *it;
+    net_pbuf_t *pb;
 
     if(mutex_lock_irqsafe(&udp_mutex))
         return;
@@ -600,17 +841,11 @@ static void net_udp_close(net_socket_t *hnd) {
         return;
     }
 
-    it = udpsock->packets.tqh_first;
-    while(it) {
-        pkt = it;
-        it = it->pkt_queue.tqe_next;
-
-        free(pkt->data);
-        TAILQ_REMOVE(&udpsock->packets, pkt, pkt_queue);
-        free(pkt);
-    }
+    while((pb = TAILQ_FIRST(&udpsock->packets)))
+        udp_dequeue(udpsock, pb);
 
     LIST_REMOVE(udpsock, sock_list);
+    udp_set_port(udpsock, 0);
 
     free(udpsock);
     mutex_unlock(&udp_mutex);
@@ -640,6 +875,10 @@ static int net_udp_getsockopt(net_socket_t *hnd, int level, int option_name,
                 case SO_TYPE:
                     tmp = SOCK_DGRAM;
                     goto copy_int;
+
+                case SO_RCVBUF:
+                    tmp = (int)sock->rcvbuf;
+                    goto copy_int;
             }
 
             break;
@@ -751,6 +990,20 @@ static int net_udp_setsockopt(net_socket_t *hnd, int level, int option_name,
                 case SO_ERROR:
                 case SO_TYPE:
                     goto ret_inval;
+
+                case SO_RCVBUF:
+                    if(option_len != sizeof(int))
+                        goto ret_inval;
+
+                    tmp = *((int *)option_value);
+
+                    if(tmp < UDP_MIN_RCVBUF)
+                        tmp = UDP_MIN_RCVBUF;
+                    else if(tmp > UDP_MAX_RCVBUF)
+                        tmp = UDP_MAX_RCVBUF;
+
+                    sock->rcvbuf = tmp;
+                    goto ret_success;
             }
 
             break;
@@ -1094,7 +1347,62 @@ static short net_udp_poll(net_socket_t *hnd, short events) {
     return rv & events;
 }
 
-extern void __poll_event_trigger(int fd, short event);
+/* Queue a received datagram on a socket. If it is in the packet buffer that is
+   being received, the socket just keeps a reference to that, otherwise it is
+   copied into a buffer of its own. A socket that already holds its share of
+   the pool (UDP_POOL_QUOTA) gets a copy on the heap instead. Either way, the
+   whole buffer counts against the socket's receive buffer size, and the
+   datagram is dropped if it doesn't fit (unless nothing else is queued, so
+   that any datagram can get through). */
+static int udp_enqueue(struct udp_sock *sock, const struct sockaddr_in6 *from,
+                       const uint8_t *data, size_t size) {
+    struct udp_pkt *pkt;
+    net_pbuf_t *pb;
+    int over = sock->pool_held >= UDP_POOL_QUOTA;
+
+    if((pb = net_pbuf_rx_hold(data, size)) && !pb->heap && over) {
+        net_pbuf_free(pb);
+        pb = NULL;
+    }
+
+    if(!pb) {
+        if(over)
+            pb = net_pbuf_alloc_heap(0, size);
+        else
+            pb = net_pbuf_alloc(0, size);
+
+        if(!pb) {
+            ++udp_stats.pkt_recv_dropped;
+            return -1;
+        }
+
+        net_pbuf_copy(pb->data, data, size);
+        data = pb->data;
+
+        if(over)
+            ++udp_stats.pkt_recv_copied;
+    }
+
+    if(sock->rcvqueued && sock->rcvqueued + pb->size > sock->rcvbuf) {
+        net_pbuf_free(pb);
+        ++udp_stats.pkt_recv_dropped;
+        return -1;
+    }
+
+    sock->rcvqueued += pb->size;
+
+    if(!pb->heap)
+        ++sock->pool_held;
+
+    pkt = UDP_PKT(pb);
+    pkt->from = *from;
+    pkt->data = data;
+    pkt->datasize = size;
+
+    TAILQ_INSERT_TAIL(&sock->packets, pb, pkt_queue);
+
+    return 0;
+}
 
 static int net_udp_input4(netif_t *src, const ip_hdr_t *ip, const uint8_t *data,
                           size_t size) {
@@ -1102,7 +1410,7 @@ static int net_udp_input4(netif_t *src, const ip_hdr_t *ip, const uint8_t *data,
     uint16_t cs, cscov = 0;
     int partial = 1;
     struct udp_sock *sock;
-    struct udp_pkt *pkt;
+    struct sockaddr_in6 from;
 
     (void)src;
 
@@ -1159,7 +1467,7 @@ static int net_udp_input4(netif_t *src, const ip_hdr_t *ip, const uint8_t *data,
         /* If the mutex is locked, there isn't much that can be done. */
         return -1;
 
-    LIST_FOREACH(sock, &net_udp_sockets, sock_list) {
+    LIST_FOREACH(sock, udp_port_bucket(hdr->dst_port), port_list) {
         /* Don't even bother looking at IPv6-only sockets */
         if(sock->domain == AF_INET6 && (sock->flags & FS_SOCKET_V6ONLY))
             continue;
@@ -1197,30 +1505,18 @@ static int net_udp_input4(netif_t *src, const ip_hdr_t *ip, const uint8_t *data,
             return 0;
         }
 
-        if(!(pkt = (struct udp_pkt *)malloc(sizeof(struct udp_pkt)))) {
-            mutex_unlock(&udp_mutex);
-            return -1;
-        }
-
-        memset(pkt, 0, sizeof(struct udp_pkt));
+        memset(&from, 0, sizeof(struct sockaddr_in6));
+        from.sin6_family = AF_INET6;
+        from.sin6_addr.__s6_addr.__s6_addr16[5] = 0xFFFF;
+        from.sin6_addr.__s6_addr.__s6_addr32[3] = ip->src;
+        from.sin6_port = hdr->src_port;
 
-        pkt->datasize = size - sizeof(udp_hdr_t);
-
-        if(!(pkt->data = (uint8_t *)malloc(pkt->datasize))) {
-            free(pkt);
+        if(udp_enqueue(sock, &from, data + sizeof(udp_hdr_t),
+                       size - sizeof(udp_hdr_t))) {
             mutex_unlock(&udp_mutex);
             return -1;
         }
 
-        pkt->from.sin6_family = AF_INET6;
-        pkt->from.sin6_addr.__s6_addr.__s6_addr16[5] = 0xFFFF;
-        pkt->from.sin6_addr.__s6_addr.__s6_addr32[3] = ip->src;
-        pkt->from.sin6_port = hdr->src_port;
-
-        memcpy(pkt->data, data + sizeof(udp_hdr_t), pkt->datasize);
-
-        TAILQ_INSERT_TAIL(&sock->packets, pkt, pkt_queue);
-
         ++udp_stats.pkt_recv;
         __poll_event_trigger(sock->sock, POLLRDNORM);
         genwait_wake_one(sock);
@@ -1241,7 +1537,7 @@ static int net_udp_input6(netif_t *src, const ipv6_hdr_t *ip, const uint8_t *dat
     uint16_t cs, cscov = 0;
     int partial = 1;
     struct udp_sock *sock;
-    struct udp_pkt *pkt;
+    struct sockaddr_in6 from;
 
     (void)src;
 
@@ -1296,7 +1592,7 @@ static int net_udp_input6(netif_t *src, const ipv6_hdr_t *ip, const uint8_t *dat
         /* If the mutex is locked, there isn't much that can be done. */
         return -1;
 
-    LIST_FOREACH(sock, &net_udp_sockets, sock_list) {
+    LIST_FOREACH(sock, udp_port_bucket(hdr->dst_port), port_list) {
         /* Don't even bother looking at IPv4 sockets */
         if(sock->domain == AF_INET)
             continue;
@@ -1334,29 +1630,17 @@ static int net_udp_input6(netif_t *src, const ipv6_hdr_t *ip, const uint8_t *dat
             return 0;
         }
 
-        if(!(pkt = (struct udp_pkt *)malloc(sizeof(struct udp_pkt)))) {
-            mutex_unlock(&udp_mutex);
-            return -1;
-        }
-
-        memset(pkt, 0, sizeof(struct udp_pkt));
-
-        pkt->datasize = size - sizeof(udp_hdr_t);
+        memset(&from, 0, sizeof(struct sockaddr_in6));
+        from.sin6_family = AF_INET6;
+        from.sin6_addr = ip->src_addr;
+        from.sin6_port = hdr->src_port;
 
-        if(!(pkt->data = (uint8_t *)malloc(pkt->datasize))) {
-            free(pkt);
+        if(udp_enqueue(sock, &from, data + sizeof(udp_hdr_t),
+                       size - sizeof(udp_hdr_t))) {
             mutex_unlock(&udp_mutex);
             return -1;
         }
 
-        pkt->from.sin6_family = AF_INET6;
-        pkt->from.sin6_addr = ip->src_addr;
-        pkt->from.sin6_port = hdr->src_port;
-
-        memcpy(pkt->data, data + sizeof(udp_hdr_t), pkt->datasize);
-
-        TAILQ_INSERT_TAIL(&sock->packets, pkt, pkt_queue);
-
         ++udp_stats.pkt_recv;
         __poll_event_trigger(sock->sock, POLLRDNORM);
         genwait_wake_one(sock);
@@ -1384,15 +1668,22 @@ static int net_udp_input(netif_t *src, int domain, const void *hdr,
     return -1;
 }
 
+/* Swap the bytes of a partial Internet checksum. */
+static inline uint16_t cs_swap(uint16_t cs) {
+    return (uint16_t)((cs << 8) | (cs >> 8));
+}
+
 /* XXX */
 static int net_udp_send_raw(netif_t *net, const struct sockaddr_in6 *src,
-                            const struct sockaddr_in6 *dst, const uint8_t *data,
-                            size_t size, uint32_t flags, int hops,
-                            uint32_t iflags, int proto, uint16_t cscov) {
-    uint8_t buf[size + sizeof(udp_hdr_t)];
-    udp_hdr_t *hdr = (udp_hdr_t *)buf;
+                            const struct sockaddr_in6 *dst,
+                            const struct iovec *iov, int iovcnt, size_t size,
+                            uint32_t flags, int hops, uint32_t iflags,
+                            int proto, uint16_t cscov) {
+    net_pbuf_t *pb;
+    uint8_t *buf, *pos;
+    udp_hdr_t *hdr;
     uint16_t cs;
-    int err;
+    int err, i, odd;
     struct in6_addr srcaddr = src->sin6_addr;
 
     (void)flags;
@@ -1433,8 +1724,16 @@ static int net_udp_send_raw(netif_t *net, const struct sockaddr_in6 *src,
         }
     }
 
-    memcpy(buf + sizeof(udp_hdr_t), data, size);
-    size += sizeof(udp_hdr_t);
+    /* Build the datagram with enough room in front of it for the lower
+       layers to add their headers without copying it again. */
+    if(!(pb = net_pbuf_alloc(NET_PBUF_HEADROOM, size + sizeof(udp_hdr_t)))) {
+        errno = ENOBUFS;
+        ++udp_stats.pkt_send_failed;
+        return -1;
+    }
+
+    buf = pb->data;
+    hdr = (udp_hdr_t *)buf;
 
     hdr->src_port = src->sin6_port;
     hdr->dst_port = dst->sin6_port;
@@ -1442,15 +1741,49 @@ static int net_udp_send_raw(netif_t *net, const struct sockaddr_in6 *src,
 
     /* Is this UDP or UDP-Lite? */
     if(proto == IPPROTO_UDP) {
-        hdr->length = htons(size);
+        hdr->length = htons(size + sizeof(udp_hdr_t));
+
+        pos = buf + sizeof(udp_hdr_t);
 
         if(!(iflags & UDPSOCK_NO_CHECKSUM)) {
-            cs = net_ipv6_checksum_pseudo(&srcaddr, &dst->sin6_addr, size,
-                                          proto);
-            hdr->checksum = net_ipv4_checksum(buf, size, cs);
+            /* Add up the data as it's copied in, then the header. A piece
+               that starts at an odd offset in the datagram gets added up
+               with its bytes the wrong way around, so swap the sum so far
+               to match while adding it in, and then swap it back. */
+            cs = net_ipv6_checksum_pseudo(&srcaddr, &dst->sin6_addr,
+                                          size + sizeof(udp_hdr_t), proto);
+            odd = 0;
+
+            for(i = 0; i < iovcnt; pos += iov[i].iov_len, ++i) {
+                if(odd)
+                    cs = cs_swap(cs);
+
+                cs = ~net_ipv4_checksum_copy(pos, iov[i].iov_base,
+                                             iov[i].iov_len, cs);
+
+                if(odd)
+                    cs = cs_swap(cs);
+
+                odd ^= iov[i].iov_len & 1;
+            }
+
+            hdr->checksum = net_ipv4_checksum(buf, sizeof(udp_hdr_t), cs);
+        }
+        else {
+            for(i = 0; i < iovcnt; pos += iov[i].iov_len, ++i)
+                memcpy(pos, iov[i].iov_base, iov[i].iov_len);
         }
+
+        size += sizeof(udp_hdr_t);
     }
     else {
+        pos = buf + sizeof(udp_hdr_t);
+
+        for(i = 0; i < iovcnt; pos += iov[i].iov_len, ++i)
+            memcpy(pos, iov[i].iov_base, iov[i].iov_len);
+
+        size += sizeof(udp_hdr_t);
+
         if(cscov <= size) {
             hdr->length = htons(cscov);
         }
@@ -1464,8 +1797,8 @@ static int net_udp_send_raw(netif_t *net, const struct sockaddr_in6 *src,
     }
 
     /* Pass everything off to the network layer to do the rest. */
-    err = net_ipv6_send(net, buf, size, hops, proto, &srcaddr,
-                        &dst->sin6_addr);
+    err = net_ipv6_send_pbuf(net, pb, hops, proto, &srcaddr, &dst->sin6_addr);
+    net_pbuf_free(pb);
 
     if(err < 0) {
         ++udp_stats.pkt_send_failed;
@@ -1502,7 +1835,9 @@ static fs_socket_proto_t proto = {
     net_udp_getsockname,
     net_udp_getpeername,
     net_udp_fcntl,
-    net_udp_poll
+    net_udp_poll,
+    net_udp_recvmmsg,
+    net_udp_sendmmsg
 };
 
 static fs_socket_proto_t proto_lite = {
@@ -1525,7 +1860,9 @@ static fs_socket_proto_t proto_lite = {
     net_udp_getsockname,
     net_udp_getpeername,
     net_udp_fcntl,
-    net_udp_poll
+    net_udp_poll,
+    net_udp_recvmmsg,
+    net_udp_sendmmsg
 };
 
 int net_udp_init(void) {
@@ -23,13 +23,14 @@
 
 int cond_init(condvar_t *cv) {
     cv->dummy = 0;
+    TAILQ_INIT(&cv->waiters);
     return 0;
 }
 
 /* Free a condvar */
 int cond_destroy(condvar_t *cv) {
     /* Give all sleeping threads a timed out error */
-    genwait_wake_all_err(cv, ENOTRECOVERABLE);
+    genwait_wake_queue_cnt(&cv->waiters, -1, ENOTRECOVERABLE);
 
     return 0;
 }
@@ -45,7 +46,7 @@ int cond_wait_timed(condvar_t *cv, mutex_t *m, int timeout) {
 
     irq_disable_scoped();
 
-    if(m->type > MUTEX_TYPE_RECURSIVE ||
+    if(!MUTEX_TYPE_VALID(m->type) ||
        !mutex_is_locked(m)) {
         errno = EINVAL;
         return -1;
@@ -55,7 +56,8 @@ int cond_wait_timed(condvar_t *cv, mutex_t *m, int timeout) {
     mutex_unlock(m);
 
     /* Now block us until we're signaled */
-    rv = genwait_wait(cv, timeout ? "cond_wait_timed" : "cond_wait", timeout);
+    rv = genwait_wait_queue(&cv->waiters, cv,
+                            timeout ? "cond_wait_timed" : "cond_wait", timeout);
 
     if(rv < 0 && errno == EAGAIN)
         errno = ETIMEDOUT;
@@ -74,7 +76,7 @@ int cond_signal(condvar_t *cv) {
     irq_disable_scoped();
 
     /* Wake one thread who's waiting, if any */
-    genwait_wake_one(cv);
+    genwait_wake_queue_cnt(&cv->waiters, 1, 0);
 
     return 0;
 }
@@ -83,7 +85,7 @@ int cond_broadcast(condvar_t *cv) {
     irq_disable_scoped();
 
     /* Wake all threads who are waiting */
-    genwait_wake_all(cv);
+    genwait_wake_queue_cnt(&cv->waiters, -1, 0);
 
     return 0;
 }
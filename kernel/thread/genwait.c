@@ -12,9 +12,15 @@
    hash of the address to a set of sleep queues, and then searching
    through them from the top to find matching sleepers. This functionality
    is enough to implement all of the various thread sync primitives
-   as well as some more advanced stuff. */
+   as well as some more advanced stuff.
+
+   Objects that sleepers wait on often enough (mutexes, semaphores, condvars)
+   can embed a wait queue head of their own and use the genwait_*_queue()
+   variants instead. Their sleepers are then kept off the hashed queues, and
+   waking them up never has to skip over unrelated threads. */
 
 #include <string.h>
+#include <stdlib.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <assert.h>
@@ -29,57 +35,116 @@
    figure if they've been using it as long as they have, they must be
    on to something. :) */
 #define TABLESIZE   128
-static TAILQ_HEAD(slpquehead, kthread) slpque[TABLESIZE];
+static genwait_queue_t slpque[TABLESIZE];
 #define LOOKUP(x)   (((uintptr_t)(x) >> 8) & (TABLESIZE - 1))
 
+/* Contention statistics */
+static genwait_stats_t stats;
+
 /* Timed event queue. Anything that isn't ready to run yet, but will be
    ready to run at a later time will be placed here. Note that this doesn't
    deal with pre-emptive timeslice context switching, only things that are
    specifically blocked for a timed event (thd_sleep, genwait_wait, etc).
-   This queue is sorted by remaining time (smallest at the front). */
-static struct ktqueue timer_queue;
 
-/* Internal function to insert a thread on the timer queue. Maintains
-   sorting order by wait time. */
-static void __nonnull_all tq_insert(kthread_t *thd) {
-    kthread_t *t;
+   This is a binary min-heap keyed on the wake-up time, so the next event is
+   always at the top, and inserting or removing a waiter costs O(log n) rather
+   than a walk of a sorted list. Each thread remembers its own position in the
+   heap (timer_idx) so that it can be removed when woken before its timeout.
+
+   A thread is only ever in the heap once, so thd_create() makes sure there's a
+   slot for every thread with genwait_reserve(). Nothing is allocated while
+   going to sleep, and inserting can't fail. */
+static kthread_t **timer_heap;
+static size_t timer_heap_size;
+static size_t timer_heap_cap;
+
+/* Initial number of slots in the timer heap; it doubles whenever it needs to
+   hold more threads. */
+#define TIMER_HEAP_INIT 32
+
+static inline void tq_set(size_t idx, kthread_t *thd) {
+    timer_heap[idx] = thd;
+    thd->timer_idx = idx;
+}
 
-    /* Search for its place; note that new threads will be placed at
-       the end of a group with the same timeout. */
-    TAILQ_FOREACH_REVERSE(t, &timer_queue, slpquehead, timerq) {
-        if(thd->wait_timeout >= t->wait_timeout) {
-            TAILQ_INSERT_AFTER(&timer_queue, t, thd, timerq);
-            return;
-        }
+static void tq_sift_up(size_t idx) {
+    kthread_t *thd = timer_heap[idx];
+    size_t parent;
+
+    while(idx > 0) {
+        parent = (idx - 1) / 2;
+
+        if(timer_heap[parent]->wait_timeout <= thd->wait_timeout)
+            break;
+
+        tq_set(idx, timer_heap[parent]);
+        idx = parent;
     }
 
-    /* Couldn't find anything scheduled earlier, put this at the start. */
-    TAILQ_INSERT_HEAD(&timer_queue, thd, timerq);
+    tq_set(idx, thd);
+}
+
+static void tq_sift_down(size_t idx) {
+    kthread_t *thd = timer_heap[idx];
+    size_t child;
+
+    while((child = 2 * idx + 1) < timer_heap_size) {
+        if(child + 1 < timer_heap_size &&
+           timer_heap[child + 1]->wait_timeout < timer_heap[child]->wait_timeout)
+            child++;
+
+        if(thd->wait_timeout <= timer_heap[child]->wait_timeout)
+            break;
+
+        tq_set(idx, timer_heap[child]);
+        idx = child;
+    }
+
+    tq_set(idx, thd);
+}
+
+/* Internal function to insert a thread on the timer queue. */
+static void __nonnull_all tq_insert(kthread_t *thd) {
+    assert(timer_heap_size < timer_heap_cap);
+
+    timer_heap[timer_heap_size] = thd;
+    tq_sift_up(timer_heap_size++);
 }
 
 /* Internal function to remove a thread from the timer queue. */
 static void __nonnull_all tq_remove(kthread_t *thd) {
-    TAILQ_REMOVE(&timer_queue, thd, timerq);
+    size_t idx = thd->timer_idx;
+    kthread_t *last = timer_heap[--timer_heap_size];
+
+    assert(timer_heap[idx] == thd);
+
+    if(idx == timer_heap_size)
+        return;
+
+    /* Move the last element into the hole, then restore the heap property in
+       whichever direction it was broken. */
+    tq_set(idx, last);
+    tq_sift_down(idx);
+    tq_sift_up(last->timer_idx);
 }
 
 /* Returns the top thread on the timer queue (next event). If nothing is
    queued, we'll return NULL. */
 static kthread_t *tq_next(void) {
-    return TAILQ_FIRST(&timer_queue);
+    return timer_heap_size ? timer_heap[0] : NULL;
 }
 
-int genwait_wait(void *obj, const char *mesg, unsigned int timeout) {
+/* Sleep on the given queue, which is either one of the hashed queues or the
+   embedded queue of the object. */
+static int genwait_wait_on(genwait_queue_t *queue, void *obj, const char *mesg,
+                           unsigned int timeout, bool embedded) {
     kthread_t   *me, *t;
 
     assert(!irq_inside_int());
 
     irq_disable_scoped();
 
-    /* Prepare us for sleep */
     me = thd_current;
-    me->state = STATE_WAIT;
-    me->wait_obj = obj;
-    me->wait_msg = mesg;
 
     if(timeout > 0) {
         /* If we have a timeout, insert us on the timer queue. */
@@ -89,8 +154,22 @@ int genwait_wait(void *obj, const char *mesg, unsigned int timeout) {
     else
         me->wait_timeout = 0;
 
+    /* Statically initialized objects have an all-zero queue head */
+    if(__predict_false(!queue->tqh_last))
+        TAILQ_INIT(queue);
+
+    /* Prepare us for sleep */
+    me->state = STATE_WAIT;
+    me->wait_obj = obj;
+    me->wait_msg = mesg;
+    me->wait_queue = embedded ? queue : NULL;
+
+    ++stats.waits;
+    if(embedded)
+        ++stats.queue_waits;
+
     /* Go through and find where to insert */
-    TAILQ_FOREACH(t, &slpque[LOOKUP(obj)], thdq) {
+    TAILQ_FOREACH(t, queue, thdq) {
         if(me->prio < t->prio) {
             TAILQ_INSERT_BEFORE(t, me, thdq);
             break;
@@ -99,12 +178,21 @@ int genwait_wait(void *obj, const char *mesg, unsigned int timeout) {
 
     /* We got to the end of the list, so insert at end */
     if(!t)
-        TAILQ_INSERT_TAIL(&slpque[LOOKUP(obj)], me, thdq);
+        TAILQ_INSERT_TAIL(queue, me, thdq);
 
     /* Block us until we're signaled */
     return thd_block_now(&me->context);
 }
 
+int genwait_wait(void *obj, const char *mesg, unsigned int timeout) {
+    return genwait_wait_on(&slpque[LOOKUP(obj)], obj, mesg, timeout, false);
+}
+
+int genwait_wait_queue(genwait_queue_t *queue, void *obj, const char *mesg,
+                       unsigned int timeout) {
+    return genwait_wait_on(queue, obj, mesg, timeout, true);
+}
+
 /* Removes a thread from its wait queue; assumes ints are disabled. */
 static void __nonnull_all genwait_unqueue(kthread_t *thd, int err) {
 
@@ -118,7 +206,10 @@ static void __nonnull_all genwait_unqueue(kthread_t *thd, int err) {
     }
 
     /* Remove it from the queue */
-    TAILQ_REMOVE(&slpque[LOOKUP(thd->wait_obj)], thd, thdq);
+    if(thd->wait_queue)
+        TAILQ_REMOVE(thd->wait_queue, thd, thdq);
+    else
+        TAILQ_REMOVE(&slpque[LOOKUP(thd->wait_obj)], thd, thdq);
 
     /* Also remove it from the timer queue if applicable */
     if(thd->wait_timeout)
@@ -127,8 +218,11 @@ static void __nonnull_all genwait_unqueue(kthread_t *thd, int err) {
     /* Clean up wait stuff */
     thd->wait_obj = NULL;
     thd->wait_msg = NULL;
+    thd->wait_queue = NULL;
     thd->wait_timeout = 0;
 
+    ++stats.wakeups;
+
     /* Make it runnable again */
     thd->state = STATE_READY;
     thd_add_to_runnable(thd, 0);
@@ -141,10 +235,24 @@ static int genwait_wake_thd_cnt(const void *obj, int cntmax, kthread_t *thd, int
     /* Twiddle interrupt state */
     irq_disable_scoped();
 
+    /* A specific thread sleeping on an embedded queue can be removed without
+       looking anything up. */
+    if(thd && thd->wait_queue) {
+        if(thd->state != STATE_WAIT || thd->wait_obj != obj)
+            return 0;
+
+        genwait_unqueue(thd, err);
+        return 1;
+    }
+
     /* Go through and find any matching entries */
     TAILQ_FOREACH_SAFE(t, &slpque[LOOKUP(obj)], thdq, nt) {
+        ++stats.hashed_scans;
+
         /* Is this thread a match? */
-        if(t->wait_obj == obj && (!thd || t == thd)) {
+        if(t->wait_obj != obj)
+            ++stats.hashed_collisions;
+        else if(!thd || t == thd) {
             /* Yes, remove it from the wait queue */
             genwait_unqueue(t, err);
 
@@ -161,6 +269,24 @@ static int genwait_wake_thd_cnt(const void *obj, int cntmax, kthread_t *thd, int
     return cnt;
 }
 
+int genwait_wake_queue_cnt(genwait_queue_t *queue, int cntmax, int err) {
+    kthread_t       *t;
+    int         cnt = 0;
+
+    irq_disable_scoped();
+
+    /* Everything on the queue is sleeping on the object, so just wake up
+       the sleepers from the front. */
+    while((t = TAILQ_FIRST(queue))) {
+        genwait_unqueue(t, err);
+
+        if(++cnt == cntmax)
+            break;
+    }
+
+    return cnt;
+}
+
 int genwait_wake_cnt(const void *obj, int cntmax, int err) {
     return genwait_wake_thd_cnt(obj, cntmax, NULL, err);
 }
@@ -195,6 +321,7 @@ void genwait_check_timeouts(uint64_t tm) {
             return;
 
         /* Re-activate it with an error code */
+        ++stats.timeouts;
         genwait_unqueue(t, EAGAIN);
     }
 }
@@ -208,16 +335,54 @@ uint64_t genwait_next_timeout(void) {
         return t->wait_timeout;
 }
 
+void genwait_get_stats(genwait_stats_t *out) {
+    irq_disable_scoped();
+
+    *out = stats;
+}
+
+int genwait_reserve(size_t count) {
+    kthread_t **heap;
+    size_t cap;
+
+    if(count <= timer_heap_cap)
+        return 0;
+
+    cap = timer_heap_cap ? timer_heap_cap : TIMER_HEAP_INIT;
+
+    while(cap < count)
+        cap *= 2;
+
+    heap = realloc(timer_heap, cap * sizeof(*heap));
+
+    if(!heap) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    timer_heap = heap;
+    timer_heap_cap = cap;
+
+    return 0;
+}
+
 int genwait_init(void) {
     for(size_t i = 0; i < TABLESIZE; i++)
         TAILQ_INIT(&slpque[i]);
 
-    TAILQ_INIT(&timer_queue);
-    return 0;
+    timer_heap_size = 0;
+    memset(&stats, 0, sizeof(stats));
+
+    return genwait_reserve(TIMER_HEAP_INIT);
 }
 
 void genwait_shutdown(void) {
     /* XXX Do something about queued up procs */
+
+    free(timer_heap);
+    timer_heap = NULL;
+    timer_heap_size = 0;
+    timer_heap_cap = 0;
 }
 
 
@@ -11,6 +11,7 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <limits.h>
+#include <sys/queue.h>
 
 #include <kos/mutex.h>
 #include <kos/genwait.h>
@@ -24,9 +25,49 @@
 
 static int mutex_trylock_thd(mutex_t *m, kthread_t *thd);
 
+/* Lock statistics, only allocated for mutexes passed to mutex_stats_enable().
+   The counters are only updated by the thread that holds the mutex, so the
+   mutex itself serializes them. */
+typedef struct mutex_stats {
+    LIST_ENTRY(mutex_stats) list;
+    const mutex_t *mutex;
+    const char *name;
+    uint64_t acquisitions;
+    uint64_t contended;
+    uint64_t wait_us;
+    uint64_t max_hold_us;
+    uint64_t hold_start;
+} mutex_stats_t;
+
+static LIST_HEAD(mstats_list, mutex_stats) mutex_stats_list =
+    LIST_HEAD_INITIALIZER(mutex_stats_list);
+
+/* Called by the new holder right after acquiring the mutex. */
+static void mutex_stats_acquired(mutex_t *m, uint64_t wait_start) {
+    mutex_stats_t *st = m->stats;
+    uint64_t now = timer_us_gettime64();
+
+    st->acquisitions++;
+    st->hold_start = now;
+
+    if(wait_start) {
+        st->contended++;
+        st->wait_us += now - wait_start;
+    }
+}
+
+/* Called by the holder right before releasing the mutex. */
+static void mutex_stats_released(mutex_t *m) {
+    mutex_stats_t *st = m->stats;
+    uint64_t held = timer_us_gettime64() - st->hold_start;
+
+    if(held > st->max_hold_us)
+        st->max_hold_us = held;
+}
+
 int mutex_init(mutex_t *m, unsigned int mtype) {
     /* Check the type */
-    if(mtype > MUTEX_TYPE_RECURSIVE) {
+    if(!MUTEX_TYPE_VALID(mtype)) {
         errno = EINVAL;
         return -1;
     }
@@ -35,6 +76,8 @@ int mutex_init(mutex_t *m, unsigned int mtype) {
     m->type = mtype;
     m->holder = NULL;
     m->count = 0;
+    TAILQ_INIT(&m->waiters);
+    m->stats = NULL;
 
     return 0;
 }
@@ -42,7 +85,7 @@ int mutex_init(mutex_t *m, unsigned int mtype) {
 int mutex_destroy(mutex_t *m) {
     irq_disable_scoped();
 
-    if(m->type > MUTEX_TYPE_RECURSIVE) {
+    if(!MUTEX_TYPE_VALID(m->type)) {
         errno = EINVAL;
         return -1;
     }
@@ -53,6 +96,13 @@ int mutex_destroy(mutex_t *m) {
         return -1;
     }
 
+    /* Drop the statistics, if any */
+    if(m->stats) {
+        LIST_REMOVE(m->stats, list);
+        free(m->stats);
+        m->stats = NULL;
+    }
+
     /* Set it to an invalid type of mutex */
     m->type = MUTEX_TYPE_DESTROYED;
 
@@ -67,7 +117,8 @@ int mutex_lock_irqsafe(mutex_t *m) {
 }
 
 int mutex_lock_timed(mutex_t *m, unsigned int timeout) {
-    uint64_t deadline = 0;
+    uint64_t deadline = 0, wait_start = 0;
+    int yields = 0;
     int rv = 0;
 
     assert(!irq_inside_int()); /* Only usable outside IRQ handlers */
@@ -101,16 +152,36 @@ int mutex_lock_timed(mutex_t *m, unsigned int timeout) {
                 }
             }
 
-            rv = genwait_wait(m, timeout ? "mutex_lock_timed" : "mutex_lock",
-                              timeout);
-            if(rv < 0) {
-                errno = ETIMEDOUT;
-                break;
+            /* We're about to wait for the holder, so this one counts as
+               contended. Only start the clock here, so that finding the
+               mutex free on the way in doesn't count as waiting for it. */
+            if(m->stats && !wait_start)
+                wait_start = timer_us_gettime64();
+
+            /* There is only one CPU, so spinning while the holder runs is
+               not an option. The closest thing is to hand the CPU over to
+               the holder a few times in the hope that it leaves its critical
+               section, before paying for a full sleep and wake-up. */
+            if(m->type == MUTEX_TYPE_ADAPTIVE &&
+               yields < MUTEX_ADAPTIVE_YIELDS &&
+               m->holder->state == STATE_READY) {
+                yields++;
+                thd_pass();
+            }
+            else {
+                rv = genwait_wait_queue(&m->waiters, m,
+                                        timeout ? "mutex_lock_timed" : "mutex_lock",
+                                        timeout);
+                if(rv < 0) {
+                    errno = ETIMEDOUT;
+                    break;
+                }
             }
 
             if(__predict_true(!m->holder)) {
                 m->holder = thd_current;
                 m->count = 1;
+                rv = 0;
                 break;
             }
 
@@ -125,6 +196,9 @@ int mutex_lock_timed(mutex_t *m, unsigned int timeout) {
         }
     }
 
+    if(!rv && m->stats)
+        mutex_stats_acquired(m, wait_start);
+
     return rv;
 }
 
@@ -146,10 +220,14 @@ int mutex_trylock(mutex_t *m) {
 static int mutex_trylock_thd(mutex_t *m, kthread_t *thd) {
     kthread_t *previous_thd = NULL;
 
-    assert(m->type <= MUTEX_TYPE_RECURSIVE);
+    assert(MUTEX_TYPE_VALID(m->type));
 
     if(atomic_compare_exchange_strong(&m->holder, &previous_thd, thd)) {
         m->count = 1;
+
+        if(__predict_false(m->stats != NULL))
+            mutex_stats_acquired(m, 0);
+
         return 0;
     }
 
@@ -174,7 +252,7 @@ static int mutex_trylock_thd(mutex_t *m, kthread_t *thd) {
 int mutex_unlock(mutex_t *m) {
     kthread_t *thd = thd_current;
 
-    assert(m->type <= MUTEX_TYPE_RECURSIVE);
+    assert(MUTEX_TYPE_VALID(m->type));
 
     /* If we're inside of an interrupt, use the special value for the thread
        from mutex_trylock(). */
@@ -184,6 +262,9 @@ int mutex_unlock(mutex_t *m) {
     assert(m->holder == thd && m->count > 0);
 
     if (__predict_true(!--m->count)) {
+        if(__predict_false(m->stats != NULL))
+            mutex_stats_released(m);
+
         m->holder = NULL;
 
         /* Restore real priority in case we were dynamically boosted.
@@ -193,8 +274,73 @@ int mutex_unlock(mutex_t *m) {
             thd->prio = thd->real_prio;
 
         /* If we need to wake up a thread, do so. */
-        genwait_wake_one(m);
+        genwait_wake_queue_cnt(&m->waiters, 1, 0);
+    }
+
+    return 0;
+}
+
+int mutex_stats_enable(mutex_t *m, const char *name) {
+    mutex_stats_t *st;
+
+    if(!MUTEX_TYPE_VALID(m->type)) {
+        errno = EINVAL;
+        return -1;
     }
 
+    if(m->stats) {
+        m->stats->name = name;
+        return 0;
+    }
+
+    st = calloc(1, sizeof(*st));
+    if(!st) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    st->mutex = m;
+    st->name = name;
+
+    irq_disable_scoped();
+
+    /* Don't start measuring a hold that began before we got here. */
+    if(m->holder)
+        st->hold_start = timer_us_gettime64();
+
+    LIST_INSERT_HEAD(&mutex_stats_list, st, list);
+    m->stats = st;
+
     return 0;
 }
+
+void mutex_stats_print(int (*pf)(const char *fmt, ...)) {
+    mutex_stats_t *st;
+
+    irq_disable_scoped();
+
+    pf("All profiled mutexes:\n");
+    pf("addr\t    acquired   contended\t   wait_us   max_hold_us  name\n");
+
+    LIST_FOREACH(st, &mutex_stats_list, list) {
+        pf("%08lx  %10llu  %10llu  %10llu  %12llu  %s%s\n",
+           (unsigned long)st->mutex, st->acquisitions, st->contended,
+           st->wait_us, st->max_hold_us, st->name,
+           st->mutex->holder ? " (locked)" : "");
+    }
+
+    pf("--end of list--\n");
+}
+
+void mutex_stats_reset(void) {
+    mutex_stats_t *st;
+
+    irq_disable_scoped();
+
+    LIST_FOREACH(st, &mutex_stats_list, list) {
+        st->acquisitions = 0;
+        st->contended = 0;
+        st->wait_us = 0;
+        st->max_hold_us = 0;
+    }
+}
@@ -41,7 +41,7 @@ int sem_init(semaphore_t *sm, int count) {
 /* Take care of destroying a semaphore */
 int sem_destroy(semaphore_t *sm) {
     /* Wake up any queued threads with an error */
-    genwait_wake_all_err(sm, ENOTRECOVERABLE);
+    genwait_wake_queue_cnt(&sm->waiters, -1, ENOTRECOVERABLE);
 
     sm->count = 0;
     sm->initialized = 0;
@@ -63,7 +63,9 @@ int sem_wait_timed(semaphore_t *sm, unsigned int timeout) {
     /* If there's enough count left, then let the thread proceed */
     if(sm->count < 0) {
         /* Block us until we're signaled */
-        int rv = genwait_wait(sm, timeout ? "sem_wait_timed" : "sem_wait", timeout);
+        int rv = genwait_wait_queue(&sm->waiters, sm,
+                                    timeout ? "sem_wait_timed" : "sem_wait",
+                                    timeout);
 
         /* Did we fail to get the lock? */
         if(rv < 0) {
@@ -105,7 +107,7 @@ int sem_signal(semaphore_t *sm) {
 
     /* Is there anyone waiting? If so, pass off to them */
     if(sm->count < 0)
-        genwait_wake_one(sm);
+        genwait_wake_queue_cnt(&sm->waiters, 1, 0);
 
     sm->count++;
 
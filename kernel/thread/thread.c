@@ -28,6 +28,7 @@
 #include <kos/cond.h>
 #include <kos/genwait.h>
 #include <kos/timer.h>
+#include <kos/init.h>
 
 #include <arch/arch.h>
 #include <arch/stack.h>
@@ -64,24 +65,77 @@ static unsigned int thd_ageing_ms_log2;
  * will be doubled. */
 #define THD_AGEING_THRESHOLD 8
 
+/* Whether new thread stacks are filled with THD_STACK_PAINT_PATTERN, so that
+   their high-water mark can be measured exactly (INIT_THD_STACK_PAINT). */
+static bool thd_paint_stacks;
+#define THD_STACK_PAINT_PATTERN 0xa5a5a5a5
+
+/* Set by thd_choose_new(), so that the switch it causes is counted as a
+   voluntary one. Every other path into the scheduler is an IRQ. */
+static bool thd_switch_voluntary;
+
 /* Thread list. This includes all threads except dead ones. */
 static struct ktlist thd_list;
 
+/* Thread ID hash. Every thread in thd_list is also in the bucket its ID hashes
+   to, so that thd_by_tid() doesn't have to walk every thread. Buckets are in
+   no particular order. */
+#define THD_TID_HASH_SIZE   64
+#define THD_TID_HASH(tid)   ((unsigned int)(tid) & (THD_TID_HASH_SIZE - 1))
+static struct ktlist tid_hash[THD_TID_HASH_SIZE];
+
 /* Run queue. This is more like on a standard time sharing system than the
-   previous versions. The top element of this priority queue should be the
-   thread that is ready to run next. When a thread is scheduled, it will be
-   removed from this queue. When it's de-scheduled, it will be re-inserted
-   by its priority value at the end of its priority group. Note that right
-   now this condition is being broken because sleeping threads are on the
-   same queue. We deal with those in thd_switch below. */
-static struct ktqueue run_queue;
+   previous versions. The run queue is split into one bucket per priority
+   value; each bucket is a FIFO of ready threads, and a two-level bitmap
+   tracks which buckets are non-empty so that picking the next thread is a
+   find-first-set rather than a walk of every ready thread. When a thread is
+   scheduled, it will be removed from its bucket. When it's de-scheduled, it
+   will be re-inserted at the end of its bucket.
+
+   Priorities below THD_RUNQ_TOP each get their own bucket. Everything at or
+   above it (which in practice is only the idle thread) shares the last
+   bucket, which is kept sorted by priority.
+
+   Ageing is handled by epochs: every time the ageing interval elapses, all
+   buckets are shifted down by halving their priority, which moves whole
+   buckets at once instead of touching each queued thread. A queued thread's
+   current bucket can always be recomputed from the priority and epoch it was
+   queued with, see thd_rq_prio(). */
+#define THD_RUNQ_BUCKETS    256
+#define THD_RUNQ_TOP        (THD_RUNQ_BUCKETS - 1)
+#define THD_RUNQ_WORDS      (THD_RUNQ_BUCKETS / 32)
+
+static struct ktqueue run_queue[THD_RUNQ_BUCKETS];
+static uint32_t run_queue_map[THD_RUNQ_WORDS];
+static uint32_t run_queue_summary;
+
+/* Current ageing epoch and the time (in ms) at which it started. */
+static uint32_t run_queue_epoch;
+static uint64_t run_queue_epoch_time;
+
+/* Polling threads. These are not runnable until their poll callback says so,
+   so they are kept aside from the run queue. Their rq_prio is set to -1. */
+static struct ktqueue poll_queue;
 
 /* The currently executing thread. This thread should not be on any queues. */
 kthread_t *thd_current = NULL;
 
-/* Thread mode: uninitialized or pre-emptive. */
+/* Thread mode: uninitialized, pre-emptive or tickless. */
 static kthread_mode_t thd_mode = THD_MODE_NONE;
 
+/* In tickless mode, the longest we let the primary timer sleep for, even when
+   there is nothing to wake up for. */
+#define THD_TICKLESS_MAX_MS 1000
+
+/* In tickless mode, the absolute time (in ms) the primary timer is programmed
+   to fire at, or 0 if it is not programmed. */
+static uint64_t thd_next_wakeup;
+
+/* Tick instrumentation: number of primary timer interrupts handled and number
+   of calls to the scheduler. */
+static uint32_t thd_timer_ticks;
+static uint32_t thd_sched_count;
+
 /* Reaper semaphore. Counts the number of threads waiting to be reaped. */
 static semaphore_t thd_reap_sem;
 
@@ -94,7 +148,7 @@ static kthread_t *thd_idle_thd = NULL;
 /*****************************************************************************/
 /* Debug */
 
-static const char *thd_state_to_str(kthread_t *thd) {
+static const char *thd_state_to_str(const kthread_t *thd) {
     switch(thd->state) {
         case STATE_ZOMBIE:
             return "zombie";
@@ -130,15 +184,59 @@ int thd_each(int (*cb)(kthread_t *thd, void *user_data), void *data) {
     return 0;
 }
 
+/* Returns how much of the thread's stack has been used so far. Painted stacks
+   are scanned from the bottom for the first overwritten word, which gives the
+   exact figure; otherwise this is only the deepest point seen at a context
+   switch. */
+static size_t thd_stack_used(const kthread_t *thd) {
+    const uint32_t *cur, *end;
+    size_t used;
+
+    if(!(thd->flags & THD_STACK_PAINTED))
+        return thd->stack_hwm;
+
+    cur = (const uint32_t *)thd->stack;
+    end = (const uint32_t *)((uintptr_t)thd->stack + thd->stack_size);
+
+    while(cur < end && *cur == THD_STACK_PAINT_PATTERN)
+        cur++;
+
+    used = (uintptr_t)end - (uintptr_t)cur;
+
+    return used > thd->stack_hwm ? used : thd->stack_hwm;
+}
+
+static void thd_fill_stats(kthread_stats_t *stats, const kthread_t *thd) {
+    stats->cpu_time_us = thd->cpu_time.total;
+    stats->voluntary_switches = thd->switches.voluntary;
+    stats->involuntary_switches = thd->switches.involuntary;
+    stats->stack_size = thd->stack_size;
+    stats->stack_used = thd_stack_used(thd);
+    stats->stack_painted = !!(thd->flags & THD_STACK_PAINTED);
+}
+
+int thd_get_stats(kthread_t *thd, kthread_stats_t *stats) {
+    if(!thd)
+        thd = thd_current;
+
+    irq_disable_scoped();
+
+    thd_fill_stats(stats, thd);
+
+    return 0;
+}
+
 int thd_pslist(int (*pf)(const char *fmt, ...)) {
-    uint64_t cpu_time, ms_time, cpu_total = 0;
+    uint64_t cpu_time, us_time, ms_time, cpu_total = 0;
     kthread_t *cur;
 
     pf("All threads (may not be deterministic):\n");
-    pf("addr\t  tid\tprio\tflags\t  wait_timeout\t  cpu_time\t      state\t  name\n");
+    pf("addr\t  tid\tprio\tflags\t  wait_timeout\t  cpu_time(us)\t"
+       "      switches(v/i)\t  stack(used/size)  state\t  name\n");
 
     irq_disable_scoped();
-    ms_time = timer_ms_gettime64();
+    us_time = timer_us_gettime64();
+    ms_time = us_time / 1000;
 
     LIST_FOREACH(cur, &thd_list, t_list) {
         pf("%08lx  ", CONTEXT_PC(cur->context));
@@ -155,42 +253,63 @@ int thd_pslist(int (*pf)(const char *fmt, ...)) {
         cpu_time = cur->cpu_time.total;
         cpu_total += cpu_time;
 
-        pf("%12llu (%6.3lf%%)  ",
-            cpu_time, (double)cpu_time / (double)ms_time * 100.0);
+        pf("%14llu (%6.3lf%%)  ",
+            cpu_time, (double)cpu_time / (double)us_time * 100.0);
+
+        pf("%8lu/%-8lu  ", cur->switches.voluntary, cur->switches.involuntary);
+        pf("%7lu/%-7lu  ", (uint32_t)thd_stack_used(cur),
+                            (uint32_t)cur->stack_size);
 
         pf("%-10s  ", thd_state_to_str(cur));
         pf("%-10s\n", cur->label);
     }
 
     pf("-\t  -\t -\t       -\t     -");
-    pf("%12llu (%6.3lf%%)       -      [system]\n", (ms_time - cpu_total),
-        (double)(ms_time - cpu_total) / (double)ms_time * 100.0);
+    pf("%14llu (%6.3lf%%)  %17s  %15s  -         [system]\n",
+        (us_time - cpu_total),
+        (double)(us_time - cpu_total) / (double)us_time * 100.0, "-", "-");
 
     pf("--end of list--\n");
 
+    pf("Scheduler: %s, HZ=%u, %lu timer ticks (%llu periodic), "
+       "%lu reschedules\n",
+       thd_mode == THD_MODE_TICKLESS ? "tickless" : "periodic", thd_get_hz(),
+       thd_timer_ticks, ms_time / thd_sched_ms, thd_sched_count);
+
     return 0;
 }
 
+static void thd_pslist_queue_one(int (*pf)(const char *fmt, ...),
+                                 const kthread_t *cur) {
+    pf("%08lx\t", CONTEXT_PC(cur->context));
+    pf("%d\t", cur->tid);
+
+    if(cur->prio == PRIO_MAX)
+        pf("MAX\t");
+    else
+        pf("%d\t", cur->prio);
+
+    pf("%08lx\t", cur->flags);
+    pf("%ld\t\t", (uint32_t)cur->wait_timeout);
+    pf("%10s", thd_state_to_str(cur));
+    pf("%s\n", cur->label);
+}
+
 int thd_pslist_queue(int (*pf)(const char *fmt, ...)) {
     kthread_t *cur;
+    unsigned int i;
 
     pf("Queued threads:\n");
     pf("addr\t\ttid\tprio\tflags\twait_timeout\tstate     name\n");
-    TAILQ_FOREACH(cur, &run_queue, thdq) {
-        pf("%08lx\t", CONTEXT_PC(cur->context));
-        pf("%d\t", cur->tid);
 
-        if(cur->prio == PRIO_MAX)
-            pf("MAX\t");
-        else
-            pf("%d\t", cur->prio);
-
-        pf("%08lx\t", cur->flags);
-        pf("%ld\t\t", (uint32_t)cur->wait_timeout);
-        pf("%10s", thd_state_to_str(cur));
-        pf("%s\n", cur->label);
+    for(i = 0; i < THD_RUNQ_BUCKETS; i++) {
+        TAILQ_FOREACH(cur, &run_queue[i], thdq)
+            thd_pslist_queue_one(pf, cur);
     }
 
+    TAILQ_FOREACH(cur, &poll_queue, thdq)
+        thd_pslist_queue_one(pf, cur);
+
     return 0;
 }
 
@@ -212,7 +331,7 @@ static tid_t thd_next_free(void) {
 kthread_t *thd_by_tid(tid_t tid) {
     kthread_t *np;
 
-    LIST_FOREACH(np, &thd_list, t_list) {
+    LIST_FOREACH(np, &tid_hash[THD_TID_HASH(tid)], t_hash) {
         if(np->tid == tid)
             return np;
     }
@@ -220,18 +339,48 @@ kthread_t *thd_by_tid(tid_t tid) {
     return NULL;
 }
 
+static void thd_snapshot_one(kthread_snapshot_t *snap, const kthread_t *thd) {
+    snap->tid = thd->tid;
+    snap->prio = thd->prio;
+    snap->real_prio = thd->real_prio;
+    snap->state = thd->state;
+    snap->flags = thd->flags;
+    thd_fill_stats(&snap->stats, thd);
 
-static bool thd_has_polls(void) {
-    kthread_t *thd;
+    strncpy(snap->label, thd->label, sizeof(snap->label) - 1);
+    snap->label[sizeof(snap->label) - 1] = '\0';
+}
 
-    irq_disable_scoped();
+size_t thd_snapshot(kthread_snapshot_t *buf, size_t count) {
+    const kthread_t *cur;
+    size_t n = 0;
+    unsigned int i;
+
+    /* Interrupts are only disabled for one hash bucket at a time, so that
+       other threads and IRQs can run in between. */
+    for(i = 0; i < THD_TID_HASH_SIZE && n < count; i++) {
+        irq_disable_scoped();
 
-    TAILQ_FOREACH(thd, &run_queue, thdq) {
-        if(thd->state == STATE_POLLING)
-            return true;
+        LIST_FOREACH(cur, &tid_hash[i], t_hash) {
+            if(n == count)
+                break;
+
+            thd_snapshot_one(&buf[n++], cur);
+        }
     }
 
-    return false;
+    return n;
+}
+
+size_t thd_get_count(void) {
+    return thd_count;
+}
+
+
+static bool thd_has_polls(void) {
+    irq_disable_scoped();
+
+    return !TAILQ_EMPTY(&poll_queue);
 }
 
 /*****************************************************************************/
@@ -333,57 +482,236 @@ void thd_exit(void *rv) {
 /*****************************************************************************/
 /* Thread creation and deletion */
 
-/* Enqueue a process in the runnable queue; adds it right after the
-   process group of the same priority (front_of_line==0) or
-   right before the process group of the same priority (front_of_line!=0).
-   See thd_schedule for why this is helpful. */
-void thd_add_to_runnable(kthread_t *t, bool front_of_line) {
-    kthread_t *i;
-    int done;
+/* Returns the aged priority a thread had when it was queued, adjusted for
+   the number of ageing epochs that have passed since. */
+static inline prio_t thd_rq_prio(const kthread_t *thd) {
+    uint32_t age = run_queue_epoch - thd->rq_epoch;
+    prio_t prio = thd->rq_prio;
 
-    if(t->flags & THD_QUEUED)
-        return;
+    if(__predict_true(prio < PRIO_MAX))
+        prio = (age >= 32) ? 0 : (prio >> age);
+
+    return prio;
+}
+
+static inline unsigned int thd_rq_bucket(prio_t prio) {
+    return ((unsigned int)prio < THD_RUNQ_TOP) ? (unsigned int)prio : THD_RUNQ_TOP;
+}
+
+static inline void thd_rq_mark(unsigned int bucket) {
+    run_queue_map[bucket >> 5] |= 1u << (bucket & 31);
+    run_queue_summary |= 1u << (bucket >> 5);
+}
 
-    done = 0;
+static inline void thd_rq_unmark(unsigned int bucket) {
+    if(TAILQ_EMPTY(&run_queue[bucket])) {
+        run_queue_map[bucket >> 5] &= ~(1u << (bucket & 31));
+
+        if(!run_queue_map[bucket >> 5])
+            run_queue_summary &= ~(1u << (bucket >> 5));
+    }
+}
+
+/* Returns the thread at the front of the first non-empty bucket. */
+static inline kthread_t *thd_rq_first(void) {
+    unsigned int word;
+
+    if(!run_queue_summary)
+        return NULL;
 
-    if(!front_of_line) {
-        /* Look for a thread of lower priority and insert
-           before it. If there is nothing on the run queue, we'll
-           fall through to the bottom. */
-        TAILQ_FOREACH(i, &run_queue, thdq) {
-            if(i->prio > t->prio) {
+    word = __builtin_ctz(run_queue_summary);
+
+    return TAILQ_FIRST(&run_queue[(word << 5) +
+                                  __builtin_ctz(run_queue_map[word])]);
+}
+
+/* Insert a thread in the bucket of the given aged priority. Only the shared
+   top bucket needs a sorted insertion; all the others hold a single
+   priority value. */
+static void thd_rq_insert(kthread_t *t, prio_t prio, bool front_of_line) {
+    unsigned int bucket = thd_rq_bucket(prio);
+    struct ktqueue *q = &run_queue[bucket];
+    kthread_t *i;
+    prio_t iprio;
+
+    if(__predict_false(bucket == THD_RUNQ_TOP)) {
+        TAILQ_FOREACH(i, q, thdq) {
+            iprio = thd_rq_prio(i);
+
+            if(iprio > prio || (front_of_line && iprio == prio)) {
                 TAILQ_INSERT_BEFORE(i, t, thdq);
-                done = 1;
                 break;
             }
         }
+
+        if(!i)
+            TAILQ_INSERT_TAIL(q, t, thdq);
+    }
+    else if(front_of_line) {
+        TAILQ_INSERT_HEAD(q, t, thdq);
     }
     else {
-        /* Look for a thread of the same or lower priority and
-           insert before it. If there is nothing on the run queue,
-           we'll fall through to the bottom. */
-        TAILQ_FOREACH(i, &run_queue, thdq) {
-            if(i->prio >= t->prio) {
-                TAILQ_INSERT_BEFORE(i, t, thdq);
-                done = 1;
-                break;
-            }
+        TAILQ_INSERT_TAIL(q, t, thdq);
+    }
+
+    thd_rq_mark(bucket);
+}
+
+/* Move to the next ageing epoch: every queued thread sees its priority
+   halved. Buckets are processed in ascending order so that a bucket is
+   never aged twice, and are moved as a whole. */
+static void thd_rq_age_once(void) {
+    kthread_t *t, *tmp;
+    unsigned int word, bucket;
+    uint32_t bits;
+    prio_t prio;
+
+    run_queue_epoch++;
+
+    for(word = 0; word < THD_RUNQ_WORDS; word++) {
+        bits = run_queue_map[word];
+
+        /* Bucket 0 can't be promoted any further, and the top bucket is
+           handled separately below. */
+        if(word == 0)
+            bits &= ~1u;
+        if(word == THD_RUNQ_WORDS - 1)
+            bits &= ~(1u << 31);
+
+        while(bits) {
+            bucket = (word << 5) + __builtin_ctz(bits);
+            bits &= bits - 1;
+
+            TAILQ_CONCAT(&run_queue[bucket >> 1], &run_queue[bucket], thdq);
+            thd_rq_mark(bucket >> 1);
+            thd_rq_unmark(bucket);
         }
     }
 
-    /* Didn't find one, put it at the end */
-    if(!done)
-        TAILQ_INSERT_TAIL(&run_queue, t, thdq);
+    /* The top bucket is sorted, so the threads that now fit in a regular
+       bucket are all at its front. Threads with a priority of PRIO_MAX or
+       more never age and sit at its end. */
+    TAILQ_FOREACH_SAFE(t, &run_queue[THD_RUNQ_TOP], thdq, tmp) {
+        prio = thd_rq_prio(t);
+
+        if(prio >= THD_RUNQ_TOP)
+            break;
+
+        TAILQ_REMOVE(&run_queue[THD_RUNQ_TOP], t, thdq);
+        TAILQ_INSERT_TAIL(&run_queue[prio], t, thdq);
+        thd_rq_mark(prio);
+    }
+
+    thd_rq_unmark(THD_RUNQ_TOP);
+}
+
+/* Age the run queue up to the given time. */
+static void thd_rq_age(uint64_t now) {
+    uint64_t steps = (now - run_queue_epoch_time) >> thd_ageing_ms_log2;
+
+    if(__predict_true(!steps))
+        return;
+
+    run_queue_epoch_time += steps << thd_ageing_ms_log2;
+
+    /* Past this many halvings, every ageing priority is zero. */
+    if(steps > 13)
+        steps = 13;
+
+    while(steps--)
+        thd_rq_age_once();
+}
+
+/* Program the primary timer to fire at the given time, unless it is already
+   programmed to fire earlier. Tickless mode only. */
+static void thd_tickless_arm(uint64_t deadline) {
+    uint64_t now = timer_ms_gettime64();
+
+    if(thd_next_wakeup && thd_next_wakeup <= deadline)
+        return;
+
+    thd_next_wakeup = deadline;
+    timer_primary_wakeup(deadline > now ? deadline - now : 1);
+}
+
+/* Decide when the scheduler needs to run next in tickless mode. Timeslices are
+   only needed when some other thread than the current one is waiting for the
+   CPU, or when threads are polling; otherwise we sleep until the next genwait
+   timeout. */
+static void thd_tickless_program(uint64_t now) {
+    const kthread_t *next = thd_rq_first();
+    uint64_t timeout = genwait_next_timeout();
+    uint64_t deadline;
+
+    if(!TAILQ_EMPTY(&poll_queue) || (next && next != thd_idle_thd))
+        deadline = now + thd_sched_ms;
+    else
+        deadline = now + THD_TICKLESS_MAX_MS;
+
+    if(timeout && timeout < deadline)
+        deadline = timeout;
+
+    /* The timer is still running towards that same deadline */
+    if(deadline == thd_next_wakeup && deadline > now)
+        return;
+
+    thd_next_wakeup = 0;
+    thd_tickless_arm(deadline);
+}
+
+/* Enqueue a process in the runnable queue; adds it at the end of its
+   priority bucket (front_of_line==0) or at the front of it
+   (front_of_line!=0). See thd_schedule for why this is helpful. */
+void thd_add_to_runnable(kthread_t *t, bool front_of_line) {
+    const kthread_t *first;
+    bool contended;
+
+    if(t->flags & THD_QUEUED)
+        return;
 
     t->flags |= THD_QUEUED;
+
+    if(__predict_false(t->state == STATE_POLLING)) {
+        t->rq_prio = -1;
+        TAILQ_INSERT_TAIL(&poll_queue, t, thdq);
+        return;
+    }
+
+    /* Was anything besides the idle thread already waiting for the CPU? */
+    first = thd_rq_first();
+    contended = first && first != thd_idle_thd;
+
+    t->rq_prio = t->prio;
+    t->rq_epoch = run_queue_epoch;
+    thd_rq_insert(t, t->prio, front_of_line);
+
+    /* In tickless mode, the timer may be sleeping until the next timeout
+       because only the current thread was runnable. If this is the first
+       thread to wait for the CPU, make sure that we get a preemption tick
+       within one timeslice. If another one was already waiting, the timer is
+       set for that, and the current thread is dealt with by thd_schedule(). */
+    if(thd_mode == THD_MODE_TICKLESS && thd_current && !contended &&
+       t != thd_current && t != thd_idle_thd)
+        thd_tickless_arm(timer_ms_gettime64() + thd_sched_ms);
 }
 
 /* Removes a thread from the runnable queue, if it's there. */
 int thd_remove_from_runnable(kthread_t *thd) {
+    unsigned int bucket;
+
     if(!(thd->flags & THD_QUEUED)) return 0;
 
     thd->flags &= ~THD_QUEUED;
-    TAILQ_REMOVE(&run_queue, thd, thdq);
+
+    if(__predict_false(thd->rq_prio < 0)) {
+        TAILQ_REMOVE(&poll_queue, thd, thdq);
+        return 0;
+    }
+
+    bucket = thd_rq_bucket(thd_rq_prio(thd));
+    TAILQ_REMOVE(&run_queue[bucket], thd, thdq);
+    thd_rq_unmark(bucket);
+
     return 0;
 }
 
@@ -418,6 +746,12 @@ kthread_t *thd_create_ex(const kthread_attr_t *restrict attr,
 
     irq_disable_scoped();
 
+    /* Make sure the thread will have a place in the genwait timer queue, so
+       that timed waits never have to allocate. This comes before taking a
+       thread id, so that failing here doesn't use one up. */
+    if(genwait_reserve(thd_count + 1) < 0)
+        return NULL;
+
     /* Get a new thread id */
     tid = thd_next_free();
 
@@ -451,6 +785,18 @@ kthread_t *thd_create_ex(const kthread_attr_t *restrict attr,
 
             nt->stack_size = real_attr.stack_size;
 
+            /* Paint the stack, unless this is the already running kernel
+               thread. */
+            if(thd_paint_stacks && routine) {
+                uint32_t *word = (uint32_t *)nt->stack;
+                size_t i;
+
+                for(i = 0; i < nt->stack_size / sizeof(uint32_t); i++)
+                    word[i] = THD_STACK_PAINT_PATTERN;
+
+                nt->flags |= THD_STACK_PAINTED;
+            }
+
             /* Populate the context */
             params[0] = (uintptr_t)routine;
             params[1] = (uintptr_t)param;
@@ -506,6 +852,7 @@ kthread_t *thd_create_ex(const kthread_attr_t *restrict attr,
 
             /* Insert it into the thread list */
             LIST_INSERT_HEAD(&thd_list, nt, t_list);
+            LIST_INSERT_HEAD(&tid_hash[THD_TID_HASH(tid)], nt, t_hash);
 
             /* Add it to our count */
             ++thd_count;
@@ -545,6 +892,7 @@ int thd_destroy(kthread_t *thd) {
 
     /* Remove it from the thread list. */
     LIST_REMOVE(thd, t_list);
+    LIST_REMOVE(thd, t_hash);
 
     /* Call destructors on TLS entries.  */
     LIST_FOREACH(i, &thd->tls_list, kv_list) {
@@ -589,8 +937,19 @@ int thd_set_prio(kthread_t *thd, prio_t prio) {
     if((prio < 0) || (prio > PRIO_MAX))
         return -2;
 
-    /* Set the new priority */
-    thd->prio = prio;
+    irq_disable_scoped();
+
+    /* Set the new priority, and move the thread to its new bucket if it
+       is waiting to run. */
+    if((thd->flags & THD_QUEUED) && thd->state == STATE_READY) {
+        thd_remove_from_runnable(thd);
+        thd->prio = prio;
+        thd_add_to_runnable(thd, false);
+    }
+    else {
+        thd->prio = prio;
+    }
+
     thd->real_prio = prio;
     return 0;
 }
@@ -612,7 +971,9 @@ tid_t thd_get_id(const kthread_t *thd) {
 /*****************************************************************************/
 /* Scheduling routines */
 
-static void thd_update_cpu_time(kthread_t *thd, uint64_t now) {
+static void thd_update_cpu_time(kthread_t *thd) {
+    uint64_t now = timer_us_gettime64();
+
     thd_current->cpu_time.total +=
             now - thd_current->cpu_time.scheduled;
 
@@ -620,36 +981,41 @@ static void thd_update_cpu_time(kthread_t *thd, uint64_t now) {
 }
 
 /* Helper function that sets a thread being scheduled */
-static inline void thd_schedule_inner(kthread_t *thd, uint64_t now) {
+static inline void thd_schedule_inner(kthread_t *thd) {
     thd_remove_from_runnable(thd);
 
-    thd_update_cpu_time(thd, now);
+    thd_update_cpu_time(thd);
+
+    if(thd != thd_current) {
+        if(thd_switch_voluntary)
+            ++thd_current->switches.voluntary;
+        else
+            ++thd_current->switches.involuntary;
+    }
 
     thd_current = thd;
     _impure_ptr = &thd->thd_reent;
     thd->state = STATE_RUNNING;
 
-    /* Make sure the thread hasn't underrun its stack */
+    /* Make sure the thread hasn't underrun its stack, and keep track of the
+       deepest stack pointer seen at a switch. */
     if(thd_current->stack && thd_current->stack_size) {
-        if(CONTEXT_SP(thd_current->context) < (uintptr_t)(thd_current->stack)) {
+        uintptr_t sp = CONTEXT_SP(thd_current->context);
+        uintptr_t top = (uintptr_t)thd_current->stack + thd_current->stack_size;
+
+        if(sp < (uintptr_t)(thd_current->stack)) {
             thd_pslist(printf);
             thd_pslist_queue(printf);
             assert_msg(0, "Thread stack underrun");
         }
+
+        if(top - sp > thd_current->stack_hwm)
+            thd_current->stack_hwm = top - sp;
     }
 
     irq_set_context(&thd_current->context);
 }
 
-static inline prio_t thd_calc_prio(const kthread_t *thd, uint32_t now) {
-    prio_t prio = thd->prio;
-
-    if(__predict_true(prio < PRIO_MAX))
-       prio >>= (now - (uint32_t)thd->cpu_time.scheduled) >> thd_ageing_ms_log2;
-
-    return prio;
-}
-
 /* Thread scheduler; this function will find a new thread to run when a
    context switch is requested. No work is done in here except to change
    out the thd_current variable contents. Assumed that we are in an
@@ -667,12 +1033,12 @@ static inline prio_t thd_calc_prio(const kthread_t *thd, uint32_t now) {
    don't want a full context switch inside the same priority group.
 */
 void thd_schedule(bool front_of_line) {
-    kthread_t *thd, *next_thd = NULL;
-    prio_t prio, max_prio = INT_MAX;
+    kthread_t *thd, *tmp, *next_thd;
     uint64_t now;
     int ret;
 
     now = timer_ms_gettime64();
+    ++thd_sched_count;
 
     /* If there's only two thread left, it's the idle task and the reaper task:
        exit the OS */
@@ -691,38 +1057,28 @@ void thd_schedule(bool front_of_line) {
     /* Look for timed out waits */
     genwait_check_timeouts(now);
 
-    /* Search downwards through the run queue for a runnable thread; if
-       we don't find a normal runnable thread, the idle process will
-       always be there at the bottom. */
-    TAILQ_FOREACH(thd, &run_queue, thdq) {
-        if(__predict_false(thd->state == STATE_POLLING)) {
-            /* Is it polling? Call the polling function. */
-
-            if(thd->wait_timeout && thd->wait_timeout < now) {
-                thd->state = STATE_READY;
-                CONTEXT_RET(thd->context) = 0;
-            }
-            else {
-                ret = thd->poll_cb(thd->wait_obj);
-
-                if(ret) {
-                    thd->state = STATE_READY;
-                    CONTEXT_RET(thd->context) = ret;
-                }
-            }
-        }
-
-        /* Is it runnable? If not, keep going */
-        if(thd->state != STATE_READY)
+    /* Call the polling functions of the polling threads, and move those that
+       are done polling to the run queue. */
+    TAILQ_FOREACH_SAFE(thd, &poll_queue, thdq, tmp) {
+        if(thd->wait_timeout && thd->wait_timeout < now)
+            ret = 0;
+        else if(!(ret = thd->poll_cb(thd->wait_obj)))
             continue;
 
-        prio = thd_calc_prio(thd, now);
-        if(prio < max_prio) {
-            next_thd = thd;
-            max_prio = prio;
-        }
+        thd_remove_from_runnable(thd);
+        thd->state = STATE_READY;
+        CONTEXT_RET(thd->context) = ret;
+        thd_add_to_runnable(thd, false);
     }
 
+    /* Promote the threads that have been waiting for long enough */
+    thd_rq_age(now);
+
+    /* The front of the first non-empty bucket is the thread to run; if we
+       don't find a normal runnable thread, the idle process will always be
+       there in the top bucket. */
+    next_thd = thd_rq_first();
+
     /* If we didn't already re-enqueue the thread and we are supposed to do so,
        do it now. */
     if(!front_of_line && thd_current->state == STATE_RUNNING) {
@@ -746,7 +1102,10 @@ void thd_schedule(bool front_of_line) {
 
     /* We should now have a runnable thread, so remove it from the
        run queue and switch to it. */
-    thd_schedule_inner(next_thd, now);
+    thd_schedule_inner(next_thd);
+
+    if(thd_mode == THD_MODE_TICKLESS)
+        thd_tickless_program(now);
 }
 
 /* Temporary priority boosting function: call this from within an interrupt
@@ -775,7 +1134,11 @@ void thd_schedule_next(kthread_t *thd) {
         thd_add_to_runnable(thd_current, 0);
     }
 
-    thd_schedule_inner(thd, timer_ms_gettime64());
+    thd_schedule_inner(thd);
+
+    /* The timer is still set up for the thread we switched away from. */
+    if(thd_mode == THD_MODE_TICKLESS)
+        thd_tickless_program(timer_ms_gettime64());
 }
 
 /* See kos/thread.h for description */
@@ -783,7 +1146,9 @@ irq_context_t *thd_choose_new(void) {
     //printf("thd_choose_new() woken at %d\n", (uint32_t)now);
 
     /* Do any re-scheduling */
+    thd_switch_voluntary = true;
     thd_schedule(false);
+    thd_switch_voluntary = false;
 
     /* Return the new IRQ context back to the caller */
     return &thd_current->context;
@@ -800,8 +1165,17 @@ static void thd_timer_hnd(irq_context_t *context) {
 
     //printf("timer woke at %d\n", (uint32_t)now);
 
-    thd_schedule(false);
-    timer_primary_wakeup(thd_sched_ms);
+    ++thd_timer_ticks;
+
+    if(thd_mode == THD_MODE_TICKLESS) {
+        /* The timer stopped itself; thd_schedule() will program it again. */
+        thd_next_wakeup = 0;
+        thd_schedule(false);
+    }
+    else {
+        thd_schedule(false);
+        timer_primary_wakeup(thd_sched_ms);
+    }
 }
 
 /*****************************************************************************/
@@ -1011,10 +1385,18 @@ struct _reent *thd_get_reent(kthread_t *thd) {
 }
 
 uint64_t thd_get_cpu_time(kthread_t *thd) {
-    return thd->cpu_time.total;
+    return thd_get_cpu_time_us(thd) / 1000;
 }
 
 uint64_t thd_get_total_cpu_time(void) {
+    return thd_get_total_cpu_time_us() / 1000;
+}
+
+uint64_t thd_get_cpu_time_us(kthread_t *thd) {
+    return thd->cpu_time.total;
+}
+
+uint64_t thd_get_total_cpu_time_us(void) {
     kthread_t *cur;
     uint64_t retval = 0;
 
@@ -1029,10 +1411,27 @@ uint64_t thd_get_total_cpu_time(void) {
 
 /* Change threading modes */
 int thd_set_mode(kthread_mode_t mode) {
-    dbglog(DBG_WARNING, "thd_set_mode() has no effect. Cooperative threading "
-           "mode is deprecated. Threading is always in preemptive mode.\n");
+    kthread_mode_t old = thd_mode;
+
+    if(mode != THD_MODE_PREEMPT && mode != THD_MODE_TICKLESS) {
+        dbglog(DBG_WARNING, "thd_set_mode() only supports the preemptive and "
+               "tickless modes. Cooperative threading mode is deprecated.\n");
+        return old;
+    }
 
-    return mode;
+    irq_disable_scoped();
+
+    if(old == THD_MODE_NONE || old == mode)
+        return old;
+
+    thd_mode = mode;
+
+    /* Get the periodic tick going again, or let the scheduler pick the next
+       wakeup time on the next tick. */
+    thd_next_wakeup = 0;
+    timer_primary_wakeup(thd_sched_ms);
+
+    return old;
 }
 
 kthread_mode_t thd_get_mode(void) {
@@ -1087,7 +1486,17 @@ int thd_init(void) {
         return -1;
 
     /* Setup our mode as appropriate */
-    thd_mode = THD_MODE_PREEMPT;
+    if(__kos_init_flags & INIT_THD_TICKLESS)
+        thd_mode = THD_MODE_TICKLESS;
+    else
+        thd_mode = THD_MODE_PREEMPT;
+
+    thd_next_wakeup = 0;
+    thd_timer_ticks = 0;
+    thd_sched_count = 0;
+
+    thd_paint_stacks = !!(__kos_init_flags & INIT_THD_STACK_PAINT);
+    thd_switch_voluntary = false;
 
     /* Initialize handle counters */
     tid_highest = 1;
@@ -1095,8 +1504,18 @@ int thd_init(void) {
     /* Initialize the thread list */
     LIST_INIT(&thd_list);
 
+    for(size_t i = 0; i < THD_TID_HASH_SIZE; i++)
+        LIST_INIT(&tid_hash[i]);
+
     /* Initialize the run queue */
-    TAILQ_INIT(&run_queue);
+    for(size_t i = 0; i < THD_RUNQ_BUCKETS; i++)
+        TAILQ_INIT(&run_queue[i]);
+
+    memset(run_queue_map, 0, sizeof(run_queue_map));
+    run_queue_summary = 0;
+    run_queue_epoch = 0;
+    run_queue_epoch_time = timer_ms_gettime64();
+    TAILQ_INIT(&poll_queue);
 
     /* Start off with no "current" thread */
     thd_current = NULL;
@@ -1119,7 +1538,7 @@ int thd_init(void) {
 
     /* Main thread -- the kern thread */
     thd_current = kern;
-    thd_schedule_inner(kern, timer_ms_gettime64());
+    thd_schedule_inner(kern);
 
     /* Initialize tls */
     arch_tls_init();
@@ -1141,7 +1560,8 @@ int thd_init(void) {
     /* Schedule our first wakeup */
     timer_primary_wakeup(thd_sched_ms);
 
-    dbglog(DBG_DEBUG, "thd: pre-emption enabled, HZ=%u\n", thd_get_hz());
+    dbglog(DBG_DEBUG, "thd: pre-emption enabled, HZ=%u%s\n", thd_get_hz(),
+           thd_mode == THD_MODE_TICKLESS ? ", tickless" : "");
 
     return 0;
 }
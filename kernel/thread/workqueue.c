@@ -4,6 +4,7 @@
    Copyright (C) 2026 Paul Cercueil
 */
 
+#include <errno.h>
 #include <limits.h>
 #include <stdbool.h>
 #include <stdlib.h>
@@ -15,46 +16,147 @@
 #include <kos/thread.h>
 #include <kos/workqueue.h>
 
-typedef struct workqueue {
-    STAILQ_HEAD(workqueue_jobs, workqueue_job) jobs;
+/* Values of workqueue_job_t::queue, other than a worker's index plus one.
+   Zero has to mean idle, so that statically initialized jobs can be
+   cancelled before they are ever enqueued. */
+#define WQ_JOB_IDLE     0   /* Not queued (new, running or done) */
+#define WQ_JOB_DELAYED  -1  /* In the timer list */
+
+TAILQ_HEAD(workqueue_jobs, workqueue_job);
+
+typedef struct workqueue_worker {
+    /* Ready jobs, sorted by priority */
+    struct workqueue_jobs jobs;
+    struct workqueue *wq;
     kthread_t *thd;
+    unsigned int idx;
+} workqueue_worker_t;
+
+/* All of the lists, including the per-worker ones, are protected by the one
+   lock: there is only one CPU, so per-worker locks would never be contended
+   by anything but preemption, and would only add overhead. */
+typedef struct workqueue {
+    /* Jobs that are not due yet, sorted by time */
+    struct workqueue_jobs delayed;
+    workqueue_worker_t *workers;
+    unsigned int nworkers;
+    unsigned int next;
     mutex_t lock;
     condvar_t cond;
     bool quit;
 } workqueue_t;
 
+/* Insert a job in a worker's queue, after the jobs of the same priority. */
+static void workqueue_push(workqueue_worker_t *w, workqueue_job_t *job) {
+    workqueue_job_t *elm;
+
+    TAILQ_FOREACH_REVERSE(elm, &w->jobs, workqueue_jobs, entry) {
+        if(elm->prio <= job->prio) {
+            TAILQ_INSERT_AFTER(&w->jobs, elm, job, entry);
+            break;
+        }
+    }
+
+    if(!elm)
+        TAILQ_INSERT_HEAD(&w->jobs, job, entry);
+
+    job->queue = w->idx + 1;
+}
+
+/* Pick the worker queue a ready job goes to: the caller's own queue if it is
+   one of our workers (the job is likely related to what it is doing), or the
+   next queue in turn otherwise. */
+static workqueue_worker_t *workqueue_pick(workqueue_t *wq) {
+    unsigned int i;
+
+    for(i = 0; i < wq->nworkers; i++) {
+        if(wq->workers[i].thd == thd_current)
+            return &wq->workers[i];
+    }
+
+    i = wq->next++;
+    if(wq->next == wq->nworkers)
+        wq->next = 0;
+
+    return &wq->workers[i];
+}
+
+/* Move the jobs that are due from the timer list to the given worker. */
+static void workqueue_promote(workqueue_t *wq, workqueue_worker_t *w,
+                              uint64_t now) {
+    workqueue_job_t *job;
+
+    while((job = TAILQ_FIRST(&wq->delayed)) && job->time_ms <= now) {
+        TAILQ_REMOVE(&wq->delayed, job, entry);
+        workqueue_push(w, job);
+    }
+}
+
+/* Get the next job to run: the most urgent job of our own queue, or else the
+   most urgent job of the first other worker that has any. */
+static workqueue_job_t *workqueue_take(workqueue_t *wq, workqueue_worker_t *w) {
+    workqueue_worker_t *victim;
+    workqueue_job_t *job;
+    unsigned int i;
+
+    for(i = 0; i < wq->nworkers; i++) {
+        victim = &wq->workers[(w->idx + i) % wq->nworkers];
+        job = TAILQ_FIRST(&victim->jobs);
+
+        if(job) {
+            TAILQ_REMOVE(&victim->jobs, job, entry);
+            job->queue = WQ_JOB_IDLE;
+            return job;
+        }
+    }
+
+    return NULL;
+}
+
+static void workqueue_batch_done(workqueue_batch_t *batch) {
+    if(!--batch->pending)
+        cond_broadcast(&batch->done);
+}
+
 static void *workqueue_thread(void *d) {
-    workqueue_t *wq = d;
+    workqueue_worker_t *w = d;
+    workqueue_t *wq = w->wq;
+    workqueue_batch_t *batch;
     workqueue_job_t *job;
     uint64_t now;
-    int ret;
-
-    while(!wq->quit) {
-        mutex_lock(&wq->lock);
 
-        job = STAILQ_FIRST(&wq->jobs);
-        if(job)
-            now = timer_ms_gettime64();
+    mutex_lock(&wq->lock);
 
-        if(!job || job->time_ms > now) {
-            ret = cond_wait_timed(&wq->cond, &wq->lock,
-                                  job ? job->time_ms - now : 0);
-            if (!ret) {
-                mutex_unlock(&wq->lock);
+    while(!wq->quit) {
+        now = timer_ms_gettime64();
+        workqueue_promote(wq, w, now);
 
-                /* We did not time out, so something was added to the queue. */
-                continue;
-            }
+        job = workqueue_take(wq, w);
+        if(!job) {
+            /* Nothing to do; sleep until the next delayed job is due, or
+               until something is enqueued. */
+            job = TAILQ_FIRST(&wq->delayed);
+            cond_wait_timed(&wq->cond, &wq->lock,
+                            job ? job->time_ms - now : 0);
+            continue;
         }
 
-        /* Remove the job from the queue */
-        STAILQ_REMOVE(&wq->jobs, job, workqueue_job, entry);
+        /* The job may re-enqueue itself, so detach it from its batch now. */
+        batch = job->batch;
+        job->batch = NULL;
 
         mutex_unlock(&wq->lock);
 
-        job->cb(d, job);
+        job->cb(wq, job);
+
+        mutex_lock(&wq->lock);
+
+        if(batch)
+            workqueue_batch_done(batch);
     }
 
+    mutex_unlock(&wq->lock);
+
     return NULL;
 }
 
@@ -62,72 +164,175 @@ static const kthread_attr_t workqueue_attrs = {
     .label = "[workqueue]",
 };
 
-workqueue_t *workqueue_create(void) {
+workqueue_t *workqueue_create_pool(unsigned int workers,
+                                   const kthread_attr_t *attr) {
     workqueue_t *wq;
+    unsigned int i;
+
+    if(!workers)
+        workers = 1;
+
+    if(!attr)
+        attr = &workqueue_attrs;
 
     wq = calloc(1, sizeof(workqueue_t));
     if(!wq)
         return NULL;
 
+    wq->workers = calloc(workers, sizeof(workqueue_worker_t));
+    if(!wq->workers) {
+        free(wq);
+        return NULL;
+    }
+
     wq->lock = (mutex_t)MUTEX_INITIALIZER;
     wq->cond = (condvar_t)COND_INITIALIZER;
-    STAILQ_INIT(&wq->jobs);
+    TAILQ_INIT(&wq->delayed);
 
-    wq->thd = thd_create_ex(&workqueue_attrs, workqueue_thread, wq);
-    if(!wq->thd) {
-        free(wq);
+    for(i = 0; i < workers; i++) {
+        wq->workers[i].wq = wq;
+        wq->workers[i].idx = i;
+        TAILQ_INIT(&wq->workers[i].jobs);
+    }
+
+    /* The workers look at each other's queues, so they must all be set up
+       before the first one starts. */
+    mutex_lock(&wq->lock);
+
+    for(i = 0; i < workers; i++) {
+        wq->workers[i].thd = thd_create_ex(attr, workqueue_thread,
+                                           &wq->workers[i]);
+        if(!wq->workers[i].thd)
+            break;
+
+        wq->nworkers++;
+    }
+
+    mutex_unlock(&wq->lock);
+
+    if(wq->nworkers < workers) {
+        workqueue_destroy(wq);
         return NULL;
     }
 
     return wq;
 }
 
-void workqueue_enqueue(workqueue_t *wq, workqueue_job_t *job) {
-    workqueue_job_t *elm, *prev = NULL;
+workqueue_t *workqueue_create(void) {
+    return workqueue_create_pool(1, NULL);
+}
 
-    mutex_lock_scoped(&wq->lock);
+static void workqueue_enqueue_locked(workqueue_t *wq, workqueue_job_t *job) {
+    workqueue_job_t *elm;
+    uint64_t now = timer_ms_gettime64();
 
     if(!job->time_ms)
-        job->time_ms = timer_ms_gettime64();
-
-    STAILQ_FOREACH(elm, &wq->jobs, entry) {
-        if(job->time_ms < elm->time_ms) {
-            if(prev)
-                STAILQ_INSERT_AFTER(&wq->jobs, prev, job, entry);
-            else
-                STAILQ_INSERT_HEAD(&wq->jobs, job, entry);
-            break;
-        }
+        job->time_ms = now;
 
-        prev = elm;
+    if(job->time_ms <= now) {
+        workqueue_push(workqueue_pick(wq), job);
     }
+    else {
+        TAILQ_FOREACH(elm, &wq->delayed, entry) {
+            if(job->time_ms < elm->time_ms) {
+                TAILQ_INSERT_BEFORE(elm, job, entry);
+                break;
+            }
+        }
 
-    if(!elm)
-        STAILQ_INSERT_TAIL(&wq->jobs, job, entry);
+        if(!elm)
+            TAILQ_INSERT_TAIL(&wq->delayed, job, entry);
+
+        job->queue = WQ_JOB_DELAYED;
+    }
 
     cond_signal(&wq->cond);
 }
 
+void workqueue_enqueue(workqueue_t *wq, workqueue_job_t *job) {
+    mutex_lock_scoped(&wq->lock);
+
+    job->batch = NULL;
+    workqueue_enqueue_locked(wq, job);
+}
+
+void workqueue_enqueue_batch(workqueue_t *wq, workqueue_batch_t *batch,
+                             workqueue_job_t *job) {
+    mutex_lock_scoped(&wq->lock);
+
+    job->batch = batch;
+    batch->pending++;
+    workqueue_enqueue_locked(wq, job);
+}
+
+int workqueue_batch_wait(workqueue_t *wq, workqueue_batch_t *batch,
+                         unsigned int timeout) {
+    uint64_t deadline = 0;
+    int64_t left;
+
+    mutex_lock_scoped(&wq->lock);
+
+    if(timeout)
+        deadline = timer_ms_gettime64() + timeout;
+
+    while(batch->pending) {
+        if(timeout) {
+            left = deadline - timer_ms_gettime64();
+            if(left <= 0) {
+                errno = ETIMEDOUT;
+                return -1;
+            }
+
+            timeout = left;
+        }
+
+        cond_wait_timed(&batch->done, &wq->lock, timeout);
+    }
+
+    return 0;
+}
+
 void workqueue_cancel(workqueue_t *wq, workqueue_job_t *job) {
     mutex_lock_scoped(&wq->lock);
 
-    STAILQ_REMOVE(&wq->jobs, job, workqueue_job, entry);
+    if(job->queue == WQ_JOB_IDLE)
+        return;
+
+    if(job->queue == WQ_JOB_DELAYED)
+        TAILQ_REMOVE(&wq->delayed, job, entry);
+    else
+        TAILQ_REMOVE(&wq->workers[job->queue - 1].jobs, job, entry);
+
+    job->queue = WQ_JOB_IDLE;
+
+    if(job->batch) {
+        workqueue_batch_done(job->batch);
+        job->batch = NULL;
+    }
+
     cond_signal(&wq->cond);
 }
 
 void workqueue_kill(workqueue_t *wq) {
+    unsigned int i;
+
     if(!wq->quit) {
+        mutex_lock(&wq->lock);
         wq->quit = true;
-        cond_signal(&wq->cond);
-        thd_join(wq->thd, NULL);
+        cond_broadcast(&wq->cond);
+        mutex_unlock(&wq->lock);
+
+        for(i = 0; i < wq->nworkers; i++)
+            thd_join(wq->workers[i].thd, NULL);
     }
 }
 
 void workqueue_destroy(workqueue_t *wq) {
     workqueue_kill(wq);
+    free(wq->workers);
     free(wq);
 }
 
 kthread_t *workqueue_get_thread(workqueue_t *wq) {
-    return wq->thd;
+    return wq->workers[0].thd;
 }